@@ -0,0 +1,120 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "capture.h"
+#include "logger.h"
+
+/* records are buffered, and written out in blocks of this size */
+#define CAPTURE_BUFSZ	(1 << 20)
+
+static void add_record(unsigned int conn, const void *data, int size);
+static uint64_t nsec_now(void);
+
+static FILE *fp;
+static char *buf;
+static uint64_t start;
+
+
+int capture_open(const char *fname)
+{
+	int fd;
+	struct capture_header hdr;
+
+	capture_close();
+
+	/* a new file, rather than truncating one which might still be written
+	 * by the process we took over from in a hot restart. Captures hold
+	 * everything clients send, cookies and passwords included, so only we
+	 * can read it, and with O_EXCL a link put in its place isn't followed.
+	 */
+	unlink(fname);
+	if((fd = open(fname, O_CREAT | O_EXCL | O_WRONLY, 0600)) == -1) {
+		logmsg("failed to create capture file: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(!(fp = fdopen(fd, "wb"))) {
+		logmsg("failed to open capture file: %s: %s\n", fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if((buf = malloc(CAPTURE_BUFSZ))) {
+		setvbuf(fp, buf, _IOFBF, CAPTURE_BUFSZ);
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof hdr.magic);
+	hdr.version = CAPTURE_VERSION;
+	hdr.start = time(0);
+	start = nsec_now();
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1) {
+		logmsg("failed to write capture file: %s: %s\n", fname, strerror(errno));
+		capture_close();
+		return -1;
+	}
+	logmsg("capturing traffic to %s\n", fname);
+	return 0;
+}
+
+void capture_close(void)
+{
+	if(fp) {
+		fclose(fp);
+		fp = 0;
+	}
+	free(buf);
+	buf = 0;
+}
+
+int capture_enabled(void)
+{
+	return fp != 0;
+}
+
+void capture_data(unsigned int conn, const void *data, int size)
+{
+	if(fp && size > 0) {
+		add_record(conn, data, size);
+	}
+}
+
+void capture_eof(unsigned int conn)
+{
+	if(fp) {
+		add_record(conn, 0, 0);
+	}
+}
+
+/* a failed write stops the capture, rather than leaving a gap in it */
+static void add_record(unsigned int conn, const void *data, int size)
+{
+	struct capture_record rec;
+
+	rec.time = nsec_now() - start;
+	rec.conn = conn;
+	rec.size = size;
+
+	if(fwrite(&rec, sizeof rec, 1, fp) != 1 || (size && fwrite(data, size, 1, fp) != 1)) {
+		logmsg("failed to write capture file, stopping capture: %s\n", strerror(errno));
+		capture_close();
+	}
+}
+
+static uint64_t nsec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,45 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+
+/* Traffic capture: everything received from clients, as it arrives, for
+ * replaying it later with the twreplay tool. The file starts with a
+ * capture_header, followed by records in the order they happened, each one a
+ * capture_record followed by size bytes of data. Integers are in native byte
+ * order.
+ *
+ * Data is captured after TLS decryption, so captures of HTTPS listeners are
+ * replayed over plain connections.
+ */
+#define CAPTURE_MAGIC	"TWCAPT\r\n"
+#define CAPTURE_VERSION	1
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t unused;
+	int64_t start;			/* wall clock time the capture started, in seconds */
+};
+
+struct capture_record {
+	uint64_t time;			/* nanoseconds since the capture started */
+	uint32_t conn;			/* connection number, unique in the capture */
+	uint32_t size;			/* 0: the client shut down its side */
+};
+
+int capture_open(const char *fname);
+void capture_close(void);
+int capture_enabled(void);
+
+void capture_data(unsigned int conn, const void *data, int size);
+void capture_eof(unsigned int conn);
+
+#endif	/* CAPTURE_H_ */
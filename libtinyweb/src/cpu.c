@@ -0,0 +1,153 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <alloca.h>
+#include "cpu.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+
+int cpu_get_allowed(int *cpus, int max)
+{
+	int i, count = 0;
+	cpu_set_t set;
+
+	if(sched_getaffinity(0, sizeof set, &set) == -1) {
+		return -1;
+	}
+	for(i=0; i<CPU_SETSIZE && count < max; i++) {
+		if(CPU_ISSET(i, &set)) {
+			cpus[count++] = i;
+		}
+	}
+	return count;
+}
+
+int cpu_bind(int cpu)
+{
+	cpu_set_t set;
+
+	if(cpu < 0 || cpu >= CPU_SETSIZE) {
+		logmsg("invalid CPU: %d\n", cpu);
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof set, &set) == -1) {
+		logmsg("failed to pin process to CPU %d: %s\n", cpu, strerror(errno));
+		return -1;
+	}
+
+	/* pages are allocated on the node of the CPU which first touches them by
+	 * default, but we might have been started with a different policy (by
+	 * numactl for instance). Not fatal, it's just slower.
+	 */
+	if(syscall(SYS_set_mempolicy, MPOL_LOCAL, 0, 0) == -1 && errno != ENOSYS) {
+		logmsg("failed to set local memory allocation policy: %s\n", strerror(errno));
+	}
+	return 0;
+}
+
+int cpu_node(int cpu)
+{
+	DIR *dir;
+	struct dirent *dent;
+	char path[64];
+	int node = -1;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if(!(dir = opendir(path))) {
+		return -1;
+	}
+	while((dent = readdir(dir))) {
+		if(memcmp(dent->d_name, "node", 4) == 0 && dent->d_name[4] >= '0' &&
+				dent->d_name[4] <= '9') {
+			node = atoi(dent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+/* the reuseport program returns the index of the socket for the connection,
+ * and anything out of range falls back to selecting by hash:
+ *
+ *     ld cpu
+ *     jeq #cpus[0], 0, 1
+ *     ret #0
+ *     jeq #cpus[1], 0, 1
+ *     ret #1
+ *     ...
+ *     ret #-1
+ */
+int cpu_steer(int sock, const int *cpus, int n)
+{
+	int i;
+	struct sock_filter *code, *ptr;
+	struct sock_fprog prog;
+
+	if(n <= 0 || n > BPF_MAXINSNS / 2 - 1) {
+		return -1;
+	}
+	code = ptr = alloca((n * 2 + 2) * sizeof *code);
+
+	*ptr++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for(i=0; i<n; i++) {
+		*ptr++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+		*ptr++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	*ptr++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	prog.len = ptr - code;
+	prog.filter = code;
+	if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == -1) {
+		logmsg("failed to attach connection steering program: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+#else	/* !__linux__ */
+
+int cpu_get_allowed(int *cpus, int max)
+{
+	return -1;
+}
+
+int cpu_bind(int cpu)
+{
+	logmsg("CPU affinity is not supported on this system\n");
+	return -1;
+}
+
+int cpu_node(int cpu)
+{
+	return -1;
+}
+
+int cpu_steer(int sock, const int *cpus, int n)
+{
+	logmsg("connection steering is not supported on this system\n");
+	return -1;
+}
+
+#endif	/* __linux__ */
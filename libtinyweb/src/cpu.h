@@ -0,0 +1,31 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef CPU_H_
+#define CPU_H_
+
+/* fill cpus with the CPUs the process is allowed to run on, in order, and
+ * return how many there are, or -1 if it's not supported.
+ */
+int cpu_get_allowed(int *cpus, int max);
+
+/* pin the calling process to a CPU, and allocate its memory from then on
+ * from the NUMA node of that CPU.
+ */
+int cpu_bind(int cpu);
+
+/* NUMA node of a CPU, or -1 if it's unknown */
+int cpu_node(int cpu);
+
+/* make the SO_REUSEPORT group of sock pass each connection to the socket of
+ * the worker running on the CPU which received it: the socket at index i was
+ * the i-th to start listening, and belongs to the worker on cpus[i].
+ * Connections received by other CPUs are distributed by hash as usual.
+ */
+int cpu_steer(int sock, const int *cpus, int n);
+
+#endif	/* CPU_H_ */
@@ -0,0 +1,523 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "dirlist.h"
+#include "rbtree.h"
+#include "logger.h"
+#include "memgov.h"
+
+/* maximum amount of memory used by cached listings: 16mb */
+#define CACHE_MAX_SIZE	(16 * 1024 * 1024)
+
+#define GETDENTS_BUFSZ	65536
+
+/* getdents64 record, as written by the kernel */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+struct entry {
+	int name;	/* offset into the names pool */
+	int isdir;
+};
+
+struct dirlist_cache {
+	int dirfd;
+	struct rbtree *tree;	/* listings by path */
+};
+
+struct listing {
+	char *path;
+	struct dirlist_cache *dc;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+
+	/* sorted directory entries, kept around to generate other formats */
+	char *names;
+	struct entry *ent;
+	int num_ent;
+
+	char *text[NUM_DIRLIST_FMT];
+	int size[NUM_DIRLIST_FMT];
+	long memsize;
+
+	struct listing *prev, *next;	/* LRU list, most recently used first */
+};
+
+struct strbuf {
+	char *buf;
+	int len, size;
+};
+
+static struct listing *read_dir(struct dirlist_cache *dc, const char *path, struct stat *st);
+static int gen_html(struct listing *ls, struct strbuf *sb);
+static int gen_json(struct listing *ls, struct strbuf *sb);
+static void free_listing(struct listing *ls);
+static void del_func(struct rbnode *node, void *cls);
+static void lru_remove(struct listing *ls);
+static void drop_listing(struct listing *ls);
+static void lru_push(struct listing *ls);
+static int cmp_entries(const void *a, const void *b);
+
+static int sb_append(struct strbuf *sb, const char *s, int len);
+static int sb_puts(struct strbuf *sb, const char *s);
+static int sb_put_html(struct strbuf *sb, const char *s);
+static int sb_put_url(struct strbuf *sb, const char *s);
+static int sb_put_json(struct strbuf *sb, const char *s);
+
+static struct listing *lru_head, *lru_tail;
+static long cache_size;
+
+/* names pool used by the qsort comparison function */
+static const char *sort_names;
+
+
+struct dirlist_cache *dirlist_create(int dirfd)
+{
+	struct dirlist_cache *dc;
+
+	if(!(dc = malloc(sizeof *dc))) {
+		return 0;
+	}
+	if(!(dc->tree = rb_create(RB_KEY_STRING))) {
+		free(dc);
+		return 0;
+	}
+	rb_set_delete_func(dc->tree, del_func, 0);
+	dc->dirfd = dirfd;
+	return dc;
+}
+
+void dirlist_destroy(struct dirlist_cache *dc)
+{
+	struct listing *ls, *next;
+
+	if(!dc) return;
+
+	for(ls=lru_head; ls; ls=next) {
+		next = ls->next;
+		if(ls->dc == dc) {
+			lru_remove(ls);
+			cache_size -= ls->memsize;
+			mem_charge(MEM_CACHE, -ls->memsize);
+		}
+	}
+	rb_free(dc->tree);
+	free(dc);
+}
+
+const char *dirlist_get(struct dirlist_cache *dc, const char *path, struct stat *st,
+		int fmt, int *size)
+{
+	struct rbnode *node;
+	struct listing *ls;
+	struct strbuf sb = {0, 0, 0};
+	int res;
+
+	if(!dc || fmt < 0 || fmt >= NUM_DIRLIST_FMT) {
+		return 0;
+	}
+
+	if((node = rb_find(dc->tree, (void*)path))) {
+		ls = node->data;
+		if(ls->dev != st->st_dev || ls->ino != st->st_ino ||
+				ls->mtime.tv_sec != st->st_mtim.tv_sec ||
+				ls->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+			/* stale, drop it and re-read the directory */
+			drop_listing(ls);
+			ls = 0;
+		}
+	} else {
+		ls = 0;
+	}
+
+	if(!ls) {
+		if(!(ls = read_dir(dc, path, st))) {
+			return 0;
+		}
+		rb_insert(dc->tree, ls->path, ls);
+		cache_size += ls->memsize;
+		mem_charge(MEM_CACHE, ls->memsize);
+	} else {
+		lru_remove(ls);
+	}
+	lru_push(ls);
+
+	if(!ls->text[fmt]) {
+		res = fmt == DIRLIST_JSON ? gen_json(ls, &sb) : gen_html(ls, &sb);
+		if(res == -1) {
+			free(sb.buf);
+			return 0;
+		}
+		ls->text[fmt] = sb.buf;
+		ls->size[fmt] = sb.len;
+		ls->memsize += sb.size;
+		cache_size += sb.size;
+		mem_charge(MEM_CACHE, sb.size);
+	}
+
+	/* evict least recently used listings until we're within budget, but never
+	 * the one we're about to return.
+	 */
+	while(cache_size > CACHE_MAX_SIZE && lru_tail != ls) {
+		drop_listing(lru_tail);
+	}
+
+	*size = ls->size[fmt];
+	return ls->text[fmt];
+}
+
+void dirlist_clear_cache(void)
+{
+	while(lru_head) {
+		drop_listing(lru_head);
+	}
+	cache_size = 0;
+}
+
+long dirlist_trim(long max_size)
+{
+	long prev_size = cache_size;
+
+	while(lru_tail && cache_size > max_size) {
+		drop_listing(lru_tail);
+	}
+	return prev_size - cache_size;
+}
+
+/* read all directory entries with getdents64 in one pass over the directory,
+ * and sort them, directories first.
+ */
+static struct listing *read_dir(struct dirlist_cache *dc, const char *path, struct stat *st)
+{
+	int fd, rdsz, pool_used = 0, pool_size = 0, max_ent = 0;
+	char *buf, *pool = 0;
+	struct entry *ent = 0;
+	struct listing *ls;
+
+	if(!(ls = calloc(1, sizeof *ls)) || !(ls->path = strdup(path))) {
+		logmsg("failed to allocate directory listing: %s\n", strerror(errno));
+		free(ls);
+		return 0;
+	}
+	ls->dc = dc;
+	ls->dev = st->st_dev;
+	ls->ino = st->st_ino;
+	ls->mtime = st->st_mtim;
+
+	if((fd = openat(dc->dirfd, path, O_RDONLY | O_DIRECTORY)) == -1) {
+		logmsg("failed to open directory %s: %s\n", path, strerror(errno));
+		free_listing(ls);
+		return 0;
+	}
+	if(!(buf = malloc(GETDENTS_BUFSZ))) {
+		close(fd);
+		free_listing(ls);
+		return 0;
+	}
+
+	while((rdsz = syscall(SYS_getdents64, fd, buf, GETDENTS_BUFSZ)) > 0) {
+		int pos = 0;
+		while(pos < rdsz) {
+			struct linux_dirent64 *dent = (struct linux_dirent64*)(buf + pos);
+			int namelen, isdir;
+			pos += dent->d_reclen;
+
+			/* skip . and .., and hidden files */
+			if(dent->d_name[0] == '.') continue;
+
+			if(dent->d_type == DT_DIR) {
+				isdir = 1;
+			} else if(dent->d_type == DT_LNK || dent->d_type == DT_UNKNOWN) {
+				struct stat est;
+				isdir = fstatat(fd, dent->d_name, &est, 0) == 0 && S_ISDIR(est.st_mode);
+			} else {
+				isdir = 0;
+			}
+
+			namelen = strlen(dent->d_name) + 1;
+			if(pool_used + namelen > pool_size) {
+				int newsz = pool_size ? pool_size * 2 : 4096;
+				char *tmp;
+				while(newsz < pool_used + namelen) newsz *= 2;
+				if(!(tmp = realloc(pool, newsz))) goto nomem;
+				pool = tmp;
+				pool_size = newsz;
+			}
+			if(ls->num_ent >= max_ent) {
+				int newsz = max_ent ? max_ent * 2 : 64;
+				struct entry *tmp;
+				if(!(tmp = realloc(ent, newsz * sizeof *ent))) goto nomem;
+				ent = tmp;
+				max_ent = newsz;
+			}
+
+			memcpy(pool + pool_used, dent->d_name, namelen);
+			ent[ls->num_ent].name = pool_used;
+			ent[ls->num_ent].isdir = isdir;
+			ls->num_ent++;
+			pool_used += namelen;
+		}
+	}
+	if(rdsz == -1) {
+		logmsg("failed to read directory %s: %s\n", path, strerror(errno));
+		goto err;
+	}
+	free(buf);
+	close(fd);
+
+	sort_names = pool;
+	qsort(ent, ls->num_ent, sizeof *ent, cmp_entries);
+
+	ls->names = pool;
+	ls->ent = ent;
+	ls->memsize = sizeof *ls + strlen(path) + pool_size + max_ent * sizeof *ent;
+	return ls;
+
+nomem:
+	logmsg("failed to allocate memory while reading directory %s\n", path);
+err:
+	free(buf);
+	free(pool);
+	free(ent);
+	close(fd);
+	free_listing(ls);
+	return 0;
+}
+
+static int gen_html(struct listing *ls, struct strbuf *sb)
+{
+	int i;
+	const char *dir = ls->path;
+
+	if(strcmp(dir, ".") == 0) dir = "";
+
+	if(sb_puts(sb, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Index of /") == -1 ||
+			sb_put_html(sb, dir) == -1 || (*dir && sb_puts(sb, "/") == -1) ||
+			sb_puts(sb, "</title>\n</head>\n<body>\n<h1>Index of /") == -1 ||
+			sb_put_html(sb, dir) == -1 || (*dir && sb_puts(sb, "/") == -1) ||
+			sb_puts(sb, "</h1>\n<hr>\n<pre>\n") == -1) {
+		return -1;
+	}
+	if(*dir && sb_puts(sb, "<a href=\"../\">../</a>\n") == -1) {
+		return -1;
+	}
+
+	for(i=0; i<ls->num_ent; i++) {
+		const char *name = ls->names + ls->ent[i].name;
+		const char *slash = ls->ent[i].isdir ? "/" : "";
+
+		if(sb_puts(sb, "<a href=\"") == -1 || sb_put_url(sb, name) == -1 ||
+				sb_puts(sb, slash) == -1 || sb_puts(sb, "\">") == -1 ||
+				sb_put_html(sb, name) == -1 || sb_puts(sb, slash) == -1 ||
+				sb_puts(sb, "</a>\n") == -1) {
+			return -1;
+		}
+	}
+	return sb_puts(sb, "</pre>\n<hr>\n</body>\n</html>\n");
+}
+
+static int gen_json(struct listing *ls, struct strbuf *sb)
+{
+	int i;
+
+	if(sb_puts(sb, "[") == -1) {
+		return -1;
+	}
+	for(i=0; i<ls->num_ent; i++) {
+		if(sb_puts(sb, i ? ",\n{\"name\":\"" : "\n{\"name\":\"") == -1 ||
+				sb_put_json(sb, ls->names + ls->ent[i].name) == -1 ||
+				sb_puts(sb, ls->ent[i].isdir ? "\",\"type\":\"dir\"}" : "\",\"type\":\"file\"}") == -1) {
+			return -1;
+		}
+	}
+	return sb_puts(sb, "\n]\n");
+}
+
+static void free_listing(struct listing *ls)
+{
+	int i;
+
+	if(!ls) return;
+
+	for(i=0; i<NUM_DIRLIST_FMT; i++) {
+		free(ls->text[i]);
+	}
+	free(ls->names);
+	free(ls->ent);
+	free(ls->path);
+	free(ls);
+}
+
+static void del_func(struct rbnode *node, void *cls)
+{
+	/* the key is the path owned by the listing */
+	free_listing(node->data);
+}
+
+static void lru_remove(struct listing *ls)
+{
+	if(ls->prev) {
+		ls->prev->next = ls->next;
+	} else {
+		lru_head = ls->next;
+	}
+	if(ls->next) {
+		ls->next->prev = ls->prev;
+	} else {
+		lru_tail = ls->prev;
+	}
+	ls->prev = ls->next = 0;
+}
+
+/* remove a listing from the LRU list and its cache, which frees it */
+static void drop_listing(struct listing *ls)
+{
+	lru_remove(ls);
+	cache_size -= ls->memsize;
+	mem_charge(MEM_CACHE, -ls->memsize);
+	rb_delete(ls->dc->tree, ls->path);
+}
+
+static void lru_push(struct listing *ls)
+{
+	ls->prev = 0;
+	ls->next = lru_head;
+	if(lru_head) {
+		lru_head->prev = ls;
+	} else {
+		lru_tail = ls;
+	}
+	lru_head = ls;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+
+	if(ea->isdir != eb->isdir) {
+		return eb->isdir - ea->isdir;
+	}
+	return strcmp(sort_names + ea->name, sort_names + eb->name);
+}
+
+
+static int sb_append(struct strbuf *sb, const char *s, int len)
+{
+	if(sb->len + len + 1 > sb->size) {
+		int newsz = sb->size ? sb->size * 2 : 4096;
+		char *tmp;
+
+		while(newsz < sb->len + len + 1) newsz *= 2;
+		if(!(tmp = realloc(sb->buf, newsz))) {
+			return -1;
+		}
+		sb->buf = tmp;
+		sb->size = newsz;
+	}
+	memcpy(sb->buf + sb->len, s, len);
+	sb->len += len;
+	sb->buf[sb->len] = 0;
+	return 0;
+}
+
+static int sb_puts(struct strbuf *sb, const char *s)
+{
+	return sb_append(sb, s, strlen(s));
+}
+
+static int sb_put_html(struct strbuf *sb, const char *s)
+{
+	const char *start = s;
+
+	while(*s) {
+		const char *esc;
+
+		switch(*s) {
+		case '<': esc = "&lt;"; break;
+		case '>': esc = "&gt;"; break;
+		case '&': esc = "&amp;"; break;
+		case '"': esc = "&quot;"; break;
+		default:
+			s++;
+			continue;
+		}
+		if(sb_append(sb, start, s - start) == -1 || sb_puts(sb, esc) == -1) {
+			return -1;
+		}
+		start = ++s;
+	}
+	return sb_append(sb, start, s - start);
+}
+
+static int sb_put_url(struct strbuf *sb, const char *s)
+{
+	static const char *hex = "0123456789ABCDEF";
+	char esc[3];
+
+	while(*s) {
+		unsigned char c = *s++;
+
+		if(isalnum(c) || strchr("-._~", c)) {
+			if(sb_append(sb, (char*)&c, 1) == -1) {
+				return -1;
+			}
+		} else {
+			esc[0] = '%';
+			esc[1] = hex[c >> 4];
+			esc[2] = hex[c & 0xf];
+			if(sb_append(sb, esc, 3) == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int sb_put_json(struct strbuf *sb, const char *s)
+{
+	char esc[8];
+
+	while(*s) {
+		unsigned char c = *s++;
+
+		if(c == '"' || c == '\\') {
+			esc[0] = '\\';
+			esc[1] = c;
+			if(sb_append(sb, esc, 2) == -1) {
+				return -1;
+			}
+		} else if(c < 0x20) {
+			sprintf(esc, "\\u%04x", c);
+			if(sb_append(sb, esc, 6) == -1) {
+				return -1;
+			}
+		} else {
+			if(sb_append(sb, (char*)&c, 1) == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
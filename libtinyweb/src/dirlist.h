@@ -0,0 +1,48 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef DIRLIST_H_
+#define DIRLIST_H_
+
+#include <sys/stat.h>
+
+enum {
+	DIRLIST_HTML,
+	DIRLIST_JSON,
+
+	NUM_DIRLIST_FMT
+};
+
+struct dirlist_cache;
+
+/* a cache of listings for the directories under dirfd (AT_FDCWD for the
+ * current directory). All caches share the same memory budget, and the least
+ * recently used listings of any of them are dropped to stay within it.
+ */
+struct dirlist_cache *dirlist_create(int dirfd);
+void dirlist_destroy(struct dirlist_cache *dc);
+
+/* dirlist_get returns the listing of directory path in the requested format,
+ * and stores its size through the size pointer. The st argument should be the
+ * result of a stat on path, and is used to validate the cached listing: if the
+ * directory mtime hasn't changed since it was generated, the cached copy is
+ * returned without touching the directory at all.
+ *
+ * The returned buffer belongs to the cache, and is only valid until the next
+ * call to dirlist_get. Returns null on failure.
+ */
+const char *dirlist_get(struct dirlist_cache *dc, const char *path, struct stat *st,
+		int fmt, int *size);
+
+/* drop the listings of all caches */
+void dirlist_clear_cache(void);
+/* drop the least recently used listings of any cache, until they take up at
+ * most max_size bytes. Returns the number of bytes freed.
+ */
+long dirlist_trim(long max_size);
+
+#endif	/* DIRLIST_H_ */
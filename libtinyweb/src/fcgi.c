@@ -0,0 +1,1324 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <alloca.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fcgi.h"
+#include "outq.h"
+#include "memgov.h"
+#include "logger.h"
+
+#define FCGI_VERSION_1			1
+
+/* record types */
+#define FCGI_BEGIN_REQUEST		1
+#define FCGI_ABORT_REQUEST		2
+#define FCGI_END_REQUEST		3
+#define FCGI_PARAMS				4
+#define FCGI_STDIN				5
+#define FCGI_STDOUT				6
+#define FCGI_STDERR				7
+#define FCGI_GET_VALUES			9
+#define FCGI_GET_VALUES_RESULT	10
+
+#define FCGI_RESPONDER			1
+#define FCGI_KEEP_CONN			1
+
+#define FCGI_HDR_SIZE			8
+#define FCGI_MAX_CONTENT		65535
+
+/* maximum number of requests multiplexed over a single connection, for
+ * applications which report that they can do that.
+ */
+#define MAX_CONN_REQS			16
+
+/* maximum number of 4k reads from an application connection at a time */
+#define MAX_READS				16
+/* maximum number of request body records sent to a connection at a time */
+#define MAX_SENDS				16
+
+/* milliseconds a request can go without progress, waiting for a connection or
+ * for the application, before it fails with FCGI_TIMEOUT.
+ */
+#define RESP_TIMEOUT			60000
+
+/* workers which exit this soon after starting aren't restarted right away,
+ * but after a delay which doubles every time, so that a script which isn't a
+ * FastCGI application isn't forked again for every request.
+ */
+#define QUICK_EXIT				5000
+#define RESTART_DELAY			1000
+#define RESTART_MAX				60000
+
+/* how often to look for exited workers while requests are waiting on them */
+#define CHECK_INTERVAL			1000
+
+struct fcgi_app {
+	char *path;		/* absolute path of the script */
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int lis;		/* listening socket shared by all worker processes */
+	pid_t *pids;
+	long long *started;	/* when each worker was started */
+	int num_workers;
+	long long restart_at, next_check;
+	long backoff;
+
+	struct fcgi_conn *conns;
+	int num_conns;
+
+	/* requests waiting for a free connection slot */
+	struct fcgi_req *pending, *pending_tail;
+
+	struct fcgi_app *next;
+};
+
+struct fcgi_conn {
+	int s;
+	struct fcgi_app *app;
+	int max_reqs;	/* 1 unless the application can multiplex requests */
+	int num_reqs;
+	struct fcgi_req *reqs[MAX_CONN_REQS];	/* active requests, by id - 1 */
+
+	/* incoming data, until we have complete records */
+	unsigned char *inbuf;
+	int inlen, insize;
+
+	/* records waiting to be sent, and the request whose body is being sent as
+	 * its stdin stream, a record at a time as the queue drains.
+	 */
+	struct outq outq;
+	struct fcgi_req *stdin_req;
+
+	int events;		/* TW_READ/TW_WRITE, as reported to the socket function */
+
+	struct fcgi_conn *next;
+};
+
+struct fcgi_req {
+	int id;
+	struct fcgi_conn *conn;
+
+	/* encoded FCGI_PARAMS name-value pairs, and the request body, until the
+	 * request is sent.
+	 */
+	unsigned char *params;
+	int params_len, params_size;
+	struct req_body body;
+
+	fcgi_out_func out;	/* null if the request was aborted */
+	void *cls;
+	int throttled;
+	long long deadline;
+
+	struct fcgi_req *next;
+};
+
+static struct fcgi_app *create_app(char *path);
+static void destroy_app(struct fcgi_app *app);
+static int spawn_worker(struct fcgi_app *app, int idx);
+static void check_workers(struct fcgi_app *app);
+static int workers_running(struct fcgi_app *app);
+static int app_busy(struct fcgi_app *app);
+
+static int schedule(struct fcgi_app *app);
+static struct fcgi_conn *new_conn(struct fcgi_app *app);
+static void close_conn(struct fcgi_conn *conn, int fail_reqs);
+static int start_request(struct fcgi_conn *conn, struct fcgi_req *freq);
+static int feed_stdin(struct fcgi_conn *conn);
+static int send_queued(struct fcgi_conn *conn);
+static int conn_throttled(struct fcgi_conn *conn);
+static int conn_events(struct fcgi_conn *conn);
+static void update_events(struct fcgi_conn *conn);
+static int proc_record(struct fcgi_conn *conn, unsigned char *rec);
+static void free_request(struct fcgi_req *freq);
+static void fail_pending(struct fcgi_app *app);
+
+static int build_params(struct fcgi_req *freq, struct tw_request *req, const char *path,
+		const struct fcgi_vars *vars);
+static int add_param(struct fcgi_req *freq, const char *name, const char *val);
+static int add_paramn(struct fcgi_req *freq, const char *name, int nlen, const char *val, int vlen);
+static long get_length(unsigned char **ptr, unsigned char *end);
+static int append(unsigned char **buf, int *len, int *size, const void *data, int datalen);
+static void write_header(unsigned char *hdr, int type, int id, int len);
+static long long now_msec(void);
+
+static struct fcgi_app *applist;
+static int num_workers = 4;
+static unsigned int app_seq;
+static fcgi_sock_func sock_func;
+static void *sock_cls;
+
+/* request being queued by fcgi_request, cleared if it fails in the process */
+static struct fcgi_req *new_req;
+
+
+void fcgi_set_workers(int n)
+{
+	num_workers = n > 0 ? n : 1;
+}
+
+struct fcgi_req *fcgi_request(const char *script, struct tw_request *req,
+		const struct fcgi_vars *vars, fcgi_out_func out, void *cls)
+{
+	char *path;
+	struct fcgi_app *app;
+	struct fcgi_req *freq;
+
+	if(!(path = realpath(script, 0))) {
+		logmsg("fcgi: failed to resolve script path %s: %s\n", script, strerror(errno));
+		return 0;
+	}
+
+	app = applist;
+	while(app) {
+		if(strcmp(app->path, path) == 0) {
+			break;
+		}
+		app = app->next;
+	}
+
+	if(app) {
+		free(path);
+	} else {
+		if(!(app = create_app(path))) {
+			return 0;
+		}
+	}
+	check_workers(app);
+	if(!workers_running(app)) {
+		logmsg("fcgi: no workers running for %s\n", app->path);
+		return 0;
+	}
+
+	if(!(freq = calloc(1, sizeof *freq))) {
+		logmsg("fcgi: failed to allocate request\n");
+		return 0;
+	}
+	freq->cls = cls;
+	freq->deadline = now_msec() + RESP_TIMEOUT;
+	body_init(&freq->body);
+
+	if(build_params(freq, req, app->path, vars) == -1) {
+		logmsg("fcgi: failed to allocate request parameters\n");
+		free_request(freq);
+		return 0;
+	}
+	/* the request body is sent later, when there's a free connection */
+	body_move(&freq->body, &req->body);
+
+	if(app->pending) {
+		app->pending_tail->next = freq;
+	} else {
+		app->pending = freq;
+	}
+	app->pending_tail = freq;
+
+	/* the output callback is only set after scheduling, so that it's never
+	 * called before the caller gets a chance to see the request.
+	 */
+	new_req = freq;
+	if(schedule(app) == -1 && !app->conns) {
+		/* can't reach the application at all */
+		fail_pending(app);
+	}
+	if(!new_req) {
+		return 0;
+	}
+	new_req = 0;
+	freq->out = out;
+	return freq;
+}
+
+void fcgi_abort(struct fcgi_req *freq)
+{
+	struct fcgi_app *app;
+	struct fcgi_req dummy, *prev;
+	unsigned char rec[FCGI_HDR_SIZE];
+
+	if(freq->conn) {
+		/* already sent, ask the application to stop, and discard whatever it
+		 * sends back until the request ends.
+		 */
+		struct fcgi_conn *conn = freq->conn;
+
+		freq->out = 0;
+		freq->throttled = 0;
+		if(conn->stdin_req == freq) {
+			/* no point sending the rest of its body */
+			conn->stdin_req = 0;
+			body_destroy(&freq->body);
+		}
+		write_header(rec, FCGI_ABORT_REQUEST, freq->id, 0);
+		/* if the connection failed, fcgi_handle_socket will find out */
+		if(outq_add_mem(&conn->outq, rec, sizeof rec) != -1) {
+			send_queued(conn);
+		}
+		update_events(conn);
+		return;
+	}
+
+	/* still waiting for a connection, just drop it from the queue */
+	app = applist;
+	while(app) {
+		dummy.next = app->pending;
+		prev = &dummy;
+		while(prev->next) {
+			if(prev->next == freq) {
+				prev->next = freq->next;
+				app->pending = dummy.next;
+				if(app->pending_tail == freq) {
+					app->pending_tail = prev == &dummy ? 0 : prev;
+				}
+				free_request(freq);
+				return;
+			}
+			prev = prev->next;
+		}
+		app = app->next;
+	}
+}
+
+void fcgi_throttle(struct fcgi_req *freq, int stop)
+{
+	freq->throttled = stop;
+	if(freq->conn) {
+		update_events(freq->conn);
+	}
+}
+
+void fcgi_set_sock_func(fcgi_sock_func func, void *cls)
+{
+	sock_func = func;
+	sock_cls = cls;
+}
+
+long fcgi_next_timeout(void)
+{
+	int i;
+	struct fcgi_app *app;
+	struct fcgi_conn *conn;
+	struct fcgi_req *freq;
+	long long next = LLONG_MAX, now;
+
+	for(app=applist; app; app=app->next) {
+		if(!app_busy(app)) continue;
+
+		if(app->next_check < next) next = app->next_check;
+		for(freq=app->pending; freq; freq=freq->next) {
+			if(freq->deadline < next) next = freq->deadline;
+		}
+		for(conn=app->conns; conn; conn=conn->next) {
+			for(i=0; i<MAX_CONN_REQS; i++) {
+				if((freq = conn->reqs[i]) && freq->deadline < next) {
+					next = freq->deadline;
+				}
+			}
+		}
+	}
+	if(next == LLONG_MAX) {
+		return -1;
+	}
+	now = now_msec();
+	return next > now ? (long)(next - now) : 0;
+}
+
+void fcgi_handle_timeouts(void)
+{
+	int i, expired;
+	struct fcgi_app *app;
+	struct fcgi_conn *conn;
+	struct fcgi_req *freq, dummy, *prev;
+	long long now = now_msec();
+
+	for(app=applist; app; app=app->next) {
+		if(!app_busy(app)) continue;
+
+		if(app->next_check <= now) {
+			check_workers(app);
+			if(!workers_running(app)) {
+				/* nothing will ever accept the connections */
+				logmsg("fcgi: no workers running for %s, failing its requests\n", app->path);
+				while(app->conns) {
+					close_conn(app->conns, 1);
+				}
+				fail_pending(app);
+				continue;
+			}
+		}
+
+		dummy.next = app->pending;
+		prev = &dummy;
+		while((freq = prev->next)) {
+			if(freq->deadline > now) {
+				prev = freq;
+				continue;
+			}
+			prev->next = freq->next;
+			app->pending = dummy.next;
+			if(app->pending_tail == freq) {
+				app->pending_tail = prev == &dummy ? 0 : prev;
+			}
+			logmsg("fcgi: %s: timed out waiting for a connection\n", app->path);
+			if(freq->out) {
+				freq->out(FCGI_TIMEOUT, 0, 0, freq->cls);
+			}
+			free_request(freq);
+		}
+
+restart:
+		for(conn=app->conns; conn; conn=conn->next) {
+			expired = 0;
+			for(i=0; i<MAX_CONN_REQS; i++) {
+				if(!(freq = conn->reqs[i]) || freq->deadline > now) continue;
+
+				if(freq->throttled) {
+					/* waiting for the client, not for the application */
+					freq->deadline = now + RESP_TIMEOUT;
+					continue;
+				}
+				if(freq->out) {
+					freq->out(FCGI_TIMEOUT, 0, 0, freq->cls);
+					freq->out = 0;
+				}
+				expired = 1;
+			}
+			if(expired) {
+				/* the worker is stuck, or never accepted the connection */
+				logmsg("fcgi: %s: timed out waiting for the response\n", app->path);
+				close_conn(conn, 1);
+				goto restart;	/* the list has changed */
+			}
+		}
+		schedule(app);
+	}
+}
+
+int fcgi_get_sockets(int *socks)
+{
+	int count = 0;
+	struct fcgi_app *app;
+	struct fcgi_conn *conn;
+
+	app = applist;
+	while(app) {
+		conn = app->conns;
+		while(conn) {
+			if(conn_events(conn) & TW_READ) {
+				if(socks) {
+					*socks++ = conn->s;
+				}
+				count++;
+			}
+			conn = conn->next;
+		}
+		app = app->next;
+	}
+	return count;
+}
+
+int fcgi_get_wsockets(int *socks)
+{
+	int count = 0;
+	struct fcgi_app *app;
+	struct fcgi_conn *conn;
+
+	for(app=applist; app; app=app->next) {
+		for(conn=app->conns; conn; conn=conn->next) {
+			if(conn_events(conn) & TW_WRITE) {
+				if(socks) *socks++ = conn->s;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+int fcgi_handle_socket(int s)
+{
+	struct fcgi_app *app;
+	struct fcgi_conn *conn = 0;
+	unsigned char buf[4096];
+	int i, rdsz, reclen, pos, eof;
+
+	app = applist;
+	while(app && !conn) {
+		conn = app->conns;
+		while(conn && conn->s != s) {
+			conn = conn->next;
+		}
+		app = app->next;
+	}
+	if(!conn) {
+		return -1;
+	}
+	app = conn->app;
+
+	/* the rest of the requests, if the socket is writable again */
+	if(send_queued(conn) == -1) {
+		close_conn(conn, 1);
+		schedule(app);
+		return 0;
+	}
+
+	/* read a limited amount at a time, so that the output of a fast
+	 * application doesn't pile up here, if the client is slow.
+	 */
+	eof = 0;
+	for(i=0; i<MAX_READS; i++) {
+		if((rdsz = recv(s, buf, sizeof buf, 0)) <= 0) {
+			eof = rdsz == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+			break;
+		}
+		if(append(&conn->inbuf, &conn->inlen, &conn->insize, buf, rdsz) == -1) {
+			logmsg("fcgi: failed to allocate input buffer\n");
+			close_conn(conn, 1);
+			schedule(app);
+			return 0;
+		}
+	}
+
+	/* process all the complete records we've got */
+	pos = 0;
+	while(conn->inlen - pos >= FCGI_HDR_SIZE) {
+		unsigned char *rec = conn->inbuf + pos;
+
+		reclen = FCGI_HDR_SIZE + ((rec[4] << 8) | rec[5]) + rec[6];
+		if(conn->inlen - pos < reclen) {
+			break;
+		}
+		if(proc_record(conn, rec) == -1) {
+			close_conn(conn, 1);
+			schedule(app);
+			return 0;
+		}
+		pos += reclen;
+	}
+	if(pos > 0) {
+		memmove(conn->inbuf, conn->inbuf + pos, conn->inlen - pos);
+		conn->inlen -= pos;
+	}
+
+	if(eof) {
+		/* applications which ignore FCGI_KEEP_CONN close the connection after
+		 * every request, which is only a problem with requests in flight.
+		 */
+		if(conn->num_reqs > 0) {
+			logmsg("fcgi: %s closed the connection\n", app->path);
+		}
+		close_conn(conn, 1);
+		check_workers(app);
+	}
+
+	/* completed requests freed up connection slots, and the stdin streams
+	 * which are done don't hold up the next requests.
+	 */
+	if(!eof) {
+		update_events(conn);
+	}
+	schedule(app);
+	return 0;
+}
+
+void fcgi_shutdown(void)
+{
+	while(applist) {
+		struct fcgi_app *app = applist;
+		applist = applist->next;
+		destroy_app(app);
+	}
+}
+
+
+static struct fcgi_app *create_app(char *path)
+{
+	int i;
+	struct fcgi_app *app;
+
+	if(!(app = calloc(1, sizeof *app)) || !(app->pids = calloc(num_workers, sizeof *app->pids)) ||
+			!(app->started = calloc(num_workers, sizeof *app->started))) {
+		logmsg("fcgi: failed to allocate application\n");
+		if(app) free(app->pids);
+		free(app);
+		free(path);
+		return 0;
+	}
+	app->path = path;
+	app->num_workers = num_workers;
+
+	/* the workers accept connections on a socket in the abstract namespace,
+	 * so there is no socket file to clean up afterwards.
+	 */
+	app->addr.sun_family = AF_UNIX;
+	snprintf(app->addr.sun_path + 1, sizeof app->addr.sun_path - 1, "tinyweb-fcgi-%d-%u",
+			(int)getpid(), app_seq++);
+	app->addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(app->addr.sun_path + 1);
+
+	if((app->lis = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		logmsg("fcgi: failed to create socket: %s\n", strerror(errno));
+		goto err;
+	}
+	if(bind(app->lis, (struct sockaddr*)&app->addr, app->addrlen) == -1 || listen(app->lis, 64) == -1) {
+		logmsg("fcgi: failed to bind socket: %s\n", strerror(errno));
+		close(app->lis);
+		goto err;
+	}
+
+	for(i=0; i<app->num_workers; i++) {
+		spawn_worker(app, i);
+	}
+	logmsg("fcgi: started %d workers for %s\n", app->num_workers, path);
+
+	app->next = applist;
+	applist = app;
+	return app;
+
+err:
+	free(app->pids);
+	free(app->started);
+	free(app->path);
+	free(app);
+	return 0;
+}
+
+static void destroy_app(struct fcgi_app *app)
+{
+	int i;
+
+	while(app->conns) {
+		close_conn(app->conns, 1);
+	}
+	fail_pending(app);
+	close(app->lis);
+
+	for(i=0; i<app->num_workers; i++) {
+		if(app->pids[i] > 0) {
+			kill(app->pids[i], SIGTERM);
+			waitpid(app->pids[i], 0, 0);
+		}
+	}
+	free(app->pids);
+	free(app->started);
+	free(app->path);
+	free(app);
+}
+
+static int spawn_worker(struct fcgi_app *app, int idx)
+{
+	int fd;
+	pid_t pid;
+	char *slash;
+
+	if((pid = fork()) == -1) {
+		logmsg("fcgi: failed to fork worker process: %s\n", strerror(errno));
+		app->pids[idx] = 0;
+		return -1;
+	}
+
+	if(!pid) {
+		/* FastCGI applications expect the listening socket on fd 0, and
+		 * don't write to stdout. Anything else which does, mustn't write to
+		 * ours. stderr is left alone, for error messages.
+		 */
+		dup2(app->lis, 0);
+		if((fd = open("/dev/null", O_WRONLY)) != -1) {
+			dup2(fd, 1);
+		}
+		closefrom(3);
+
+		if((slash = strrchr(app->path, '/'))) {
+			*slash = 0;
+			if(chdir(*app->path ? app->path : "/") == -1) {
+				_exit(1);
+			}
+			*slash = '/';
+		}
+		execl(app->path, app->path, (char*)0);
+		fprintf(stderr, "fcgi: failed to execute %s: %s\n", app->path, strerror(errno));
+		_exit(1);
+	}
+
+	app->pids[idx] = pid;
+	app->started[idx] = now_msec();
+	return 0;
+}
+
+/* reap and restart any worker processes which have exited, unless they keep
+ * exiting right after they start, in which case they're restarted later.
+ */
+static void check_workers(struct fcgi_app *app)
+{
+	int i, status, quick = 0;
+	long long now = now_msec();
+
+	app->next_check = now + CHECK_INTERVAL;
+
+	for(i=0; i<app->num_workers; i++) {
+		if(app->pids[i] <= 0 || waitpid(app->pids[i], &status, WNOHANG) != app->pids[i]) {
+			continue;
+		}
+		app->pids[i] = 0;
+		if(now - app->started[i] < QUICK_EXIT) {
+			quick = 1;
+		} else {
+			app->backoff = 0;
+		}
+	}
+	if(quick) {
+		app->backoff = app->backoff ? app->backoff * 2 : RESTART_DELAY;
+		if(app->backoff > RESTART_MAX) app->backoff = RESTART_MAX;
+		app->restart_at = now + app->backoff;
+		logmsg("fcgi: workers for %s exit right after starting, restarting them in %ld ms\n",
+				app->path, app->backoff);
+	}
+	if(now < app->restart_at) {
+		return;
+	}
+
+	for(i=0; i<app->num_workers; i++) {
+		if(app->pids[i] <= 0) {
+			logmsg("fcgi: worker for %s exited, restarting\n", app->path);
+			spawn_worker(app, i);
+		}
+	}
+}
+
+static int workers_running(struct fcgi_app *app)
+{
+	int i;
+
+	for(i=0; i<app->num_workers; i++) {
+		if(app->pids[i] > 0) return 1;
+	}
+	return 0;
+}
+
+/* requests are waiting for a connection, or on one */
+static int app_busy(struct fcgi_app *app)
+{
+	struct fcgi_conn *conn;
+
+	if(app->pending) {
+		return 1;
+	}
+	for(conn=app->conns; conn; conn=conn->next) {
+		if(conn->num_reqs > 0) return 1;
+	}
+	return 0;
+}
+
+/* hand pending requests to connections with free slots, opening new
+ * connections as needed, up to one per worker process.
+ */
+static int schedule(struct fcgi_app *app)
+{
+	struct fcgi_conn *conn;
+	struct fcgi_req *freq;
+
+	while(app->pending) {
+		/* the body of a request has to be sent before the next one's */
+		conn = app->conns;
+		while(conn && (conn->num_reqs >= conn->max_reqs || conn->stdin_req)) {
+			conn = conn->next;
+		}
+
+		if(!conn) {
+			if(app->num_conns >= app->num_workers) {
+				return 0;	/* all busy, wait for a request to finish */
+			}
+			if(!(conn = new_conn(app))) {
+				return -1;
+			}
+		}
+
+		freq = app->pending;
+		if(!(app->pending = freq->next)) {
+			app->pending_tail = 0;
+		}
+		freq->next = 0;
+
+		if(start_request(conn, freq) == -1) {
+			close_conn(conn, 1);
+		}
+	}
+	return 0;
+}
+
+static struct fcgi_conn *new_conn(struct fcgi_app *app)
+{
+	struct fcgi_conn *conn;
+	unsigned char query[FCGI_HDR_SIZE + 32];
+	int len;
+
+	if(!(conn = calloc(1, sizeof *conn))) {
+		logmsg("fcgi: failed to allocate connection\n");
+		return 0;
+	}
+	conn->app = app;
+	conn->max_reqs = 1;
+	outq_init(&conn->outq);
+
+	if((conn->s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		logmsg("fcgi: failed to create socket: %s\n", strerror(errno));
+		free(conn);
+		return 0;
+	}
+	/* non-blocking before connecting, a full backlog fails instead of blocking */
+	fcntl(conn->s, F_SETFL, fcntl(conn->s, F_GETFL) | O_NONBLOCK);
+	if(connect(conn->s, (struct sockaddr*)&app->addr, app->addrlen) == -1) {
+		logmsg("fcgi: failed to connect to %s: %s\n", app->path, strerror(errno));
+		close(conn->s);
+		free(conn);
+		return 0;
+	}
+
+	/* ask if the application can multiplex requests over this connection */
+	len = 2 + strlen("FCGI_MPXS_CONNS");
+	write_header(query, FCGI_GET_VALUES, 0, len);
+	query[FCGI_HDR_SIZE] = len - 2;
+	query[FCGI_HDR_SIZE + 1] = 0;
+	memcpy(query + FCGI_HDR_SIZE + 2, "FCGI_MPXS_CONNS", len - 2);
+	if(outq_add_mem(&conn->outq, query, FCGI_HDR_SIZE + len) == -1) {
+		close(conn->s);
+		free(conn);
+		return 0;
+	}
+
+	/* it's sent along with the first request */
+	conn->next = app->conns;
+	app->conns = conn;
+	app->num_conns++;
+	return conn;
+}
+
+static void close_conn(struct fcgi_conn *conn, int fail_reqs)
+{
+	int i;
+	struct fcgi_app *app = conn->app;
+	struct fcgi_conn dummy, *prev;
+
+	for(i=0; i<MAX_CONN_REQS; i++) {
+		struct fcgi_req *freq = conn->reqs[i];
+		if(freq) {
+			if(fail_reqs && freq->out) {
+				freq->out(FCGI_ERROR, 0, 0, freq->cls);
+			}
+			free_request(freq);
+		}
+	}
+
+	dummy.next = app->conns;
+	prev = &dummy;
+	while(prev->next && prev->next != conn) {
+		prev = prev->next;
+	}
+	if(prev->next) {
+		prev->next = conn->next;
+		app->num_conns--;
+	}
+	app->conns = dummy.next;
+
+	if(conn->events) {
+		sock_func(conn->s, 0, sock_cls);
+	}
+	close(conn->s);
+	outq_destroy(&conn->outq);
+	free(conn->inbuf);
+	mem_charge(MEM_HEADER, -conn->insize);
+	free(conn);
+}
+
+static int conn_throttled(struct fcgi_conn *conn)
+{
+	int i;
+
+	for(i=0; i<MAX_CONN_REQS; i++) {
+		if(conn->reqs[i] && conn->reqs[i]->throttled) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* connections are read from unless a client can't keep up with one of their
+ * requests, and written to while there's anything left to send.
+ */
+static int conn_events(struct fcgi_conn *conn)
+{
+	int events = 0;
+
+	if(!conn_throttled(conn)) {
+		events |= TW_READ;
+	}
+	if(!outq_empty(&conn->outq) || conn->stdin_req) {
+		events |= TW_WRITE;
+	}
+	return events;
+}
+
+/* tell the socket function how the connection should be monitored now */
+static void update_events(struct fcgi_conn *conn)
+{
+	int events;
+
+	if(sock_func && (events = conn_events(conn)) != conn->events) {
+		conn->events = events;
+		sock_func(conn->s, events, sock_cls);
+	}
+}
+
+/* queue the records of a request, and start sending them. The body goes
+ * out as the stdin stream from feed_stdin, as the connection takes it.
+ */
+static int start_request(struct fcgi_conn *conn, struct fcgi_req *freq)
+{
+	int i, len, pos;
+	unsigned char begin[FCGI_HDR_SIZE * 2], hdr[FCGI_HDR_SIZE];
+
+	for(i=0; i<MAX_CONN_REQS; i++) {
+		if(!conn->reqs[i]) break;
+	}
+	freq->id = i + 1;
+	freq->conn = conn;
+	freq->deadline = now_msec() + RESP_TIMEOUT;
+	conn->reqs[i] = freq;
+	conn->num_reqs++;
+
+	write_header(begin, FCGI_BEGIN_REQUEST, freq->id, 8);
+	memset(begin + FCGI_HDR_SIZE, 0, 8);
+	begin[FCGI_HDR_SIZE + 1] = FCGI_RESPONDER;
+	begin[FCGI_HDR_SIZE + 2] = FCGI_KEEP_CONN;
+	if(outq_add_mem(&conn->outq, begin, sizeof begin) == -1) {
+		return -1;
+	}
+
+	/* parameters, split into records of at most 64k, and terminated by an
+	 * empty record.
+	 */
+	pos = 0;
+	while(pos < freq->params_len) {
+		len = freq->params_len - pos;
+		if(len > FCGI_MAX_CONTENT) len = FCGI_MAX_CONTENT;
+
+		write_header(hdr, FCGI_PARAMS, freq->id, len);
+		if(outq_add_mem(&conn->outq, hdr, sizeof hdr) == -1 ||
+				outq_add_mem(&conn->outq, freq->params + pos, len) == -1) {
+			return -1;
+		}
+		pos += len;
+	}
+	write_header(hdr, FCGI_PARAMS, freq->id, 0);
+	if(outq_add_mem(&conn->outq, hdr, sizeof hdr) == -1) {
+		return -1;
+	}
+	free(freq->params);
+	mem_charge(MEM_HEADER, -freq->params_size);
+	freq->params = 0;
+	freq->params_size = 0;
+
+	conn->stdin_req = freq;
+	if(send_queued(conn) == -1) {
+		return -1;
+	}
+	update_events(conn);
+	return 0;
+}
+
+/* queue the next record of the body being sent, once the previous one is out,
+ * so that a large body isn't copied to memory all at once. The empty record
+ * which ends the stream follows the last of it.
+ */
+static int feed_stdin(struct fcgi_conn *conn)
+{
+	struct fcgi_req *freq = conn->stdin_req;
+	unsigned char hdr[FCGI_HDR_SIZE];
+	char *buf;
+	long len;
+
+	if(!freq || !outq_empty(&conn->outq)) {
+		return 0;
+	}
+
+	if((len = freq->body.size - freq->body.rdpos) > FCGI_MAX_CONTENT) {
+		len = FCGI_MAX_CONTENT;
+	}
+	write_header(hdr, FCGI_STDIN, freq->id, len);
+	if(outq_add_mem(&conn->outq, hdr, sizeof hdr) == -1) {
+		return -1;
+	}
+	freq->deadline = now_msec() + RESP_TIMEOUT;
+
+	if(len == 0) {
+		conn->stdin_req = 0;
+		body_destroy(&freq->body);
+		return 0;
+	}
+
+	if(!(buf = malloc(len))) {
+		logmsg("fcgi: failed to allocate request body buffer\n");
+		return -1;
+	}
+	if(body_read(&freq->body, buf, len) != len) {
+		logmsg("fcgi: failed to read request body\n");
+		free(buf);
+		return -1;
+	}
+	if(outq_add_buf(&conn->outq, buf, len) == -1) {
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+/* send as much as the connection takes without blocking, topping up the
+ * queue from the body being sent.
+ */
+static int send_queued(struct fcgi_conn *conn)
+{
+	int i, res;
+
+	for(i=0; i<MAX_SENDS; i++) {
+		if(feed_stdin(conn) == -1) {
+			return -1;
+		}
+		if((res = outq_flush(&conn->outq, conn->s, LONG_MAX)) == -1) {
+			logmsg("fcgi: failed to send request to %s: %s\n", conn->app->path, strerror(errno));
+			return -1;
+		}
+		if(res == 1 || !conn->stdin_req) {
+			break;	/* the socket is full, or there's nothing more to queue */
+		}
+	}
+	return 0;
+}
+
+static int proc_record(struct fcgi_conn *conn, unsigned char *rec)
+{
+	int id, len;
+	long nlen, vlen;
+	struct fcgi_req *freq = 0;
+	unsigned char *content = rec + FCGI_HDR_SIZE, *end;
+
+	if(rec[0] != FCGI_VERSION_1) {
+		logmsg("fcgi: invalid record from %s\n", conn->app->path);
+		return -1;
+	}
+	id = (rec[2] << 8) | rec[3];
+	len = (rec[4] << 8) | rec[5];
+
+	if(id > 0 && id <= MAX_CONN_REQS) {
+		freq = conn->reqs[id - 1];
+	}
+
+	if(freq) {
+		freq->deadline = now_msec() + RESP_TIMEOUT;
+	}
+
+	switch(rec[1]) {
+	case FCGI_STDOUT:
+		if(freq && freq->out && len > 0) {
+			freq->out(FCGI_DATA, (char*)content, len, freq->cls);
+		}
+		break;
+
+	case FCGI_STDERR:
+		if(len > 0) {
+			logmsg("fcgi: %s: %.*s\n", conn->app->path, len, (char*)content);
+		}
+		break;
+
+	case FCGI_END_REQUEST:
+		if(freq) {
+			conn->reqs[id - 1] = 0;
+			conn->num_reqs--;
+			if(freq->out) {
+				freq->out(FCGI_END, 0, 0, freq->cls);
+			}
+			free_request(freq);
+			update_events(conn);
+		}
+		break;
+
+	case FCGI_GET_VALUES_RESULT:
+		end = content + len;
+		while(content < end) {
+			if((nlen = get_length(&content, end)) == -1 || (vlen = get_length(&content, end)) == -1 ||
+					nlen + vlen > end - content) {
+				break;	/* truncated */
+			}
+			if(nlen == 15 && memcmp(content, "FCGI_MPXS_CONNS", 15) == 0) {
+				if(vlen > 0 && content[nlen] == '1') {
+					conn->max_reqs = MAX_CONN_REQS;
+				}
+			}
+			content += nlen + vlen;
+		}
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+static void free_request(struct fcgi_req *freq)
+{
+	if(freq == new_req) {
+		new_req = 0;
+	}
+	if(freq->conn && freq->conn->stdin_req == freq) {
+		/* ended before reading all of its stdin */
+		freq->conn->stdin_req = 0;
+	}
+	free(freq->params);
+	mem_charge(MEM_HEADER, -freq->params_size);
+	body_destroy(&freq->body);
+	free(freq);
+}
+
+static void fail_pending(struct fcgi_app *app)
+{
+	struct fcgi_req *freq;
+
+	while(app->pending) {
+		freq = app->pending;
+		app->pending = freq->next;
+		if(freq->out) {
+			freq->out(FCGI_ERROR, 0, 0, freq->cls);
+		}
+		free_request(freq);
+	}
+	app->pending_tail = 0;
+}
+
+/* CGI/1.1 meta-variables for the request */
+static int build_params(struct fcgi_req *freq, struct tw_request *req, const char *path,
+		const struct fcgi_vars *vars)
+{
+	int i, len;
+	const char *host, *val;
+	char *cwd, *name, *dest;
+	char buf[32];
+	struct http_req_header *hdr = req->hdr;
+
+	/* the script is named by the request path, up to the path info */
+	len = strlen(req->path);
+	if(vars->path_info) {
+		len -= strlen(vars->path_info);
+		if(add_param(freq, "PATH_INFO", vars->path_info) == -1) {
+			return -1;
+		}
+	}
+	if(add_paramn(freq, "SCRIPT_NAME", 11, req->path, len) == -1) {
+		return -1;
+	}
+
+	sprintf(buf, "HTTP/%d.%d", hdr->ver_major, hdr->ver_minor);
+	if(add_param(freq, "GATEWAY_INTERFACE", "CGI/1.1") == -1 ||
+			add_param(freq, "SERVER_SOFTWARE", "tinyweb") == -1 ||
+			add_param(freq, "SERVER_PROTOCOL", buf) == -1 ||
+			add_param(freq, "REQUEST_METHOD", http_method_name(hdr->method)) == -1 ||
+			add_param(freq, "REQUEST_URI", hdr->uri) == -1 ||
+			add_param(freq, "SCRIPT_FILENAME", path) == -1 ||
+			add_param(freq, "QUERY_STRING", req->query ? req->query : "") == -1) {
+		return -1;
+	}
+
+	if(vars->docroot) {
+		if(add_param(freq, "DOCUMENT_ROOT", vars->docroot) == -1) {
+			return -1;
+		}
+	} else if((cwd = getcwd(0, 0))) {
+		i = add_param(freq, "DOCUMENT_ROOT", cwd);
+		free(cwd);
+		if(i == -1) return -1;
+	}
+	if(vars->remote_addr && add_param(freq, "REMOTE_ADDR", vars->remote_addr) == -1) {
+		return -1;
+	}
+	if(vars->server_port > 0) {
+		sprintf(buf, "%d", vars->server_port);
+		if(add_param(freq, "SERVER_PORT", buf) == -1) {
+			return -1;
+		}
+	}
+	if(req->secure && add_param(freq, "HTTPS", "on") == -1) {
+		return -1;
+	}
+	if(req->body.size > 0 || http_field(hdr, HTTP_TRANSFER_ENCODING)) {
+		sprintf(buf, "%ld", req->body.size);
+		if(add_param(freq, "CONTENT_LENGTH", buf) == -1) {
+			return -1;
+		}
+	}
+
+	/* the host the client asked for, without the port, or the address the
+	 * request came to, if it didn't say.
+	 */
+	if((host = http_field(hdr, HTTP_HOST)) && *host) {
+		if(*host == '[' && (val = strchr(host, ']'))) {
+			len = val + 1 - host;	/* IPv6 address */
+		} else {
+			len = strcspn(host, ":");
+		}
+	} else {
+		host = vars->server_addr ? vars->server_addr : "localhost";
+		len = strlen(host);
+	}
+	if(add_paramn(freq, "SERVER_NAME", 11, host, len) == -1) {
+		return -1;
+	}
+
+	/* header fields become HTTP_* variables, except for the content type,
+	 * which has its own, and the body framing fields which only concern us.
+	 * Proxy is dropped too: as HTTP_PROXY, applications would take it for the
+	 * proxy to use for their own outgoing requests (httpoxy).
+	 */
+	for(i=0; i<hdr->num_hdrfields; i++) {
+		const char *field = hdr->hdrfields[i];
+
+		if(!(val = strchr(field, ':'))) continue;
+		len = val - field;
+		do val++; while(*val && isspace(*val));
+
+		if(len == 5 && strncasecmp(field, "Proxy", 5) == 0) {
+			continue;
+		}
+
+		switch(http_field_id(field, len)) {
+		case HTTP_CONTENT_LENGTH:
+		case HTTP_TRANSFER_ENCODING:
+			continue;
+		case HTTP_CONTENT_TYPE:
+			if(add_param(freq, "CONTENT_TYPE", val) == -1) return -1;
+			continue;
+		}
+
+		name = alloca(len + 6);
+		strcpy(name, "HTTP_");
+		dest = name + 5;
+		while(len-- > 0) {
+			*dest++ = *field == '-' ? '_' : toupper(*field);
+			field++;
+		}
+		*dest = 0;
+		if(add_param(freq, name, val) == -1) return -1;
+	}
+	return 0;
+}
+
+static int add_param(struct fcgi_req *freq, const char *name, const char *val)
+{
+	return add_paramn(freq, name, strlen(name), val, strlen(val));
+}
+
+/* name-value pair lengths are encoded in one byte if they're shorter than 128
+ * bytes, or four bytes with the top bit set otherwise.
+ */
+static int add_paramn(struct fcgi_req *freq, const char *name, int nlen, const char *val, int vlen)
+{
+	unsigned char lenbuf[8], *ptr = lenbuf;
+	int i, lens[2];
+
+	lens[0] = nlen;
+	lens[1] = vlen;
+	for(i=0; i<2; i++) {
+		if(lens[i] < 128) {
+			*ptr++ = lens[i];
+		} else {
+			*ptr++ = (lens[i] >> 24) | 0x80;
+			*ptr++ = lens[i] >> 16;
+			*ptr++ = lens[i] >> 8;
+			*ptr++ = lens[i];
+		}
+	}
+
+	if(append(&freq->params, &freq->params_len, &freq->params_size, lenbuf, ptr - lenbuf) == -1 ||
+			append(&freq->params, &freq->params_len, &freq->params_size, name, nlen) == -1 ||
+			append(&freq->params, &freq->params_len, &freq->params_size, val, vlen) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* read a name-value pair length encoded like add_paramn does it, or return
+ * -1 if it doesn't fit before end.
+ */
+static long get_length(unsigned char **ptr, unsigned char *end)
+{
+	unsigned char *p = *ptr;
+
+	if(p >= end) {
+		return -1;
+	}
+	if(!(*p & 0x80)) {
+		*ptr = p + 1;
+		return *p;
+	}
+	if(end - p < 4) {
+		return -1;
+	}
+	*ptr = p + 4;
+	return ((long)(p[0] & 0x7f) << 24) | ((long)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* the parameters of requests, and the input of connections, are collected
+ * here, and charged as header memory.
+ */
+static int append(unsigned char **buf, int *len, int *size, const void *data, int datalen)
+{
+	if(*len + datalen > *size) {
+		unsigned char *tmp;
+		int newsz = *size ? *size * 2 : 1024;
+
+		while(newsz < *len + datalen) newsz *= 2;
+		if(!(tmp = realloc(*buf, newsz))) {
+			return -1;
+		}
+		mem_charge(MEM_HEADER, newsz - *size);
+		*buf = tmp;
+		*size = newsz;
+	}
+	memcpy(*buf + *len, data, datalen);
+	*len += datalen;
+	return 0;
+}
+
+static void write_header(unsigned char *hdr, int type, int id, int len)
+{
+	hdr[0] = FCGI_VERSION_1;
+	hdr[1] = type;
+	hdr[2] = id >> 8;
+	hdr[3] = id;
+	hdr[4] = len >> 8;
+	hdr[5] = len;
+	hdr[6] = 0;	/* padding */
+	hdr[7] = 0;
+}
+
+static long long now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
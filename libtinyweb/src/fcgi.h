@@ -0,0 +1,84 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef FCGI_H_
+#define FCGI_H_
+
+#include "request.h"
+
+struct fcgi_req;
+
+/* output callback status */
+enum {
+	FCGI_DATA,		/* more output from the application in data/size */
+	FCGI_END,		/* the request is complete */
+	FCGI_ERROR,		/* the request failed */
+	FCGI_TIMEOUT	/* the application didn't respond in time */
+};
+
+/* called with the output of the application as it arrives, and once more
+ * when the request ends, with FCGI_END, FCGI_ERROR or FCGI_TIMEOUT.
+ */
+typedef void (*fcgi_out_func)(int status, const char *data, int size, void *cls);
+
+/* CGI meta-variables which don't come from the request itself */
+struct fcgi_vars {
+	const char *docroot;		/* DOCUMENT_ROOT, the current directory if null */
+	const char *path_info;		/* PATH_INFO, the path following the script, or null */
+	const char *remote_addr;	/* REMOTE_ADDR, the client address, or null */
+	const char *server_addr;	/* SERVER_NAME without a Host field, or null */
+	int server_port;			/* SERVER_PORT, 0 if there isn't one */
+};
+
+/* set the number of worker processes to spawn for each FastCGI application */
+void fcgi_set_workers(int n);
+
+/* Pass a request to the FastCGI application in the script file. The first
+ * request for a script spawns its worker pool, and the workers are kept
+ * running, serving requests over persistent connections. The output callback
+ * is called from fcgi_handle_socket as the response arrives.
+ * The meta-variables in vars are only used during the call. The request body
+ * is moved out of req, to be sent to the application as its standard input.
+ */
+struct fcgi_req *fcgi_request(const char *script, struct tw_request *req,
+		const struct fcgi_vars *vars, fcgi_out_func out, void *cls);
+
+/* abandon a request: the output callback will not be called again */
+void fcgi_abort(struct fcgi_req *freq);
+
+/* stop reading the output of a request while the client can't keep up, or
+ * resume reading it. This also holds back any other requests multiplexed
+ * over the same connection.
+ */
+void fcgi_throttle(struct fcgi_req *freq, int stop);
+
+/* connections to the applications, which need to be monitored for reading
+ * and writing, and passed to fcgi_handle_socket. Both work like
+ * tw_get_sockets, and return the number of sockets.
+ */
+int fcgi_get_sockets(int *socks);
+int fcgi_get_wsockets(int *socks);
+/* returns -1 if s isn't an application connection */
+int fcgi_handle_socket(int s);
+
+/* called whenever the events (TW_READ/TW_WRITE) a connection needs to be
+ * monitored for change, with 0 right before it's closed.
+ */
+typedef void (*fcgi_sock_func)(int s, int events, void *cls);
+
+void fcgi_set_sock_func(fcgi_sock_func func, void *cls);
+
+/* milliseconds until the next request times out, or the workers of an
+ * application with requests in flight are due to be checked, or -1.
+ */
+long fcgi_next_timeout(void);
+void fcgi_handle_timeouts(void);
+
+/* close all connections and terminate all worker processes */
+void fcgi_shutdown(void);
+
+#endif	/* FCGI_H_ */
@@ -0,0 +1,1006 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include "h2.h"
+#include "memgov.h"
+#include "logger.h"
+
+/* frame types */
+enum {
+	FR_DATA,
+	FR_HEADERS,
+	FR_PRIORITY,
+	FR_RST_STREAM,
+	FR_SETTINGS,
+	FR_PUSH_PROMISE,
+	FR_PING,
+	FR_GOAWAY,
+	FR_WINDOW_UPDATE,
+	FR_CONTINUATION
+};
+
+/* frame flags */
+#define FL_END_STREAM	0x01
+#define FL_ACK			0x01
+#define FL_END_HEADERS	0x04
+#define FL_PADDED		0x08
+#define FL_PRIORITY		0x20
+
+/* settings */
+enum {
+	SET_HEADER_TABLE_SIZE = 1,
+	SET_ENABLE_PUSH,
+	SET_MAX_CONCURRENT_STREAMS,
+	SET_INITIAL_WINDOW_SIZE,
+	SET_MAX_FRAME_SIZE,
+	SET_MAX_HEADER_LIST_SIZE
+};
+
+#define FRAME_HDR_SIZE		9
+#define DEF_FRAME_SIZE		16384
+#define DEF_WINDOW			65535
+#define MAX_WINDOW			0x7fffffff
+
+/* we accept frames up to the default size, and header blocks up to the same
+ * size as HTTP/1 headers.
+ */
+#define MAX_FRAME			DEF_FRAME_SIZE
+#define MAX_HBLOCK			65536
+#define MAX_STREAMS			100
+#define HPACK_TABLE_SIZE	4096
+
+/* receive window for the connection and for each stream, larger than the
+ * default so that uploads aren't limited by round trips. Credit is returned
+ * to the client once half of it is used.
+ */
+#define RCV_WINDOW			(1 << 20)
+
+/* request header being converted to HTTP/1 form */
+struct reqhdr {
+	char *method, *path, *authority;
+	char *fields;		/* regular fields as "name: value" lines */
+	int len, size;
+	char *cookie;		/* cookie fields, joined */
+	int cookielen;
+	int listsize;		/* decoded size, as SETTINGS_MAX_HEADER_LIST_SIZE counts it,
+						 * and charged as header memory for what's kept of it */
+	int regular;		/* past the pseudo-header fields */
+	int malformed;
+	int toolarge;		/* over the advertised limit, the fields are dropped */
+};
+
+static int process_frame(struct h2_conn *h2, int type, int flags, unsigned int id,
+		unsigned char *data, int len);
+static int recv_data(struct h2_conn *h2, int flags, unsigned int id, unsigned char *data, int len);
+static int recv_headers(struct h2_conn *h2, int flags, unsigned int id, unsigned char *data, int len);
+static int end_headers(struct h2_conn *h2);
+static int recv_settings(struct h2_conn *h2, int flags, unsigned int id, unsigned char *data, int len);
+static int apply_settings(struct h2_conn *h2, const unsigned char *data, int len);
+static int recv_window_update(struct h2_conn *h2, unsigned int id, unsigned char *data, int len);
+static int strip_padding(int flags, unsigned char **data, int *len);
+
+static int req_field(const char *name, int namelen, const char *val, int vallen, void *cls);
+static int skip_field(const char *name, int namelen, const char *val, int vallen, void *cls);
+static int append(char **buf, int *len, int *size, const char *fmt, ...);
+static char *build_request(struct reqhdr *rh, int *len, int *size);
+static void destroy_reqhdr(struct reqhdr *rh);
+
+static struct h2_stream *find_stream(struct h2_conn *h2, unsigned int id);
+static struct h2_stream *new_stream(struct h2_conn *h2, unsigned int id);
+static void free_stream(struct h2_conn *h2, struct h2_stream *st);
+static int conn_error(struct h2_conn *h2, int err);
+static int send_goaway(struct h2_conn *h2, int err);
+static int stream_error(struct h2_conn *h2, unsigned int id, int err);
+static int queue_frame(struct h2_conn *h2, int type, int flags, unsigned int id,
+		const void *payload, int len);
+static void write_frame_header(unsigned char *buf, int len, int type, int flags, unsigned int id);
+static unsigned int read32(const unsigned char *p);
+static void write32(unsigned char *p, unsigned int val);
+
+/* connection-specific fields, which don't exist in HTTP/2 */
+static const char *conn_fields[] = {
+	"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", 0
+};
+
+
+int h2_init(struct h2_conn *h2, struct outq *outq, const struct h2_callbacks *cb, void *cls)
+{
+	unsigned char buf[18], *ptr = buf;
+	unsigned char upd[4];
+
+	memset(h2, 0, sizeof *h2);
+	h2->outq = outq;
+	h2->cb = cb;
+	h2->cls = cls;
+	h2->max_frame = DEF_FRAME_SIZE;
+	h2->init_wnd = h2->wnd = DEF_WINDOW;
+	h2->rcv_wnd = RCV_WINDOW;
+
+	if(!(h2->frame = malloc(FRAME_HDR_SIZE + MAX_FRAME))) {
+		logmsg("failed to allocate HTTP/2 frame buffer\n");
+		return -1;
+	}
+	hpack_init(&h2->dec, HPACK_TABLE_SIZE);
+
+	ptr[0] = 0; ptr[1] = SET_MAX_CONCURRENT_STREAMS; write32(ptr + 2, MAX_STREAMS); ptr += 6;
+	ptr[0] = 0; ptr[1] = SET_INITIAL_WINDOW_SIZE; write32(ptr + 2, RCV_WINDOW); ptr += 6;
+	ptr[0] = 0; ptr[1] = SET_MAX_HEADER_LIST_SIZE; write32(ptr + 2, MAX_HBLOCK); ptr += 6;
+
+	/* the connection window can only be changed with a WINDOW_UPDATE */
+	write32(upd, RCV_WINDOW - DEF_WINDOW);
+
+	if(queue_frame(h2, FR_SETTINGS, 0, 0, buf, ptr - buf) == -1 ||
+			queue_frame(h2, FR_WINDOW_UPDATE, 0, 0, upd, 4) == -1) {
+		h2_destroy(h2);
+		return -1;
+	}
+	return 0;
+}
+
+void h2_destroy(struct h2_conn *h2)
+{
+	while(h2->streams) {
+		free_stream(h2, h2->streams);
+	}
+	hpack_destroy(&h2->dec);
+	free(h2->frame);
+	free(h2->hblock);
+	mem_charge(MEM_HEADER, -h2->hbsize);
+	h2->frame = h2->hblock = 0;
+	h2->hbsize = 0;
+	h2->closed = 1;
+}
+
+int h2_input(struct h2_conn *h2, const char *data, int size)
+{
+	int len, res;
+	unsigned char *fr;
+
+	while(size > 0 && !h2->closed) {
+		if(h2->preface < H2_PREFACE_LEN) {
+			len = H2_PREFACE_LEN - h2->preface;
+			if(len > size) len = size;
+			if(memcmp(data, H2_PREFACE + h2->preface, len) != 0) {
+				return conn_error(h2, H2_PROTOCOL_ERROR);
+			}
+			h2->preface += len;
+			data += len;
+			size -= len;
+			continue;
+		}
+
+		fr = h2->frame;
+		if(h2->framelen < FRAME_HDR_SIZE) {
+			len = FRAME_HDR_SIZE - h2->framelen;
+		} else {
+			len = FRAME_HDR_SIZE + ((fr[0] << 16) | (fr[1] << 8) | fr[2]) - h2->framelen;
+		}
+		if(len > size) len = size;
+		memcpy(fr + h2->framelen, data, len);
+		h2->framelen += len;
+		data += len;
+		size -= len;
+
+		if(h2->framelen < FRAME_HDR_SIZE) {
+			break;
+		}
+		len = (fr[0] << 16) | (fr[1] << 8) | fr[2];
+		if(len > MAX_FRAME) {
+			return conn_error(h2, H2_FRAME_SIZE_ERROR);
+		}
+		if(h2->framelen < FRAME_HDR_SIZE + len) {
+			continue;
+		}
+
+		h2->framelen = 0;
+		res = process_frame(h2, fr[3], fr[4], read32(fr + 5) & MAX_WINDOW, fr + FRAME_HDR_SIZE, len);
+		if(res == -1 || h2->closed) {
+			return -1;
+		}
+	}
+	return h2->closed ? -1 : 0;
+}
+
+/* HTTP2-Settings is the payload of a SETTINGS frame in base64url */
+int h2_upgrade_settings(struct h2_conn *h2, const char *b64)
+{
+	unsigned char buf[128];
+	unsigned int acc = 0;
+	int bits = 0, len = 0;
+	const char *ptr;
+
+	for(ptr=b64; *ptr && *ptr != '='; ptr++) {
+		int val;
+		if(*ptr >= 'A' && *ptr <= 'Z') {
+			val = *ptr - 'A';
+		} else if(*ptr >= 'a' && *ptr <= 'z') {
+			val = *ptr - 'a' + 26;
+		} else if(*ptr >= '0' && *ptr <= '9') {
+			val = *ptr - '0' + 52;
+		} else if(*ptr == '-' || *ptr == '+') {
+			val = 62;
+		} else if(*ptr == '_' || *ptr == '/') {
+			val = 63;
+		} else {
+			return -1;
+		}
+		acc = (acc << 6) | val;
+		if((bits += 6) >= 8) {
+			bits -= 8;
+			if(len >= sizeof buf) return -1;
+			buf[len++] = acc >> bits;
+		}
+	}
+	if(len % 6) {
+		return -1;
+	}
+	return apply_settings(h2, buf, len);
+}
+
+struct h2_stream *h2_upgrade_stream(struct h2_conn *h2)
+{
+	struct h2_stream *st;
+
+	if(!(st = new_stream(h2, 1))) {
+		return 0;
+	}
+	st->rcv_closed = 1;
+	h2->last_id = 1;
+	return st;
+}
+
+int h2_send_headers(struct h2_conn *h2, struct h2_stream *st, struct http_resp_header *resp)
+{
+	int i, j, size, len, namelen, frlen, type;
+	unsigned char *buf, *ptr;
+	const char *val;
+
+	if(h2->closed) return -1;
+
+	size = 8;
+	for(i=0; i<resp->num_fields; i++) {
+		size += HPACK_FIELD_MAX(strlen(resp->fields[i]), 0);
+	}
+	if(!(buf = malloc(size))) {
+		logmsg("failed to allocate HTTP/2 header block\n");
+		return -1;
+	}
+
+	len = hpack_encode_status(buf, resp->status);
+	for(i=0; i<resp->num_fields; i++) {
+		const char *field = resp->fields[i];
+
+		if(!(val = strchr(field, ':'))) continue;
+		namelen = val - field;
+		for(j=0; conn_fields[j]; j++) {
+			if(strncasecmp(field, conn_fields[j], namelen) == 0 && !conn_fields[j][namelen]) {
+				break;
+			}
+		}
+		if(conn_fields[j]) continue;
+
+		while(*++val && isspace(*val));
+		len += hpack_encode_field(buf + len, field, namelen, val, strlen(val));
+	}
+
+	/* split it over CONTINUATION frames if it's larger than a frame */
+	ptr = buf;
+	type = FR_HEADERS;
+	do {
+		frlen = len > h2->max_frame ? h2->max_frame : len;
+		len -= frlen;
+		if(queue_frame(h2, type, len ? 0 : FL_END_HEADERS, st->id, ptr, frlen) == -1) {
+			free(buf);
+			return -1;
+		}
+		ptr += frlen;
+		type = FR_CONTINUATION;
+	} while(len > 0);
+
+	free(buf);
+	return 0;
+}
+
+long h2_send_window(struct h2_conn *h2, struct h2_stream *st)
+{
+	long wnd;
+
+	/* the client's SETTINGS may change the stream windows and the frame size.
+	 * After an upgrade, clients also don't expect much data before they've
+	 * sent their preface.
+	 */
+	if(!h2->got_settings) {
+		return 0;
+	}
+	wnd = h2->wnd < st->wnd ? h2->wnd : st->wnd;
+	return wnd < h2->max_frame ? wnd : h2->max_frame;
+}
+
+int h2_send_data(struct h2_conn *h2, struct h2_stream *st, struct outq *src, long size, int eos)
+{
+	unsigned char hdr[FRAME_HDR_SIZE];
+
+	if(h2->closed) return -1;
+
+	/* the frame header goes in memory, and file data is still sent from the
+	 * page cache.
+	 */
+	write_frame_header(hdr, size, FR_DATA, eos ? FL_END_STREAM : 0, st->id);
+	if(outq_add_mem(h2->outq, hdr, sizeof hdr) == -1 ||
+			outq_splice(h2->outq, src, size) == -1) {
+		return -1;
+	}
+	h2->wnd -= size;
+	st->wnd -= size;
+	return 0;
+}
+
+void h2_close_stream(struct h2_conn *h2, struct h2_stream *st, int err)
+{
+	if(h2->closed) return;
+
+	if(err || !st->rcv_closed) {
+		unsigned char buf[4];
+		write32(buf, err);
+		queue_frame(h2, FR_RST_STREAM, 0, st->id, buf, 4);
+	}
+	free_stream(h2, st);
+}
+
+int h2_goaway(struct h2_conn *h2, int err)
+{
+	if(h2->closed || h2->goaway) return 0;
+	return send_goaway(h2, err);
+}
+
+/* Returns -1 on connection errors. Stream errors only reset the stream. */
+static int process_frame(struct h2_conn *h2, int type, int flags, unsigned int id,
+		unsigned char *data, int len)
+{
+	struct h2_stream *st;
+
+	if(!h2->got_settings) {
+		if(type != FR_SETTINGS || (flags & FL_ACK)) {
+			return conn_error(h2, H2_PROTOCOL_ERROR);
+		}
+		h2->got_settings = 1;
+	}
+
+	/* nothing else can come between the frames of a header block */
+	if(h2->hb_pending && (type != FR_CONTINUATION || id != h2->hb_stream)) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+
+	switch(type) {
+	case FR_DATA:
+		return recv_data(h2, flags, id, data, len);
+
+	case FR_HEADERS:
+		return recv_headers(h2, flags, id, data, len);
+
+	case FR_CONTINUATION:
+		if(!h2->hb_pending) {
+			return conn_error(h2, H2_PROTOCOL_ERROR);
+		}
+		return recv_headers(h2, flags, id, data, len);
+
+	case FR_PRIORITY:
+		/* all streams are treated equally */
+		if(!id) return conn_error(h2, H2_PROTOCOL_ERROR);
+		if(len != 5) return stream_error(h2, id, H2_FRAME_SIZE_ERROR);
+		break;
+
+	case FR_RST_STREAM:
+		if(!id || id > h2->last_id) {
+			return conn_error(h2, H2_PROTOCOL_ERROR);
+		}
+		if(len != 4) {
+			return conn_error(h2, H2_FRAME_SIZE_ERROR);
+		}
+		if((st = find_stream(h2, id))) {
+			h2->cb->reset(st);
+			free_stream(h2, st);
+		}
+		break;
+
+	case FR_SETTINGS:
+		return recv_settings(h2, flags, id, data, len);
+
+	case FR_PING:
+		if(id) return conn_error(h2, H2_PROTOCOL_ERROR);
+		if(len != 8) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+		if(!(flags & FL_ACK)) {
+			return queue_frame(h2, FR_PING, FL_ACK, 0, data, 8);
+		}
+		break;
+
+	case FR_GOAWAY:
+		/* the client will close the connection when it's done */
+		if(id) return conn_error(h2, H2_PROTOCOL_ERROR);
+		if(len < 8) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+		break;
+
+	case FR_WINDOW_UPDATE:
+		return recv_window_update(h2, id, data, len);
+
+	case FR_PUSH_PROMISE:
+		/* clients can't push */
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+
+	default:
+		break;	/* unknown frame types are ignored */
+	}
+	return 0;
+}
+
+static int recv_data(struct h2_conn *h2, int flags, unsigned int id, unsigned char *data, int len)
+{
+	struct h2_stream *st;
+	unsigned char buf[4];
+	int frlen = len, eos = flags & FL_END_STREAM;
+
+	if(!id || id > h2->last_id) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+	if(strip_padding(flags, &data, &len) == -1) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+
+	/* padding counts against flow control too */
+	if(frlen > h2->rcv_wnd) {
+		return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+	}
+	if((h2->rcv_wnd -= frlen) < RCV_WINDOW / 2) {
+		write32(buf, RCV_WINDOW - h2->rcv_wnd);
+		h2->rcv_wnd = RCV_WINDOW;
+		if(queue_frame(h2, FR_WINDOW_UPDATE, 0, 0, buf, 4) == -1) {
+			return -1;
+		}
+	}
+
+	if(!(st = find_stream(h2, id))) {
+		return 0;	/* we're done with it, and reset it already */
+	}
+	if(st->rcv_closed) {
+		return stream_error(h2, id, H2_STREAM_CLOSED);
+	}
+	if(frlen > st->rcv_wnd) {
+		return stream_error(h2, id, H2_FLOW_CONTROL_ERROR);
+	}
+	if((st->rcv_wnd -= frlen) < RCV_WINDOW / 2 && !eos) {
+		write32(buf, RCV_WINDOW - st->rcv_wnd);
+		st->rcv_wnd = RCV_WINDOW;
+		if(queue_frame(h2, FR_WINDOW_UPDATE, 0, id, buf, 4) == -1) {
+			return -1;
+		}
+	}
+	st->rcv_closed = eos;
+
+	/* the stream might be gone after this */
+	h2->cb->data(st, (char*)data, len, eos);
+	return 0;
+}
+
+/* collect a header block, from a HEADERS frame and its CONTINUATION frames */
+static int recv_headers(struct h2_conn *h2, int flags, unsigned int id, unsigned char *data, int len)
+{
+	if(!id) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+
+	if(!h2->hb_pending) {
+		if(strip_padding(flags, &data, &len) == -1) {
+			return conn_error(h2, H2_PROTOCOL_ERROR);
+		}
+		if(flags & FL_PRIORITY) {
+			if(len < 5) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+			data += 5;
+			len -= 5;
+		}
+		h2->hb_stream = id;
+		h2->hb_flags = flags;
+		h2->hblen = 0;
+		h2->hb_pending = 1;
+	}
+
+	if(h2->hblen + len > MAX_HBLOCK) {
+		return conn_error(h2, H2_ENHANCE_YOUR_CALM);
+	}
+	if(h2->hblen + len > h2->hbsize) {
+		int newsz = h2->hbsize ? h2->hbsize : 1024;
+		void *tmp;
+
+		while(newsz < h2->hblen + len) newsz *= 2;
+		if(!(tmp = realloc(h2->hblock, newsz))) {
+			logmsg("failed to allocate HTTP/2 header block buffer\n");
+			return conn_error(h2, H2_INTERNAL_ERROR);
+		}
+		mem_charge(MEM_HEADER, newsz - h2->hbsize);
+		h2->hblock = tmp;
+		h2->hbsize = newsz;
+	}
+	memcpy(h2->hblock + h2->hblen, data, len);
+	h2->hblen += len;
+
+	if(!(flags & FL_END_HEADERS)) {
+		return 0;
+	}
+	h2->hb_pending = 0;
+	return end_headers(h2);
+}
+
+static int end_headers(struct h2_conn *h2)
+{
+	struct h2_stream *st;
+	struct reqhdr rh;
+	unsigned int id = h2->hb_stream;
+	int res, size, textsz, hblen = h2->hblen;
+	int eos = h2->hb_flags & FL_END_STREAM;
+	char *text;
+
+	if((st = find_stream(h2, id))) {
+		/* trailer fields, which are ignored. They have to end the stream */
+		if(hpack_decode(&h2->dec, h2->hblock, hblen, skip_field, 0) == -1) {
+			return conn_error(h2, H2_COMPRESSION_ERROR);
+		}
+		if(st->rcv_closed) {
+			return stream_error(h2, id, H2_STREAM_CLOSED);
+		}
+		if(!eos) {
+			return stream_error(h2, id, H2_PROTOCOL_ERROR);
+		}
+		st->rcv_closed = 1;
+		h2->cb->data(st, 0, 0, 1);
+		return 0;
+	}
+
+	if(!(id & 1) || id <= h2->last_id) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+	h2->last_id = id;
+
+	memset(&rh, 0, sizeof rh);
+	res = hpack_decode(&h2->dec, h2->hblock, hblen, req_field, &rh);
+	if(res == -1) {
+		destroy_reqhdr(&rh);
+		return conn_error(h2, H2_COMPRESSION_ERROR);
+	}
+
+	if(h2->goaway) {
+		destroy_reqhdr(&rh);
+		return 0;
+	}
+	if(rh.toolarge) {
+		logmsg("HTTP/2 request header list over %d bytes, refusing the stream\n", MAX_HBLOCK);
+		destroy_reqhdr(&rh);
+		return stream_error(h2, id, H2_ENHANCE_YOUR_CALM);
+	}
+	if(rh.malformed || !rh.method || !rh.path) {
+		destroy_reqhdr(&rh);
+		return stream_error(h2, id, H2_PROTOCOL_ERROR);
+	}
+	if(h2->num_streams >= MAX_STREAMS) {
+		destroy_reqhdr(&rh);
+		return stream_error(h2, id, H2_REFUSED_STREAM);
+	}
+
+	text = build_request(&rh, &size, &textsz);
+	destroy_reqhdr(&rh);
+	if(!text || !(st = new_stream(h2, id))) {
+		free(text);
+		mem_charge(MEM_HEADER, -textsz);
+		return stream_error(h2, id, H2_REFUSED_STREAM);
+	}
+	st->rcv_closed = eos;
+
+	/* the request might be complete, and the stream gone, after this */
+	res = h2->cb->request(st, text, size, eos, h2->cls);
+	free(text);
+	mem_charge(MEM_HEADER, -textsz);
+	if(res == -1) {
+		h2_close_stream(h2, st, H2_REFUSED_STREAM);
+	}
+	return 0;
+}
+
+static int recv_settings(struct h2_conn *h2, int flags, unsigned int id, unsigned char *data, int len)
+{
+	if(id) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+	if(flags & FL_ACK) {
+		return len ? conn_error(h2, H2_FRAME_SIZE_ERROR) : 0;
+	}
+	if(len % 6) {
+		return conn_error(h2, H2_FRAME_SIZE_ERROR);
+	}
+	if(apply_settings(h2, data, len) == -1) {
+		return -1;
+	}
+	return queue_frame(h2, FR_SETTINGS, FL_ACK, 0, 0, 0);
+}
+
+static int apply_settings(struct h2_conn *h2, const unsigned char *data, int len)
+{
+	struct h2_stream *st;
+	unsigned int val;
+	long delta;
+	int i;
+
+	for(i=0; i<len; i+=6) {
+		val = read32(data + i + 2);
+
+		switch((data[i] << 8) | data[i + 1]) {
+		case SET_ENABLE_PUSH:
+			if(val > 1) return conn_error(h2, H2_PROTOCOL_ERROR);
+			break;
+
+		case SET_INITIAL_WINDOW_SIZE:
+			if(val > MAX_WINDOW) {
+				return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+			}
+			/* applies retroactively to the windows of all open streams */
+			delta = (long)val - h2->init_wnd;
+			for(st=h2->streams; st; st=st->next) {
+				if((st->wnd += delta) > MAX_WINDOW) {
+					return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+				}
+			}
+			h2->init_wnd = val;
+			break;
+
+		case SET_MAX_FRAME_SIZE:
+			if(val < DEF_FRAME_SIZE || val > 0xffffff) {
+				return conn_error(h2, H2_PROTOCOL_ERROR);
+			}
+			h2->max_frame = val;
+			break;
+
+		default:
+			/* our encoder doesn't use the dynamic table, so the table size
+			 * doesn't matter, and we never push.
+			 */
+			break;
+		}
+	}
+	return 0;
+}
+
+static int recv_window_update(struct h2_conn *h2, unsigned int id, unsigned char *data, int len)
+{
+	struct h2_stream *st;
+	unsigned int inc;
+
+	if(len != 4) {
+		return conn_error(h2, H2_FRAME_SIZE_ERROR);
+	}
+	inc = read32(data) & MAX_WINDOW;
+
+	if(!id) {
+		if(!inc) return conn_error(h2, H2_PROTOCOL_ERROR);
+		if((h2->wnd += inc) > MAX_WINDOW) {
+			return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+		}
+		return 0;
+	}
+
+	if(id > h2->last_id) {
+		return conn_error(h2, H2_PROTOCOL_ERROR);
+	}
+	if(!(st = find_stream(h2, id))) {
+		return 0;
+	}
+	if(!inc) {
+		return stream_error(h2, id, H2_PROTOCOL_ERROR);
+	}
+	if((st->wnd += inc) > MAX_WINDOW) {
+		return stream_error(h2, id, H2_FLOW_CONTROL_ERROR);
+	}
+	return 0;
+}
+
+static int strip_padding(int flags, unsigned char **data, int *len)
+{
+	int pad;
+
+	if(flags & FL_PADDED) {
+		if(*len < 1 || (pad = **data) >= *len) {
+			return -1;
+		}
+		++*data;
+		*len -= pad + 1;
+	}
+	return 0;
+}
+
+/* collect the fields of a request header, and check that it's well formed.
+ * Malformed requests are only rejected after the whole block is decoded, to
+ * keep the decoder state in sync. A small block can decode to a huge list by
+ * repeating a large dynamic table entry, so past the limit we advertised the
+ * fields are only decoded, and not kept.
+ */
+static int req_field(const char *name, int namelen, const char *val, int vallen, void *cls)
+{
+	struct reqhdr *rh = cls;
+	char **pseudo = 0;
+	int i, size = namelen + vallen + 32;
+
+	if(rh->toolarge) {
+		return 0;
+	}
+	if(rh->listsize + size > MAX_HBLOCK) {
+		rh->toolarge = 1;
+		return 0;
+	}
+	rh->listsize += size;
+	mem_charge(MEM_HEADER, size);
+
+	for(i=0; i<vallen; i++) {
+		if(val[i] == 0 || val[i] == '\r' || val[i] == '\n') {
+			rh->malformed = 1;
+			return 0;
+		}
+	}
+
+	if(namelen > 0 && name[0] == ':') {
+		if(namelen == 7 && memcmp(name, ":method", 7) == 0) {
+			pseudo = &rh->method;
+		} else if(namelen == 5 && memcmp(name, ":path", 5) == 0) {
+			pseudo = &rh->path;
+		} else if(namelen == 10 && memcmp(name, ":authority", 10) == 0) {
+			pseudo = &rh->authority;
+		} else if(!(namelen == 7 && memcmp(name, ":scheme", 7) == 0)) {
+			rh->malformed = 1;
+			return 0;
+		}
+		if(rh->regular || (pseudo && *pseudo)) {
+			rh->malformed = 1;
+			return 0;
+		}
+		if(pseudo) {
+			if(!(*pseudo = malloc(vallen + 1))) {
+				return -1;
+			}
+			memcpy(*pseudo, val, vallen);
+			(*pseudo)[vallen] = 0;
+		}
+		return 0;
+	}
+	rh->regular = 1;
+
+	if(namelen == 0) {
+		rh->malformed = 1;
+		return 0;
+	}
+	for(i=0; i<namelen; i++) {
+		if(isupper(name[i]) || isspace(name[i]) || name[i] == ':' || !isprint(name[i])) {
+			rh->malformed = 1;
+			return 0;
+		}
+	}
+	for(i=0; conn_fields[i]; i++) {
+		if(strncmp(name, conn_fields[i], namelen) == 0 && !conn_fields[i][namelen]) {
+			rh->malformed = 1;
+			return 0;
+		}
+	}
+	if(namelen == 2 && memcmp(name, "te", 2) == 0) {
+		if(vallen != 8 || memcmp(val, "trailers", 8) != 0) {
+			rh->malformed = 1;
+		}
+		return 0;
+	}
+	if(namelen == 4 && memcmp(name, "host", 4) == 0 && rh->authority) {
+		return 0;	/* :authority takes precedence */
+	}
+
+	/* cookies can be split into separate fields, which have to be joined
+	 * again for HTTP/1.
+	 */
+	if(namelen == 6 && memcmp(name, "cookie", 6) == 0) {
+		int size = rh->cookie ? rh->cookielen + 1 : 0;
+		return append(&rh->cookie, &rh->cookielen, &size, "%s%.*s",
+				rh->cookielen ? "; " : "", vallen, val);
+	}
+	return append(&rh->fields, &rh->len, &rh->size, "%.*s: %.*s\r\n", namelen, name, vallen, val);
+}
+
+static int skip_field(const char *name, int namelen, const char *val, int vallen, void *cls)
+{
+	return 0;
+}
+
+static int append(char **buf, int *len, int *size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	char tmp;
+
+	va_start(ap, fmt);
+	n = vsnprintf(&tmp, 0, fmt, ap);
+	va_end(ap);
+
+	if(*len + n + 1 > *size) {
+		int newsz = *size ? *size : 256;
+		char *newbuf;
+
+		while(newsz < *len + n + 1) newsz *= 2;
+		if(!(newbuf = realloc(*buf, newsz))) {
+			logmsg("failed to allocate HTTP/2 request header\n");
+			return -1;
+		}
+		*buf = newbuf;
+		*size = newsz;
+	}
+
+	va_start(ap, fmt);
+	vsprintf(*buf + *len, fmt, ap);
+	va_end(ap);
+	*len += n;
+	return 0;
+}
+
+/* the request as HTTP/1 text, which is charged as header memory, in size
+ * bytes, until it's freed.
+ */
+static char *build_request(struct reqhdr *rh, int *textlen, int *size)
+{
+	char *buf = 0;
+	int len = 0, bufsz = 0, res;
+
+	res = append(&buf, &len, &bufsz, "%s %s HTTP/2.0\r\n", rh->method, rh->path);
+	if(res != -1 && rh->authority) {
+		res = append(&buf, &len, &bufsz, "Host: %s\r\n", rh->authority);
+	}
+	if(res != -1 && rh->fields) {
+		res = append(&buf, &len, &bufsz, "%s", rh->fields);
+	}
+	if(res != -1 && rh->cookie) {
+		res = append(&buf, &len, &bufsz, "cookie: %s\r\n", rh->cookie);
+	}
+	if(res == -1 || append(&buf, &len, &bufsz, "\r\n") == -1) {
+		free(buf);
+		*size = 0;
+		return 0;
+	}
+	mem_charge(MEM_HEADER, bufsz);
+	*textlen = len;
+	*size = bufsz;
+	return buf;
+}
+
+static void destroy_reqhdr(struct reqhdr *rh)
+{
+	free(rh->method);
+	free(rh->path);
+	free(rh->authority);
+	free(rh->fields);
+	free(rh->cookie);
+	mem_charge(MEM_HEADER, -rh->listsize);
+}
+
+static struct h2_stream *find_stream(struct h2_conn *h2, unsigned int id)
+{
+	struct h2_stream *st = h2->streams;
+
+	while(st && st->id != id) {
+		st = st->next;
+	}
+	return st;
+}
+
+static struct h2_stream *new_stream(struct h2_conn *h2, unsigned int id)
+{
+	struct h2_stream *st;
+
+	if(!(st = calloc(1, sizeof *st))) {
+		logmsg("failed to allocate HTTP/2 stream\n");
+		return 0;
+	}
+	st->id = id;
+	st->wnd = h2->init_wnd;
+	st->rcv_wnd = RCV_WINDOW;
+	st->next = h2->streams;
+	h2->streams = st;
+	h2->num_streams++;
+	return st;
+}
+
+static void free_stream(struct h2_conn *h2, struct h2_stream *st)
+{
+	struct h2_stream dummy, *prev = &dummy;
+
+	dummy.next = h2->streams;
+	while(prev->next && prev->next != st) {
+		prev = prev->next;
+	}
+	if(prev->next) {
+		prev->next = st->next;
+		h2->num_streams--;
+	}
+	h2->streams = dummy.next;
+	free(st);
+}
+
+static int conn_error(struct h2_conn *h2, int err)
+{
+	logmsg("HTTP/2 connection error %d\n", err);
+	send_goaway(h2, err);
+	return -1;
+}
+
+static int send_goaway(struct h2_conn *h2, int err)
+{
+	unsigned char buf[8];
+
+	write32(buf, h2->last_id);
+	write32(buf + 4, err);
+	h2->goaway = 1;
+	return queue_frame(h2, FR_GOAWAY, 0, 0, buf, 8);
+}
+
+static int stream_error(struct h2_conn *h2, unsigned int id, int err)
+{
+	struct h2_stream *st;
+	unsigned char buf[4];
+
+	if((st = find_stream(h2, id))) {
+		h2->cb->reset(st);
+		free_stream(h2, st);
+	}
+	write32(buf, err);
+	return queue_frame(h2, FR_RST_STREAM, 0, id, buf, 4);
+}
+
+static int queue_frame(struct h2_conn *h2, int type, int flags, unsigned int id,
+		const void *payload, int len)
+{
+	unsigned char *buf;
+
+	if(!(buf = malloc(FRAME_HDR_SIZE + len))) {
+		logmsg("failed to allocate HTTP/2 frame\n");
+		return -1;
+	}
+	write_frame_header(buf, len, type, flags, id);
+	if(len > 0) {
+		memcpy(buf + FRAME_HDR_SIZE, payload, len);
+	}
+	if(outq_add_buf(h2->outq, buf, FRAME_HDR_SIZE + len) == -1) {
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+static void write_frame_header(unsigned char *buf, int len, int type, int flags, unsigned int id)
+{
+	buf[0] = len >> 16;
+	buf[1] = len >> 8;
+	buf[2] = len;
+	buf[3] = type;
+	buf[4] = flags;
+	write32(buf + 5, id);
+}
+
+static unsigned int read32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void write32(unsigned char *p, unsigned int val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
@@ -0,0 +1,125 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef H2_H_
+#define H2_H_
+
+#include "hpack.h"
+#include "http.h"
+#include "outq.h"
+
+/* HTTP/2 framing and connection state (RFC 9113). Requests are converted to
+ * HTTP/1 style headers, so that they go through the same parser and request
+ * processing as everything else. Responses are queued as frames on the output
+ * queue of the connection.
+ */
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN	24
+
+/* error codes */
+enum {
+	H2_NO_ERROR,
+	H2_PROTOCOL_ERROR,
+	H2_INTERNAL_ERROR,
+	H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT,
+	H2_STREAM_CLOSED,
+	H2_FRAME_SIZE_ERROR,
+	H2_REFUSED_STREAM,
+	H2_CANCEL,
+	H2_COMPRESSION_ERROR,
+	H2_CONNECT_ERROR,
+	H2_ENHANCE_YOUR_CALM,
+	H2_INADEQUATE_SECURITY,
+	H2_HTTP_1_1_REQUIRED
+};
+
+struct h2_stream {
+	unsigned int id;
+	long wnd;			/* send window */
+	long rcv_wnd;		/* receive window left, before we extend it */
+	int rcv_closed;		/* the client has ended its side */
+	void *cls;
+	struct h2_stream *next;
+};
+
+struct h2_callbacks {
+	/* the header of a request arrived on a new stream, converted to HTTP/1
+	 * form. eos is set if there's no request body. Return -1 to refuse the
+	 * stream.
+	 */
+	int (*request)(struct h2_stream *st, const char *hdr, int size, int eos, void *cls);
+	/* request body data, eos is set with the last of it */
+	void (*data)(struct h2_stream *st, char *data, int size, int eos);
+	/* the client reset the stream, which is freed after the call */
+	void (*reset)(struct h2_stream *st);
+};
+
+struct h2_conn {
+	struct outq *outq;
+	const struct h2_callbacks *cb;
+	void *cls;
+	int closed;				/* destroyed while in h2_input */
+
+	int preface;			/* bytes of the client preface received */
+	int got_settings;
+
+	/* frame being received */
+	unsigned char *frame;
+	int framelen;
+
+	/* header block split over HEADERS and CONTINUATION frames */
+	unsigned char *hblock;
+	int hblen, hbsize;
+	int hb_pending;			/* waiting for CONTINUATION frames */
+	unsigned int hb_stream;
+	int hb_flags;
+
+	struct hpack_table dec;
+
+	struct h2_stream *streams;
+	int num_streams;
+	unsigned int last_id;	/* highest stream opened by the client */
+	int goaway;				/* we sent a GOAWAY */
+
+	/* client settings, and the send and receive windows of the connection */
+	int max_frame;
+	long init_wnd;
+	long wnd;
+	long rcv_wnd;
+};
+
+/* queues our SETTINGS. The client preface is expected as the first input */
+int h2_init(struct h2_conn *h2, struct outq *outq, const struct h2_callbacks *cb, void *cls);
+void h2_destroy(struct h2_conn *h2);
+
+/* process received data. Returns -1 if the connection has to be closed, after
+ * sending whatever is queued (possibly a GOAWAY).
+ */
+int h2_input(struct h2_conn *h2, const char *data, int size);
+
+/* For connections upgraded from HTTP/1.1: apply the HTTP2-Settings header
+ * field, and open stream 1 for the request which carried it.
+ */
+int h2_upgrade_settings(struct h2_conn *h2, const char *b64);
+struct h2_stream *h2_upgrade_stream(struct h2_conn *h2);
+
+/* queue a HEADERS frame with the response header */
+int h2_send_headers(struct h2_conn *h2, struct h2_stream *st, struct http_resp_header *resp);
+/* how much data can be sent in the next DATA frame of the stream */
+long h2_send_window(struct h2_conn *h2, struct h2_stream *st);
+/* move size bytes from the src queue to the connection as a DATA frame */
+int h2_send_data(struct h2_conn *h2, struct h2_stream *st, struct outq *src, long size, int eos);
+/* remove the stream, and reset it with the error code if it's not 0, or if
+ * the client is still sending.
+ */
+void h2_close_stream(struct h2_conn *h2, struct h2_stream *st, int err);
+/* tell the client we're not accepting any more streams */
+int h2_goaway(struct h2_conn *h2, int err);
+
+#endif	/* H2_H_ */
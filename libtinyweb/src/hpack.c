@@ -0,0 +1,561 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "hpack.h"
+#include "memgov.h"
+#include "logger.h"
+
+#define NUM_STATIC		61
+#define ENTRY_OVERHEAD	32
+
+struct hpack_entry {
+	char *name, *val;	/* both in the same allocation */
+	int namelen, vallen;
+};
+
+struct huff_code {
+	unsigned int code;
+	int len;
+};
+
+static int decode_int(const unsigned char **ptr, const unsigned char *end, int prefix);
+static int decode_str(struct hpack_table *tab, const unsigned char **ptr,
+		const unsigned char *end, int offs);
+static int huff_decode(char *dest, const unsigned char *src, int len);
+static int get_entry(struct hpack_table *tab, int idx, const char **name, int *namelen,
+		const char **val, int *vallen);
+static int add_entry(struct hpack_table *tab, const char *name, int namelen,
+		const char *val, int vallen);
+static void evict(struct hpack_table *tab, int max_size);
+static int encode_int(unsigned char *buf, int val, int prefix, int flags);
+static int encode_str(unsigned char *buf, const char *str, int len, int lower);
+static void build_huff_tree(void);
+
+static const struct {
+	const char *name, *val;
+} static_table[NUM_STATIC] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""},
+};
+
+/* RFC 7541 appendix B, followed by the end of string symbol */
+static const struct huff_code huff_codes[257] = {
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+	{0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+	{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+	{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+	{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+	{0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+	{0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+	{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+	{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+	{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+	{0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+	{0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+	{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+	{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+	{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+	{0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+	{0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+	{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+	{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+	{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+	{0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+	{0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+	{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+	{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+	{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+	{0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+	{0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+	{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+	{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+	{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+	{0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+	{0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+	{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+	{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+	{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+	{0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+	{0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+	{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+	{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+	{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+	{0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+	{0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+	{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+	{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+	{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+	{0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+	{0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+	{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+	{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+	{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+	{0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+	{0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+	{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+	{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+	{0x3fffffff, 30}	/* EOS */
+};
+
+/* decoding tree: children of each node are node indices, or negative for
+ * leaves, -(symbol + 1).
+ */
+static short huff_tree[256][2];
+static int huff_tree_valid;
+
+
+void hpack_init(struct hpack_table *tab, int limit)
+{
+	memset(tab, 0, sizeof *tab);
+	tab->max_size = tab->limit = limit;
+
+	if(!huff_tree_valid) {
+		build_huff_tree();
+		huff_tree_valid = 1;
+	}
+}
+
+void hpack_destroy(struct hpack_table *tab)
+{
+	evict(tab, 0);
+	free(tab->ent);
+	free(tab->buf);
+	mem_charge(MEM_HEADER, -tab->bufsz);
+	memset(tab, 0, sizeof *tab);
+}
+
+int hpack_decode(struct hpack_table *tab, const unsigned char *data, int size,
+		hpack_field_func func, void *cls)
+{
+	const unsigned char *ptr = data, *end = data + size;
+	const char *name, *val;
+	int idx, namelen, vallen, prefix, index;
+
+	while(ptr < end) {
+		if(*ptr & 0x80) {
+			/* indexed field */
+			if((idx = decode_int(&ptr, end, 7)) <= 0) {
+				return -1;
+			}
+			if(get_entry(tab, idx, &name, &namelen, &val, &vallen) == -1) {
+				return -1;
+			}
+			if(func(name, namelen, val, vallen, cls) == -1) {
+				return -1;
+			}
+			continue;
+		}
+
+		if((*ptr & 0xe0) == 0x20) {
+			/* dynamic table size update */
+			if((idx = decode_int(&ptr, end, 5)) < 0 || idx > tab->limit) {
+				return -1;
+			}
+			tab->max_size = idx;
+			evict(tab, idx);
+			continue;
+		}
+
+		/* literal field, with incremental indexing, without indexing, or never
+		 * indexed. The name is either an index, or a string.
+		 */
+		index = *ptr & 0x40;
+		prefix = index ? 6 : 4;
+		if((idx = decode_int(&ptr, end, prefix)) < 0) {
+			return -1;
+		}
+		if(idx) {
+			if(get_entry(tab, idx, &name, &namelen, 0, 0) == -1) {
+				return -1;
+			}
+			if(namelen > tab->bufsz) {
+				/* entries can be evicted by add_entry, so keep a copy */
+				char *tmp = realloc(tab->buf, namelen);
+				if(!tmp) return -1;
+				mem_charge(MEM_HEADER, namelen - tab->bufsz);
+				tab->buf = tmp;
+				tab->bufsz = namelen;
+			}
+			memcpy(tab->buf, name, namelen);
+		} else {
+			if((namelen = decode_str(tab, &ptr, end, 0)) < 0) {
+				return -1;
+			}
+		}
+		if((vallen = decode_str(tab, &ptr, end, namelen)) < 0) {
+			return -1;
+		}
+		name = tab->buf;
+		val = tab->buf + namelen;
+
+		if(index && add_entry(tab, name, namelen, val, vallen) == -1) {
+			return -1;
+		}
+		if(func(name, namelen, val, vallen, cls) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int hpack_encode_status(unsigned char *buf, int status)
+{
+	int i;
+	char str[8];
+
+	/* static entries 8 to 14 are :status with common values */
+	static const int codes[] = {200, 204, 206, 304, 400, 404, 500};
+
+	for(i=0; i<sizeof codes / sizeof *codes; i++) {
+		if(codes[i] == status) {
+			return encode_int(buf, 8 + i, 7, 0x80);
+		}
+	}
+	sprintf(str, "%03d", status % 1000);
+	i = encode_int(buf, 8, 4, 0);
+	return i + encode_str(buf + i, str, 3, 0);
+}
+
+int hpack_encode_field(unsigned char *buf, const char *name, int namelen,
+		const char *val, int vallen)
+{
+	int i, len;
+
+	/* find the name in the static table, skipping the pseudo-header fields */
+	for(i=14; i<NUM_STATIC; i++) {
+		const char *sname = static_table[i].name;
+		if(strncasecmp(sname, name, namelen) == 0 && !sname[namelen]) {
+			break;
+		}
+	}
+
+	if(i < NUM_STATIC) {
+		len = encode_int(buf, i + 1, 4, 0);
+	} else {
+		*buf = 0;
+		len = 1 + encode_str(buf + 1, name, namelen, 1);
+	}
+	return len + encode_str(buf + len, val, vallen, 0);
+}
+
+/* integers with an N-bit prefix, continued in 7-bit groups */
+static int decode_int(const unsigned char **ptr, const unsigned char *end, int prefix)
+{
+	const unsigned char *p = *ptr;
+	int val, shift = 0, mask = (1 << prefix) - 1;
+
+	if(p >= end) return -1;
+	val = *p++ & mask;
+	if(val == mask) {
+		do {
+			if(p >= end || shift > 21) {
+				return -1;
+			}
+			val += (*p & 0x7f) << shift;
+			shift += 7;
+		} while(*p++ & 0x80);
+	}
+	*ptr = p;
+	return val;
+}
+
+/* decode a string literal into tab->buf at offs. Returns its length */
+static int decode_str(struct hpack_table *tab, const unsigned char **ptr,
+		const unsigned char *end, int offs)
+{
+	const unsigned char *p = *ptr;
+	int len, huff, maxlen;
+
+	if(p >= end) return -1;
+	huff = *p & 0x80;
+	if((len = decode_int(&p, end, 7)) < 0 || len > end - p) {
+		return -1;
+	}
+
+	/* the shortest Huffman code is 5 bits */
+	maxlen = huff ? len * 8 / 5 : len;
+	if(offs + maxlen > tab->bufsz) {
+		char *tmp;
+		int newsz = tab->bufsz ? tab->bufsz : 256;
+
+		while(newsz < offs + maxlen) newsz *= 2;
+		if(!(tmp = realloc(tab->buf, newsz))) {
+			logmsg("failed to allocate %d bytes for HPACK decoding\n", newsz);
+			return -1;
+		}
+		mem_charge(MEM_HEADER, newsz - tab->bufsz);
+		tab->buf = tmp;
+		tab->bufsz = newsz;
+	}
+
+	if(huff) {
+		if((maxlen = huff_decode(tab->buf + offs, p, len)) == -1) {
+			return -1;
+		}
+	} else {
+		memcpy(tab->buf + offs, p, len);
+		maxlen = len;
+	}
+	*ptr = p + len;
+	return maxlen;
+}
+
+static int huff_decode(char *dest, const unsigned char *src, int len)
+{
+	int i, bit, node = 0, nbits = 0, ones = 1, count = 0;
+
+	for(i=0; i<len; i++) {
+		for(bit=7; bit>=0; bit--) {
+			int b = (src[i] >> bit) & 1;
+
+			node = huff_tree[node][b];
+			nbits++;
+			ones &= b;
+
+			if(node < 0) {
+				if(node == -257) {
+					return -1;	/* EOS in the string is an error */
+				}
+				dest[count++] = -node - 1;
+				node = nbits = 0;
+				ones = 1;
+			}
+		}
+	}
+
+	/* padding must be the most significant bits of EOS, shorter than a byte */
+	if(nbits > 7 || !ones) {
+		return -1;
+	}
+	return count;
+}
+
+static int get_entry(struct hpack_table *tab, int idx, const char **name, int *namelen,
+		const char **val, int *vallen)
+{
+	struct hpack_entry *ent;
+
+	if(idx <= NUM_STATIC) {
+		*name = static_table[idx - 1].name;
+		*namelen = strlen(*name);
+		if(val) {
+			*val = static_table[idx - 1].val;
+			*vallen = strlen(*val);
+		}
+		return 0;
+	}
+
+	if((idx -= NUM_STATIC + 1) >= tab->num) {
+		return -1;
+	}
+	ent = tab->ent + idx;
+	*name = ent->name;
+	*namelen = ent->namelen;
+	if(val) {
+		*val = ent->val;
+		*vallen = ent->vallen;
+	}
+	return 0;
+}
+
+static int add_entry(struct hpack_table *tab, const char *name, int namelen,
+		const char *val, int vallen)
+{
+	struct hpack_entry ent;
+	int size = namelen + vallen + ENTRY_OVERHEAD;
+
+	if(size > tab->max_size) {
+		/* too large for the table, which ends up empty */
+		evict(tab, 0);
+		return 0;
+	}
+	evict(tab, tab->max_size - size);
+
+	if(tab->num >= tab->max_num) {
+		int newmax = tab->max_num ? tab->max_num * 2 : 16;
+		void *tmp = realloc(tab->ent, newmax * sizeof *tab->ent);
+		if(!tmp) return -1;
+		tab->ent = tmp;
+		tab->max_num = newmax;
+	}
+
+	if(!(ent.name = malloc(namelen + vallen + 1))) {
+		return -1;
+	}
+	memcpy(ent.name, name, namelen);
+	ent.val = ent.name + namelen;
+	memcpy(ent.val, val, vallen);
+	ent.namelen = namelen;
+	ent.vallen = vallen;
+
+	memmove(tab->ent + 1, tab->ent, tab->num * sizeof *tab->ent);
+	tab->ent[0] = ent;
+	tab->num++;
+	tab->size += size;
+	mem_charge(MEM_HEADER, size);
+	return 0;
+}
+
+/* drop the oldest entries until the table fits in max_size */
+static void evict(struct hpack_table *tab, int max_size)
+{
+	while(tab->num > 0 && tab->size > max_size) {
+		struct hpack_entry *ent = tab->ent + --tab->num;
+		int size = ent->namelen + ent->vallen + ENTRY_OVERHEAD;
+
+		tab->size -= size;
+		mem_charge(MEM_HEADER, -size);
+		free(ent->name);
+	}
+}
+
+static int encode_int(unsigned char *buf, int val, int prefix, int flags)
+{
+	int len = 1, mask = (1 << prefix) - 1;
+
+	if(val < mask) {
+		*buf = flags | val;
+		return 1;
+	}
+	*buf = flags | mask;
+	val -= mask;
+	while(val >= 128) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[len++] = val;
+	return len;
+}
+
+/* string literal, Huffman coded if that's shorter */
+static int encode_str(unsigned char *buf, const char *str, int len, int lower)
+{
+	int i, hlen, nbits = 0, bits = 0;
+	unsigned long acc = 0;
+	unsigned char *ptr;
+
+	for(i=0; i<len; i++) {
+		int c = (unsigned char)(lower ? tolower(str[i]) : str[i]);
+		bits += huff_codes[c].len;
+	}
+	hlen = (bits + 7) / 8;
+
+	if(hlen >= len) {
+		ptr = buf + encode_int(buf, len, 7, 0);
+		for(i=0; i<len; i++) {
+			*ptr++ = lower ? tolower(str[i]) : str[i];
+		}
+		return ptr - buf;
+	}
+
+	ptr = buf + encode_int(buf, hlen, 7, 0x80);
+	for(i=0; i<len; i++) {
+		const struct huff_code *hc = huff_codes + (unsigned char)(lower ? tolower(str[i]) : str[i]);
+
+		acc = (acc << hc->len) | hc->code;
+		nbits += hc->len;
+		while(nbits >= 8) {
+			nbits -= 8;
+			*ptr++ = acc >> nbits;
+		}
+	}
+	if(nbits > 0) {
+		/* pad with the most significant bits of EOS */
+		*ptr++ = (acc << (8 - nbits)) | (0xff >> nbits);
+	}
+	return ptr - buf;
+}
+
+static void build_huff_tree(void)
+{
+	int i, j, bit, node, next = 1;
+
+	for(i=0; i<257; i++) {
+		node = 0;
+		for(j=huff_codes[i].len - 1; j>0; j--) {
+			bit = (huff_codes[i].code >> j) & 1;
+			if(!huff_tree[node][bit]) {
+				huff_tree[node][bit] = next++;
+			}
+			node = huff_tree[node][bit];
+		}
+		huff_tree[node][huff_codes[i].code & 1] = -(i + 1);
+	}
+}
@@ -0,0 +1,55 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef HPACK_H_
+#define HPACK_H_
+
+/* HPACK header compression for HTTP/2 (RFC 7541) */
+
+struct hpack_entry;
+
+/* dynamic table of the decoder */
+struct hpack_table {
+	struct hpack_entry *ent;	/* newest first */
+	int num, max_num;
+	int size;			/* sum of name + value + 32 for each entry */
+	int max_size;		/* current maximum, chosen by the encoder */
+	int limit;			/* upper bound for max_size, which we advertised */
+
+	char *buf;			/* decoded name and value of the current field */
+	int bufsz;
+};
+
+/* called for each decoded field. The strings aren't null terminated, and are
+ * only valid during the call. Return -1 to stop decoding.
+ */
+typedef int (*hpack_field_func)(const char *name, int namelen, const char *val,
+		int vallen, void *cls);
+
+void hpack_init(struct hpack_table *tab, int limit);
+void hpack_destroy(struct hpack_table *tab);
+
+/* decode a complete header block. Returns 0 on success, or -1 if the block is
+ * invalid, or func returned -1. Decoding errors leave the table in an
+ * undefined state, and the connection has to be closed.
+ */
+int hpack_decode(struct hpack_table *tab, const unsigned char *data, int size,
+		hpack_field_func func, void *cls);
+
+/* The encoder doesn't keep a dynamic table: fields are sent as literals
+ * without indexing, referring to the static table for known names, and Huffman
+ * coded when it makes them shorter. Both return the number of bytes written to
+ * buf, which needs HPACK_FIELD_MAX bytes.
+ */
+#define HPACK_FIELD_MAX(namelen, vallen)	((namelen) + (vallen) + 12)
+
+int hpack_encode_status(unsigned char *buf, int status);
+/* the name is converted to lowercase, as HTTP/2 requires */
+int hpack_encode_field(unsigned char *buf, const char *name, int namelen,
+		const char *val, int vallen);
+
+#endif	/* HPACK_H_ */
@@ -8,12 +8,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
 #include <alloca.h>
 #include "http.h"
 #include "logger.h"
 
+static void index_field(struct http_req_header *hdr, char *line);
+
+/* names of the known fields, by enum http_field */
+static const char *field_names[] = {
+	"Host",
+	"Connection",
+	"Content-Length",
+	"Content-Type",
+	"Transfer-Encoding",
+	"Expect",
+	"Accept",
+	"Accept-Encoding",
+	"If-None-Match",
+	"If-Modified-Since",
+	"Range",
+	"Upgrade",
+	"HTTP2-Settings"
+};
+
 
 static const char *http_method_str[] = {
 	"<unknown>",
@@ -77,7 +98,19 @@ static const char *http_msg4xx[] = {
 	"Request-URI Too Large",	/* 414 */
 	"Unsupported Media Type",	/* 415 */
 	"Request range not satisfiable", /* 416 */
-	"Expectation Failed"		/* 417 */
+	"Expectation Failed",		/* 417 */
+	"I'm a teapot",				/* 418 */
+	"<unknown>",				/* 419 */
+	"<unknown>",				/* 420 */
+	"Misdirected Request",		/* 421 */
+	"Unprocessable Entity",		/* 422 */
+	"Locked",					/* 423 */
+	"Failed Dependency",		/* 424 */
+	"Too Early",				/* 425 */
+	"Upgrade Required",			/* 426 */
+	"<unknown>",				/* 427 */
+	"Precondition Required",	/* 428 */
+	"Too Many Requests"			/* 429 */
 };
 
 /* HTTP 5xx error strings */
@@ -90,8 +123,19 @@ static const char *http_msg5xx[] = {
 	"HTTP Version not supported"	/* 505 */
 };
 
+/* chunked decoder states */
+enum {
+	CHUNK_SIZE,		/* hex digits of the chunk size */
+	CHUNK_EXT,		/* rest of the size line */
+	CHUNK_DATA,
+	CHUNK_DATA_END,	/* CRLF after the data */
+	CHUNK_TRAILER,	/* start of a trailer line, or the final empty line */
+	CHUNK_TRAILER_LINE,
+	CHUNK_DONE
+};
 
-static enum http_method parse_method(const char *s);
+/* maximum length of chunk size lines, and trailer lines */
+#define MAX_CHUNK_LINE	4096
 
 
 int http_parse_request(struct http_req_header *hdr, const char *buf, int bufsz)
@@ -119,7 +163,7 @@ int http_parse_request(struct http_req_header *hdr, const char *buf, int bufsz)
 		}
 	}
 
-	if(!rqline) {
+	if(!rqline || !hdr->body_offset) {
 		return HTTP_HDR_PARTIAL;
 	}
 
@@ -139,7 +183,7 @@ int http_parse_request(struct http_req_header *hdr, const char *buf, int bufsz)
 	while(*ptr && !isspace(*ptr)) ++ptr;
 	while(*ptr && isspace(*ptr)) *ptr++ = 0;
 
-	hdr->method = parse_method(method);
+	hdr->method = http_parse_method(method);
 	hdr->uri = strdup(uri);
 	if(sscanf(version, "HTTP/%d.%d", &hdr->ver_major, &hdr->ver_minor) != 2) {
 		fprintf(stderr, "warning: failed to parse HTTP version \"%s\"\n", version);
@@ -164,9 +208,13 @@ int http_parse_request(struct http_req_header *hdr, const char *buf, int bufsz)
 
 			if(startln > buf) {	/* skip first line */
 				int idx = hdr->num_hdrfields++;
-				hdr->hdrfields[idx] = malloc(linesz + 1);
+				if(!(hdr->hdrfields[idx] = malloc(linesz + 1))) {
+					hdr->num_hdrfields--;
+					return HTTP_HDR_NOMEM;
+				}
 				memcpy(hdr->hdrfields[idx], startln, linesz);
 				hdr->hdrfields[idx][linesz] = 0;
+				index_field(hdr, hdr->hdrfields[idx]);
 			}
 			startln = endln = buf + i + 1;
 		}
@@ -175,6 +223,70 @@ int http_parse_request(struct http_req_header *hdr, const char *buf, int bufsz)
 	return HTTP_HDR_OK;
 }
 
+const char *http_get_field(struct http_req_header *hdr, const char *name)
+{
+	int i, len = strlen(name);
+
+	if((i = http_field_id(name, len)) != -1) {
+		return hdr->field[i];
+	}
+
+	for(i=0; i<hdr->num_hdrfields; i++) {
+		const char *field = hdr->hdrfields[i];
+
+		if(strncasecmp(field, name, len) == 0 && field[len] == ':') {
+			field += len + 1;
+			while(*field && isspace(*field)) ++field;
+			return field;
+		}
+	}
+	return 0;
+}
+
+/* only the names with the same length, and the same first letter where that's
+ * not enough, need to be compared.
+ */
+int http_field_id(const char *name, int len)
+{
+	int id;
+
+	switch(len) {
+	case 4:
+		id = HTTP_HOST;
+		break;
+	case 5:
+		id = HTTP_RANGE;
+		break;
+	case 6:
+		id = tolower(*name) == 'a' ? HTTP_ACCEPT : HTTP_EXPECT;
+		break;
+	case 7:
+		id = HTTP_UPGRADE;
+		break;
+	case 10:
+		id = HTTP_CONNECTION;
+		break;
+	case 12:
+		id = HTTP_CONTENT_TYPE;
+		break;
+	case 13:
+		id = HTTP_IF_NONE_MATCH;
+		break;
+	case 14:
+		id = tolower(*name) == 'c' ? HTTP_CONTENT_LENGTH : HTTP_HTTP2_SETTINGS;
+		break;
+	case 15:
+		id = HTTP_ACCEPT_ENCODING;
+		break;
+	case 17:
+		id = tolower(*name) == 't' ? HTTP_TRANSFER_ENCODING : HTTP_IF_MODIFIED_SINCE;
+		break;
+	default:
+		return -1;
+	}
+	return strncasecmp(name, field_names[id], len) == 0 ? id : -1;
+}
+
 void http_log_request(struct http_req_header *hdr)
 {
 	int i;
@@ -217,21 +329,30 @@ int http_init_resp(struct http_resp_header *resp)
 
 int http_add_resp_field(struct http_resp_header *resp, const char *fmt, ...)
 {
-	int sz;
+	int res;
 	va_list ap;
-	char *field, **newarr, tmp;
 
 	va_start(ap, fmt);
-	sz = vsnprintf(&tmp, 0, fmt, ap);
+	res = http_add_resp_fieldv(resp, fmt, ap);
 	va_end(ap);
+	return res;
+}
+
+int http_add_resp_fieldv(struct http_resp_header *resp, const char *fmt, va_list ap)
+{
+	int sz;
+	va_list ap2;
+	char *field, **newarr, tmp;
+
+	va_copy(ap2, ap);
+	sz = vsnprintf(&tmp, 0, fmt, ap2);
+	va_end(ap2);
 
 	if(sz <= 0) sz = 1023;
 	if(!(field = malloc(sz + 1))) {
 		return -1;
 	}
-	va_start(ap, fmt);
 	vsnprintf(field, sz + 1, fmt, ap);
-	va_end(ap);
 
 	if(!(newarr = realloc(resp->fields, (resp->num_fields + 1) * sizeof *resp->fields))) {
 		free(field);
@@ -272,7 +393,7 @@ int http_serialize_resp(struct http_resp_header *resp, char *buf)
 		fsize[i] = len;
 		size += len;
 	}
-	size += 2;	/* CRLF and null */
+	size += 2;	/* final CRLF, not counting the terminating null */
 
 	if(buf) {
 		sprintf(buf, "HTTP/%d.%d %d %s\r\n", resp->ver_major, resp->ver_minor,
@@ -291,6 +412,40 @@ int http_serialize_resp(struct http_resp_header *resp, char *buf)
 	return size;
 }
 
+const char *http_method_name(int method)
+{
+	if(method < 0 || method >= NUM_HTTP_METHODS) {
+		method = HTTP_UNKNOWN;
+	}
+	return http_method_str[method];
+}
+
+/* decode %xx escapes in URIs. dest and src may be the same buffer */
+int http_decode_uri(char *dest, const char *src, int len)
+{
+	const char *end = src + len;
+
+	while(src < end) {
+		if(*src == '%') {
+			char hex[3];
+			if(end - src < 3 || !isxdigit(src[1]) || !isxdigit(src[2])) {
+				return -1;
+			}
+			hex[0] = src[1];
+			hex[1] = src[2];
+			hex[2] = 0;
+			if(!(*dest++ = strtol(hex, 0, 16))) {
+				return -1;	/* embedded nulls are never valid */
+			}
+			src += 3;
+		} else {
+			*dest++ = *src++;
+		}
+	}
+	*dest = 0;
+	return 0;
+}
+
 const char *http_strmsg(int code)
 {
 	static const char **msgxxx[] = {
@@ -319,7 +474,7 @@ const char *http_strmsg(int code)
 	return msgxxx[type][idx];
 }
 
-static enum http_method parse_method(const char *s)
+enum http_method http_parse_method(const char *s)
 {
 	int i;
 	for(i=0; http_method_str[i]; i++) {
@@ -329,3 +484,110 @@ static enum http_method parse_method(const char *s)
 	}
 	return HTTP_UNKNOWN;
 }
+
+void http_init_dechunk(struct http_dechunk *dc)
+{
+	dc->state = CHUNK_SIZE;
+	dc->left = 0;
+	dc->linelen = 0;
+}
+
+int http_dechunk(struct http_dechunk *dc, char *buf, int size, int *datasz)
+{
+	char *src = buf, *dest = buf, *end = buf + size;
+	int c, len;
+
+	while(src < end && dc->state != CHUNK_DONE) {
+		switch(dc->state) {
+		case CHUNK_SIZE:
+			c = *src;
+			if(isxdigit(c)) {
+				if(dc->left > (LONG_MAX >> 4)) {
+					return -1;
+				}
+				dc->left = (dc->left << 4) | (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+				if(++dc->linelen > 16) {
+					return -1;
+				}
+				src++;
+				break;
+			}
+			if(!dc->linelen) {
+				return -1;	/* no size */
+			}
+			dc->state = CHUNK_EXT;
+			/* fallthrough */
+
+		case CHUNK_EXT:
+			if(*src++ == '\n') {
+				dc->linelen = 0;
+				dc->state = dc->left ? CHUNK_DATA : CHUNK_TRAILER;
+			} else if(++dc->linelen > MAX_CHUNK_LINE) {
+				return -1;
+			}
+			break;
+
+		case CHUNK_DATA:
+			len = end - src;
+			if(len > dc->left) len = dc->left;
+			memmove(dest, src, len);
+			dest += len;
+			src += len;
+			if(!(dc->left -= len)) {
+				dc->state = CHUNK_DATA_END;
+			}
+			break;
+
+		case CHUNK_DATA_END:
+			c = *src++;
+			if(c == '\n') {
+				dc->state = CHUNK_SIZE;
+			} else if(c != '\r') {
+				return -1;
+			}
+			break;
+
+		case CHUNK_TRAILER:
+			c = *src++;
+			if(c == '\n') {
+				dc->state = CHUNK_DONE;
+			} else if(c != '\r') {
+				dc->state = CHUNK_TRAILER_LINE;
+			}
+			break;
+
+		case CHUNK_TRAILER_LINE:
+			if(*src++ == '\n') {
+				dc->linelen = 0;
+				dc->state = CHUNK_TRAILER;
+			} else if(++dc->linelen > MAX_CHUNK_LINE) {
+				return -1;
+			}
+			break;
+		}
+	}
+
+	*datasz = dest - buf;
+	return dc->state == CHUNK_DONE ? 1 : 0;
+}
+
+/* add a header field line to the known fields, if it's one of them, with the
+ * whitespace around the value stripped.
+ */
+static void index_field(struct http_req_header *hdr, char *line)
+{
+	int id;
+	char *val, *end;
+
+	if(!(val = strchr(line, ':')) || (id = http_field_id(line, val - line)) == -1 ||
+			hdr->field[id]) {
+		return;
+	}
+
+	val++;
+	while(*val && isspace(*val)) val++;
+	end = val + strlen(val);
+	while(end > val && isspace(end[-1])) *--end = 0;
+
+	hdr->field[id] = val;
+}
@@ -8,6 +8,8 @@
 #ifndef HTTP_H_
 #define HTTP_H_
 
+#include <stdarg.h>
+
 enum http_method {
 	HTTP_UNKNOWN,
 	HTTP_OPTIONS,
@@ -22,6 +24,27 @@ enum http_method {
 	NUM_HTTP_METHODS
 };
 
+/* header fields used by the server itself, which are found while parsing the
+ * request, to be looked up directly.
+ */
+enum http_field {
+	HTTP_HOST,
+	HTTP_CONNECTION,
+	HTTP_CONTENT_LENGTH,
+	HTTP_CONTENT_TYPE,
+	HTTP_TRANSFER_ENCODING,
+	HTTP_EXPECT,
+	HTTP_ACCEPT,
+	HTTP_ACCEPT_ENCODING,
+	HTTP_IF_NONE_MATCH,
+	HTTP_IF_MODIFIED_SINCE,
+	HTTP_RANGE,
+	HTTP_UPGRADE,
+	HTTP_HTTP2_SETTINGS,
+
+	NUM_HTTP_FIELDS
+};
+
 struct http_req_header {
 	enum http_method method;
 	char *uri;
@@ -29,6 +52,11 @@ struct http_req_header {
 	char **hdrfields;
 	int num_hdrfields;
 	int body_offset;
+	/* values of the known fields without surrounding whitespace, pointing into
+	 * hdrfields, or null if they're missing. The first one counts if a field
+	 * is repeated.
+	 */
+	const char *field[NUM_HTTP_FIELDS];
 };
 
 struct http_resp_header {
@@ -38,20 +66,51 @@ struct http_resp_header {
 	int num_fields;
 };
 
+/* decoder state for chunked request bodies */
+struct http_dechunk {
+	int state;
+	long left;		/* size of the current chunk still to come */
+	int linelen;	/* chunk extensions or trailer fields skipped so far */
+};
+
 #define HTTP_HDR_OK			0
 #define HTTP_HDR_INVALID	-1
 #define HTTP_HDR_NOMEM		-2
 #define HTTP_HDR_PARTIAL	-3
 
 int http_parse_request(struct http_req_header *hdr, const char *buf, int bufsz);
+/* returns the value of the named header field, or null if it's missing */
+const char *http_get_field(struct http_req_header *hdr, const char *name);
+#define http_field(hdr, id)	((hdr)->field[id])
+/* returns the enum http_field of a field name, or -1 if it's not one of them */
+int http_field_id(const char *name, int len);
 void http_log_request(struct http_req_header *hdr);
 void http_destroy_request(struct http_req_header *hdr);
 
 int http_init_resp(struct http_resp_header *resp);
 int http_add_resp_field(struct http_resp_header *resp, const char *fmt, ...);
+int http_add_resp_fieldv(struct http_resp_header *resp, const char *fmt, va_list ap);
 void http_destroy_resp(struct http_resp_header *resp);
 int http_serialize_resp(struct http_resp_header *resp, char *buf);
 
+enum http_method http_parse_method(const char *s);
+const char *http_method_name(int method);
+
+/* decode %xx escapes in the first len characters of src, and write the null
+ * terminated result to dest (which can be the same as src). Returns -1 on
+ * invalid escapes.
+ */
+int http_decode_uri(char *dest, const char *src, int len);
+
+/* Decode chunked transfer-encoding in place. The size bytes in buf are
+ * replaced by the chunk data they contain, and the size of the data is written
+ * to datasz. Returns 1 after the last chunk and any trailer fields, 0 if more
+ * input is needed, or -1 if the encoding is invalid. Chunk extensions and
+ * trailer fields are discarded.
+ */
+void http_init_dechunk(struct http_dechunk *dc);
+int http_dechunk(struct http_dechunk *dc, char *buf, int size, int *datasz);
+
 const char *http_strmsg(int code);
 
 #endif	/* HTTP_H_ */
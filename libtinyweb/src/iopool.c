@@ -0,0 +1,267 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "iopool.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+struct job {
+	iopool_func work, done;
+	void *data;
+	struct job *next;
+};
+
+static int start_pool(void);
+static void *pool_thread(void *cls);
+static void notify(void);
+
+static int num_threads, num_started;
+static pthread_t *threads;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* jobs waiting for a thread, and finished jobs waiting for the event loop */
+static struct job *queue, *queue_tail, *done;
+static int quit;
+/* eventfd, or a pipe where there's no eventfd */
+static int evfd[2] = {-1, -1};
+
+
+void iopool_set_threads(int n)
+{
+	if(num_started) {
+		logmsg("the I/O thread pool is already running\n");
+		return;
+	}
+	num_threads = n > 0 ? n : 0;
+}
+
+int iopool_enabled(void)
+{
+	return num_threads > 0;
+}
+
+/* the threads finish the jobs already queued before quitting */
+void iopool_shutdown(void)
+{
+	int i;
+	struct job *job;
+
+	if(!num_started) return;
+
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for(i=0; i<num_started; i++) {
+		pthread_join(threads[i], 0);
+	}
+	free(threads);
+	threads = 0;
+	num_started = 0;
+	quit = 0;
+
+	while((job = done)) {
+		done = job->next;
+		job->done(job->data);
+		free(job);
+	}
+
+	close(evfd[0]);
+	if(evfd[1] != evfd[0]) {
+		close(evfd[1]);
+	}
+	evfd[0] = evfd[1] = -1;
+}
+
+int iopool_submit(iopool_func work, iopool_func done, void *data)
+{
+	struct job *job;
+
+	if(!num_threads || (!num_started && start_pool() == -1)) {
+		return -1;
+	}
+	if(!(job = malloc(sizeof *job))) {
+		return -1;
+	}
+	job->work = work;
+	job->done = done;
+	job->data = data;
+	job->next = 0;
+
+	pthread_mutex_lock(&lock);
+	if(queue) {
+		queue_tail->next = job;
+	} else {
+		queue = job;
+	}
+	queue_tail = job;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int iopool_fd(void)
+{
+	return evfd[0];
+}
+
+void iopool_complete(void)
+{
+	struct job *list, *job, *prev = 0;
+#ifdef __linux__
+	uint64_t count;
+
+	while(read(evfd[0], &count, sizeof count) > 0);
+#else
+	char buf[64];
+
+	while(read(evfd[0], buf, sizeof buf) > 0);
+#endif
+
+	pthread_mutex_lock(&lock);
+	list = done;
+	done = 0;
+	pthread_mutex_unlock(&lock);
+
+	/* finished jobs were pushed to the front, reverse them to finish in order */
+	while(list) {
+		job = list;
+		list = list->next;
+		job->next = prev;
+		prev = job;
+	}
+	while((job = prev)) {
+		prev = job->next;
+		job->done(job->data);
+		free(job);
+	}
+}
+
+static int start_pool(void)
+{
+	int i;
+	sigset_t sigset, oldset;
+
+#ifdef __linux__
+	if((evfd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		logmsg("failed to create eventfd: %s\n", strerror(errno));
+		num_threads = 0;
+		return -1;
+	}
+	evfd[1] = evfd[0];
+#else
+	if(pipe(evfd) == -1) {
+		logmsg("failed to create I/O pool pipe: %s\n", strerror(errno));
+		num_threads = 0;
+		return -1;
+	}
+	for(i=0; i<2; i++) {
+		fcntl(evfd[i], F_SETFL, fcntl(evfd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(evfd[i], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+
+	if(!(threads = malloc(num_threads * sizeof *threads))) {
+		logmsg("failed to allocate I/O threads\n");
+		goto fail;
+	}
+
+	/* signals are left to the main thread */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+	for(i=0; i<num_threads; i++) {
+		if(pthread_create(threads + num_started, 0, pool_thread, 0) != 0) {
+			break;
+		}
+		num_started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, 0);
+
+	if(!num_started) {
+		logmsg("failed to start I/O threads, doing file I/O in the event loop\n");
+		free(threads);
+		threads = 0;
+		goto fail;
+	}
+	if(num_started < num_threads) {
+		logmsg("started %d of %d I/O threads\n", num_started, num_threads);
+	}
+	return 0;
+
+fail:
+	close(evfd[0]);
+	if(evfd[1] != evfd[0]) {
+		close(evfd[1]);
+	}
+	evfd[0] = evfd[1] = -1;
+	num_threads = 0;
+	return -1;
+}
+
+static void *pool_thread(void *cls)
+{
+	struct job *job;
+	int was_empty;
+
+	pthread_mutex_lock(&lock);
+	for(;;) {
+		while(!queue && !quit) {
+			pthread_cond_wait(&cond, &lock);
+		}
+		if(!(job = queue)) {
+			break;
+		}
+		if(!(queue = job->next)) {
+			queue_tail = 0;
+		}
+		pthread_mutex_unlock(&lock);
+
+		job->work(job->data);
+
+		pthread_mutex_lock(&lock);
+		was_empty = !done;
+		job->next = done;
+		done = job;
+		/* one wakeup is enough until the event loop takes the finished jobs */
+		if(was_empty) {
+			notify();
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static void notify(void)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	if(write(evfd[1], &one, sizeof one) == -1) {
+		/* the counter can't overflow, it's drained by every iopool_complete */
+	}
+#else
+	if(write(evfd[1], "", 1) == -1) {
+		/* the pipe is full, there's a wakeup pending anyway */
+	}
+#endif
+}
@@ -0,0 +1,36 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef IOPOOL_H_
+#define IOPOOL_H_
+
+/* Thread pool for blocking filesystem calls. Each job runs its work function
+ * on one of the threads, and then its done function on the event loop thread,
+ * when iopool_complete is called after the notification descriptor returned by
+ * iopool_fd becomes readable. The work function must not touch anything the
+ * event loop uses, and done is always called, so that it can free the job.
+ *
+ * The threads are started by the first iopool_submit, so that a process
+ * setting up the pool can fork workers which start their own.
+ */
+typedef void (*iopool_func)(void *data);
+
+void iopool_set_threads(int n);
+int iopool_enabled(void);
+void iopool_shutdown(void);
+
+/* returns -1 if the job couldn't be queued, and the caller should do the
+ * work itself.
+ */
+int iopool_submit(iopool_func work, iopool_func done, void *data);
+
+/* the descriptor to monitor for readability, or -1 if the pool isn't running */
+int iopool_fd(void);
+/* call the done functions of the finished jobs */
+void iopool_complete(void);
+
+#endif	/* IOPOOL_H_ */
@@ -0,0 +1,36 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include "memgov.h"
+
+static long used[MEM_NUM_KINDS];
+static long total, peak;
+
+
+void mem_charge(int kind, long size)
+{
+	used[kind] += size;
+	total += size;
+	if(total > peak) {
+		peak = total;
+	}
+}
+
+long mem_used(int kind)
+{
+	return used[kind];
+}
+
+long mem_total(void)
+{
+	return total;
+}
+
+long mem_peak(void)
+{
+	return peak;
+}
@@ -0,0 +1,32 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef MEMGOV_H_
+#define MEMGOV_H_
+
+/* Memory accounting: the buffers held for connections, and the caches, are
+ * charged here as they grow and shrink, so that the server can tell how close
+ * it is to its memory budget. Only used from the thread running the loop.
+ */
+enum {
+	MEM_HEADER,		/* request headers being received */
+	MEM_BODY,		/* request bodies kept in memory */
+	MEM_OUTPUT,		/* responses being built, and output waiting to be sent */
+	MEM_CACHE,		/* cached directory listings */
+
+	MEM_NUM_KINDS
+};
+
+/* size is negative when memory is released */
+void mem_charge(int kind, long size);
+
+long mem_used(int kind);
+long mem_total(void);
+/* the highest total so far */
+long mem_peak(void);
+
+#endif	/* MEMGOV_H_ */
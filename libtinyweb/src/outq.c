@@ -0,0 +1,349 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "outq.h"
+#include "tls.h"
+#include "memgov.h"
+#include "logger.h"
+
+/* send at most this much from a file segment at once, so that a single large
+ * file doesn't hog the server.
+ */
+#define MAX_SENDFILE	(1 << 20)
+
+/* descriptor shared by the pieces of a file segment split by outq_splice,
+ * closed along with the last of them.
+ */
+struct shared_fd {
+	int fd;
+	int nref;
+};
+
+struct outseg {
+	char *buf;		/* memory segment, or null for file segments */
+	int ref;		/* buf isn't owned by the queue */
+	struct outq_shbuf *shared;	/* buf is part of this shared buffer */
+	int fd;
+	struct shared_fd *shfd;		/* fd is shared with other segments */
+	off_t offs;		/* send position in buf or in the file */
+	long size;		/* bytes left to send */
+	struct outseg *next;
+};
+
+static struct outseg *add_seg(struct outq *q);
+static void free_seg(struct outseg *seg);
+
+
+void outq_init(struct outq *q)
+{
+	memset(q, 0, sizeof *q);
+}
+
+void outq_destroy(struct outq *q)
+{
+	while(q->head) {
+		struct outseg *seg = q->head;
+		q->head = seg->next;
+		free_seg(seg);
+	}
+	mem_charge(MEM_OUTPUT, -q->memsize);
+	outq_init(q);
+}
+
+int outq_add_mem(struct outq *q, const void *data, long size)
+{
+	void *buf;
+
+	if(size <= 0) return 0;
+
+	if(!(buf = malloc(size))) {
+		logmsg("failed to allocate %ld byte output buffer\n", size);
+		return -1;
+	}
+	memcpy(buf, data, size);
+
+	if(outq_add_buf(q, buf, size) == -1) {
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+int outq_add_buf(struct outq *q, void *buf, long size)
+{
+	struct outseg *seg;
+
+	if(size <= 0) {
+		free(buf);
+		return 0;
+	}
+
+	if(!(seg = add_seg(q))) {
+		return -1;
+	}
+	seg->buf = buf;
+	seg->fd = -1;
+	seg->size = size;
+	q->size += size;
+	q->memsize += size;
+	mem_charge(MEM_OUTPUT, size);
+	return 0;
+}
+
+int outq_add_ref(struct outq *q, const void *data, long size)
+{
+	struct outseg *seg;
+
+	if(size <= 0) return 0;
+
+	if(!(seg = add_seg(q))) {
+		return -1;
+	}
+	seg->buf = (char*)data;
+	seg->ref = 1;
+	seg->fd = -1;
+	seg->size = size;
+	q->size += size;
+	return 0;
+}
+
+int outq_add_shared(struct outq *q, struct outq_shbuf *sb, long offs, long size)
+{
+	if(outq_add_ref(q, sb->data + offs, size) == -1) {
+		return -1;
+	}
+	if(size > 0) {
+		q->tail->shared = sb;
+		sb->nref++;
+	}
+	return 0;
+}
+
+int outq_add_file(struct outq *q, int fd, off_t offs, long size)
+{
+	struct outseg *seg;
+
+	if(size <= 0) {
+		close(fd);
+		return 0;
+	}
+
+	if(!(seg = add_seg(q))) {
+		return -1;
+	}
+	seg->fd = fd;
+	seg->offs = offs;
+	seg->size = size;
+	q->size += size;
+	return 0;
+}
+
+struct outq_shbuf *outq_shbuf_create(long size)
+{
+	struct outq_shbuf *sb;
+
+	if(!(sb = malloc(sizeof *sb + size))) {
+		logmsg("failed to allocate %ld byte shared buffer\n", size);
+		return 0;
+	}
+	sb->nref = 1;
+	sb->size = size;
+	sb->data = (char*)(sb + 1);
+	mem_charge(MEM_OUTPUT, size);
+	return sb;
+}
+
+void outq_shbuf_release(struct outq_shbuf *sb)
+{
+	if(sb && --sb->nref <= 0) {
+		mem_charge(MEM_OUTPUT, -sb->size);
+		free(sb);
+	}
+}
+
+int outq_splice(struct outq *dest, struct outq *src, long size)
+{
+	struct outseg *seg, *piece;
+
+	while(size > 0 && (seg = src->head)) {
+		if(seg->size > size) {
+			/* split it, the rest stays in src */
+			if(seg->shared) {
+				if(outq_add_shared(dest, seg->shared, seg->buf + seg->offs -
+							seg->shared->data, size) == -1) {
+					return -1;
+				}
+			} else if(seg->ref) {
+				if(outq_add_ref(dest, seg->buf + seg->offs, size) == -1) {
+					return -1;
+				}
+			} else if(seg->buf) {
+				if(outq_add_mem(dest, seg->buf + seg->offs, size) == -1) {
+					return -1;
+				}
+				src->memsize -= size;
+				mem_charge(MEM_OUTPUT, -size);
+			} else {
+				/* each piece sends from its own offset, so they can share
+				 * the descriptor, instead of a dup for every piece.
+				 */
+				if(!seg->shfd) {
+					if(!(seg->shfd = malloc(sizeof *seg->shfd))) {
+						logmsg("failed to allocate shared file descriptor\n");
+						return -1;
+					}
+					seg->shfd->fd = seg->fd;
+					seg->shfd->nref = 1;
+				}
+				if(!(piece = add_seg(dest))) {
+					return -1;
+				}
+				piece->fd = seg->fd;
+				piece->shfd = seg->shfd;
+				piece->shfd->nref++;
+				piece->offs = seg->offs;
+				piece->size = size;
+				dest->size += size;
+			}
+			seg->offs += size;
+			seg->size -= size;
+			src->size -= size;
+			break;
+		}
+
+		if(!(src->head = seg->next)) {
+			src->tail = 0;
+		}
+		seg->next = 0;
+		src->size -= seg->size;
+		dest->size += seg->size;
+		if(seg->buf && !seg->ref) {
+			src->memsize -= seg->size;
+			dest->memsize += seg->size;
+		}
+		if(dest->tail) {
+			dest->tail->next = seg;
+		} else {
+			dest->head = seg;
+		}
+		dest->tail = seg;
+		size -= seg->size;
+	}
+	return 0;
+}
+
+int outq_flush(struct outq *q, int s, long max)
+{
+	struct outseg *seg;
+	long wrsz, pend;
+
+	while((seg = q->head)) {
+		long len = seg->size;
+
+		if(max <= 0) {
+			return 1;
+		}
+		if(len > max) len = max;
+		if(!seg->buf && len > MAX_SENDFILE) len = MAX_SENDFILE;
+
+		/* a TLS write can't be retried with less, whatever the limit */
+		if(q->tls && (pend = tls_write_pending(q->tls)) > len && pend <= seg->size) {
+			len = pend;
+		}
+
+		if(seg->buf) {
+			if(q->tls) {
+				wrsz = tls_send(q->tls, seg->buf + seg->offs, len);
+			} else {
+				/* let the kernel coalesce a header with the data following it */
+				int flags = MSG_NOSIGNAL | (seg->next ? MSG_MORE : 0);
+				wrsz = send(s, seg->buf + seg->offs, len, flags);
+			}
+		} else {
+			if(q->tls) {
+				wrsz = tls_sendfile(q->tls, seg->fd, &seg->offs, len);
+			} else {
+				wrsz = sendfile(s, seg->fd, &seg->offs, len);
+			}
+		}
+
+		if(wrsz == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			return -1;
+		}
+		if(wrsz == 0) {
+			return -1;	/* file truncated under us */
+		}
+
+		if(seg->buf) {
+			seg->offs += wrsz;
+			if(!seg->ref) {
+				q->memsize -= wrsz;
+				mem_charge(MEM_OUTPUT, -wrsz);
+			}
+		}
+		seg->size -= wrsz;
+		q->size -= wrsz;
+		max -= wrsz;
+
+		if(seg->size <= 0) {
+			if(!(q->head = seg->next)) {
+				q->tail = 0;
+			}
+			free_seg(seg);
+		} else if(!seg->buf) {
+			return 1;	/* give the other clients a chance */
+		}
+	}
+	return 0;
+}
+
+static struct outseg *add_seg(struct outq *q)
+{
+	struct outseg *seg;
+
+	if(!(seg = calloc(1, sizeof *seg))) {
+		logmsg("failed to allocate output queue segment\n");
+		return 0;
+	}
+	if(q->tail) {
+		q->tail->next = seg;
+	} else {
+		q->head = seg;
+	}
+	q->tail = seg;
+	return seg;
+}
+
+static void free_seg(struct outseg *seg)
+{
+	if(seg->buf) {
+		if(seg->shared) {
+			outq_shbuf_release(seg->shared);
+		} else if(!seg->ref) {
+			free(seg->buf);
+		}
+	} else if(seg->shfd) {
+		if(--seg->shfd->nref <= 0) {
+			close(seg->shfd->fd);
+			free(seg->shfd);
+		}
+	} else if(seg->fd != -1) {
+		close(seg->fd);
+	}
+	free(seg);
+}
@@ -0,0 +1,74 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef OUTQ_H_
+#define OUTQ_H_
+
+#include <sys/types.h>
+
+/* output queue of a connection. Data waiting to be sent is kept as a list of
+ * segments, which are either memory buffers, or ranges of open files which
+ * are sent with sendfile.
+ */
+struct outseg;
+struct tls_conn;
+
+/* reference counted buffer, which can be queued to any number of output
+ * queues at once without copying it. It's freed when the last reference is
+ * released, by its creator or by the queues once they've sent it.
+ */
+struct outq_shbuf {
+	int nref;
+	long size;
+	char *data;
+};
+
+struct outq {
+	struct outseg *head, *tail;
+	long size;		/* total bytes queued */
+	long memsize;	/* bytes queued in memory segments owned by the queue */
+
+	struct tls_conn *tls;	/* send through TLS if not null */
+};
+
+void outq_init(struct outq *q);
+void outq_destroy(struct outq *q);
+
+/* copy data to the queue */
+int outq_add_mem(struct outq *q, const void *data, long size);
+/* queue a malloc'ed buffer, which is freed by the queue after it's sent */
+int outq_add_buf(struct outq *q, void *buf, long size);
+/* queue memory which stays valid and unchanged until it's sent, without
+ * copying it. The queue never frees it.
+ */
+int outq_add_ref(struct outq *q, const void *data, long size);
+/* queue size bytes of a shared buffer starting at offs, adding a reference */
+int outq_add_shared(struct outq *q, struct outq_shbuf *sb, long offs, long size);
+/* queue a range of a file. The queue takes ownership of fd, and closes it
+ * after it's sent.
+ */
+int outq_add_file(struct outq *q, int fd, off_t offs, long size);
+
+/* allocate a shared buffer with a single reference, and drop a reference */
+struct outq_shbuf *outq_shbuf_create(long size);
+void outq_shbuf_release(struct outq_shbuf *sb);
+
+/* move size bytes from the start of src to the end of dest. Segments which
+ * don't fit are split, with the pieces of file segments sharing the same
+ * descriptor.
+ */
+int outq_splice(struct outq *dest, struct outq *src, long size);
+
+/* send as much as possible without blocking, up to max bytes. Returns 0 if
+ * the queue is empty, 1 if there's more to send when the socket is writable
+ * again, or max bytes have been sent, or -1 on errors.
+ */
+int outq_flush(struct outq *q, int s, long max);
+
+#define outq_empty(q)	(!(q)->head)
+
+#endif	/* OUTQ_H_ */
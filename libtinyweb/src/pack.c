@@ -0,0 +1,215 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pack.h"
+#include "logger.h"
+
+struct pack {
+	unsigned char *data;
+	size_t size;
+
+	struct pack_header *hdr;
+	struct pack_entry *ent;
+	const char *str;
+};
+
+static int check_pack(struct pack *pk, const char *fname);
+static int check_str(struct pack *pk, uint32_t offs);
+static int check_range(struct pack *pk, uint64_t offs, uint64_t size);
+
+
+struct pack *pack_open(const char *fname)
+{
+	int fd;
+	struct stat st;
+	struct pack *pk;
+	void *data;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		logmsg("failed to open pack: %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	fstat(fd, &st);
+	if(st.st_size < sizeof(struct pack_header)) {
+		logmsg("invalid pack: %s\n", fname);
+		close(fd);
+		return 0;
+	}
+
+	/* every process serving the pack shares the same page cache pages */
+	data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		logmsg("failed to map pack: %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+
+	if(!(pk = malloc(sizeof *pk))) {
+		logmsg("failed to allocate pack\n");
+		munmap(data, st.st_size);
+		return 0;
+	}
+	pk->data = data;
+	pk->size = st.st_size;
+
+	if(check_pack(pk, fname) == -1) {
+		pack_close(pk);
+		return 0;
+	}
+	logmsg("loaded pack %s: %u entries\n", fname, (unsigned int)pk->hdr->num_ent);
+	return pk;
+}
+
+void pack_close(struct pack *pk)
+{
+	if(pk) {
+		munmap(pk->data, pk->size);
+		free(pk);
+	}
+}
+
+long pack_prefetch(struct pack *pk, long max_size, int *count)
+{
+	int i;
+	long total = 0;
+	struct pack_entry *ent;
+
+	*count = 0;
+	for(i=0; i<pk->hdr->num_ent; i++) {
+		ent = pk->ent + i;
+		if((ent->flags & PACK_DIR) || ent->size > max_size) {
+			continue;
+		}
+		/* files and their variants start on page boundaries */
+		if(ent->size > 0 && posix_madvise(pk->data + ent->offs, ent->size,
+					POSIX_MADV_WILLNEED) == 0) {
+			total += ent->size;
+		}
+		if(ent->gz_size > 0 && posix_madvise(pk->data + ent->gz_offs, ent->gz_size,
+					POSIX_MADV_WILLNEED) == 0) {
+			total += ent->gz_size;
+		}
+		(*count)++;
+	}
+	return total;
+}
+
+const struct pack_entry *pack_find(struct pack *pk, const char *path)
+{
+	int len, res, lo, hi, mid;
+	const char *name;
+
+	while(*path == '/') path++;
+	len = strlen(path);
+	while(len > 0 && path[len - 1] == '/') len--;
+
+	lo = 0;
+	hi = pk->hdr->num_ent - 1;
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		name = pk->str + pk->ent[mid].path;
+
+		if(!(res = strncmp(path, name, len))) {
+			res = name[len] ? -1 : 0;
+		}
+		if(res == 0) {
+			return pk->ent + mid;
+		}
+		if(res < 0) {
+			hi = mid - 1;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return 0;
+}
+
+const struct pack_entry *pack_entry(struct pack *pk, int idx)
+{
+	return idx >= 0 && idx < pk->hdr->num_ent ? pk->ent + idx : 0;
+}
+
+const char *pack_str(struct pack *pk, uint32_t offs)
+{
+	return pk->str + offs;
+}
+
+const void *pack_data(struct pack *pk, uint64_t offs)
+{
+	return pk->data + offs;
+}
+
+/* everything is checked once when the pack is loaded, so that requests can
+ * use it without any further checks.
+ */
+static int check_pack(struct pack *pk, const char *fname)
+{
+	int i;
+	struct pack_header *hdr;
+	struct pack_entry *ent;
+
+	hdr = pk->hdr = (struct pack_header*)pk->data;
+	if(memcmp(hdr->magic, PACK_MAGIC, sizeof hdr->magic) != 0 || hdr->version != PACK_VERSION) {
+		logmsg("%s is not a tinyweb pack, or it's of an unsupported version\n", fname);
+		return -1;
+	}
+	if(hdr->ent_offs % sizeof(uint64_t) ||
+			check_range(pk, hdr->ent_offs, (uint64_t)hdr->num_ent * sizeof *ent) == -1 ||
+			check_range(pk, hdr->str_offs, hdr->str_size) == -1 || hdr->str_size < 1) {
+		goto invalid;
+	}
+	pk->ent = (struct pack_entry*)(pk->data + hdr->ent_offs);
+	pk->str = (const char*)pk->data + hdr->str_offs;
+	if(pk->str[hdr->str_size - 1]) {
+		goto invalid;
+	}
+
+	for(i=0; i<hdr->num_ent; i++) {
+		ent = pk->ent + i;
+		if(check_str(pk, ent->path) == -1 || check_str(pk, ent->type) == -1 ||
+				check_str(pk, ent->etag) == -1 || check_str(pk, ent->gz_etag) == -1) {
+			goto invalid;
+		}
+		if(i > 0 && strcmp(pk->str + ent[-1].path, pk->str + ent->path) >= 0) {
+			goto invalid;
+		}
+		if(ent->flags & PACK_DIR) {
+			if(ent->index != -1 && (ent->index < 0 || ent->index >= hdr->num_ent ||
+						(pk->ent[ent->index].flags & PACK_DIR))) {
+				goto invalid;
+			}
+		} else {
+			if(check_range(pk, ent->offs, ent->size) == -1 ||
+					check_range(pk, ent->gz_offs, ent->gz_size) == -1) {
+				goto invalid;
+			}
+		}
+	}
+	return 0;
+
+invalid:
+	logmsg("invalid or truncated pack: %s\n", fname);
+	return -1;
+}
+
+static int check_str(struct pack *pk, uint32_t offs)
+{
+	return offs < pk->hdr->str_size ? 0 : -1;
+}
+
+static int check_range(struct pack *pk, uint64_t offs, uint64_t size)
+{
+	return offs <= pk->size && size <= pk->size - offs ? 0 : -1;
+}
@@ -0,0 +1,68 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <stdint.h>
+
+/* Static site pack: a whole document tree in a single file, built by the
+ * twpack tool, and served straight from memory after mapping it. The file
+ * starts with a pack_header, followed by the entries sorted by path, the
+ * string table, and the file data, with every file starting at a page
+ * boundary. Integers are in native byte order.
+ *
+ * Paths are relative to the root, without leading or trailing slashes (the
+ * root directory itself is the empty path). Strings are referenced by their
+ * offset in the string table, and are null terminated.
+ */
+#define PACK_MAGIC		"TWPACK\r\n"
+#define PACK_VERSION	1
+#define PACK_ALIGN		4096
+
+enum {
+	PACK_DIR	= 1
+};
+
+struct pack_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_ent;
+	uint64_t ent_offs;
+	uint64_t str_offs, str_size;
+};
+
+struct pack_entry {
+	uint32_t path;			/* strings: path, MIME type (empty if unknown) */
+	uint32_t type;
+	uint32_t etag;			/* quoted entity tags of the file and its gzip variant */
+	uint32_t gz_etag;
+	uint32_t flags;
+	int32_t index;			/* directories: entry of the index file, or -1 */
+	uint64_t offs, size;	/* file data */
+	uint64_t gz_offs, gz_size;	/* gzip encoded variant, if gz_size > 0 */
+};
+
+struct pack;
+
+/* map a pack file, and check that it's valid */
+struct pack *pack_open(const char *fname);
+void pack_close(struct pack *pk);
+
+/* ask the kernel to start reading the files up to max_size bytes into the
+ * page cache. Returns the number of bytes, and the number of files in count.
+ */
+long pack_prefetch(struct pack *pk, long max_size, int *count);
+
+/* find the entry for a path, ignoring leading and trailing slashes */
+const struct pack_entry *pack_find(struct pack *pk, const char *path);
+const struct pack_entry *pack_entry(struct pack *pk, int idx);
+
+const char *pack_str(struct pack *pk, uint32_t offs);
+const void *pack_data(struct pack *pk, uint64_t offs);
+
+#endif	/* PACK_H_ */
@@ -0,0 +1,1184 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <alloca.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "proxy.h"
+#include "outq.h"
+#include "memgov.h"
+#include "logger.h"
+
+/* idle keep-alive connections kept open to each upstream */
+#define MAX_IDLE			16
+
+/* maximum number of 16k reads from an upstream connection at a time */
+#define MAX_READS			16
+
+#define MAX_RESP_HDR		65536
+
+/* timeouts in milliseconds, for connecting, for a response to make progress,
+ * and for an idle connection to be reused.
+ */
+#define CONNECT_TIMEOUT		5000
+#define RESP_TIMEOUT		60000
+#define IDLE_TIMEOUT		30000
+
+/* an upstream which fails isn't tried again for this long */
+#define FAIL_TIMEOUT		10000
+
+struct upstream {
+	char *name;		/* address as configured, for logging */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	long long down_until;	/* failed recently, skipped until then */
+
+	/* keep-alive connections, most recently used first */
+	struct proxy_conn *idle;
+	int num_idle;
+
+	struct upstream *next;
+};
+
+struct proxy_group {
+	char *prefix;	/* without trailing slashes */
+	int prefix_len;
+	struct upstream *ups;
+	struct upstream *cur;	/* the last one picked, the next takes its turn */
+	int num_ups;
+
+	struct proxy_group *next;
+};
+
+enum { CONN_CONNECTING, CONN_BUSY, CONN_IDLE };
+
+struct proxy_conn {
+	int s;
+	struct upstream *up;
+	int state;
+	int reused;			/* served a request before, might have been closed since */
+	long long deadline;
+	struct outq outq;	/* request still to be sent */
+	struct proxy_req *preq;
+	int events;			/* reported to the socket function */
+
+	struct proxy_conn *next;
+};
+
+enum { RESP_HEADER, RESP_BODY };
+
+struct proxy_req {
+	struct proxy_group *grp;
+	struct proxy_conn *conn;
+	int tries;			/* upstreams which failed it so far */
+
+	/* the request to send, kept until the response is over, to retry it */
+	char *hdr;
+	int hdrlen, hdrsize;
+	struct req_body body;
+	int head;			/* HEAD request, the response has no body */
+	int idempotent;		/* can be sent again, even if it might have been processed */
+
+	int state;
+	char *inbuf;		/* response header, until it's complete */
+	int inlen, insize;
+	long body_left;		/* -1 for chunked, -2 until the connection is closed */
+	struct http_dechunk dechunk;
+	int keepalive;
+
+	fcgi_out_func out;	/* null if the request was aborted */
+	void *cls;
+	int throttled;
+};
+
+static struct upstream *pick_upstream(struct proxy_group *grp);
+static int resolve(struct upstream *up, const char *addr);
+static int start_request(struct proxy_req *preq);
+static int send_request(struct proxy_conn *conn, struct proxy_req *preq);
+static struct proxy_conn *new_conn(struct upstream *up);
+static void close_conn(struct proxy_conn *conn);
+static void release_conn(struct proxy_conn *conn);
+static void unlink_conn(struct proxy_conn *conn);
+static struct proxy_conn *find_conn(int s);
+static int conn_events(struct proxy_conn *conn);
+static void update_events(struct proxy_conn *conn);
+static void conn_failed(struct proxy_conn *conn, const char *why);
+static void conn_eof(struct proxy_conn *conn);
+static void end_request(struct proxy_conn *conn, int keep);
+static void fail_request(struct proxy_conn *conn);
+static int deliver(struct proxy_conn *conn, const char *data, int size);
+static int proc_input(struct proxy_conn *conn, char *data, int size);
+static int proc_header(struct proxy_req *preq, char **cgihdr, int *cgilen);
+static int proc_body(struct proxy_conn *conn, char *data, int size);
+static void free_request(struct proxy_req *preq);
+static int build_header(struct proxy_req *preq, struct tw_request *req, const char *remote_addr);
+static int add_str(struct proxy_req *preq, const char *s, int len);
+static int has_token(const char *list, int len, const char *tok);
+static long long now_msec(void);
+
+static struct proxy_group *grplist;
+static struct proxy_conn *active;	/* connecting or busy connections */
+static proxy_sock_func sock_func;
+static void *sock_cls;
+
+/* connection whose request is in the output callback. Aborting it then only
+ * marks it, and it's closed once the callback returns.
+ */
+static struct proxy_conn *cur_conn;
+
+
+int proxy_add(const char *prefix, const char *addr)
+{
+	struct proxy_group *grp;
+	struct upstream *up, *tail;
+	int len;
+
+	if(*prefix != '/') {
+		logmsg("proxy: prefix must be an absolute path: %s\n", prefix);
+		return -1;
+	}
+	len = strlen(prefix);
+	while(len > 0 && prefix[len - 1] == '/') len--;
+
+	if(!(up = calloc(1, sizeof *up)) || !(up->name = strdup(addr))) {
+		logmsg("proxy: failed to allocate upstream\n");
+		free(up);
+		return -1;
+	}
+	if(resolve(up, addr) == -1) {
+		free(up->name);
+		free(up);
+		return -1;
+	}
+
+	for(grp=grplist; grp; grp=grp->next) {
+		if(grp->prefix_len == len && memcmp(grp->prefix, prefix, len) == 0) {
+			break;
+		}
+	}
+	if(!grp) {
+		if(!(grp = calloc(1, sizeof *grp)) || !(grp->prefix = malloc(len + 1))) {
+			logmsg("proxy: failed to allocate upstream group\n");
+			free(grp);
+			free(up->name);
+			free(up);
+			return -1;
+		}
+		memcpy(grp->prefix, prefix, len);
+		grp->prefix[len] = 0;
+		grp->prefix_len = len;
+		grp->next = grplist;
+		grplist = grp;
+	}
+
+	if(grp->ups) {
+		tail = grp->ups;
+		while(tail->next) tail = tail->next;
+		tail->next = up;
+	} else {
+		grp->ups = up;
+	}
+	grp->num_ups++;
+	return 0;
+}
+
+struct proxy_group *proxy_find(const char *path)
+{
+	struct proxy_group *grp, *best = 0;
+
+	for(grp=grplist; grp; grp=grp->next) {
+		if(strncmp(path, grp->prefix, grp->prefix_len) != 0) continue;
+		if(path[grp->prefix_len] != '/' && path[grp->prefix_len] != 0) continue;
+		if(!best || grp->prefix_len > best->prefix_len) {
+			best = grp;
+		}
+	}
+	return best;
+}
+
+struct proxy_req *proxy_request(struct proxy_group *grp, struct tw_request *req,
+		const char *remote_addr, fcgi_out_func out, void *cls)
+{
+	struct proxy_req *preq;
+	int method = req->hdr->method;
+
+	if(!(preq = calloc(1, sizeof *preq))) {
+		logmsg("proxy: failed to allocate request\n");
+		return 0;
+	}
+	preq->grp = grp;
+	preq->cls = cls;
+	preq->head = method == HTTP_HEAD;
+	preq->idempotent = method == HTTP_GET || method == HTTP_HEAD || method == HTTP_PUT ||
+		method == HTTP_DELETE || method == HTTP_OPTIONS;
+	body_init(&preq->body);
+
+	if(build_header(preq, req, remote_addr) == -1) {
+		logmsg("proxy: failed to allocate request header\n");
+		free_request(preq);
+		return 0;
+	}
+	body_move(&preq->body, &req->body);
+
+	if(start_request(preq) == -1) {
+		logmsg("proxy: no upstream available for %s\n", grp->prefix[0] ? grp->prefix : "/");
+		free_request(preq);
+		return 0;
+	}
+	preq->out = out;
+	return preq;
+}
+
+void proxy_abort(struct proxy_req *preq)
+{
+	struct proxy_conn *conn = preq->conn;
+
+	preq->out = 0;
+	if(conn && conn == cur_conn) {
+		return;
+	}
+	if(conn) {
+		close_conn(conn);
+	}
+	free_request(preq);
+}
+
+void proxy_throttle(struct proxy_req *preq, int stop)
+{
+	preq->throttled = stop;
+	if(preq->conn) {
+		update_events(preq->conn);
+	}
+}
+
+int proxy_get_sockets(int *socks)
+{
+	int count = 0;
+	struct proxy_group *grp;
+	struct upstream *up;
+	struct proxy_conn *conn;
+
+	for(conn=active; conn; conn=conn->next) {
+		if(conn_events(conn) & TW_READ) {
+			if(socks) *socks++ = conn->s;
+			count++;
+		}
+	}
+	for(grp=grplist; grp; grp=grp->next) {
+		for(up=grp->ups; up; up=up->next) {
+			for(conn=up->idle; conn; conn=conn->next) {
+				if(socks) *socks++ = conn->s;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+int proxy_get_wsockets(int *socks)
+{
+	int count = 0;
+	struct proxy_conn *conn;
+
+	for(conn=active; conn; conn=conn->next) {
+		if(conn_events(conn) & TW_WRITE) {
+			if(socks) *socks++ = conn->s;
+			count++;
+		}
+	}
+	return count;
+}
+
+int proxy_handle_socket(int s)
+{
+	struct proxy_conn *conn;
+	struct proxy_req *preq;
+	int i, err, rdsz;
+	socklen_t len;
+	char buf[16384];
+
+	if(!(conn = find_conn(s))) {
+		return -1;
+	}
+
+	if(conn->state == CONN_IDLE) {
+		/* the upstream closed it, or sent something it shouldn't have */
+		close_conn(conn);
+		return 0;
+	}
+
+	if(conn->state == CONN_CONNECTING) {
+		len = sizeof err;
+		if(getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+			err = errno;
+		}
+		if(err) {
+			conn_failed(conn, strerror(err));
+			return 0;
+		}
+		conn->state = CONN_BUSY;
+		conn->deadline = now_msec() + RESP_TIMEOUT;
+	}
+
+	if(!outq_empty(&conn->outq)) {
+		long size = conn->outq.size;
+		if(outq_flush(&conn->outq, s, LONG_MAX) == -1) {
+			conn_failed(conn, strerror(errno));
+			return 0;
+		}
+		if(conn->outq.size < size) {
+			conn->deadline = now_msec() + RESP_TIMEOUT;
+		}
+	}
+
+	/* read a limited amount at a time, the response is passed on as it
+	 * arrives, and the client might not keep up.
+	 */
+	preq = conn->preq;
+	for(i=0; i<MAX_READS && !preq->throttled; i++) {
+		if((rdsz = recv(s, buf, sizeof buf, 0)) == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			conn_failed(conn, strerror(errno));
+			return 0;
+		}
+		if(rdsz == 0) {
+			conn_eof(conn);
+			return 0;
+		}
+		conn->deadline = now_msec() + RESP_TIMEOUT;
+		if(proc_input(conn, buf, rdsz) == -1) {
+			return 0;	/* the request is over, one way or another */
+		}
+	}
+	update_events(conn);
+	return 0;
+}
+
+void proxy_set_sock_func(proxy_sock_func func, void *cls)
+{
+	sock_func = func;
+	sock_cls = cls;
+}
+
+long proxy_next_timeout(void)
+{
+	struct proxy_group *grp;
+	struct upstream *up;
+	struct proxy_conn *conn;
+	long long next = LLONG_MAX, now;
+
+	for(conn=active; conn; conn=conn->next) {
+		if(conn->deadline < next) next = conn->deadline;
+	}
+	for(grp=grplist; grp; grp=grp->next) {
+		for(up=grp->ups; up; up=up->next) {
+			for(conn=up->idle; conn; conn=conn->next) {
+				if(conn->deadline < next) next = conn->deadline;
+			}
+		}
+	}
+	if(next == LLONG_MAX) {
+		return -1;
+	}
+	now = now_msec();
+	return next > now ? (long)(next - now) : 0;
+}
+
+void proxy_handle_timeouts(void)
+{
+	struct proxy_group *grp;
+	struct upstream *up;
+	struct proxy_conn *conn, *next;
+	long long now = now_msec();
+
+restart:
+	for(conn=active; conn; conn=conn->next) {
+		if(conn->deadline > now) continue;
+
+		if(conn->preq->throttled) {
+			/* waiting for the client, not for the upstream */
+			conn->deadline = now + RESP_TIMEOUT;
+			continue;
+		}
+		if(conn->state == CONN_CONNECTING) {
+			conn_failed(conn, "connection timed out");
+		} else if(conn->preq->state == RESP_HEADER && !conn->preq->inlen) {
+			conn_failed(conn, "timed out waiting for the response");
+		} else {
+			logmsg("proxy: %s: timed out in the middle of the response\n", conn->up->name);
+			fail_request(conn);
+		}
+		goto restart;	/* the list has changed */
+	}
+
+	for(grp=grplist; grp; grp=grp->next) {
+		for(up=grp->ups; up; up=up->next) {
+			for(conn=up->idle; conn; conn=next) {
+				next = conn->next;
+				if(conn->deadline <= now) {
+					close_conn(conn);
+				}
+			}
+		}
+	}
+}
+
+void proxy_shutdown(void)
+{
+	struct proxy_group *grp;
+	struct upstream *up;
+	struct proxy_req *preq;
+
+	while(active) {
+		if((preq = active->preq)) {
+			preq->conn = 0;
+			free_request(preq);
+		}
+		close_conn(active);
+	}
+	for(grp=grplist; grp; grp=grp->next) {
+		for(up=grp->ups; up; up=up->next) {
+			while(up->idle) {
+				close_conn(up->idle);
+			}
+		}
+	}
+}
+
+
+/* the upstreams take turns, skipping those which failed recently, unless
+ * they all have.
+ */
+static struct upstream *pick_upstream(struct proxy_group *grp)
+{
+	int i;
+	struct upstream *up = grp->cur;
+	long long now = now_msec();
+
+	for(i=0; i<grp->num_ups; i++) {
+		up = up && up->next ? up->next : grp->ups;
+		if(up->down_until <= now) break;
+	}
+	grp->cur = up;
+	return up;
+}
+
+static int resolve(struct upstream *up, const char *addr)
+{
+	struct sockaddr_un *sun;
+	struct addrinfo hints, *ai;
+	char *host, *port, *end;
+	int res;
+
+	if(strncmp(addr, "unix:", 5) == 0) {
+		sun = (struct sockaddr_un*)&up->addr;
+		if(!addr[5] || strlen(addr + 5) >= sizeof sun->sun_path) {
+			logmsg("proxy: invalid unix socket path: %s\n", addr + 5);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, addr + 5);
+		up->addrlen = sizeof *sun;
+		return 0;
+	}
+
+	host = alloca(strlen(addr) + 1);
+	strcpy(host, addr);
+	if(*host == '[') {
+		host++;
+		if(!(end = strchr(host, ']')) || end[1] != ':') {
+			logmsg("proxy: invalid upstream address: %s\n", addr);
+			return -1;
+		}
+		*end = 0;
+		port = end + 2;
+	} else {
+		if(!(port = strrchr(host, ':'))) {
+			logmsg("proxy: upstream address without a port: %s\n", addr);
+			return -1;
+		}
+		*port++ = 0;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	if((res = getaddrinfo(host, port, &hints, &ai)) != 0) {
+		logmsg("proxy: failed to resolve %s: %s\n", addr, gai_strerror(res));
+		return -1;
+	}
+	memcpy(&up->addr, ai->ai_addr, ai->ai_addrlen);
+	up->addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 0;
+}
+
+/* send the request to the next upstream which takes it. An upstream which
+ * can't be reached is marked down, and the next one is tried, until they've
+ * all been tried.
+ */
+static int start_request(struct proxy_req *preq)
+{
+	struct upstream *up;
+	struct proxy_conn *conn;
+
+	while(preq->tries < preq->grp->num_ups) {
+		up = pick_upstream(preq->grp);
+
+		if((conn = up->idle)) {
+			up->idle = conn->next;
+			up->num_idle--;
+			conn->state = CONN_BUSY;
+			conn->next = active;
+			active = conn;
+		} else if(!(conn = new_conn(up))) {
+			up->down_until = now_msec() + FAIL_TIMEOUT;
+			preq->tries++;
+			continue;
+		}
+
+		if(send_request(conn, preq) != -1) {
+			return 0;
+		}
+		preq->conn = 0;
+		if(!conn->reused) {
+			up->down_until = now_msec() + FAIL_TIMEOUT;
+			preq->tries++;
+		}
+		close_conn(conn);
+	}
+	return -1;
+}
+
+/* queue the request header and body on the connection, and start sending
+ * them if it's connected. The body is sent straight from memory, or from its
+ * temporary file.
+ */
+static int send_request(struct proxy_conn *conn, struct proxy_req *preq)
+{
+	int fd;
+
+	conn->preq = preq;
+	preq->conn = conn;
+	preq->state = RESP_HEADER;
+	preq->inlen = 0;
+
+	if(outq_add_ref(&conn->outq, preq->hdr, preq->hdrlen) == -1) {
+		return -1;
+	}
+	if(preq->body.size > 0) {
+		if(preq->body.fd == -1) {
+			if(outq_add_ref(&conn->outq, preq->body.mem, preq->body.size) == -1) {
+				return -1;
+			}
+		} else {
+			if((fd = dup(preq->body.fd)) == -1) {
+				logmsg("proxy: failed to duplicate file descriptor: %s\n", strerror(errno));
+				return -1;
+			}
+			if(outq_add_file(&conn->outq, fd, 0, preq->body.size) == -1) {
+				close(fd);
+				return -1;
+			}
+		}
+	}
+
+	if(conn->state == CONN_BUSY) {
+		conn->deadline = now_msec() + RESP_TIMEOUT;
+		if(outq_flush(&conn->outq, conn->s, LONG_MAX) == -1) {
+			if(!conn->reused) {
+				logmsg("proxy: %s: %s\n", conn->up->name, strerror(errno));
+			}
+			return -1;
+		}
+	}
+	update_events(conn);
+	return 0;
+}
+
+static struct proxy_conn *new_conn(struct upstream *up)
+{
+	struct proxy_conn *conn;
+	int one = 1;
+
+	if(!(conn = calloc(1, sizeof *conn))) {
+		logmsg("proxy: failed to allocate connection\n");
+		return 0;
+	}
+	conn->up = up;
+	outq_init(&conn->outq);
+
+	if((conn->s = socket(up->addr.ss_family, SOCK_STREAM, 0)) == -1) {
+		logmsg("proxy: failed to create socket: %s\n", strerror(errno));
+		free(conn);
+		return 0;
+	}
+	fcntl(conn->s, F_SETFL, fcntl(conn->s, F_GETFL) | O_NONBLOCK);
+	if(up->addr.ss_family != AF_UNIX) {
+		setsockopt(conn->s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+
+	if(connect(conn->s, (struct sockaddr*)&up->addr, up->addrlen) == -1) {
+		if(errno != EINPROGRESS) {
+			logmsg("proxy: failed to connect to %s: %s\n", up->name, strerror(errno));
+			close(conn->s);
+			free(conn);
+			return 0;
+		}
+		conn->state = CONN_CONNECTING;
+		conn->deadline = now_msec() + CONNECT_TIMEOUT;
+	} else {
+		conn->state = CONN_BUSY;
+		conn->deadline = now_msec() + RESP_TIMEOUT;
+	}
+
+	conn->next = active;
+	active = conn;
+	return conn;
+}
+
+static void close_conn(struct proxy_conn *conn)
+{
+	unlink_conn(conn);
+	if(conn->preq) {
+		conn->preq->conn = 0;
+	}
+	if(sock_func && conn->events) {
+		sock_func(conn->s, 0, sock_cls);
+	}
+	close(conn->s);
+	outq_destroy(&conn->outq);
+	free(conn);
+}
+
+/* keep the connection open for the next request to the same upstream */
+static void release_conn(struct proxy_conn *conn)
+{
+	struct upstream *up = conn->up;
+
+	if(up->num_idle >= MAX_IDLE) {
+		close_conn(conn);
+		return;
+	}
+	unlink_conn(conn);
+	conn->state = CONN_IDLE;
+	conn->reused = 1;
+	conn->deadline = now_msec() + IDLE_TIMEOUT;
+	conn->next = up->idle;
+	up->idle = conn;
+	up->num_idle++;
+	update_events(conn);
+}
+
+static void unlink_conn(struct proxy_conn *conn)
+{
+	struct proxy_conn dummy, *prev;
+	struct upstream *up = conn->up;
+
+	dummy.next = conn->state == CONN_IDLE ? up->idle : active;
+	prev = &dummy;
+	while(prev->next && prev->next != conn) {
+		prev = prev->next;
+	}
+	if(prev->next) {
+		prev->next = conn->next;
+		if(conn->state == CONN_IDLE) up->num_idle--;
+	}
+	if(conn->state == CONN_IDLE) {
+		up->idle = dummy.next;
+	} else {
+		active = dummy.next;
+	}
+	conn->next = 0;
+}
+
+static struct proxy_conn *find_conn(int s)
+{
+	struct proxy_group *grp;
+	struct upstream *up;
+	struct proxy_conn *conn;
+
+	for(conn=active; conn; conn=conn->next) {
+		if(conn->s == s) return conn;
+	}
+	for(grp=grplist; grp; grp=grp->next) {
+		for(up=grp->ups; up; up=up->next) {
+			for(conn=up->idle; conn; conn=conn->next) {
+				if(conn->s == s) return conn;
+			}
+		}
+	}
+	return 0;
+}
+
+/* idle connections are watched for the upstream closing them */
+static int conn_events(struct proxy_conn *conn)
+{
+	int events;
+
+	if(conn->state == CONN_CONNECTING) {
+		return TW_WRITE;
+	}
+	events = outq_empty(&conn->outq) ? 0 : TW_WRITE;
+	if(conn->state == CONN_IDLE || !conn->preq->throttled) {
+		events |= TW_READ;
+	}
+	return events;
+}
+
+static void update_events(struct proxy_conn *conn)
+{
+	int events;
+
+	if(sock_func && (events = conn_events(conn)) != conn->events) {
+		sock_func(conn->s, events, sock_cls);
+		conn->events = events;
+	}
+}
+
+/* the connection failed before any of the response arrived. The request is
+ * retried on another connection if it can't have been processed, or it's
+ * safe to repeat. Reused connections closed by the upstream while idle don't
+ * count against it.
+ */
+static void conn_failed(struct proxy_conn *conn, const char *why)
+{
+	struct proxy_req *preq = conn->preq;
+	struct upstream *up = conn->up;
+	fcgi_out_func out;
+	int retry;
+
+	if(preq->state != RESP_HEADER || preq->inlen > 0) {
+		logmsg("proxy: %s: %s\n", up->name, why);
+		fail_request(conn);
+		return;
+	}
+
+	retry = conn->state == CONN_CONNECTING || preq->idempotent;
+	if(!conn->reused) {
+		logmsg("proxy: %s: %s\n", up->name, why);
+		up->down_until = now_msec() + FAIL_TIMEOUT;
+		preq->tries++;
+	}
+	close_conn(conn);
+
+	if(retry && start_request(preq) != -1) {
+		return;
+	}
+	out = preq->out;
+	if(out) {
+		out(FCGI_ERROR, 0, 0, preq->cls);
+	}
+	free_request(preq);
+}
+
+static void conn_eof(struct proxy_conn *conn)
+{
+	struct proxy_req *preq = conn->preq;
+
+	if(preq->state == RESP_BODY && preq->body_left == -2) {
+		end_request(conn, 0);
+	} else if(preq->state == RESP_HEADER && !preq->inlen) {
+		conn_failed(conn, "connection closed");
+	} else {
+		logmsg("proxy: %s closed the connection in the middle of the response\n", conn->up->name);
+		fail_request(conn);
+	}
+}
+
+/* the response is complete, the connection is kept for another request if
+ * both sides agree, and nothing else is in flight on it.
+ */
+static void end_request(struct proxy_conn *conn, int keep)
+{
+	struct proxy_req *preq = conn->preq;
+	fcgi_out_func out = preq->out;
+	void *cls = preq->cls;
+
+	keep = keep && preq->keepalive && outq_empty(&conn->outq);
+	conn->preq = 0;
+	preq->conn = 0;
+	free_request(preq);
+
+	if(keep) {
+		release_conn(conn);
+	} else {
+		close_conn(conn);
+	}
+	if(out) {
+		out(FCGI_END, 0, 0, cls);
+	}
+}
+
+static void fail_request(struct proxy_conn *conn)
+{
+	struct proxy_req *preq = conn->preq;
+	fcgi_out_func out = preq->out;
+	void *cls = preq->cls;
+
+	close_conn(conn);
+	free_request(preq);
+	if(out) {
+		out(FCGI_ERROR, 0, 0, cls);
+	}
+}
+
+/* pass output on, and finish aborting the request if that happened in the
+ * callback. Returns -1 if it did.
+ */
+static int deliver(struct proxy_conn *conn, const char *data, int size)
+{
+	struct proxy_req *preq = conn->preq;
+
+	if(preq->out) {
+		cur_conn = conn;
+		preq->out(FCGI_DATA, data, size, preq->cls);
+		cur_conn = 0;
+	}
+	if(!preq->out) {
+		close_conn(conn);
+		free_request(preq);
+		return -1;
+	}
+	return 0;
+}
+
+/* returns -1 once the request is over, and the connection isn't ours to
+ * read from anymore.
+ */
+static int proc_input(struct proxy_conn *conn, char *data, int size)
+{
+	struct proxy_req *preq = conn->preq;
+	int newsz, res, cgilen;
+	char *tmp, *cgihdr;
+
+	if(preq->state == RESP_BODY) {
+		return proc_body(conn, data, size);
+	}
+
+	if(preq->inlen + size > preq->insize) {
+		newsz = preq->insize ? preq->insize * 2 : 4096;
+		while(newsz < preq->inlen + size) newsz *= 2;
+		if(!(tmp = realloc(preq->inbuf, newsz))) {
+			logmsg("proxy: failed to allocate response buffer\n");
+			fail_request(conn);
+			return -1;
+		}
+		mem_charge(MEM_HEADER, newsz - preq->insize);
+		preq->inbuf = tmp;
+		preq->insize = newsz;
+	}
+	memcpy(preq->inbuf + preq->inlen, data, size);
+	preq->inlen += size;
+
+	if((res = proc_header(preq, &cgihdr, &cgilen)) <= 0) {
+		if(res == -1) {
+			logmsg("proxy: invalid response header from %s\n", conn->up->name);
+			fail_request(conn);
+		}
+		return res;
+	}
+	if(deliver(conn, cgihdr, cgilen) == -1) {
+		free(cgihdr);
+		return -1;
+	}
+	free(cgihdr);
+
+	/* whatever followed the header is the start of the body */
+	return proc_body(conn, preq->inbuf + res, preq->inlen - res);
+}
+
+/* Once the response header is complete, convert it to CGI header lines in
+ * cgihdr, without the fields which only concern this connection, and figure
+ * out how the body ends. Interim 1xx responses are skipped.
+ * Returns the size of the header, 0 if it's incomplete, or -1 if it's invalid.
+ */
+static int proc_header(struct proxy_req *preq, char **cgihdr, int *cgilen)
+{
+	char *buf, *line, *next, *end, *cgi, *ptr;
+	int hdrlen, len, minor, status, conn_close = 0, conn_keep = 0, chunked = 0;
+	long clen = -1;
+
+	for(;;) {
+		buf = preq->inbuf;
+		end = 0;
+		for(ptr=buf; ptr < buf + preq->inlen - 1; ptr++) {
+			if(ptr[0] == '\n' && (ptr[1] == '\n' || (ptr[1] == '\r' &&
+							ptr + 2 < buf + preq->inlen && ptr[2] == '\n'))) {
+				end = ptr + (ptr[1] == '\n' ? 2 : 3);
+				break;
+			}
+		}
+		if(!end) {
+			return preq->inlen > MAX_RESP_HDR ? -1 : 0;
+		}
+		hdrlen = end - buf;
+
+		if(hdrlen < 12 || memcmp(buf, "HTTP/1.", 7) != 0 || !isdigit(buf[7]) ||
+				buf[8] != ' ' || !isdigit(buf[9]) || !isdigit(buf[10]) || !isdigit(buf[11])) {
+			return -1;
+		}
+		minor = buf[7] - '0';
+		status = atoi(buf + 9);
+		if(status < 100) {
+			return -1;
+		}
+		if(status >= 200) break;
+		if(status == 101) {
+			return -1;	/* no protocol switching through the proxy */
+		}
+		memmove(buf, buf + hdrlen, preq->inlen - hdrlen);
+		preq->inlen -= hdrlen;
+	}
+
+	/* the framing of the body first, then the fields to pass on */
+	for(line=buf; line < end; line=next) {
+		if(!(next = memchr(line, '\n', end - line))) break;
+		next++;
+		len = next - line - 1;
+		if(len > 0 && line[len - 1] == '\r') len--;
+
+		if(len > 11 && strncasecmp(line, "Connection:", 11) == 0) {
+			if(has_token(line + 11, len - 11, "close")) conn_close = 1;
+			if(has_token(line + 11, len - 11, "keep-alive")) conn_keep = 1;
+		} else if(len > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+			chunked = has_token(line + 18, len - 18, "chunked");
+		} else if(len > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+			clen = strtol(line + 15, 0, 10);
+		}
+	}
+
+	if(!(cgi = malloc(hdrlen * 2 + 32))) {
+		logmsg("proxy: failed to allocate response header\n");
+		return -1;
+	}
+	ptr = cgi + sprintf(cgi, "Status: %d\r\n", status);
+	line = (char*)memchr(buf, '\n', end - buf) + 1;	/* skip the status line */
+	for(; line < end; line=next) {
+		if(!(next = memchr(line, '\n', end - line))) break;
+		next++;
+		len = next - line - 1;
+		if(len > 0 && line[len - 1] == '\r') len--;
+		if(!len || !memchr(line, ':', len)) continue;
+
+		if((len > 11 && strncasecmp(line, "Connection:", 11) == 0) ||
+				(len > 11 && strncasecmp(line, "Keep-Alive:", 11) == 0) ||
+				(len > 17 && strncasecmp(line, "Proxy-Connection:", 17) == 0) ||
+				(len > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) ||
+				(len > 8 && strncasecmp(line, "Trailer:", 8) == 0) ||
+				(len > 8 && strncasecmp(line, "Upgrade:", 8) == 0) ||
+				(chunked && len > 15 && strncasecmp(line, "Content-Length:", 15) == 0)) {
+			continue;
+		}
+		memcpy(ptr, line, len);
+		ptr += len;
+		*ptr++ = '\r';
+		*ptr++ = '\n';
+	}
+	*ptr++ = '\r';
+	*ptr++ = '\n';
+
+	preq->keepalive = minor >= 1 ? !conn_close : conn_keep;
+	if(preq->head || status == 204 || status == 304) {
+		preq->body_left = 0;
+	} else if(chunked) {
+		preq->body_left = -1;
+		http_init_dechunk(&preq->dechunk);
+	} else if(clen >= 0) {
+		preq->body_left = clen;
+	} else {
+		preq->body_left = -2;
+		preq->keepalive = 0;
+	}
+	preq->state = RESP_BODY;
+
+	*cgihdr = cgi;
+	*cgilen = ptr - cgi;
+	return hdrlen;
+}
+
+static int proc_body(struct proxy_conn *conn, char *data, int size)
+{
+	struct proxy_req *preq = conn->preq;
+	int res, len, done, extra = 0;
+
+	if(preq->body_left == -1) {
+		if((res = http_dechunk(&preq->dechunk, data, size, &len)) == -1) {
+			logmsg("proxy: invalid chunked response from %s\n", conn->up->name);
+			fail_request(conn);
+			return -1;
+		}
+		done = res;
+	} else if(preq->body_left == -2) {
+		len = size;
+		done = 0;
+	} else {
+		len = size > preq->body_left ? preq->body_left : size;
+		preq->body_left -= len;
+		done = preq->body_left == 0;
+		extra = size > len;
+	}
+
+	if(len > 0 && deliver(conn, data, len) == -1) {
+		return -1;
+	}
+	if(done) {
+		/* anything after the response means we're out of step with it */
+		end_request(conn, !extra);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_request(struct proxy_req *preq)
+{
+	free(preq->hdr);
+	free(preq->inbuf);
+	mem_charge(MEM_HEADER, -(preq->hdrsize + preq->insize));
+	body_destroy(&preq->body);
+	free(preq);
+}
+
+/* the request line and header fields for the upstream. Fields about this
+ * connection are dropped, the body is always sent with a Content-Length, and
+ * the client address and scheme are added in X-Forwarded-For and
+ * X-Forwarded-Proto.
+ */
+static int build_header(struct proxy_req *preq, struct tw_request *req, const char *remote_addr)
+{
+	struct http_req_header *hdr = req->hdr;
+	const char *field, *val, *xff = 0;
+	const char *method = http_method_name(hdr->method);
+	char buf[64];
+	int i, len;
+
+	len = strcspn(req->rawpath, "#");
+	if(add_str(preq, method, strlen(method)) == -1 || add_str(preq, " ", 1) == -1 ||
+			add_str(preq, req->rawpath, len) == -1 ||
+			add_str(preq, " HTTP/1.1\r\n", 11) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<hdr->num_hdrfields; i++) {
+		field = hdr->hdrfields[i];
+		if(!(val = strchr(field, ':'))) continue;
+		len = val - field;
+
+		switch(http_field_id(field, len)) {
+		case HTTP_CONNECTION:
+		case HTTP_CONTENT_LENGTH:
+		case HTTP_TRANSFER_ENCODING:
+		case HTTP_EXPECT:
+		case HTTP_UPGRADE:
+		case HTTP_HTTP2_SETTINGS:
+			continue;
+		default:
+			break;
+		}
+		if((len == 10 && strncasecmp(field, "Keep-Alive", 10) == 0) ||
+				(len == 16 && strncasecmp(field, "Proxy-Connection", 16) == 0) ||
+				(len == 2 && strncasecmp(field, "TE", 2) == 0) ||
+				(len == 7 && strncasecmp(field, "Trailer", 7) == 0) ||
+				(len == 17 && strncasecmp(field, "X-Forwarded-Proto", 17) == 0)) {
+			continue;
+		}
+		if(len == 15 && strncasecmp(field, "X-Forwarded-For", 15) == 0) {
+			/* added to below */
+			do val++; while(*val && isspace(*val));
+			xff = val;
+			continue;
+		}
+		if(add_str(preq, field, strlen(field)) == -1 || add_str(preq, "\r\n", 2) == -1) {
+			return -1;
+		}
+	}
+
+	if(!http_field(hdr, HTTP_HOST)) {
+		if(add_str(preq, "Host: localhost\r\n", 17) == -1) {
+			return -1;
+		}
+	}
+	if(remote_addr) {
+		if(add_str(preq, "X-Forwarded-For: ", 17) == -1 ||
+				(xff && (add_str(preq, xff, strlen(xff)) == -1 || add_str(preq, ", ", 2) == -1)) ||
+				add_str(preq, remote_addr, strlen(remote_addr)) == -1 ||
+				add_str(preq, "\r\n", 2) == -1) {
+			return -1;
+		}
+	}
+	len = sprintf(buf, "X-Forwarded-Proto: %s\r\n", req->secure ? "https" : "http");
+	if(add_str(preq, buf, len) == -1) {
+		return -1;
+	}
+	if(req->body.size > 0 || http_field(hdr, HTTP_CONTENT_LENGTH) ||
+			http_field(hdr, HTTP_TRANSFER_ENCODING)) {
+		len = sprintf(buf, "Content-Length: %ld\r\n", req->body.size);
+		if(add_str(preq, buf, len) == -1) {
+			return -1;
+		}
+	}
+	return add_str(preq, "\r\n", 2);
+}
+
+static int add_str(struct proxy_req *preq, const char *s, int len)
+{
+	if(preq->hdrlen + len > preq->hdrsize) {
+		char *tmp;
+		int newsz = preq->hdrsize ? preq->hdrsize * 2 : 1024;
+
+		while(newsz < preq->hdrlen + len) newsz *= 2;
+		if(!(tmp = realloc(preq->hdr, newsz))) {
+			return -1;
+		}
+		mem_charge(MEM_HEADER, newsz - preq->hdrsize);
+		preq->hdr = tmp;
+		preq->hdrsize = newsz;
+	}
+	memcpy(preq->hdr + preq->hdrlen, s, len);
+	preq->hdrlen += len;
+	return 0;
+}
+
+/* check if a comma separated list of len characters contains a token */
+static int has_token(const char *list, int len, const char *tok)
+{
+	const char *end = list + len;
+	int toklen = strlen(tok), n;
+
+	while(list < end) {
+		while(list < end && (isspace(*list) || *list == ',')) list++;
+		n = 0;
+		while(list + n < end && list[n] != ',' && !isspace(list[n])) n++;
+		if(n == toklen && strncasecmp(list, tok, n) == 0) {
+			return 1;
+		}
+		list += n;
+	}
+	return 0;
+}
+
+static long long now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
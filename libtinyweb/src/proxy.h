@@ -0,0 +1,67 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include "request.h"
+#include "fcgi.h"
+
+/* requests under a path prefix which are forwarded to a group of upstream
+ * HTTP servers.
+ */
+struct proxy_group;
+struct proxy_req;
+
+/* add an upstream server for a path prefix, creating its group with the
+ * first one. addr is host:port, [ipv6addr]:port, or unix:path.
+ */
+int proxy_add(const char *prefix, const char *addr);
+/* the group with the longest prefix matching a decoded path, or null */
+struct proxy_group *proxy_find(const char *path);
+
+/* Forward a request to the upstreams of a group, in turn. Idle keep-alive
+ * connections are reused, and an upstream which can't be reached is skipped
+ * for a while, with the request retried on the next one. The output callback
+ * is called like the FastCGI one: with the response header converted to CGI
+ * header lines, the body as it arrives, and FCGI_END or FCGI_ERROR at the
+ * end. The request body is moved out of req, and sent after the header.
+ * remote_addr is passed in X-Forwarded-For, and can be null.
+ */
+struct proxy_req *proxy_request(struct proxy_group *grp, struct tw_request *req,
+		const char *remote_addr, fcgi_out_func out, void *cls);
+
+/* abandon a request: the output callback will not be called again */
+void proxy_abort(struct proxy_req *preq);
+
+/* stop reading the response while the client can't keep up, or resume it */
+void proxy_throttle(struct proxy_req *preq, int stop);
+
+/* connections to the upstreams, which need to be monitored for reading and
+ * writing, and passed to proxy_handle_socket. Both return the number of
+ * sockets.
+ */
+int proxy_get_sockets(int *socks);
+int proxy_get_wsockets(int *socks);
+/* returns -1 if s isn't an upstream connection */
+int proxy_handle_socket(int s);
+
+/* called whenever the events (TW_READ/TW_WRITE) a connection needs to be
+ * monitored for change, with 0 right before it's closed.
+ */
+typedef void (*proxy_sock_func)(int s, int events, void *cls);
+
+void proxy_set_sock_func(proxy_sock_func func, void *cls);
+
+/* milliseconds until the next connect, response, or idle timeout, or -1 */
+long proxy_next_timeout(void);
+void proxy_handle_timeouts(void);
+
+/* close all upstream connections, dropping any requests in flight */
+void proxy_shutdown(void);
+
+#endif	/* PROXY_H_ */
@@ -0,0 +1,266 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include "ratelim.h"
+#include "logger.h"
+
+/* entries in each table (a power of two), and how many slots an address can
+ * be in, starting from its hash. Both tables together take about 450kb.
+ */
+#define TABLE_SIZE	8192
+#define MAX_PROBE	16
+
+struct entry {
+	unsigned char key[16];	/* IPv6 address, or IPv4 mapped to IPv6, masked */
+	uint32_t stamp;			/* last refill, in milliseconds */
+	float tokens;
+	uint16_t conns;
+	uint16_t used;
+};
+
+struct table {
+	struct entry *ent;
+	float rate;				/* tokens per millisecond */
+	float burst;
+	int max_conns;
+	int prefix;				/* keyed by network prefix instead of address */
+	int full_warned;
+};
+
+static int make_key(const struct sockaddr *addr, struct table *tab, unsigned char *key);
+static struct entry *lookup(struct table *tab, const unsigned char *key, int create,
+		uint32_t now);
+static void refill(struct table *tab, struct entry *e, uint32_t now);
+static uint32_t msec_now(void);
+
+static struct table tables[RL_NUM_SCOPES];
+static int num_enabled;
+static uint32_t seed;
+
+
+int ratelim_set(int scope, double rate, int burst, int max_conns)
+{
+	struct table *tab;
+	int was_enabled, enable;
+
+	if(scope < 0 || scope >= RL_NUM_SCOPES || rate < 0 || burst < 0 || max_conns < 0) {
+		logmsg("invalid rate limit\n");
+		return -1;
+	}
+	tab = tables + scope;
+	was_enabled = tab->ent != 0;
+	enable = rate > 0 || max_conns > 0;
+
+	if(enable && !tab->ent) {
+		if(!(tab->ent = calloc(TABLE_SIZE, sizeof *tab->ent))) {
+			logmsg("failed to allocate rate limit table\n");
+			return -1;
+		}
+		if(!seed) {
+			seed = ((uint32_t)time(0) * 2654435761u) ^ (uint32_t)getpid() ^ 0x811c9dc5;
+		}
+	} else if(!enable) {
+		free(tab->ent);
+		tab->ent = 0;
+	}
+
+	tab->rate = rate / 1000.0;
+	tab->burst = burst > 0 ? burst : (rate > 1 ? rate : 1);
+	tab->max_conns = max_conns;
+	tab->prefix = scope == RL_PREFIX;
+	tab->full_warned = 0;
+
+	num_enabled += enable - was_enabled;
+	return 0;
+}
+
+int ratelim_enabled(void)
+{
+	return num_enabled > 0;
+}
+
+int ratelim_conn_open(const struct sockaddr *addr)
+{
+	int i;
+	unsigned char key[16];
+	struct entry *ent[RL_NUM_SCOPES];
+	struct table *tab;
+	uint32_t now = msec_now();
+
+	for(i=0; i<RL_NUM_SCOPES; i++) {
+		tab = tables + i;
+		ent[i] = 0;
+		if(!tab->ent || !tab->max_conns || make_key(addr, tab, key) == -1) {
+			continue;
+		}
+		if((ent[i] = lookup(tab, key, 1, now)) && ent[i]->conns >= tab->max_conns) {
+			return -1;
+		}
+	}
+
+	for(i=0; i<RL_NUM_SCOPES; i++) {
+		if(ent[i]) ent[i]->conns++;
+	}
+	return 0;
+}
+
+void ratelim_conn_close(const struct sockaddr *addr)
+{
+	int i;
+	unsigned char key[16];
+	struct entry *e;
+	struct table *tab;
+
+	for(i=0; i<RL_NUM_SCOPES; i++) {
+		tab = tables + i;
+		if(!tab->ent || !tab->max_conns || make_key(addr, tab, key) == -1) {
+			continue;
+		}
+		/* entries with open connections are never evicted */
+		if((e = lookup(tab, key, 0, 0)) && e->conns > 0) {
+			e->conns--;
+		}
+	}
+}
+
+int ratelim_request(const struct sockaddr *addr)
+{
+	int i, wait;
+	unsigned char key[16];
+	struct entry *ent[RL_NUM_SCOPES];
+	struct table *tab;
+	uint32_t now = msec_now();
+
+	/* only take tokens if every scope has one to spare */
+	for(i=0; i<RL_NUM_SCOPES; i++) {
+		tab = tables + i;
+		ent[i] = 0;
+		if(!tab->ent || tab->rate <= 0 || make_key(addr, tab, key) == -1) {
+			continue;
+		}
+		if(!(ent[i] = lookup(tab, key, 1, now))) {
+			continue;
+		}
+		refill(tab, ent[i], now);
+		if(ent[i]->tokens < 1.0f) {
+			wait = (int)((1.0f - ent[i]->tokens) / tab->rate / 1000.0f) + 1;
+			return wait;
+		}
+	}
+
+	for(i=0; i<RL_NUM_SCOPES; i++) {
+		if(ent[i]) ent[i]->tokens -= 1.0f;
+	}
+	return 0;
+}
+
+static int make_key(const struct sockaddr *addr, struct table *tab, unsigned char *key)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	int keep;
+
+	switch(addr->sa_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in*)addr;
+		memset(key, 0, 10);
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12, &sin->sin_addr, 4);
+		keep = tab->prefix ? 15 : 16;	/* /24 */
+		break;
+
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6*)addr;
+		memcpy(key, &sin6->sin6_addr, 16);
+		keep = tab->prefix ? 8 : 16;	/* /64 */
+		break;
+
+	default:
+		return -1;
+	}
+	memset(key + keep, 0, 16 - keep);
+	return 0;
+}
+
+/* an address can be in any of the MAX_PROBE slots after its hash, and empty
+ * slots don't end the search, so that entries can be dropped without leaving
+ * anything behind. To make room, the least recently refilled entry without
+ * connections is taken, which is either stale, or has the most tokens back
+ * anyway. If every slot has connections open, the client isn't limited.
+ */
+static struct entry *lookup(struct table *tab, const unsigned char *key, int create,
+		uint32_t now)
+{
+	int i;
+	uint32_t h = seed;
+	struct entry *e, *victim = 0;
+
+	for(i=0; i<16; i++) {
+		h = (h ^ key[i]) * 16777619;	/* FNV-1a */
+	}
+	h ^= h >> 15;
+
+	for(i=0; i<MAX_PROBE; i++) {
+		e = tab->ent + ((h + i) & (TABLE_SIZE - 1));
+		if(e->used) {
+			if(memcmp(e->key, key, 16) == 0) {
+				return e;
+			}
+			if(!e->conns && (!victim || (victim->used &&
+							(int32_t)(e->stamp - victim->stamp) < 0))) {
+				victim = e;
+			}
+		} else if(!victim || victim->used) {
+			victim = e;
+		}
+	}
+
+	if(!create) {
+		return 0;
+	}
+	if(!victim) {
+		if(!tab->full_warned) {
+			logmsg("rate limit table full, some clients aren't limited\n");
+			tab->full_warned = 1;
+		}
+		return 0;
+	}
+	memcpy(victim->key, key, 16);
+	victim->stamp = now;
+	victim->tokens = tab->burst;
+	victim->conns = 0;
+	victim->used = 1;
+	return victim;
+}
+
+static void refill(struct table *tab, struct entry *e, uint32_t now)
+{
+	uint32_t dt = now - e->stamp;
+
+	if(dt > 0) {
+		e->tokens += dt * tab->rate;
+		if(e->tokens > tab->burst) {
+			e->tokens = tab->burst;
+		}
+		e->stamp = now;
+	}
+}
+
+static uint32_t msec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
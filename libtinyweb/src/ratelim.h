@@ -0,0 +1,40 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef RATELIM_H_
+#define RATELIM_H_
+
+#include <sys/socket.h>
+
+/* Per client limits: a token bucket for the request rate, and the number of
+ * open connections, kept for each client address and for each network prefix
+ * (/24 for IPv4, /64 for IPv6), in fixed size hash tables. Clients on other
+ * kinds of sockets are never limited.
+ */
+enum {
+	RL_ADDR,
+	RL_PREFIX,
+
+	RL_NUM_SCOPES
+};
+
+/* rate requests per second with bursts of up to burst, and up to max_conns
+ * connections. 0 disables either, and both disable the scope.
+ */
+int ratelim_set(int scope, double rate, int burst, int max_conns);
+int ratelim_enabled(void);
+
+/* count a new connection, or return -1 if it's over the limit */
+int ratelim_conn_open(const struct sockaddr *addr);
+void ratelim_conn_close(const struct sockaddr *addr);
+
+/* take a token for a new request. Returns 0 if it's within the limits, or the
+ * number of seconds until the client can make another request.
+ */
+int ratelim_request(const struct sockaddr *addr);
+
+#endif	/* RATELIM_H_ */
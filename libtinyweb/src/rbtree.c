@@ -143,16 +143,19 @@ int rb_inserti(struct rbtree *rb, int key, void *data)
 
 int rb_delete(struct rbtree *rb, void *key)
 {
+	if(!rb_find(rb, key)) {
+		return -1;
+	}
 	rb->root = delete(rb, rb->root, key);
-	rb->root->red = 0;
+	if(rb->root) {
+		rb->root->red = 0;
+	}
 	return 0;
 }
 
 int rb_deletei(struct rbtree *rb, int key)
 {
-	rb->root = delete(rb, rb->root, INT2PTR(key));
-	rb->root->red = 0;
-	return 0;
+	return rb_delete(rb, INT2PTR(key));
 }
 
 
@@ -339,7 +342,7 @@ static struct rbnode *delete(struct rbtree *rb, struct rbnode *tree, void *key)
 		}
 
 		/* found it at the bottom (XXX what certifies left is null?) */
-		if(cmp == 0 && !tree->right) {
+		if(rb->cmp(key, tree->key) == 0 && !tree->right) {
 			if(rb->del) {
 				rb->del(tree, rb->del_cls);
 			}
@@ -351,8 +354,11 @@ static struct rbnode *delete(struct rbtree *rb, struct rbnode *tree, void *key)
 			tree = move_red_left(tree);
 		}
 
-		if(key == tree->key) {
+		if(rb->cmp(key, tree->key) == 0) {
 			struct rbnode *rmin = find_min(tree->right);
+			if(rb->del) {
+				rb->del(tree, rb->del_cls);
+			}
 			tree->key = rmin->key;
 			tree->data = rmin->data;
 			tree->right = del_min(rb, tree->right);
@@ -432,13 +438,13 @@ static struct rbnode *find_min(struct rbnode *tree)
 	return tree;
 }
 
+/* the key/data of the minimum node have been moved by the caller, so only
+ * the node itself is freed here, without calling the delete function.
+ */
 static struct rbnode *del_min(struct rbtree *rb, struct rbnode *tree)
 {
 	if(!tree->left) {
-		if(rb->del) {
-			rb->del(tree->left, rb->del_cls);
-		}
-		rb->free(tree->left);
+		rb->free(tree);
 		return 0;
 	}
 
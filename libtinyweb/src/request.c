@@ -0,0 +1,363 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <alloca.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "request.h"
+#include "logger.h"
+#include "memgov.h"
+
+static int resp_reserve(struct tw_response *resp, int size);
+static int open_tmpfile(void);
+
+
+int req_init(struct tw_request *req, struct http_req_header *hdr)
+{
+	const char *uri, *ptr;
+	int len;
+
+	memset(req, 0, sizeof *req);
+	req->hdr = hdr;
+	body_init(&req->body);
+
+	/* skip the scheme and host part of absolute URIs */
+	uri = hdr->uri;
+	if((ptr = strstr(uri, "://"))) {
+		uri = ptr + 3;
+		if(!(uri = strchr(uri, '/'))) {
+			uri = "/";
+		}
+	}
+	if(*uri != '/') {
+		return -1;
+	}
+
+	len = strcspn(uri, "?#");
+	req->rawpath = uri;
+	req->rawpath_len = len;
+
+	if(!(req->path = malloc(len + 1))) {
+		return -1;
+	}
+	if(http_decode_uri(req->path, uri, len) == -1) {
+		return -1;
+	}
+
+	if(uri[len] == '?') {
+		ptr = uri + len + 1;
+		len = strcspn(ptr, "#");
+		if(!(req->query = malloc(len + 1))) {
+			return -1;
+		}
+		memcpy(req->query, ptr, len);
+		req->query[len] = 0;
+	}
+	return 0;
+}
+
+void req_destroy(struct tw_request *req)
+{
+	int i;
+
+	for(i=0; i<req->num_params; i++) {
+		free(req->param_val[i]);
+	}
+	free(req->path);
+	free(req->query);
+	body_destroy(&req->body);
+}
+
+int req_set_params(struct tw_request *req, struct route_match *m)
+{
+	int i;
+
+	for(i=0; i<m->num_params; i++) {
+		if(!(req->param_val[i] = malloc(m->param[i].len + 1))) {
+			return -1;
+		}
+		req->param_name[i] = m->param[i].name;
+		req->num_params = i + 1;
+
+		if(http_decode_uri(req->param_val[i], m->param[i].val, m->param[i].len) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void body_init(struct req_body *body)
+{
+	memset(body, 0, sizeof *body);
+	body->fd = -1;
+}
+
+void body_destroy(struct req_body *body)
+{
+	mem_charge(MEM_BODY, -body->memsize);
+	free(body->mem);
+	if(body->fd != -1) {
+		close(body->fd);
+	}
+	body_init(body);
+}
+
+int body_write(struct req_body *body, const void *data, int size)
+{
+	const char *ptr = data;
+	int wrsz;
+
+	if(body->fd == -1 && body->size + size > BODY_MEM_MAX) {
+		/* too big to keep in memory, move what we have to a temporary file */
+		if((body->fd = open_tmpfile()) == -1) {
+			return -1;
+		}
+		if(body->size > 0 && write(body->fd, body->mem, body->size) != body->size) {
+			logmsg("failed to write request body: %s\n", strerror(errno));
+			return -1;
+		}
+		mem_charge(MEM_BODY, -body->memsize);
+		free(body->mem);
+		body->mem = 0;
+		body->memsize = 0;
+	}
+
+	if(body->fd == -1) {
+		if(body->size + size > body->memsize) {
+			char *tmp;
+			int newsz = body->memsize ? body->memsize : 1024;
+
+			while(newsz < body->size + size) newsz *= 2;
+			if(!(tmp = realloc(body->mem, newsz))) {
+				logmsg("failed to allocate request body buffer\n");
+				return -1;
+			}
+			mem_charge(MEM_BODY, newsz - body->memsize);
+			body->mem = tmp;
+			body->memsize = newsz;
+		}
+		memcpy(body->mem + body->size, data, size);
+		body->size += size;
+		return 0;
+	}
+
+	while(size > 0) {
+		if((wrsz = write(body->fd, ptr, size)) == -1) {
+			if(errno == EINTR) continue;
+			logmsg("failed to write request body: %s\n", strerror(errno));
+			return -1;
+		}
+		ptr += wrsz;
+		size -= wrsz;
+		body->size += wrsz;
+	}
+	return 0;
+}
+
+int body_read(struct req_body *body, void *buf, int size)
+{
+	int rdsz;
+
+	if(size > body->size - body->rdpos) {
+		size = body->size - body->rdpos;
+	}
+	if(size <= 0) {
+		return 0;
+	}
+
+	if(body->fd == -1) {
+		memcpy(buf, body->mem + body->rdpos, size);
+		rdsz = size;
+	} else {
+		while((rdsz = pread(body->fd, buf, size, body->rdpos)) == -1 && errno == EINTR);
+		if(rdsz <= 0) {
+			return -1;
+		}
+	}
+	body->rdpos += rdsz;
+	return rdsz;
+}
+
+void body_move(struct req_body *dest, struct req_body *src)
+{
+	*dest = *src;
+	body_init(src);
+}
+
+/* anonymous temporary file, which disappears when it's closed */
+static int open_tmpfile(void)
+{
+	int fd;
+	const char *dir;
+	char *path;
+
+	if(!(dir = getenv("TMPDIR")) || !*dir) {
+		dir = "/tmp";
+	}
+
+#ifdef O_TMPFILE
+	if((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) != -1) {
+		return fd;
+	}
+#endif
+
+	/* no O_TMPFILE support, create and unlink a regular file */
+	path = alloca(strlen(dir) + 32);
+	sprintf(path, "%s/tinyweb-XXXXXX", dir);
+	if((fd = mkstemp(path)) == -1) {
+		logmsg("failed to create temporary file in %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+int resp_init(struct tw_response *resp)
+{
+	memset(resp, 0, sizeof *resp);
+	return http_init_resp(&resp->hdr);
+}
+
+void resp_destroy(struct tw_response *resp)
+{
+	http_destroy_resp(&resp->hdr);
+	mem_charge(MEM_OUTPUT, -resp->body_max);
+	free(resp->body);
+}
+
+static int resp_reserve(struct tw_response *resp, int size)
+{
+	char *tmp;
+	int newsz;
+
+	if(resp->body_size + size <= resp->body_max) {
+		return 0;
+	}
+
+	newsz = resp->body_max ? resp->body_max * 2 : 1024;
+	while(newsz < resp->body_size + size) newsz *= 2;
+
+	if(!(tmp = realloc(resp->body, newsz))) {
+		logmsg("failed to allocate %d byte response buffer\n", newsz);
+		return -1;
+	}
+	mem_charge(MEM_OUTPUT, newsz - resp->body_max);
+	resp->body = tmp;
+	resp->body_max = newsz;
+	return 0;
+}
+
+
+/* ---- public request/response accessors ---- */
+
+const char *tw_req_method(struct tw_request *req)
+{
+	return http_method_name(req->hdr->method);
+}
+
+const char *tw_req_path(struct tw_request *req)
+{
+	return req->path;
+}
+
+const char *tw_req_query(struct tw_request *req)
+{
+	return req->query;
+}
+
+const char *tw_req_param(struct tw_request *req, const char *name)
+{
+	int i;
+
+	for(i=0; i<req->num_params; i++) {
+		if(strcmp(req->param_name[i], name) == 0) {
+			return req->param_val[i];
+		}
+	}
+	return 0;
+}
+
+const char *tw_req_header(struct tw_request *req, const char *name)
+{
+	return http_get_field(req->hdr, name);
+}
+
+long tw_req_body_size(struct tw_request *req)
+{
+	return req->body.size;
+}
+
+int tw_req_read_body(struct tw_request *req, void *buf, int size)
+{
+	return body_read(&req->body, buf, size);
+}
+
+void tw_resp_status(struct tw_response *resp, int status)
+{
+	resp->hdr.status = status;
+}
+
+int tw_resp_header(struct tw_response *resp, const char *fmt, ...)
+{
+	int res;
+	va_list ap;
+
+	va_start(ap, fmt);
+	res = http_add_resp_fieldv(&resp->hdr, fmt, ap);
+	va_end(ap);
+	return res;
+}
+
+int tw_resp_write(struct tw_response *resp, const void *data, int size)
+{
+	if(resp_reserve(resp, size) == -1) {
+		return -1;
+	}
+	memcpy(resp->body + resp->body_size, data, size);
+	resp->body_size += size;
+	return size;
+}
+
+int tw_resp_stream(struct tw_response *resp, tw_stream_func func, tw_cleanup_func cleanup,
+		void *cls)
+{
+	if(!func) {
+		return -1;
+	}
+	resp->stream = func;
+	resp->stream_cleanup = cleanup;
+	resp->stream_cls = cls;
+	return 0;
+}
+
+int tw_resp_printf(struct tw_response *resp, const char *fmt, ...)
+{
+	int sz;
+	va_list ap;
+	char tmp;
+
+	va_start(ap, fmt);
+	sz = vsnprintf(&tmp, 0, fmt, ap);
+	va_end(ap);
+
+	if(sz < 0 || resp_reserve(resp, sz + 1) == -1) {
+		return -1;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(resp->body + resp->body_size, sz + 1, fmt, ap);
+	va_end(ap);
+
+	resp->body_size += sz;
+	return sz;
+}
@@ -0,0 +1,80 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef REQUEST_H_
+#define REQUEST_H_
+
+#include "tinyweb.h"
+#include "http.h"
+#include "router.h"
+
+/* request bodies are kept in memory while they're small, and spill over to an
+ * anonymous temporary file once they grow past BODY_MEM_MAX bytes.
+ */
+#define BODY_MEM_MAX	65536
+
+struct req_body {
+	char *mem;
+	int memsize;
+	int fd;			/* temporary file, or -1 */
+	long size;		/* total bytes stored */
+	long rdpos;		/* read position */
+};
+
+struct tw_request {
+	struct http_req_header *hdr;
+	char *path;		/* decoded path, starting with a slash */
+	char *query;	/* query string without the ?, or null */
+
+	/* raw (still escaped) path, used for route matching */
+	const char *rawpath;
+	int rawpath_len;
+
+	/* decoded route parameters */
+	const char *param_name[MAX_ROUTE_PARAMS];
+	char *param_val[MAX_ROUTE_PARAMS];
+	int num_params;
+
+	struct req_body body;
+
+	int secure;		/* received over TLS */
+};
+
+struct tw_response {
+	struct http_resp_header hdr;
+	char *body;
+	int body_size, body_max;
+
+	/* producer of streamed responses, see tw_resp_stream */
+	tw_stream_func stream;
+	tw_cleanup_func stream_cleanup;
+	void *stream_cls;
+
+	void *conn;		/* client connection, for tw_resp_resume */
+};
+
+/* split the request URI into path and query string, and decode the path.
+ * Returns -1 if the URI is malformed.
+ */
+int req_init(struct tw_request *req, struct http_req_header *hdr);
+void req_destroy(struct tw_request *req);
+
+/* copy and decode the parameters of a route match into the request */
+int req_set_params(struct tw_request *req, struct route_match *m);
+
+void body_init(struct req_body *body);
+void body_destroy(struct req_body *body);
+int body_write(struct req_body *body, const void *data, int size);
+/* returns the number of bytes read, 0 at the end of the body, or -1 on error */
+int body_read(struct req_body *body, void *buf, int size);
+/* move the body to dest, leaving the source empty */
+void body_move(struct req_body *dest, struct req_body *src);
+
+int resp_init(struct tw_response *resp);
+void resp_destroy(struct tw_response *resp);
+
+#endif	/* REQUEST_H_ */
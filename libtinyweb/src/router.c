@@ -0,0 +1,324 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "router.h"
+#include "http.h"
+#include "logger.h"
+
+/* radix trie node. Static nodes match a fragment of text, and their static
+ * children are kept in a sibling list, where no two siblings start with the
+ * same character. Parameter and wildcard nodes hang off their parent
+ * separately, and match a whole path segment, or the rest of the path
+ * respectively.
+ */
+struct rnode {
+	char *label;	/* static text matched by this node */
+	int len;
+	char *name;		/* parameter or wildcard name */
+
+	struct rnode *child, *sibling;
+	struct rnode *param, *wild;
+
+	/* handlers per method, HTTP_UNKNOWN is used for "any method" */
+	struct route *routes[NUM_HTTP_METHODS];
+};
+
+static struct rnode *alloc_node(const char *label, int len);
+static void free_node(struct rnode *node);
+static struct rnode *insert_static(struct rnode *parent, const char *s, int len);
+static struct rnode *insert_var(struct rnode **slot, const char *name, int len);
+static struct rnode *match(struct rnode *node, const char *path, int len, int method,
+		struct route_match *m);
+static int match_here(struct rnode *node, int method);
+
+static struct rnode *root;
+static int method_mismatch;
+
+
+int router_add(int method, const char *pattern, tw_handler_func func, tw_body_func body,
+		void *cls)
+{
+	struct rnode *node;
+	const char *ptr, *end;
+
+	if(method < 0 || method >= NUM_HTTP_METHODS || pattern[0] != '/') {
+		logmsg("invalid route: %s\n", pattern);
+		return -1;
+	}
+
+	if(!root && !(root = alloc_node(0, 0))) {
+		return -1;
+	}
+	node = root;
+
+	ptr = pattern;
+	while(*ptr) {
+		/* parameters and wildcards always start at the beginning of a segment */
+		if((*ptr == ':' || *ptr == '*') && ptr[-1] == '/') {
+			end = ptr + 1;
+			while(*end && *end != '/') end++;
+
+			if(end - ptr < 2) {
+				logmsg("invalid route %s: unnamed parameter\n", pattern);
+				return -1;
+			}
+
+			if(*ptr == ':') {
+				node = insert_var(&node->param, ptr + 1, end - ptr - 1);
+			} else {
+				if(*end) {
+					logmsg("invalid route %s: wildcard must be at the end\n", pattern);
+					return -1;
+				}
+				node = insert_var(&node->wild, ptr + 1, end - ptr - 1);
+			}
+		} else {
+			end = ptr + 1;
+			while(*end && !((*end == ':' || *end == '*') && end[-1] == '/')) end++;
+
+			node = insert_static(node, ptr, end - ptr);
+		}
+
+		if(!node) {
+			return -1;
+		}
+		ptr = end;
+	}
+
+	if(!node->routes[method] && !(node->routes[method] = malloc(sizeof *node->routes[method]))) {
+		logmsg("failed to allocate route: %s\n", pattern);
+		return -1;
+	}
+	node->routes[method]->func = func;
+	node->routes[method]->body = body;
+	node->routes[method]->cls = cls;
+	return 0;
+}
+
+int router_find(int method, const char *path, int pathlen, struct route_match *m)
+{
+	struct rnode *node;
+
+	m->route = 0;
+	m->num_params = 0;
+	method_mismatch = 0;
+
+	if(!root || !(node = match(root, path, pathlen, method, m))) {
+		return method_mismatch ? -2 : -1;
+	}
+
+	if(!(m->route = node->routes[method])) {
+		m->route = node->routes[HTTP_UNKNOWN];
+	}
+	return 0;
+}
+
+void router_clear(void)
+{
+	free_node(root);
+	root = 0;
+}
+
+static struct rnode *alloc_node(const char *label, int len)
+{
+	struct rnode *node;
+
+	if(!(node = calloc(1, sizeof *node))) {
+		logmsg("failed to allocate router node\n");
+		return 0;
+	}
+	if(label) {
+		if(!(node->label = malloc(len + 1))) {
+			logmsg("failed to allocate router node\n");
+			free(node);
+			return 0;
+		}
+		memcpy(node->label, label, len);
+		node->label[len] = 0;
+		node->len = len;
+	}
+	return node;
+}
+
+static void free_node(struct rnode *node)
+{
+	int i;
+
+	while(node) {
+		struct rnode *next = node->sibling;
+
+		free_node(node->child);
+		free_node(node->param);
+		free_node(node->wild);
+
+		for(i=0; i<NUM_HTTP_METHODS; i++) {
+			free(node->routes[i]);
+		}
+		free(node->label);
+		free(node->name);
+		free(node);
+		node = next;
+	}
+}
+
+/* walk down the static children of parent matching s, splitting edges and
+ * adding nodes as necessary, and return the node where s ends.
+ */
+static struct rnode *insert_static(struct rnode *parent, const char *s, int len)
+{
+	struct rnode *c, *mid, *prev;
+	char *suffix;
+	int common;
+
+	while(len > 0) {
+		prev = 0;
+		c = parent->child;
+		while(c && c->label[0] != s[0]) {
+			prev = c;
+			c = c->sibling;
+		}
+
+		if(!c) {
+			if(!(c = alloc_node(s, len))) {
+				return 0;
+			}
+			c->sibling = parent->child;
+			parent->child = c;
+			return c;
+		}
+
+		common = 1;
+		while(common < len && common < c->len && c->label[common] == s[common]) {
+			common++;
+		}
+
+		if(common < c->len) {
+			/* split the edge: mid takes the common prefix, c keeps the rest */
+			if(!(mid = alloc_node(c->label, common))) {
+				return 0;
+			}
+			if(!(suffix = malloc(c->len - common + 1))) {
+				free_node(mid);
+				return 0;
+			}
+			strcpy(suffix, c->label + common);
+			free(c->label);
+			c->label = suffix;
+			c->len -= common;
+
+			mid->sibling = c->sibling;
+			mid->child = c;
+			c->sibling = 0;
+			if(prev) {
+				prev->sibling = mid;
+			} else {
+				parent->child = mid;
+			}
+			c = mid;
+		}
+
+		parent = c;
+		s += common;
+		len -= common;
+	}
+	return parent;
+}
+
+static struct rnode *insert_var(struct rnode **slot, const char *name, int len)
+{
+	struct rnode *node = *slot;
+
+	if(node) {
+		if((int)strlen(node->name) != len || memcmp(node->name, name, len) != 0) {
+			logmsg("conflicting route parameter names: %s and %.*s\n", node->name, len, name);
+			return 0;
+		}
+		return node;
+	}
+
+	if(!(node = alloc_node(0, 0)) || !(node->name = malloc(len + 1))) {
+		free(node);
+		return 0;
+	}
+	memcpy(node->name, name, len);
+	node->name[len] = 0;
+	*slot = node;
+	return node;
+}
+
+/* match the remaining path against the children of node, backtracking from
+ * static to parameter to wildcard matches if the more specific ones fail.
+ */
+static struct rnode *match(struct rnode *node, const char *path, int len, int method,
+		struct route_match *m)
+{
+	struct rnode *c, *res;
+	int seglen, nparams = m->num_params;
+
+	if(len == 0 && match_here(node, method)) {
+		return node;
+	}
+
+	if(len > 0) {
+		/* at most one static child can start with the same character */
+		for(c=node->child; c; c=c->sibling) {
+			if(c->label[0] == path[0]) {
+				if(c->len <= len && memcmp(c->label, path, c->len) == 0 &&
+						(res = match(c, path + c->len, len - c->len, method, m))) {
+					return res;
+				}
+				break;
+			}
+		}
+
+		if(node->param && path[0] != '/' && nparams < MAX_ROUTE_PARAMS) {
+			seglen = 0;
+			while(seglen < len && path[seglen] != '/') seglen++;
+
+			m->param[nparams].name = node->param->name;
+			m->param[nparams].val = path;
+			m->param[nparams].len = seglen;
+			m->num_params = nparams + 1;
+
+			if((res = match(node->param, path + seglen, len - seglen, method, m))) {
+				return res;
+			}
+			m->num_params = nparams;
+		}
+	}
+
+	if(node->wild && nparams < MAX_ROUTE_PARAMS && match_here(node->wild, method)) {
+		m->param[nparams].name = node->wild->name;
+		m->param[nparams].val = path;
+		m->param[nparams].len = len;
+		m->num_params = nparams + 1;
+		return node->wild;
+	}
+	return 0;
+}
+
+/* checks if a node where the path ends has a route for this method, and
+ * remembers if there were routes for other methods, to report it.
+ */
+static int match_here(struct rnode *node, int method)
+{
+	int i;
+
+	if(node->routes[method] || node->routes[HTTP_UNKNOWN]) {
+		return 1;
+	}
+	for(i=0; i<NUM_HTTP_METHODS; i++) {
+		if(node->routes[i]) {
+			method_mismatch = 1;
+			break;
+		}
+	}
+	return 0;
+}
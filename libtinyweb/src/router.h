@@ -0,0 +1,56 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include "tinyweb.h"
+
+#define MAX_ROUTE_PARAMS	16
+
+struct route {
+	tw_handler_func func;
+	tw_body_func body;	/* null to store the request body */
+	void *cls;
+};
+
+/* parameters captured while matching a path. Values point into the matched
+ * path, and are not null-terminated.
+ */
+struct route_param {
+	const char *name;
+	const char *val;
+	int len;
+};
+
+struct route_match {
+	struct route *route;
+	struct route_param param[MAX_ROUTE_PARAMS];
+	int num_params;
+};
+
+/* Route patterns are absolute paths made of static text, :name parameters
+ * which match a single path segment, and an optional *name wildcard at the
+ * end, which matches the rest of the path. For example "/api/users/:id/posts",
+ * or "/static" followed by a "*file" segment.
+ *
+ * method is one of the enum http_method values, or HTTP_UNKNOWN to match any
+ * method. Adding the same pattern and method twice replaces the handler.
+ */
+int router_add(int method, const char *pattern, tw_handler_func func, tw_body_func body,
+		void *cls);
+
+/* match a request path against the routes. Static segments take precedence
+ * over parameters, which take precedence over wildcards. Returns 0 and fills
+ * in the match structure on success, or -1 if no route matched.
+ * If the path matched a pattern, but not for this method, -2 is returned.
+ */
+int router_find(int method, const char *path, int pathlen, struct route_match *match);
+
+void router_clear(void);
+
+#endif	/* ROUTER_H_ */
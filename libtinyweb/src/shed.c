@@ -0,0 +1,145 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "shed.h"
+#include "logger.h"
+
+#define DEF_INTERVAL	100000
+
+static long long usec_now(void);
+
+static long target, interval;
+
+/* smallest sojourn time in the current interval (-1 before the first request
+ * in it), and the one before.
+ */
+static long cur_min = -1, last_min;
+static long long interval_end;
+static int overloaded;
+static long num_shed;
+
+
+int shed_set(long targ, long intv)
+{
+	if(targ < 0 || intv < 0) {
+		logmsg("invalid load shedding target\n");
+		return -1;
+	}
+	target = targ;
+	interval = intv > 0 ? intv : DEF_INTERVAL;
+	cur_min = -1;
+	interval_end = 0;
+	overloaded = 0;
+	return 0;
+}
+
+int shed_enabled(void)
+{
+	return target > 0;
+}
+
+int shed_watch(int s)
+{
+	int one = 1;
+
+	if(setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one) == -1) {
+		logmsg("failed to enable receive timestamps: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+long long shed_arrival(int s)
+{
+	char byte;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+	} ctl;
+	struct timespec ts;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+
+	if(recvmsg(s, &msg, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+		return 0;
+	}
+	for(cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+			return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+	}
+	return 0;
+}
+
+int shed_request(long long arrival)
+{
+	long long now;
+	long sojourn;
+
+	if(!target || !arrival) return 0;
+
+	now = usec_now();
+	sojourn = now > arrival ? now - arrival : 0;
+
+	if(now >= interval_end) {
+		/* an interval without any requests wasn't overloaded either */
+		last_min = cur_min > 0 && now < interval_end + interval ? cur_min : 0;
+		if(last_min > target) {
+			if(!overloaded) {
+				logmsg("overloaded, requests waited at least %ld us in the last %ld ms, shedding load\n",
+						last_min, interval / 1000);
+			}
+			overloaded = 1;
+		} else {
+			if(overloaded) {
+				logmsg("no longer overloaded, %ld requests shed\n", num_shed);
+			}
+			overloaded = 0;
+		}
+		cur_min = -1;
+		interval_end = now + interval;
+	}
+	if(cur_min == -1 || sojourn < cur_min) {
+		cur_min = sojourn;
+	}
+
+	if(overloaded && sojourn > target) {
+		num_shed++;
+		return 1;
+	}
+	return 0;
+}
+
+void shed_stats(long *min_sojourn, int *over, long *shed)
+{
+	*min_sojourn = last_min;
+	*over = overloaded;
+	*shed = num_shed;
+}
+
+static long long usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
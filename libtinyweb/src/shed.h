@@ -0,0 +1,41 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef SHED_H_
+#define SHED_H_
+
+/* Load shedding on queueing delay, in the style of CoDel: the sojourn time of
+ * each request is how long its data waited in the socket after the kernel
+ * received it, until we got around to reading it, which is what grows when
+ * the server can't keep up. Once the smallest sojourn time over a whole
+ * interval is above the target (so that it isn't just a burst which cleared
+ * within the interval), requests which waited longer than the target are shed,
+ * until an interval passes with a sojourn time below it.
+ */
+
+/* target 0 disables shedding. Times in microseconds. */
+int shed_set(long target, long interval);
+int shed_enabled(void);
+
+/* ask for the arrival time of the data received on socket s */
+int shed_watch(int s);
+/* when the oldest data waiting to be read from s arrived, in microseconds
+ * since the epoch, or 0 if it's not known. Doesn't consume the data.
+ */
+long long shed_arrival(int s);
+
+/* count a request whose data arrived at time arrival, and return 1 if it
+ * should be shed.
+ */
+int shed_request(long long arrival);
+
+/* the smallest sojourn time over the last interval, whether we're shedding,
+ * and the number of requests shed so far.
+ */
+void shed_stats(long *min_sojourn, int *overloaded, long *num_shed);
+
+#endif	/* SHED_H_ */
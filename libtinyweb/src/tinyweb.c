@@ -8,19 +8,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <alloca.h>
 #include <sys/stat.h>
 #include <sys/select.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "tinyweb.h"
 #include "http.h"
+#include "request.h"
+#include "router.h"
 #include "mime.h"
+#include "dirlist.h"
+#include "fcgi.h"
+#include "proxy.h"
+#include "outq.h"
+#include "tls.h"
+#include "h2.h"
+#include "pack.h"
+#include "warmup.h"
+#include "cpu.h"
+#include "ratelim.h"
+#include "trace.h"
+#include "capture.h"
+#include "iopool.h"
+#include "vhost.h"
+#include "memgov.h"
+#include "shed.h"
 #include "logger.h"
 
 /* HTTP version */
@@ -28,27 +51,397 @@
 #define HTTP_VER_MINOR	1
 #define HTTP_VER_STR	"1.1"
 
-/* maximum request length: 64mb */
-#define MAX_REQ_LENGTH	(65536 * 1024)
+/* maximum request header length: 64k */
+#define MAX_HDR_LENGTH	65536
+
+/* default maximum request body size: 64mb */
+#define DEF_MAX_BODY	(65536 * 1024)
+
+/* default length of the accept queue of each listening socket */
+#define DEF_BACKLOG		16
+
+/* stop producing output for a client when this much is queued, until it
+ * drains below the low watermark.
+ */
+#define OUTQ_HIWAT		262144
+#define OUTQ_LOWAT		65536
+
+/* maximum calls to a stream producer, each time a client is ready for more */
+#define MAX_PRODUCE		16
+/* at most this many bytes are sent to each connection per turn, so that a
+ * few large downloads can't starve everyone else sharing the event loop.
+ */
+#define OUT_QUANTUM		(256 * 1024)
+/* connections out of bandwidth are woken up after this many milliseconds, and
+ * may save up at most twice that much of their allowance.
+ */
+#define BW_TICK_MSEC	50
+
+/* stop moving DATA frames from the streams of an HTTP/2 connection to its
+ * output queue when this much is queued, so that they stay interleaved.
+ */
+#define H2_QUEUE_MAX	65536
+
+/* files larger than this aren't prefetched by the warmup by default */
+#define DEF_WARMUP_MAX	(1 << 20)
+
+/* with the I/O thread pool, this much of each file is read before sending it,
+ * and the kernel is asked to start reading up to IO_PREFETCH_MAX.
+ */
+#define IO_FIRST_READ	(256 * 1024)
+#define IO_PREFETCH_MAX	(16 << 20)
+
+/* listening sockets passed over by tw_handover_send at once, and the maximum
+ * size of their names.
+ */
+#define MAX_HANDOVER	64
+#define LISNAME_MAX		128
+
+/* why a connection isn't read from, see want_read */
+#define MEM_PAUSED_CONN		1
+#define MEM_PAUSED_GLOBAL	2
+
+/* mark the time a traced request reaches a phase, the first time it does */
+#define TRACE(c, ph) \
+	do { \
+		if((c)->trace && !(c)->trace->t[ph]) (c)->trace->t[ph] = trace_now(); \
+	} while(0)
+
+struct listener {
+	int s;
+	int family;
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+		struct sockaddr_un un;
+	} addr;
+	socklen_t addrlen;
+	int mode;		/* permissions for UNIX domain sockets */
+	int implicit;	/* default listener added by tw_start */
+	struct tls_ctx *tls;	/* TLS context for HTTPS listeners */
+	int sockopt[TW_NUM_SOCK_OPTS];	/* TW_SOCK_*, -1 for the defaults */
+	/* with multiple workers, TCP listeners have a socket for each of them,
+	 * in the same SO_REUSEPORT group, and s is the one of this process. The
+	 * sockets this process doesn't keep are -1.
+	 */
+	int *group;
+	int group_size;
+	struct listener *next;
+};
+
+/* client states */
+enum {
+	ST_HEADER,		/* receiving the request header */
+	ST_BODY,		/* receiving the request body */
+	ST_DONE			/* request received and handled */
+};
+
+/* what to do with request bodies */
+enum {
+	BODY_DISCARD,
+	BODY_STORE,		/* keep it in the tw_request for the handler or CGI */
+	BODY_FUNC		/* pass it to the route body callback */
+};
+
+/* finding and opening a file to serve, which can block on a slow disk, and is
+ * done on the I/O threads when there are any.
+ */
+struct file_job {
+	struct client *c;		/* null if the client went away in the meantime */
+	struct vhost *vhost;	/* the site it's looked up in */
+	char *uri;				/* path relative to the root */
+	int prefetch;			/* read the start of the file, and prefetch the rest */
+
+	int status;				/* 0 if found, or the error to respond with */
+	char *path;				/* the file: uri, or the index file in it */
+	int nodir_index;		/* it's a directory without an index file */
+	struct stat st, dirst;
+	int fd;					/* -1 if it couldn't be opened */
+};
 
 struct client {
 	int s;
+	struct tls_conn *tls;	/* TLS connection, set before the handshake is done */
 	char *rcvbuf;
 	int bufsz;
-	struct client *next;
+
+	int state;
+	struct http_req_header hdr;
+	struct tw_request req;
+	int have_req;		/* hdr and req need to be destroyed */
+	struct route *route;
+
+	int body_mode;
+	long body_left;		/* remaining body size, or -1 if it's chunked (or sent
+						 * over HTTP/2, where it ends with the stream)
+						 */
+	long body_rcvd;
+	struct http_dechunk dechunk;
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int rl_counted;			/* counted by the connection limits */
+	long long arrival;		/* when the data last read was received, for shedding */
+	unsigned int conn_id;		/* connection number, for tracing and capture */
+	struct trace_req *trace;	/* phase times, if this request is traced */
+
+	/* response data waiting to be sent */
+	struct outq outq;
+	int close_when_done;	/* close the connection once the queue is empty */
+	int rd_eof;				/* the client shut down its side */
+	int chunked;			/* the response body is sent in chunks */
+
+	/* streamed response from a handler */
+	struct tw_response *resp;
+	int paused;
+
+	/* file being looked up on the I/O threads, the request is kept until then */
+	struct file_job *fjob;
+
+	/* FastCGI or proxied request in progress, and whether to send the body.
+	 * Both produce their response through cgi_output.
+	 */
+	struct fcgi_req *fcgi;
+	struct proxy_group *pgroup;
+	struct proxy_req *proxy;
+	int with_body;
+	int throttled;
+	char *cgibuf;			/* CGI response header, until it's complete */
+	int cgilen, cgi_hdr_done;
+
+	/* HTTP/2 connection, with a client for each of its streams */
+	struct h2_conn *h2;
+	struct client *streams;
+	int flushing;
+	int draining;			/* sent GOAWAY, close when all streams are done */
+	/* for streams: the connection they belong to, and the stream */
+	struct client *parent;
+	struct h2_stream *h2s;
+	int eos;				/* the request header ended the stream */
+
+	/* idle timer, in the timer list while armed */
+	long long deadline;
+	int timer_armed;
+	struct client *tprev, *tnext;
+
+	/* bandwidth allowance in bytes, last refilled at bw_time. While waiting
+	 * for it to refill, the connection is in the bandwidth wait list.
+	 */
+	long bw_tokens;
+	long long bw_time, bw_deadline;
+	int bw_waiting;
+	struct client *bwprev, *bwnext;
+
+	/* not read from while it's over its memory budget (MEM_PAUSED_CONN), or
+	 * while the global one is exceeded (MEM_PAUSED_GLOBAL).
+	 */
+	int mem_paused;
+
+	/* interest changes to report, in the dirty list */
+	int dirty;
+	struct client *next_dirty;
+
+	struct client *prev, *next;
+};
+
+/* what is known about each file descriptor, by number */
+struct fd_entry {
+	struct client *client;	/* connection using it, if any */
+	int events;				/* TW_READ/TW_WRITE last reported to the interest func */
+};
+
+/* event stream channel, and its subscribers */
+struct subscriber {
+	struct tw_channel *ch;	/* null once the channel is destroyed */
+	struct client *conn;
+	struct subscriber *prev, *next;
+};
+
+struct tw_channel {
+	int slow_policy;
+	long max_queue;
+	struct subscriber *subs;
+	int num_subs;
 };
 
-static int accept_conn(int lis);
+static struct listener *new_listener(int family);
+static int add_listener(struct listener *l);
+static int start_listener(struct listener *l);
+static int open_socket(struct listener *l, const char *name, int reuseport);
+static int sock_opt(struct listener *l, int opt);
+static void tune_socket(struct listener *l, int s, const char *name);
+static void stop_listeners(void);
+static void do_warmup(void);
+static void warm_dir(const char *path, struct stat *st, void *cls);
+static void listener_name(struct listener *l, char *buf, int bufsz);
+static int accept_conn(struct listener *lis);
 static void close_conn(struct client *c);
+static void free_client(struct client *c);
 static int handle_client(struct client *c);
-static int do_get(struct client *c, const char *uri, int with_body);
+static int conn_recv(struct client *c, void *buf, int size);
+static int recv_header(struct client *c, char *data, int size);
+static int begin_request(struct client *c);
+static int start_request(struct client *c);
+static int recv_body(struct client *c, char *data, int size);
+static int consume_body(struct client *c, char *data, int len, int done);
+static int finish_request(struct client *c);
+static void end_request(struct client *c);
+static int dispatch(struct client *c, struct tw_request *req);
+static int do_handler(struct client *c, struct tw_request *req, struct route *route, int with_body);
+static int do_get(struct client *c, struct tw_request *req, struct vhost *vh, int with_body);
+static struct vhost *find_vhost(struct tw_request *req);
+static int has_dotdot(const char *path);
+static int cgi_target(struct client *c);
+static struct file_job *new_file_job(struct vhost *vh, const char *uri);
+static void free_file_job(struct file_job *fj);
+static void resolve_file(void *data);
+static void file_resolved(void *data);
+static int serve_file(struct client *c, struct tw_request *req, struct file_job *fj, int with_body);
+static int do_pack(struct client *c, struct tw_request *req, int with_body);
+static int do_dirlist(struct client *c, struct tw_request *req, struct vhost *vh,
+		const char *path, struct stat *st, int with_body);
+static int do_cgi(struct client *c, struct tw_request *req, struct vhost *vh, const char *path,
+		int with_body);
+static void cgi_output(int status, const char *data, int size, void *cls);
+static void cgi_fail(struct client *c, int errcode);
+static void abort_backend(struct client *c);
+static void throttle_backend(struct client *c, int stop);
+static int do_proxy(struct client *c, struct tw_request *req, int with_body);
+static const char *client_addr(struct client *c, char *buf);
+static const char *server_addr(struct client *c, char *buf, int *port);
+static int cgi_header(struct client *c);
+static int start_stream(struct client *c, struct tw_response *resp, int with_body);
+static int produce(struct client *c);
+static void end_stream(struct client *c);
+static int queue_resp_body(struct client *c);
+static int queue_data(struct client *c, const void *data, int size);
+static int queue_header(struct client *c, struct http_resp_header *resp);
+static int flush_client(struct client *c);
+static void end_response(struct client *c);
+static int sub_stream(struct tw_response *resp, void *cls);
+static void sub_cleanup(void *cls);
+static long format_event(char *buf, const char *event, const char *data, int size);
 static void respond_error(struct client *c, int errcode);
+static void respond_limited(struct client *c, int status, int wait);
+static int want_write(struct client *c);
+
+static int start_h2(struct client *c, char *data, int size);
+static int want_upgrade(struct client *c);
+static int upgrade_h2(struct client *c);
+static int recv_h2(struct client *c, char *buf, int bufsz);
+static int input_h2(struct client *c, const char *data, int size);
+static int h2_request(struct h2_stream *h2s, const char *hdr, int size, int eos, void *cls);
+static void h2_data(struct h2_stream *h2s, char *data, int size, int eos);
+static void h2_reset(struct h2_stream *h2s);
+static struct client *new_stream(struct client *conn, struct h2_stream *h2s);
+static int flush_h2(struct client *c);
+static int schedule_h2(struct client *c);
+static int live_streams(struct client *c);
+static int stream_frame(struct client *c, struct client *st);
+static int has_token(const char *list, const char *tok);
+static void drain_conn(struct client *c);
+static int take_inherited(const char *name);
+static void close_inherited(void);
+static void trace_start(struct client *c, unsigned int conn, unsigned int stream);
+static void trace_end(struct client *c);
+static void fcgi_watch(int s, int events, void *cls);
+static void proxy_watch(int s, int events, void *cls);
+static struct fd_entry *get_fd_entry(int fd);
+static void set_interest(int fd, int events);
+static void mark_dirty(struct client *c);
+static void update_interest(void);
+static int client_events(struct client *c);
+static void unlink_client(struct client *c);
+static void reap_streams(struct client *c);
+static long long now_msec(void);
+static void arm_timer(struct client *c);
+static void disarm_timer(struct client *c);
+static long bw_allowance(struct client *c);
+static void bw_wait(struct client *c);
+static void bw_unwait(struct client *c);
+static int waiting_for_client(struct client *c);
+static long output_memory(struct client *c);
+static int want_read(struct client *c);
+static void set_mem_paused(struct client *c, int paused);
+static int reclaim_memory(void);
+static void resume_reading(void);
+static void free_rcvbuf(struct client *c);
 
-static int lis = -1;
+static const struct h2_callbacks h2_cb = {h2_request, h2_data, h2_reset};
+
+static struct listener *lislist;
+static int num_listeners;
+/* socket options of the listeners which don't set their own */
+static int def_sockopt[TW_NUM_SOCK_OPTS] = {DEF_BACKLOG};
+static int running;
 static int maxfd;
 static int port = 8080;
 static struct client *clist;
 static int num_clients;
+static int dirlist_enabled;
+static int cgi_enabled;
+static long max_body = DEF_MAX_BODY;
+static int http2_enabled = 1;
+static struct pack *pack;
+static int warmup_threads;
+static long warmup_max = DEF_WARMUP_MAX;
+static int draining;
+static int handed_over;
+
+/* worker processes: how many share the listeners, the CPUs they're pinned to,
+ * and which one this is (-1 in the process which started them).
+ */
+static int num_workers;
+static int *worker_cpu;
+static int steering;
+static int worker_idx = -1;
+
+/* 1 in trace_sample requests is traced, 0 if tracing is disabled */
+static int trace_sample;
+static unsigned int trace_count, conn_count;
+
+/* with an interest function, socket changes are reported to it at the end of
+ * each call into the library, for the clients in the dirty list.
+ */
+static tw_interest_func interest_func;
+static void *interest_cls;
+static struct client *dirty_list;
+static int iopool_watched = -1;
+
+static struct fd_entry *fdtab;
+static int fdtab_size;
+
+/* idle timers all have the same timeout, so the list is kept in the order
+ * they expire just by adding them at the end.
+ */
+static int idle_timeout;
+static struct client *timer_head, *timer_tail;
+
+/* per-connection bandwidth cap in bytes per second (0 for none), and the
+ * connections waiting for their allowance, in the order they wake up.
+ */
+static long conn_bandwidth;
+static struct client *bw_head, *bw_tail;
+
+/* memory budget for everything accounted in memgov, and for each connection
+ * (0 for none). Requests are turned away with 503 while the global budget is
+ * exceeded, after the caches have been trimmed, and connections over their own
+ * budget aren't read from until their output drains.
+ */
+static long mem_limit, conn_mem_limit;
+static int mem_exceeded;
+static int num_mem_paused, num_global_paused;
+static long mem_rejected, mem_evicted;
+
+/* non-zero while handling a socket or timers, when dead clients can't be
+ * freed yet.
+ */
+static int busy;
+
+/* listening sockets received from the previous process by tw_handover_recv */
+static int inherited_fd[MAX_HANDOVER];
+static char *inherited_name[MAX_HANDOVER];
+static int num_inherited;
 
 static const char *indexfiles[] = {
 	"index.cgi",
@@ -67,332 +460,3702 @@ int tw_set_root(const char *path)
 	return chdir(path);
 }
 
-int tw_set_logfile(const char *fname)
+int tw_add_vhost(const char *name, const char *root)
 {
-	return set_log_file(fname);
+	return vhost_add(name, root);
 }
 
-int tw_start(void)
+int tw_add_vhost_dir(const char *dir)
 {
-	int s;
-	struct sockaddr_in sa;
+	return vhost_add_dir(dir);
+}
 
-	logmsg("starting server ...\n");
+int tw_add_proxy(const char *prefix, const char *upstream)
+{
+	return proxy_add(prefix, upstream);
+}
 
-	if(lis != -1) {
-		logmsg("can't start tinyweb server: already running!\n");
+int tw_set_pack(const char *fname)
+{
+	struct pack *pk = 0;
+
+	if(running) {
+		logmsg("can't change the pack while the server is running\n");
 		return -1;
 	}
-
-	if((s = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-		logmsg("failed to create listening socket: %s\n", strerror(errno));
+	if(fname && !(pk = pack_open(fname))) {
 		return -1;
 	}
-	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	pack_close(pack);
+	pack = pk;
+	return 0;
+}
 
-	memset(&sa, 0, sizeof sa);
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = INADDR_ANY;
-	sa.sin_port = htons(port);
+int tw_set_logfile(const char *fname)
+{
+	return set_log_file(fname);
+}
 
-	if(bind(s, (struct sockaddr*)&sa, sizeof sa) == -1) {
-		logmsg("failed to bind socket to port %d: %s\n", port, strerror(errno));
-		return -1;
+void tw_set_dirlist(int enable)
+{
+	dirlist_enabled = enable;
+	if(!enable) {
+		dirlist_clear_cache();
 	}
-	listen(s, 16);
-
-	lis = s;
-	return s;
 }
 
-int tw_stop(void)
+void tw_set_cgi_workers(int n)
 {
-	if(lis == -1) {
-		return -1;
+	cgi_enabled = n > 0;
+	if(n > 0) {
+		fcgi_set_workers(n);
 	}
+}
 
-	logmsg("stopping server...\n");
+void tw_set_max_body(long size)
+{
+	max_body = size;
+}
+
+void tw_set_http2(int enable)
+{
+	http2_enabled = enable;
+}
 
-	close(lis);
-	lis = -1;
+void tw_set_warmup(int nthreads, long max_file_size)
+{
+	warmup_threads = nthreads;
+	warmup_max = max_file_size > 0 ? max_file_size : DEF_WARMUP_MAX;
+}
 
-	while(clist) {
-		struct client *c = clist;
-		clist = clist->next;
-		close_conn(c);
-		free(c);
-	}
-	clist = 0;
+int tw_set_workers(int n, const int *cpus)
+{
+	int *arr = 0;
 
+	if(running) {
+		logmsg("workers must be set up before starting the server\n");
+		return -1;
+	}
+	if(n > 0 && cpus) {
+		if(!(arr = malloc(n * sizeof *arr))) {
+			logmsg("failed to allocate worker CPU list\n");
+			return -1;
+		}
+		memcpy(arr, cpus, n * sizeof *arr);
+	}
+	free(worker_cpu);
+	worker_cpu = arr;
+	num_workers = n > 0 ? n : 0;
 	return 0;
 }
 
-int tw_get_sockets(int *socks)
+void tw_set_steering(int enable)
 {
-	struct client *c, dummy;
+	steering = enable;
+}
 
-	/* first cleanup the clients marked for removal */
-	dummy.next = clist;
-	c = &dummy;
+int tw_set_worker(int idx)
+{
+	struct listener *l;
+	int i, node;
 
-	while(c->next) {
-		struct client *n = c->next;
+	if(!running || idx < 0 || idx >= (num_workers ? num_workers : 1)) {
+		logmsg("tw_set_worker: invalid worker, or the server isn't running\n");
+		return -1;
+	}
+	worker_idx = idx;
 
-		if(n->s == -1) {
-			/* marked for removal */
-			c->next = n->next;
-			free(n);
-			--num_clients;
+	/* a socket stays in its group as long as any process has it open, so the
+	 * ones of the other workers must not be kept here, in case they're gone.
+	 */
+	for(l=lislist; l; l=l->next) {
+		if(l->group) {
+			set_interest(l->s, 0);
+			for(i=0; i<l->group_size; i++) {
+				if(i != idx && l->group[i] != -1) {
+					close(l->group[i]);
+					l->group[i] = -1;
+				}
+			}
+			l->s = l->group[idx];
+			set_interest(l->s, TW_READ);
+		}
+	}
+
+	/* pin before handling any connection, so that everything we allocate for
+	 * them is on our NUMA node.
+	 */
+	if(worker_cpu) {
+		if(cpu_bind(worker_cpu[idx]) == -1) {
+			return -1;
+		}
+		if((node = cpu_node(worker_cpu[idx])) >= 0) {
+			logmsg("worker %d: running on CPU %d, NUMA node %d\n", idx, worker_cpu[idx], node);
 		} else {
-			c = c->next;
+			logmsg("worker %d: running on CPU %d\n", idx, worker_cpu[idx]);
 		}
 	}
-	clist = dummy.next;
+	return 0;
+}
 
+void tw_drop_worker(int idx)
+{
+	struct listener *l;
+	int i;
 
-	if(!socks) {
-		/* just return the count */
-		return num_clients + 1;	/* +1 for the listening socket */
+	if(idx < 0 || idx >= num_workers) {
+		return;
 	}
+	for(l=lislist; l; l=l->next) {
+		if(!l->group || l->group[idx] == -1) continue;
 
-	/* go through the client list and populate the array */
-	maxfd = lis;
-	*socks++ = lis;
+		if(l->s == l->group[idx]) {
+			set_interest(l->s, 0);
+			l->s = -1;
+		}
+		close(l->group[idx]);
+		l->group[idx] = -1;
 
-	c = clist;
-	while(c) {
-		*socks++ = c->s;
-		if(c->s > maxfd) {
-			maxfd = c->s;
+		/* s stays one of the group, for the handover */
+		for(i=0; i<l->group_size && l->s == -1; i++) {
+			l->s = l->group[i];
 		}
-		c = c->next;
 	}
-	return num_clients + 1;	/* +1 for the listening socket */
 }
 
-int tw_get_maxfd(void)
+int tw_get_cpus(int *cpus, int max)
 {
-	return maxfd;
+	return cpu_get_allowed(cpus, max);
 }
 
-int tw_handle_socket(int s)
+int tw_set_rate_limit(int scope, double rate, int burst, int max_conns)
 {
-	struct client *c;
+	return ratelim_set(scope == TW_LIMIT_PREFIX ? RL_PREFIX : RL_ADDR, rate, burst, max_conns);
+}
 
-	if(s == lis) {
-		return accept_conn(s);
-	}
+int tw_set_load_shedding(long target_msec, long interval_msec)
+{
+	return shed_set(target_msec * 1000, interval_msec * 1000);
+}
 
-	/* find which client corresponds to this socket */
-	c = clist;
-	while(c) {
-		if(c->s == s) {
-			return handle_client(c);
-		}
-		c = c->next;
+void tw_get_load_stats(struct tw_load_stats *st)
+{
+	shed_stats(&st->min_sojourn_usec, &st->overloaded, &st->shed);
+}
+
+int tw_set_trace(int ring_size, int sample, long slow_msec)
+{
+	if(trace_init(ring_size, slow_msec) == -1) {
+		return -1;
 	}
+	trace_sample = ring_size > 0 ? (sample > 0 ? sample : 1) : 0;
+	return 0;
+}
 
-	logmsg("socket %d doesn't correspond to any client\n");
-	return -1;
+int tw_trace_dump(const char *fname)
+{
+	return trace_dump(fname);
 }
 
-static int accept_conn(int lis)
+void tw_set_io_threads(int n)
 {
-	int s;
-	struct client *c;
-	struct sockaddr_in addr;
-	socklen_t addr_sz = sizeof addr;
+	iopool_set_threads(n);
+}
 
-	if((s = accept(lis, (struct sockaddr*)&addr, &addr_sz)) == -1) {
-		logmsg("failed to accept incoming connection: %s\n", strerror(errno));
-		return -1;
+int tw_set_capture(const char *fname)
+{
+	if(!fname) {
+		capture_close();
+		return 0;
 	}
-	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	return capture_open(fname);
+}
 
-	if(!(c = malloc(sizeof *c))) {
-		logmsg("failed to allocate memory while accepting connection: %s\n", strerror(errno));
+int tw_set_interest_func(tw_interest_func func, void *cls)
+{
+	if(running) {
+		logmsg("the interest function must be set before starting the server\n");
 		return -1;
 	}
-	c->s = s;
-	c->rcvbuf = 0;
-	c->bufsz = 0;
-	c->next = clist;
-	clist = c;
-	++num_clients;
+	interest_func = func;
+	interest_cls = cls;
+	fcgi_set_sock_func(func ? fcgi_watch : 0, 0);
+	proxy_set_sock_func(func ? proxy_watch : 0, 0);
 	return 0;
 }
 
-static void close_conn(struct client *c)
+void tw_set_idle_timeout(int sec)
 {
-	close(c->s);
-	c->s = -1;	/* mark it for removal */
-	free(c->rcvbuf);
-	c->rcvbuf = 0;
+	struct client *c;
+
+	idle_timeout = sec > 0 ? sec : 0;
+	if(!idle_timeout) {
+		while((c = timer_head)) {
+			disarm_timer(c);
+		}
+	}
 }
 
-static int handle_client(struct client *c)
+void tw_set_conn_bandwidth(long bytes_per_sec)
 {
-	struct http_req_header hdr;
-	static char buf[2048];
-	int rdsz, status;
+	struct client *c;
 
-	while((rdsz = recv(c->s, buf, sizeof buf, 0)) > 0) {
-		char *newbuf;
-		int newsz = c->bufsz + rdsz;
-		if(newsz > MAX_REQ_LENGTH) {
-			respond_error(c, 413);
-			return -1;
+	conn_bandwidth = bytes_per_sec > 0 ? bytes_per_sec : 0;
+	if(!conn_bandwidth) {
+		while((c = bw_head)) {
+			bw_unwait(c);
+			mark_dirty(c);
 		}
+		update_interest();
+	}
+}
 
-		if(!(newbuf = realloc(c->rcvbuf, newsz + 1))) {
-			logmsg("failed to allocate %d byte buffer\n", newsz);
-			respond_error(c, 503);
-			return -1;
-		}
+void tw_set_mem_limit(long total, long per_conn)
+{
+	mem_limit = total > 0 ? total : 0;
+	conn_mem_limit = per_conn > 0 ? per_conn : 0;
+	resume_reading();
+	update_interest();
+}
+
+void tw_get_mem_stats(struct tw_mem_stats *st)
+{
+	st->header = mem_used(MEM_HEADER);
+	st->body = mem_used(MEM_BODY);
+	st->output = mem_used(MEM_OUTPUT);
+	st->cache = mem_used(MEM_CACHE);
+	st->total = mem_total();
+	st->peak = mem_peak();
+	st->limit = mem_limit;
+	st->paused = num_mem_paused;
+	st->rejected = mem_rejected;
+	st->evicted = mem_evicted;
+}
 
-		memcpy(newbuf + c->bufsz, buf, rdsz);
-		newbuf[newsz] = 0;
+long tw_next_timeout(void)
+{
+	long long next, left;
+	long backend_left = proxy_next_timeout();
+	long fcgi_left = fcgi_next_timeout();
 
-		c->rcvbuf = newbuf;
-		c->bufsz = newsz;
+	if(fcgi_left >= 0 && (backend_left < 0 || fcgi_left < backend_left)) {
+		backend_left = fcgi_left;
+	}
+	if(!timer_head && !bw_head) {
+		return backend_left;
+	}
+	next = timer_head ? timer_head->deadline : bw_head->bw_deadline;
+	if(bw_head && bw_head->bw_deadline < next) {
+		next = bw_head->bw_deadline;
 	}
+	left = next - now_msec();
+	if(left < 0) left = 0;
+	return backend_left >= 0 && backend_left < left ? backend_left : (long)left;
+}
 
-	if((status = http_parse_request(&hdr, c->rcvbuf, c->bufsz)) != HTTP_HDR_OK) {
-		http_log_request(&hdr);
-		switch(status) {
-		case HTTP_HDR_INVALID:
-			respond_error(c, 400);
-			return -1;
+void tw_handle_timeouts(void)
+{
+	struct client *c;
+	long long now;
 
-		case HTTP_HDR_NOMEM:
-			respond_error(c, 503);
-			return -1;
+	busy++;
+	proxy_handle_timeouts();
+	fcgi_handle_timeouts();
+	busy--;
+	if(!timer_head && !bw_head) {
+		update_interest();
+		return;
+	}
 
-		case HTTP_HDR_PARTIAL:
-			return 0;	/* partial header, continue reading */
+	now = now_msec();
+	busy++;
+	while((c = bw_head) && c->bw_deadline <= now) {
+		bw_unwait(c);
+		mark_dirty(c);
+		flush_client(c);
+	}
+	while((c = timer_head) && c->deadline <= now) {
+		disarm_timer(c);
+		if(waiting_for_client(c)) {
+			close_conn(c);
+		} else {
+			/* waiting for us, check again later */
+			arm_timer(c);
 		}
 	}
-	http_log_request(&hdr);
+	busy--;
+	update_interest();
+}
 
-	/* we only support GET and HEAD at this point, so freak out on anything else */
-	switch(hdr.method) {
-	case HTTP_GET:
-		if(do_get(c, hdr.uri, 1) == -1) {
-			return -1;
-		}
-		break;
+int tw_add_listen_inet(const char *addr, int port)
+{
+	struct listener *l;
 
-	case HTTP_HEAD:
-		if(do_get(c, hdr.uri, 0) == -1) {
+	if(!(l = new_listener(AF_INET))) {
+		return -1;
+	}
+	l->addr.in.sin_family = AF_INET;
+	l->addr.in.sin_port = htons(port);
+	l->addr.in.sin_addr.s_addr = INADDR_ANY;
+	l->addrlen = sizeof l->addr.in;
+
+	if(addr && *addr && strcmp(addr, "*") != 0) {
+		if(inet_pton(AF_INET, addr, &l->addr.in.sin_addr) != 1) {
+			logmsg("invalid IPv4 address: %s\n", addr);
+			free(l);
 			return -1;
 		}
-		break;
+	}
+	return add_listener(l);
+}
 
-	default:
-		respond_error(c, 501);
+int tw_add_listen_inet6(const char *addr, int port)
+{
+	struct listener *l;
+
+	if(!(l = new_listener(AF_INET6))) {
 		return -1;
 	}
+	l->addr.in6.sin6_family = AF_INET6;
+	l->addr.in6.sin6_port = htons(port);
+	l->addr.in6.sin6_addr = in6addr_any;
+	l->addrlen = sizeof l->addr.in6;
 
-	close_conn(c);
-	return 0;
+	if(addr && *addr && strcmp(addr, "*") != 0) {
+		if(inet_pton(AF_INET6, addr, &l->addr.in6.sin6_addr) != 1) {
+			logmsg("invalid IPv6 address: %s\n", addr);
+			free(l);
+			return -1;
+		}
+	}
+	return add_listener(l);
 }
 
-static int do_get(struct client *c, const char *uri, int with_body)
+int tw_add_listen_unix(const char *path, int mode)
 {
-	const char *ptr;
-	struct http_resp_header resp;
+	struct listener *l;
 
-	if((ptr = strstr(uri, "://"))) {
-		uri = ptr + 3;
+	if(strlen(path) >= sizeof l->addr.un.sun_path) {
+		logmsg("UNIX domain socket path too long: %s\n", path);
+		return -1;
 	}
 
-	/* skip the host part and the first slash if it exists */
-	if((ptr = strchr(uri, '/'))) {
-		uri = ptr + 1;
+	if(!(l = new_listener(AF_UNIX))) {
+		return -1;
 	}
+	l->addr.un.sun_family = AF_UNIX;
+	strcpy(l->addr.un.sun_path, path);
+	l->addrlen = sizeof l->addr.un;
+	l->mode = mode;
+	return add_listener(l);
+}
 
-	if(*uri) {
-		struct stat st;
-		char *path = 0;
-		char *rsphdr;
-		const char *type;
-		int fd, rspsize;
+int tw_set_listen_tls(int lis, const char *certfile, const char *keyfile)
+{
+	struct listener *l = lis >= 0 ? lislist : 0;
+	struct tls_ctx *ctx;
 
-		if(stat(uri, &st) == -1) {
-			respond_error(c, 404);
-			return -1;
-		}
+	while(l && lis-- > 0) {
+		l = l->next;
+	}
+	if(!l) {
+		logmsg("tw_set_listen_tls: invalid listener\n");
+		return -1;
+	}
+	if(running) {
+		logmsg("TLS must be enabled before starting the server\n");
+		return -1;
+	}
 
-		if(S_ISDIR(st.st_mode)) {
-			int i;
-			path = alloca(strlen(uri) + 64);
+	if(!(ctx = tls_create_ctx(certfile, keyfile))) {
+		return -1;
+	}
+	tls_destroy_ctx(l->tls);
+	l->tls = ctx;
+	return 0;
+}
 
-			for(i=0; indexfiles[i]; i++) {
-				sprintf(path, "%s/%s", uri, indexfiles[i]);
-				if(stat(path, &st) == 0 && !S_ISDIR(st.st_mode)) {
-					break;
-				}
-			}
+int tw_set_listen_opt(int lis, int opt, int value)
+{
+	int i;
+	struct listener *l = lis >= 0 ? lislist : 0;
 
-			if(indexfiles[i] == 0) {
-				respond_error(c, 404);
-				return -1;
-			}
-		} else {
-			path = (char*)uri;
+	for(i=0; l && i<lis; i++) {
+		l = l->next;
+	}
+	if((lis != -1 && !l) || opt < 0 || opt >= TW_NUM_SOCK_OPTS || value < 0) {
+		logmsg("tw_set_listen_opt: invalid arguments\n");
+		return -1;
+	}
+	if(running) {
+		logmsg("socket options must be set before starting the server\n");
+		return -1;
+	}
+	if(opt == TW_SOCK_BACKLOG && !value) {
+		value = l ? -1 : DEF_BACKLOG;
+	}
+
+	if(l) {
+		l->sockopt[opt] = value;
+	} else {
+		def_sockopt[opt] = value;
+	}
+	return 0;
+}
+
+int tw_add_handler(const char *method, const char *pattern, tw_handler_func func, void *cls)
+{
+	int m = HTTP_UNKNOWN;
+
+	if(method && (m = http_parse_method(method)) == HTTP_UNKNOWN) {
+		logmsg("tw_add_handler: unknown method: %s\n", method);
+		return -1;
+	}
+	return router_add(m, pattern, func, 0, cls);
+}
+
+int tw_add_upload_handler(const char *method, const char *pattern, tw_body_func body,
+		tw_handler_func func, void *cls)
+{
+	int m = HTTP_UNKNOWN;
+
+	if(method && (m = http_parse_method(method)) == HTTP_UNKNOWN) {
+		logmsg("tw_add_upload_handler: unknown method: %s\n", method);
+		return -1;
+	}
+	return router_add(m, pattern, func, body, cls);
+}
+
+int tw_start(void)
+{
+	struct listener *l;
+
+	logmsg("starting server ...\n");
+
+	if(running) {
+		logmsg("can't start tinyweb server: already running!\n");
+		return -1;
+	}
+
+	/* if no listeners were added explicitly, listen to the default port on
+	 * all IPv4 interfaces.
+	 */
+	if(!lislist) {
+		if(tw_add_listen_inet(0, port) == -1) {
+			return -1;
 		}
+		lislist->implicit = 1;
+	}
+
+	/* warm up before listening, so that no client waits for it */
+	if(warmup_threads > 0) {
+		do_warmup();
+	}
 
-		if((fd = open(path, O_RDONLY)) == -1) {
-			respond_error(c, 403);
+	l = lislist;
+	while(l) {
+		if(start_listener(l) == -1) {
+			stop_listeners();
 			return -1;
 		}
+		if(l->tls) {
+			tls_enable_h2(l->tls, http2_enabled);
+		}
+		set_interest(l->s, TW_READ);
+		l = l->next;
+	}
+	close_inherited();
 
-		/* construct response header */
-		http_init_resp(&resp);
-		http_add_resp_field(&resp, "Content-Length: %d", st.st_size);
-		if((type = mime_type(path))) {
-			http_add_resp_field(&resp, "Content-Type: %s", type);
+	running = 1;
+	draining = 0;
+	return 0;
+}
+
+int tw_stop(void)
+{
+	if(!running) {
+		return -1;
+	}
+
+	logmsg("stopping server...\n");
+
+	stop_listeners();
+	running = 0;
+
+	while(clist) {
+		struct client *c = clist;
+		clist = clist->next;
+		close_conn(c);
+		free_client(c);
+	}
+	clist = 0;
+	num_clients = 0;
+	dirty_list = 0;
+
+	fcgi_shutdown();
+	proxy_shutdown();
+	if(iopool_watched != -1) {
+		set_interest(iopool_watched, 0);
+		iopool_watched = -1;
+	}
+	iopool_shutdown();
+	capture_close();
+
+	return 0;
+}
+
+int tw_drain(void)
+{
+	struct client *c;
+
+	if(!running) {
+		return -1;
+	}
+	if(draining) {
+		return 0;
+	}
+	logmsg("draining: no longer accepting connections\n");
+
+	stop_listeners();
+	draining = 1;
+
+	/* HTTP/1 connections are closed after their response anyway, HTTP/2
+	 * connections are told to stop opening streams.
+	 */
+	for(c=clist; c; c=c->next) {
+		if(c->h2 && c->s != -1) {
+			drain_conn(c);
+			mark_dirty(c);
 		}
+	}
+	update_interest();
+	return 0;
+}
 
-		rspsize = http_serialize_resp(&resp, 0);
-		rsphdr = alloca(rspsize);
-		http_serialize_resp(&resp, rsphdr);
+int tw_get_num_clients(void)
+{
+	int count = 0;
+	struct client *c;
 
-		if(with_body) {
-			int cont_left = st.st_size;
-			char *cont = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-			if(cont == (void*)-1) {
-				respond_error(c, 503);
-				close(fd);
-				return -1;
-			}
-			ptr = cont;
-
-			send(c->s, rsphdr, rspsize, 0);
-			while(cont_left > 0) {
-				int sz = cont_left < 4096 ? cont_left : 4096;
-				send(c->s, ptr, sz, 0);
-				ptr += sz;
-				cont_left -= sz;
+	for(c=clist; c; c=c->next) {
+		if(c->s != -1) count++;
+	}
+	return count;
+}
+
+int tw_handover_send(int sock)
+{
+	struct listener *l;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(MAX_HANDOVER * sizeof(int))];
+	} ctl;
+	char *names, *ptr;
+	int i, *fds, count = 0;
+
+	names = ptr = alloca(MAX_HANDOVER * LISNAME_MAX);
+	fds = (int*)CMSG_DATA(&ctl.hdr);
+
+	/* all the sockets of a listener's group go in order, with the same name */
+	for(l=lislist; l && count < MAX_HANDOVER; l=l->next) {
+		if(l->s == -1) continue;
+		for(i=0; i<(l->group ? l->group_size : 1) && count < MAX_HANDOVER; i++) {
+			if(l->group && l->group[i] == -1) continue;	/* dropped worker */
+			listener_name(l, ptr, LISNAME_MAX);
+			ptr += strlen(ptr) + 1;
+			memcpy(fds + count++, l->group ? l->group + i : &l->s, sizeof l->s);
+		}
+	}
+	if(!count) {
+		logmsg("handover: no listening sockets to pass\n");
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = names;
+	iov.iov_len = ptr - names;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+
+	if(sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+		logmsg("handover: failed to pass listening sockets: %s\n", strerror(errno));
+		return -1;
+	}
+	logmsg("handover: passed %d listening sockets\n", count);
+
+	/* the socket files belong to the next process now */
+	handed_over = 1;
+	return 0;
+}
+
+void tw_handover_cancel(void)
+{
+	handed_over = 0;
+}
+
+int tw_handover_recv(int sock)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(MAX_HANDOVER * sizeof(int))];
+	} ctl;
+	char *names, *ptr, *end;
+	int i, fd, count, len;
+
+	names = alloca(MAX_HANDOVER * LISNAME_MAX);
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = names;
+	iov.iov_len = MAX_HANDOVER * LISNAME_MAX;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+
+	while((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+	if(len <= 0) {
+		logmsg("handover: failed to receive listening sockets: %s\n",
+				len ? strerror(errno) : "connection closed");
+		return -1;
+	}
+
+	if(!(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS) {
+		logmsg("handover: no listening sockets received\n");
+		return -1;
+	}
+	count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+	ptr = names;
+	end = names + len;
+	for(i=0; i<count; i++) {
+		memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof fd);
+
+		if(ptr >= end || !memchr(ptr, 0, end - ptr) || num_inherited >= MAX_HANDOVER ||
+				!(inherited_name[num_inherited] = strdup(ptr))) {
+			close(fd);
+			continue;
+		}
+		inherited_fd[num_inherited++] = fd;
+		ptr += strlen(ptr) + 1;
+	}
+	logmsg("handover: received %d listening sockets\n", num_inherited);
+	return 0;
+}
+
+int tw_get_sockets(int *socks)
+{
+	int i, count, num_fcgi;
+	struct client *c, *next;
+	struct listener *l;
+
+	/* first cleanup the clients marked for removal, and the finished streams
+	 * of HTTP/2 connections.
+	 */
+	for(c=clist; c; c=next) {
+		next = c->next;
+		if(c->s == -1) {
+			unlink_client(c);
+			free_client(c);
+			--num_clients;
+		} else {
+			reap_streams(c);
+		}
+	}
+
+	if(!socks) {
+		/* just return the count */
+		count = fcgi_get_sockets(0) + proxy_get_sockets(0);
+		if(iopool_fd() != -1) count++;
+		for(l=lislist; l; l=l->next) {
+			if(l->s != -1) count++;
+		}
+		c = clist;
+		while(c) {
+			if(want_read(c)) count++;
+			c = c->next;
+		}
+		return count;
+	}
+
+	/* add the listening sockets, then go through the client list. They're
+	 * closed while draining.
+	 */
+	maxfd = -1;
+	count = 0;
+	l = lislist;
+	while(l) {
+		if(l->s != -1) {
+			*socks++ = l->s;
+			count++;
+			if(l->s > maxfd) {
+				maxfd = l->s;
 			}
+		}
+		l = l->next;
+	}
+
+	c = clist;
+	while(c) {
+		/* still monitored after shutting down their side, for sending */
+		if(c->s > maxfd) {
+			maxfd = c->s;
+		}
+		if(want_read(c)) {
+			*socks++ = c->s;
+			count++;
+		}
+		c = c->next;
+	}
+
+	/* the I/O thread pool notification */
+	if(iopool_fd() != -1) {
+		*socks++ = iopool_fd();
+		count++;
+		if(iopool_fd() > maxfd) {
+			maxfd = iopool_fd();
+		}
+	}
+
+	/* and finally the connections to FastCGI applications and upstreams */
+	num_fcgi = fcgi_get_sockets(socks);
+	num_fcgi += proxy_get_sockets(socks + num_fcgi);
+	for(i=0; i<num_fcgi; i++) {
+		if(socks[i] > maxfd) {
+			maxfd = socks[i];
+		}
+	}
+	return count + num_fcgi;
+}
+
+int tw_get_wsockets(int *socks)
+{
+	int i, num, count = 0;
+	struct client *c = clist;
 
-			munmap(cont, st.st_size);
+	while(c) {
+		int wr;
+
+		if(c->tls && !c->outq.tls) {
+			wr = tls_want_write(c->tls);	/* still in the TLS handshake */
 		} else {
-			send(c->s, rsphdr, rspsize, 0);
+			wr = want_write(c);
+		}
+		if(c->s != -1 && wr) {
+			if(socks) {
+				*socks++ = c->s;
+			}
+			count++;
+		}
+		c = c->next;
+	}
+
+	/* upstream connections still connecting, or sending the request, and
+	 * application connections with requests left to send.
+	 */
+	num = proxy_get_wsockets(socks);
+	num += fcgi_get_wsockets(socks ? socks + num : 0);
+	if(socks) {
+		for(i=0; i<num; i++) {
+			if(socks[i] > maxfd) {
+				maxfd = socks[i];
+			}
+		}
+	}
+	return count + num;
+}
+
+void tw_resp_resume(struct tw_response *resp)
+{
+	struct client *c = resp->conn;
+
+	if(c && c->resp == resp) {
+		c->paused = 0;
+		mark_dirty(c);
+		update_interest();
+	}
+}
+
+struct tw_channel *tw_channel_create(int slow_policy, long max_queue)
+{
+	struct tw_channel *ch;
+
+	if(!(ch = calloc(1, sizeof *ch))) {
+		logmsg("failed to allocate event channel\n");
+		return 0;
+	}
+	ch->slow_policy = slow_policy;
+	ch->max_queue = max_queue;
+	return ch;
+}
+
+/* the streams of the remaining subscribers are completed, and the
+ * subscribers freed by their cleanup once that's sent.
+ */
+void tw_channel_destroy(struct tw_channel *ch)
+{
+	struct subscriber *sub;
+	struct client *c;
+
+	if(!ch) return;
+
+	while((sub = ch->subs)) {
+		ch->subs = sub->next;
+		sub->ch = 0;
+		sub->prev = sub->next = 0;
+
+		c = sub->conn;
+		if(c->resp && c->resp->stream_cls == sub) {
+			c->paused = 0;
+			mark_dirty(c);
 		}
+	}
+	free(ch);
+	update_interest();
+}
+
+int tw_channel_subscribers(struct tw_channel *ch)
+{
+	return ch->num_subs;
+}
+
+int tw_subscribe(struct tw_response *resp, struct tw_channel *ch)
+{
+	struct subscriber *sub;
+
+	if(!resp->conn) {
+		return -1;
+	}
+	if(!(sub = calloc(1, sizeof *sub))) {
+		logmsg("failed to allocate event stream subscriber\n");
+		return -1;
+	}
+	sub->ch = ch;
+	sub->conn = resp->conn;
+
+	if(tw_resp_header(resp, "Content-Type: text/event-stream") == -1 ||
+			tw_resp_header(resp, "Cache-Control: no-cache") == -1 ||
+			tw_resp_stream(resp, sub_stream, sub_cleanup, sub) == -1) {
+		free(sub);
+		return -1;
+	}
 
-		close(fd);
+	if((sub->next = ch->subs)) {
+		ch->subs->prev = sub;
 	}
+	ch->subs = sub;
+	ch->num_subs++;
 	return 0;
 }
 
-static void respond_error(struct client *c, int errcode)
+int tw_broadcast(struct tw_channel *ch, const char *event, const void *data, int size)
 {
-	char buf[512];
+	struct subscriber *sub, *next;
+	struct outq_shbuf *sb;
+	struct client *c;
+	char chunk[16];
+	long msglen;
+	int hdrlen, res, count = 0;
+
+	/* the event is formatted after room for a chunk header, so that chunked
+	 * subscribers can be sent the same buffer, framed as a chunk.
+	 */
+	msglen = format_event(0, event, data, size);
+	if(!(sb = outq_shbuf_create(sizeof chunk + msglen + 2))) {
+		return -1;
+	}
+	format_event(sb->data + sizeof chunk, event, data, size);
+	hdrlen = sprintf(chunk, "%lx\r\n", msglen);
+	memcpy(sb->data + sizeof chunk - hdrlen, chunk, hdrlen);
+	memcpy(sb->data + sizeof chunk + msglen, "\r\n", 2);
 
-	sprintf(buf, "HTTP/" HTTP_VER_STR " %d %s\r\n\r\n", errcode, http_strmsg(errcode));
+	busy++;
+	for(sub=ch->subs; sub; sub=next) {
+		next = sub->next;
+		c = sub->conn;
 
-	send(c->s, buf, strlen(buf), 0);
-	close_conn(c);
+		/* not streaming yet, while its handler is still running */
+		if(!c->resp || c->resp->stream_cls != sub || c->s == -1) {
+			continue;
+		}
+		if(ch->max_queue > 0 && c->outq.size > ch->max_queue) {
+			if(ch->slow_policy == TW_SLOW_CLOSE) {
+				close_conn(c);
+			}
+			continue;
+		}
+
+		if(c->chunked) {
+			res = outq_add_shared(&c->outq, sb, sizeof chunk - hdrlen, hdrlen + msglen + 2);
+		} else {
+			res = outq_add_shared(&c->outq, sb, sizeof chunk, msglen);
+		}
+		if(res == -1) {
+			close_conn(c);
+			continue;
+		}
+		mark_dirty(c);
+		count++;
+	}
+	outq_shbuf_release(sb);
+	busy--;
+	update_interest();
+	return count;
+}
+
+int tw_get_maxfd(void)
+{
+	return maxfd;
+}
+
+int tw_handle_socket(int s)
+{
+	struct client *c;
+	struct listener *l;
+	int res = 0;
+
+	busy++;
+
+	l = lislist;
+	while(l && l->s != s) {
+		l = l->next;
+	}
+
+	if(l) {
+		res = accept_conn(l);
+	} else if(s >= 0 && s < fdtab_size && (c = fdtab[s].client)) {
+		res = handle_client(c);
+		mark_dirty(c);
+	} else if(s == iopool_fd() && s != -1) {
+		iopool_complete();
+	} else if(proxy_handle_socket(s) == -1 && fcgi_handle_socket(s) == -1) {
+		logmsg("socket %d doesn't correspond to any client\n", s);
+		res = -1;
+	}
+
+	busy--;
+	update_interest();
+	return res;
+}
+
+static struct listener *new_listener(int family)
+{
+	int i;
+	struct listener *l;
+
+	if(running) {
+		logmsg("listeners must be added before starting the server\n");
+		return 0;
+	}
+	if(!(l = calloc(1, sizeof *l))) {
+		logmsg("failed to allocate listener: %s\n", strerror(errno));
+		return 0;
+	}
+	l->s = -1;
+	l->family = family;
+	for(i=0; i<TW_NUM_SOCK_OPTS; i++) {
+		l->sockopt[i] = -1;
+	}
+	return l;
+}
+
+static void do_warmup(void)
+{
+	struct timespec t0, t1;
+	struct warmup_stats ws;
+	struct vhost *vh;
+	long msec;
+
+	logmsg("warming up caches ...\n");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	memset(&ws, 0, sizeof ws);
+	if(pack) {
+		ws.prefetched = pack_prefetch(pack, warmup_max, &ws.num_files);
+	} else if(warmup(AT_FDCWD, warmup_threads, warmup_max, warm_dir, vhost_default(), &ws) == -1) {
+		logmsg("warmup failed\n");
+		return;
+	}
+	for(vh=vhost_list(); vh; vh=vh->next) {
+		if(warmup(vh->rootfd, warmup_threads, warmup_max, warm_dir, vh, &ws) == -1) {
+			logmsg("warmup failed for %s\n", vh->name);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	msec = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+	logmsg("warmup done in %ld ms: %d directories, %d files, %ld bytes prefetched\n",
+			msec, ws.num_dirs, ws.num_files, ws.prefetched);
+}
+
+/* generate the listings of directories without an index file in advance */
+static void warm_dir(const char *path, struct stat *st, void *cls)
+{
+	int i, size;
+	char *fname;
+	struct stat fst;
+	struct vhost *vh = cls;
+
+	if(!dirlist_enabled) return;
+
+	fname = alloca(strlen(path) + 64);
+	for(i=0; indexfiles[i]; i++) {
+		sprintf(fname, "%s/%s", path, indexfiles[i]);
+		if(fstatat(vh->rootfd, fname, &fst, 0) == 0 && !S_ISDIR(fst.st_mode)) {
+			return;
+		}
+	}
+	dirlist_get(vh->dlcache, path, st, DIRLIST_HTML, &size);
+}
+
+/* listeners are kept in the order they were added */
+static int add_listener(struct listener *l)
+{
+	struct listener dummy, *tail = &dummy;
+
+	dummy.next = lislist;
+	while(tail->next) {
+		tail = tail->next;
+	}
+	tail->next = l;
+	lislist = dummy.next;
+	return num_listeners++;
 }
 
+static int start_listener(struct listener *l)
+{
+	int i, s;
+	char name[LISNAME_MAX];
+
+	listener_name(l, name, sizeof name);
+
+	/* UNIX domain sockets can't be shared with SO_REUSEPORT, so the workers
+	 * take turns accepting from the same one.
+	 */
+	if(num_workers < 2 || l->family == AF_UNIX) {
+		if((s = open_socket(l, name, 0)) == -1) {
+			return -1;
+		}
+		l->s = s;
+		return 0;
+	}
+
+	if(!(l->group = malloc(num_workers * sizeof *l->group))) {
+		logmsg("failed to allocate listening sockets for %s\n", name);
+		return -1;
+	}
+	for(i=0; i<num_workers; i++) {
+		if((l->group[i] = open_socket(l, name, 1)) == -1) {
+			while(--i >= 0) close(l->group[i]);
+			free(l->group);
+			l->group = 0;
+			return -1;
+		}
+	}
+	l->group_size = num_workers;
+	l->s = l->group[0];
+
+	if(steering && worker_cpu && cpu_steer(l->s, worker_cpu, num_workers) == 0) {
+		logmsg("steering connections to %s by CPU\n", name);
+	}
+	return 0;
+}
+
+static int open_socket(struct listener *l, const char *name, int reuseport)
+{
+	int s, one = 1;
+	struct stat st;
+
+	/* after a handover, keep listening on the socket of the previous process,
+	 * so that no connection is refused in between.
+	 */
+	if((s = take_inherited(name)) != -1) {
+		tune_socket(l, s, name);
+		listen(s, sock_opt(l, TW_SOCK_BACKLOG));	/* just updates the backlog */
+		logmsg("listening on %s (inherited)\n", name);
+		return s;
+	}
+
+	if((s = socket(l->family, SOCK_STREAM, 0)) == -1) {
+		logmsg("failed to create listening socket: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+	if(l->family != AF_UNIX) {
+		/* don't fail to bind while connections of a previous run linger */
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	}
+	if(l->family == AF_INET6) {
+		/* don't claim the IPv4 port too, so that both can be added */
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof one);
+	} else if(l->family == AF_UNIX) {
+		/* remove a stale socket file left behind by a previous run */
+		if(lstat(l->addr.un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(l->addr.un.sun_path);
+		}
+	}
+	/* each worker gets its own accept queue */
+	if(reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == -1) {
+		logmsg("failed to enable SO_REUSEPORT on %s: %s\n", name, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	if(bind(s, (struct sockaddr*)&l->addr, l->addrlen) == -1) {
+		logmsg("failed to bind socket to %s: %s\n", name, strerror(errno));
+		close(s);
+		return -1;
+	}
+	if(l->family == AF_UNIX && l->mode && chmod(l->addr.un.sun_path, l->mode) == -1) {
+		logmsg("failed to change permissions of %s: %s\n", name, strerror(errno));
+		close(s);
+		return -1;
+	}
+	tune_socket(l, s, name);
+	listen(s, sock_opt(l, TW_SOCK_BACKLOG));
+
+	logmsg("listening on %s\n", name);
+	return s;
+}
+
+static int sock_opt(struct listener *l, int opt)
+{
+	return l->sockopt[opt] >= 0 ? l->sockopt[opt] : def_sockopt[opt];
+}
+
+/* set the options of a listening socket, before listen (or again, on one we
+ * inherited). The connections accepted from it inherit the buffer sizes, which
+ * have to be set this early for the TCP window scale to match them, and busy
+ * polling. TCP_NODELAY is set on each of them by accept_conn.
+ */
+static void tune_socket(struct listener *l, int s, const char *name)
+{
+	static const struct {
+		int opt, level, name;
+		const char *str;
+	} map[] = {
+		{TW_SOCK_RCVBUF, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF"},
+		{TW_SOCK_SNDBUF, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF"},
+#ifdef SO_BUSY_POLL
+		{TW_SOCK_BUSY_POLL, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL"},
+#endif
+#ifdef TCP_DEFER_ACCEPT
+		{TW_SOCK_DEFER_ACCEPT, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT"},
+#endif
+#ifdef TCP_FASTOPEN
+		{TW_SOCK_FASTOPEN, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN"},
+#endif
+		{-1, 0, 0, 0}
+	};
+	int i, val;
+
+	for(i=0; map[i].opt != -1; i++) {
+		if(map[i].level == IPPROTO_TCP && l->family == AF_UNIX) {
+			continue;
+		}
+		if((val = sock_opt(l, map[i].opt)) <= 0) {
+			continue;
+		}
+		if(setsockopt(s, map[i].level, map[i].name, &val, sizeof val) == -1) {
+			logmsg("failed to set %s on %s: %s\n", map[i].str, name, strerror(errno));
+		}
+	}
+}
+
+static void stop_listeners(void)
+{
+	struct listener dummy, *l = &dummy;
+
+	dummy.next = lislist;
+	while(l->next) {
+		struct listener *n = l->next;
+
+		set_interest(n->s, 0);
+		if(n->group) {
+			/* s is one of them */
+			while(n->group_size > 0) {
+				if(n->group[--n->group_size] != -1) {
+					close(n->group[n->group_size]);
+				}
+			}
+			free(n->group);
+			n->group = 0;
+			n->s = -1;
+		}
+		if(n->s != -1) {
+			close(n->s);
+			n->s = -1;
+			/* the socket files belong to the process which started the workers */
+			if(n->family == AF_UNIX && !handed_over && worker_idx < 0) {
+				unlink(n->addr.un.sun_path);
+			}
+		}
+
+		if(n->implicit) {
+			l->next = n->next;
+			tls_destroy_ctx(n->tls);
+			free(n);
+			--num_listeners;
+		} else {
+			l = n;
+		}
+	}
+	lislist = dummy.next;
+}
+
+static void listener_name(struct listener *l, char *buf, int bufsz)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	switch(l->family) {
+	case AF_INET:
+		inet_ntop(AF_INET, &l->addr.in.sin_addr, addr, sizeof addr);
+		snprintf(buf, bufsz, "%s:%d", addr, ntohs(l->addr.in.sin_port));
+		break;
+
+	case AF_INET6:
+		inet_ntop(AF_INET6, &l->addr.in6.sin6_addr, addr, sizeof addr);
+		snprintf(buf, bufsz, "[%s]:%d", addr, ntohs(l->addr.in6.sin6_port));
+		break;
+
+	case AF_UNIX:
+		snprintf(buf, bufsz, "%s", l->addr.un.sun_path);
+		break;
+	}
+}
+
+static int accept_conn(struct listener *lis)
+{
+	int s;
+	struct client *c;
+	struct fd_entry *fe;
+	struct sockaddr_storage addr;
+	socklen_t addr_sz = sizeof addr;
+
+	if((s = accept(lis->s, (struct sockaddr*)&addr, &addr_sz)) == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;	/* another worker got it first */
+		}
+		logmsg("failed to accept incoming connection: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	if(lis->family != AF_UNIX && sock_opt(lis, TW_SOCK_NODELAY)) {
+		/* the output queue still coalesces the header and body with MSG_MORE */
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+
+	/* over the connection limit, drop it before spending anything on it */
+	if(ratelim_enabled() && ratelim_conn_open((struct sockaddr*)&addr) == -1) {
+		close(s);
+		return 0;
+	}
+
+	if(!(fe = get_fd_entry(s)) || !(c = calloc(1, sizeof *c))) {
+		logmsg("failed to allocate memory while accepting connection: %s\n", strerror(errno));
+		if(ratelim_enabled()) ratelim_conn_close((struct sockaddr*)&addr);
+		close(s);
+		return -1;
+	}
+	c->s = s;
+	c->state = ST_HEADER;
+	c->rl_counted = ratelim_enabled();
+	if(shed_enabled()) {
+		shed_watch(s);
+	}
+	outq_init(&c->outq);
+	memcpy(&c->addr, &addr, addr_sz);
+	c->addrlen = addr_sz;
+	c->conn_id = ++conn_count;
+	if(trace_sample) {
+		trace_start(c, c->conn_id, 0);
+	}
+
+	c->next = clist;
+	if(clist) clist->prev = c;
+	clist = c;
+	++num_clients;
+	fe->client = c;
+	mark_dirty(c);
+	arm_timer(c);
+
+	if(lis->tls && !(c->tls = tls_accept(lis->tls, s))) {
+		close_conn(c);	/* freed with the rest of the closed connections */
+		return -1;
+	}
+	return 0;
+}
+
+static void close_conn(struct client *c)
+{
+	struct client *st;
+
+	if(c->trace) {
+		trace_end(c);
+	}
+	if(c->fjob) {
+		c->fjob->c = 0;
+		c->fjob = 0;
+	}
+	abort_backend(c);
+	end_stream(c);
+	end_request(c);
+	outq_destroy(&c->outq);
+
+	if(c->parent) {
+		/* HTTP/2 stream, reset it unless it ended normally */
+		if(c->h2s) {
+			h2_close_stream(c->parent->h2, c->h2s, H2_INTERNAL_ERROR);
+			c->h2s = 0;
+		}
+		c->s = -1;
+		free(c->cgibuf);
+		c->cgibuf = 0;
+		return;
+	}
+
+	if(c->h2) {
+		for(st=c->streams; st; st=st->next) {
+			st->h2s = 0;
+			if(st->s != -1) {
+				close_conn(st);
+			}
+		}
+		h2_destroy(c->h2);
+	}
+
+	if(c->rl_counted) {
+		ratelim_conn_close((struct sockaddr*)&c->addr);
+		c->rl_counted = 0;
+	}
+
+	disarm_timer(c);
+	bw_unwait(c);
+	tls_close(c->tls);
+	c->tls = 0;
+	if(c->s != -1) {
+		set_interest(c->s, 0);
+		fdtab[c->s].client = 0;
+		close(c->s);
+		c->s = -1;	/* mark it for removal */
+		mark_dirty(c);
+	}
+	free_rcvbuf(c);
+	free(c->cgibuf);
+	c->cgibuf = 0;
+	set_mem_paused(c, 0);
+}
+
+static void free_client(struct client *c)
+{
+	struct client *st;
+
+	while((st = c->streams)) {
+		c->streams = st->next;
+		free(st);
+	}
+	free(c->h2);
+	free(c);
+}
+
+static int handle_client(struct client *c)
+{
+	static char buf[16384];
+	int rdsz;
+
+	if(c->tls && !c->outq.tls) {
+		/* nothing else happens until the TLS handshake is done */
+		switch(tls_handshake(c->tls)) {
+		case 0:
+			return 0;
+		case -1:
+			close_conn(c);
+			return 0;
+		}
+		c->outq.tls = c->tls;
+
+		/* the client might have chosen HTTP/2 during the handshake */
+		if(tls_alpn_h2(c->tls) && start_h2(c, 0, 0) == -1) {
+			return 0;
+		}
+	}
+
+	/* first send whatever we can, if we're waiting for the client */
+	if(want_write(c)) {
+		if(flush_client(c) == -1 || c->s == -1) {
+			return 0;
+		}
+	}
+	if(!want_read(c)) {
+		return 0;
+	}
+	/* see how long the start of a request waited to be read */
+	if(shed_enabled() && (c->h2 || c->state == ST_HEADER)) {
+		c->arrival = shed_arrival(c->s);
+	}
+
+	if(c->h2) {
+		return recv_h2(c, buf, sizeof buf);
+	}
+
+	if(c->state == ST_DONE) {
+		/* the request has been handled, and we're just waiting to send the
+		 * response. We only care if the client goes away in the meantime.
+		 */
+		while((rdsz = conn_recv(c, buf, sizeof buf)) > 0);
+		if(rdsz == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			if(c->fcgi || c->proxy || rdsz == -1) {
+				close_conn(c);
+			} else {
+				/* might just be a half-close, keep sending */
+				c->rd_eof = 1;
+			}
+		}
+		return 0;
+	}
+
+	while((rdsz = conn_recv(c, buf, sizeof buf)) > 0) {
+		int res;
+
+		if(c->state == ST_BODY) {
+			res = recv_body(c, buf, rdsz);
+		} else {
+			res = recv_header(c, buf, rdsz);
+		}
+		if(res == -1) {
+			return -1;
+		}
+		if(c->state == ST_DONE) {
+			return 0;
+		}
+		if(c->h2) {
+			/* switched to HTTP/2 */
+			return recv_h2(c, buf, sizeof buf);
+		}
+	}
+
+	if(rdsz == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		/* the client went away before sending a complete request */
+		close_conn(c);
+	}
+	return 0;
+}
+
+static int conn_recv(struct client *c, void *buf, int size)
+{
+	int rdsz;
+
+	if(c->outq.tls) {
+		rdsz = tls_recv(c->outq.tls, buf, size);
+	} else {
+		rdsz = recv(c->s, buf, size, 0);
+	}
+	if(rdsz > 0) {
+		arm_timer(c);
+	}
+
+	if(capture_enabled()) {
+		if(rdsz > 0) {
+			capture_data(c->conn_id, buf, rdsz);
+		} else if(rdsz == 0) {
+			capture_eof(c->conn_id);
+		}
+	}
+	return rdsz;
+}
+
+/* accumulate the request header, and start processing the request once it's
+ * complete. Anything following the header is the start of the body.
+ */
+static int recv_header(struct client *c, char *data, int size)
+{
+	char *newbuf;
+	int status, newsz = c->bufsz + size;
+
+	if(newsz > MAX_HDR_LENGTH || (conn_mem_limit && newsz > conn_mem_limit)) {
+		respond_error(c, 413);
+		return -1;
+	}
+	TRACE(c, TR_FIRST_BYTE);
+
+	if(reclaim_memory() == -1) {
+		mem_rejected++;
+		respond_limited(c, 503, 1);
+		return -1;
+	}
+
+	if(!(newbuf = realloc(c->rcvbuf, newsz + 1))) {
+		logmsg("failed to allocate %d byte buffer\n", newsz);
+		respond_error(c, 503);
+		return -1;
+	}
+
+	memcpy(newbuf + c->bufsz, data, size);
+	newbuf[newsz] = 0;
+
+	mem_charge(MEM_HEADER, size);
+	c->rcvbuf = newbuf;
+	c->bufsz = newsz;
+
+	/* HTTP/2 with prior knowledge starts with the connection preface */
+	if(http2_enabled && memcmp(newbuf, H2_PREFACE, newsz < H2_PREFACE_LEN ? newsz : H2_PREFACE_LEN) == 0) {
+		if(newsz < H2_PREFACE_LEN) {
+			return 0;
+		}
+		c->rcvbuf = 0;
+		c->bufsz = 0;
+		status = start_h2(c, newbuf, newsz);
+		free(newbuf);
+		mem_charge(MEM_HEADER, -newsz);
+		return status;
+	}
+
+	if((status = http_parse_request(&c->hdr, c->rcvbuf, c->bufsz)) != HTTP_HDR_OK) {
+		switch(status) {
+		case HTTP_HDR_INVALID:
+			http_log_request(&c->hdr);
+			http_destroy_request(&c->hdr);
+			respond_error(c, 400);
+			return -1;
+
+		case HTTP_HDR_NOMEM:
+			http_destroy_request(&c->hdr);
+			respond_error(c, 503);
+			return -1;
+
+		case HTTP_HDR_PARTIAL:
+			return 0;	/* partial header, continue reading */
+		}
+	}
+	http_log_request(&c->hdr);
+	c->have_req = 1;
+	return begin_request(c);
+}
+
+/* start processing the request in c->hdr, which is complete */
+static int begin_request(struct client *c)
+{
+	int wait;
+
+	if(c->trace) {
+		TRACE(c, TR_HEADER);
+		snprintf(c->trace->method, sizeof c->trace->method, "%s",
+				http_method_name(c->hdr.method));
+		snprintf(c->trace->path, sizeof c->trace->path, "%s", c->hdr.uri);
+	}
+
+	/* the request is destroyed along with the header, even if it's turned away
+	 * before req_init, and its body must not close a stray descriptor then.
+	 */
+	body_init(&c->req.body);
+
+	/* clients over their rate limit are turned away before anything else */
+	if(ratelim_enabled() && (wait = ratelim_request((struct sockaddr*)&c->addr)) > 0) {
+		respond_limited(c, 429, wait);
+		return -1;
+	}
+	/* and requests which waited too long while we're overloaded, or while the
+	 * memory budget is exceeded.
+	 */
+	if(shed_enabled() && shed_request((c->parent ? c->parent : c)->arrival)) {
+		respond_limited(c, 503, 1);
+		return -1;
+	}
+	if(reclaim_memory() == -1) {
+		mem_rejected++;
+		respond_limited(c, 503, 1);
+		return -1;
+	}
+
+	if(req_init(&c->req, &c->hdr) == -1) {
+		respond_error(c, 400);
+		return -1;
+	}
+	c->req.secure = (c->parent ? c->parent : c)->tls != 0;
+	if(start_request(c) == -1) {
+		return -1;
+	}
+
+	if(c->state == ST_BODY) {
+		if(c->bufsz > c->hdr.body_offset) {
+			return recv_body(c, c->rcvbuf + c->hdr.body_offset, c->bufsz - c->hdr.body_offset);
+		}
+		return 0;
+	}
+	if(http2_enabled && want_upgrade(c)) {
+		return upgrade_h2(c);
+	}
+	return finish_request(c);
+}
+
+/* find the route for the request, and figure out if there's a body to receive,
+ * and where it should go. Requests which will be rejected anyway are rejected
+ * here, before receiving their body.
+ */
+static int start_request(struct client *c)
+{
+	struct route_match m;
+	const char *field;
+	char *endp;
+	int res, cgi = 0, method = c->hdr.method;
+
+	res = router_find(method, c->req.rawpath, c->req.rawpath_len, &m);
+	if(res != 0 && method == HTTP_HEAD) {
+		if(router_find(HTTP_GET, c->req.rawpath, c->req.rawpath_len, &m) == 0) {
+			res = 0;
+		}
+	}
+
+	if(res == 0) {
+		if(req_set_params(&c->req, &m) == -1) {
+			respond_error(c, 503);
+			return -1;
+		}
+		c->route = m.route;
+	} else if((c->pgroup = proxy_find(c->req.path))) {
+		/* anything goes, it's up to the upstream */
+	} else if(method != HTTP_GET && method != HTTP_HEAD && (res == -2 || !(cgi = cgi_target(c)))) {
+		/* we only support GET and HEAD for files, so freak out on anything else */
+		respond_error(c, res == -2 || cgi_enabled ? 405 : 501);
+		return -1;
+	}
+
+	c->body_left = 0;
+	if((field = http_field(&c->hdr, HTTP_TRANSFER_ENCODING))) {
+		if(strcasecmp(field, "chunked") != 0) {
+			respond_error(c, 501);
+			return -1;
+		}
+		if(http_field(&c->hdr, HTTP_CONTENT_LENGTH)) {
+			/* ambiguous, and a classic request smuggling trick */
+			respond_error(c, 400);
+			return -1;
+		}
+		c->body_left = -1;
+		http_init_dechunk(&c->dechunk);
+
+	} else if((field = http_field(&c->hdr, HTTP_CONTENT_LENGTH))) {
+		c->body_left = strtol(field, &endp, 10);
+		if(endp == field || *endp || c->body_left < 0) {
+			respond_error(c, 400);
+			return -1;
+		}
+		if(max_body > 0 && c->body_left > max_body) {
+			respond_error(c, 413);
+			return -1;
+		}
+	}
+	if(c->parent) {
+		/* HTTP/2 request bodies end with the stream */
+		c->body_left = c->eos ? 0 : -1;
+	}
+
+	if((field = http_field(&c->hdr, HTTP_EXPECT))) {
+		if(strcasecmp(field, "100-continue") != 0) {
+			respond_error(c, 417);
+			return -1;
+		}
+		/* the client waits for our go-ahead before sending the body */
+		if(c->body_left && c->bufsz <= c->hdr.body_offset && c->hdr.ver_minor >= 1) {
+			static const char cont[] = "HTTP/" HTTP_VER_STR " 100 Continue\r\n\r\n";
+			if(outq_add_mem(&c->outq, cont, sizeof cont - 1) == -1 || flush_client(c) == -1) {
+				close_conn(c);
+				return -1;
+			}
+		}
+	}
+
+	if(c->route && c->route->body) {
+		c->body_mode = BODY_FUNC;
+	} else if(c->route || c->pgroup || cgi || (c->body_left && cgi_target(c))) {
+		c->body_mode = BODY_STORE;
+	} else {
+		c->body_mode = BODY_DISCARD;
+	}
+
+	c->body_rcvd = 0;
+	c->state = c->body_left ? ST_BODY : ST_HEADER;
+	return 0;
+}
+
+/* decode the body and pass it on as it arrives, so that only the current
+ * receive buffer is kept in memory.
+ */
+static int recv_body(struct client *c, char *data, int size)
+{
+	int res, len, done;
+
+	if(c->body_left == -1) {
+		if((res = http_dechunk(&c->dechunk, data, size, &len)) == -1) {
+			respond_error(c, 400);
+			return -1;
+		}
+		done = res;
+	} else {
+		len = size > c->body_left ? c->body_left : size;
+		c->body_left -= len;
+		done = c->body_left == 0;
+	}
+	return consume_body(c, data, len, done);
+}
+
+/* pass decoded body data on, and process the request after the last of it */
+static int consume_body(struct client *c, char *data, int len, int done)
+{
+	if(len > 0) {
+		c->body_rcvd += len;
+		if(max_body > 0 && c->body_rcvd > max_body) {
+			respond_error(c, 413);
+			return -1;
+		}
+
+		switch(c->body_mode) {
+		case BODY_FUNC:
+			if(c->route->body(&c->req, data, len, c->route->cls) == -1) {
+				respond_error(c, 500);
+				return -1;
+			}
+			break;
+
+		case BODY_STORE:
+			if(body_write(&c->req.body, data, len) == -1) {
+				respond_error(c, 503);
+				return -1;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if(done) {
+		return finish_request(c);
+	}
+	return 0;
+}
+
+static int finish_request(struct client *c)
+{
+	int status;
+
+	c->state = ST_DONE;
+	status = dispatch(c, &c->req);
+	if(!c->fjob) {
+		end_request(c);
+	}
+
+	if(status == -1) {
+		return -1;
+	}
+	if(status == 0) {
+		end_response(c);
+	}
+	return 0;
+}
+
+static void end_request(struct client *c)
+{
+	if(c->have_req) {
+		req_destroy(&c->req);
+		http_destroy_request(&c->hdr);
+		c->have_req = 0;
+	}
+}
+
+/* pass the request to the matching handler, or serve a file. Returns 1 if the
+ * response will be sent later.
+ */
+static int dispatch(struct client *c, struct tw_request *req)
+{
+	int method = req->hdr->method;
+	struct vhost *vh;
+
+	if(c->route) {
+		return do_handler(c, req, c->route, method != HTTP_HEAD);
+	}
+	if(c->pgroup) {
+		return do_proxy(c, req, method != HTTP_HEAD);
+	}
+	/* the pack is the default site */
+	if((vh = find_vhost(req)) == vhost_default() && pack) {
+		return do_pack(c, req, method != HTTP_HEAD);
+	}
+	return do_get(c, req, vh, method != HTTP_HEAD);
+}
+
+static int do_handler(struct client *c, struct tw_request *req, struct route *route, int with_body)
+{
+	struct tw_response resp;
+
+	if(resp_init(&resp) == -1) {
+		respond_error(c, 503);
+		return -1;
+	}
+	resp.conn = c;
+
+	if(route->func(req, &resp, route->cls) == -1) {
+		if(resp.stream_cleanup) {
+			resp.stream_cleanup(resp.stream_cls);
+		}
+		resp_destroy(&resp);
+		respond_error(c, 500);
+		return -1;
+	}
+
+	if(resp.stream) {
+		return start_stream(c, &resp, with_body);
+	}
+
+	http_add_resp_field(&resp.hdr, "Content-Length: %d", resp.body_size);
+	if(queue_header(c, &resp.hdr) == -1) {
+		resp_destroy(&resp);
+		return -1;
+	}
+	if(with_body) {
+		/* hand the body buffer over to the output queue */
+		if(outq_add_buf(&c->outq, resp.body, resp.body_size) == -1) {
+			resp_destroy(&resp);
+			close_conn(c);
+			return -1;
+		}
+		resp.body = 0;
+	}
+	resp_destroy(&resp);
+	return 0;
+}
+
+/* send the header of a streamed response, and keep the response around to
+ * call its producer whenever the client is ready for more.
+ */
+static int start_stream(struct client *c, struct tw_response *resp, int with_body)
+{
+	c->chunked = c->hdr.ver_major == 1 && c->hdr.ver_minor >= 1;
+	if(c->chunked) {
+		http_add_resp_field(&resp->hdr, "Transfer-Encoding: chunked");
+	}
+	if(queue_header(c, &resp->hdr) == -1 || !with_body) {
+		if(resp->stream_cleanup) {
+			resp->stream_cleanup(resp->stream_cls);
+		}
+		resp_destroy(resp);
+		return c->s == -1 ? -1 : 0;
+	}
+
+	if(!(c->resp = malloc(sizeof *c->resp))) {
+		logmsg("failed to allocate streamed response\n");
+		if(resp->stream_cleanup) {
+			resp->stream_cleanup(resp->stream_cls);
+		}
+		resp_destroy(resp);
+		close_conn(c);
+		return -1;
+	}
+	*c->resp = *resp;
+	c->paused = 0;
+
+	/* anything the handler wrote before starting the stream goes first */
+	if(queue_resp_body(c) == -1) {
+		close_conn(c);
+		return -1;
+	}
+	flush_client(c);
+	return 1;
+}
+
+/* call the producer of a streamed response once, and queue its output */
+static int produce(struct client *c)
+{
+	struct tw_response *resp = c->resp;
+	int res;
+
+	if((res = resp->stream(resp, resp->stream_cls)) == -1) {
+		close_conn(c);
+		return -1;
+	}
+	if(queue_resp_body(c) == -1) {
+		close_conn(c);
+		return -1;
+	}
+
+	switch(res) {
+	case TW_STREAM_DONE:
+		if(c->chunked && outq_add_mem(&c->outq, "0\r\n\r\n", 5) == -1) {
+			close_conn(c);
+			return -1;
+		}
+		end_stream(c);
+		c->close_when_done = 1;
+		break;
+
+	case TW_STREAM_PAUSE:
+		c->paused = 1;
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+static void end_stream(struct client *c)
+{
+	if(c->resp) {
+		if(c->resp->stream_cleanup) {
+			c->resp->stream_cleanup(c->resp->stream_cls);
+		}
+		resp_destroy(c->resp);
+		free(c->resp);
+		c->resp = 0;
+	}
+}
+
+/* move whatever the producer wrote to the response body to the output queue */
+static int queue_resp_body(struct client *c)
+{
+	struct tw_response *resp = c->resp;
+	int res;
+
+	if(resp->body_size <= 0) {
+		return 0;
+	}
+	res = queue_data(c, resp->body, resp->body_size);
+	resp->body_size = 0;
+	return res;
+}
+
+/* queue response body data, as a chunk if the response is chunked */
+static int queue_data(struct client *c, const void *data, int size)
+{
+	char *buf;
+	int len;
+
+	if(!c->chunked) {
+		return outq_add_mem(&c->outq, data, size);
+	}
+
+	if(!(buf = malloc(size + 16))) {
+		logmsg("failed to allocate %d byte chunk\n", size);
+		return -1;
+	}
+	len = sprintf(buf, "%x\r\n", size);
+	memcpy(buf + len, data, size);
+	len += size;
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	return outq_add_buf(&c->outq, buf, len);
+}
+
+static int queue_header(struct client *c, struct http_resp_header *resp)
+{
+	char *buf;
+	int size;
+
+	if(c->trace) {
+		TRACE(c, TR_RESOLVED);
+		c->trace->status = resp->status;
+	}
+
+	if(c->parent) {
+		if(!c->h2s || h2_send_headers(c->parent->h2, c->h2s, resp) == -1) {
+			close_conn(c);
+			return -1;
+		}
+		return 0;
+	}
+
+	size = http_serialize_resp(resp, 0);
+	if(!(buf = malloc(size + 1))) {
+		logmsg("failed to allocate response header\n");
+		close_conn(c);
+		return -1;
+	}
+	http_serialize_resp(resp, buf);
+
+	if(outq_add_buf(&c->outq, buf, size) == -1) {
+		free(buf);
+		close_conn(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* send as much of the queued output as the client will take, calling the
+ * producer of streamed responses whenever the queue runs dry. The connection
+ * is closed once the response is complete.
+ */
+static int flush_client(struct client *c)
+{
+	int i, res;
+	long size, max;
+
+	/* HTTP/2 streams are sent through their connection */
+	if(c->parent) {
+		return flush_h2(c->parent);
+	}
+	if(c->h2) {
+		return flush_h2(c);
+	}
+
+	max = bw_allowance(c);
+	for(i=0; i<MAX_PRODUCE; i++) {
+		size = c->outq.size;
+		if((res = outq_flush(&c->outq, c->s, max)) == -1) {
+			close_conn(c);
+			return -1;
+		}
+		if(c->outq.size < size) {
+			TRACE(c, TR_FIRST_SENT);
+			arm_timer(c);
+			max -= size - c->outq.size;
+			if(conn_bandwidth) c->bw_tokens -= size - c->outq.size;
+		}
+		if(res == 1 && conn_bandwidth && c->bw_tokens <= 0) {
+			bw_wait(c);
+		}
+		if(res == 1 || !c->resp || c->paused) {
+			break;
+		}
+		if(produce(c) == -1) {
+			return -1;
+		}
+	}
+
+	if(c->throttled && c->outq.size < OUTQ_LOWAT) {
+		throttle_backend(c, 0);
+	}
+
+	if(c->close_when_done && outq_empty(&c->outq) && !c->resp && !c->fcgi && !c->proxy) {
+		TRACE(c, TR_LAST_SENT);
+		close_conn(c);
+	}
+	return 0;
+}
+
+/* the response is complete, close the connection once it's sent */
+static void end_response(struct client *c)
+{
+	c->close_when_done = 1;
+	flush_client(c);
+}
+
+static int do_get(struct client *c, struct tw_request *req, struct vhost *vh, int with_body)
+{
+	struct file_job *fj;
+	int res;
+
+	/* nothing outside the root of the site */
+	if(has_dotdot(req->path)) {
+		respond_error(c, 403);
+		return -1;
+	}
+
+	/* file paths are relative to the root of the site */
+	if(!(fj = new_file_job(vh, req->path[1] ? req->path + 1 : "."))) {
+		respond_error(c, 503);
+		return -1;
+	}
+
+	/* with the I/O threads, the response continues in file_resolved */
+	if(iopool_enabled()) {
+		fj->c = c;
+		fj->prefetch = with_body;
+		if(iopool_submit(resolve_file, file_resolved, fj) != -1) {
+			c->fjob = fj;
+			return 1;
+		}
+		fj->c = 0;
+		fj->prefetch = 0;
+	}
+
+	resolve_file(fj);
+	res = serve_file(c, req, fj, with_body);
+	free_file_job(fj);
+	return res;
+}
+
+/* the site named by the host of an absolute URI, or the Host field */
+static struct vhost *find_vhost(struct tw_request *req)
+{
+	const char *host, *uri = req->hdr->uri;
+
+	if(!vhost_list()) {
+		return vhost_default();
+	}
+	if((host = strstr(uri, "://"))) {
+		host += 3;
+	} else {
+		host = http_field(req->hdr, HTTP_HOST);
+	}
+	return vhost_find(host);
+}
+
+static int has_dotdot(const char *path)
+{
+	const char *ptr = path;
+
+	while((ptr = strstr(ptr, ".."))) {
+		if((ptr == path || ptr[-1] == '/') && (!ptr[2] || ptr[2] == '/')) {
+			return 1;
+		}
+		ptr += 2;
+	}
+	return 0;
+}
+
+/* whether do_get will pass the request to a CGI program, which is the only
+ * reason to keep the body of a request for a file. A directory is served by
+ * its index, and index.cgi comes first. A path continuing past a .cgi file
+ * goes to it too, so those are kept just in case.
+ */
+static int cgi_target(struct client *c)
+{
+	struct vhost *vh;
+	struct stat st;
+	const char *type, *path = c->req.path;
+	char *fname;
+
+	if(!cgi_enabled || has_dotdot(path)) {
+		return 0;
+	}
+	if((vh = find_vhost(&c->req)) == vhost_default() && pack) {
+		return 0;
+	}
+	if(((type = strrchr(path, '.')) && strcmp(type, ".cgi") == 0) || strstr(path, ".cgi/")) {
+		return 1;
+	}
+	fname = alloca(strlen(path) + 16);
+	sprintf(fname, "%s/%s", path[1] ? path + 1 : ".", indexfiles[0]);
+	return fstatat(vh->rootfd, fname, &st, 0) == 0 && !S_ISDIR(st.st_mode);
+}
+
+static struct file_job *new_file_job(struct vhost *vh, const char *uri)
+{
+	struct file_job *fj;
+
+	if(!(fj = calloc(1, sizeof *fj))) {
+		return 0;
+	}
+	fj->vhost = vh;
+	if(!(fj->uri = strdup(uri)) || !(fj->path = malloc(strlen(uri) + 64))) {
+		free(fj->uri);
+		free(fj);
+		return 0;
+	}
+	fj->fd = -1;
+	return fj;
+}
+
+static void free_file_job(struct file_job *fj)
+{
+	if(fj->fd != -1) {
+		close(fj->fd);
+	}
+	free(fj->uri);
+	free(fj->path);
+	free(fj);
+}
+
+/* everything which might wait for the disk. Runs on the I/O threads if there
+ * are any, so it only touches the job.
+ */
+static void resolve_file(void *data)
+{
+	struct file_job *fj = data;
+	const char *type, *ptr;
+	char *buf;
+	long size, offs;
+	int i, rd;
+
+	if(fstatat(fj->vhost->rootfd, fj->uri, &fj->st, 0) == -1) {
+		/* a CGI program, with the rest of the path passed to it in PATH_INFO */
+		if(cgi_enabled && (ptr = strstr(fj->uri, ".cgi/"))) {
+			i = ptr + 4 - fj->uri;
+			memcpy(fj->path, fj->uri, i);
+			fj->path[i] = 0;
+			if(fstatat(fj->vhost->rootfd, fj->path, &fj->st, 0) == 0 && S_ISREG(fj->st.st_mode)) {
+				return;
+			}
+		}
+		fj->status = 404;
+		return;
+	}
+
+	if(S_ISDIR(fj->st.st_mode)) {
+		fj->dirst = fj->st;
+		for(i=0; indexfiles[i]; i++) {
+			sprintf(fj->path, "%s/%s", fj->uri, indexfiles[i]);
+			if(fstatat(fj->vhost->rootfd, fj->path, &fj->st, 0) == 0 && !S_ISDIR(fj->st.st_mode)) {
+				break;
+			}
+		}
+		if(indexfiles[i] == 0) {
+			fj->nodir_index = 1;
+			return;
+		}
+	} else {
+		strcpy(fj->path, fj->uri);
+	}
+
+	/* CGI programs are run, not opened */
+	if(cgi_enabled && (type = strrchr(fj->path, '.')) && strcmp(type, ".cgi") == 0) {
+		return;
+	}
+	if((fj->fd = openat(fj->vhost->rootfd, fj->path, O_RDONLY)) == -1 || !fj->prefetch) {
+		return;
+	}
+
+	/* get the start of the file in the page cache before it's sent, and the
+	 * kernel going on the rest, so that sendfile doesn't wait for the disk.
+	 */
+	size = fj->st.st_size < IO_FIRST_READ ? fj->st.st_size : IO_FIRST_READ;
+	if(size > 0 && (buf = malloc(size < 65536 ? size : 65536))) {
+		for(offs=0; offs<size; offs+=rd) {
+			rd = size - offs < 65536 ? size - offs : 65536;
+			if((rd = pread(fj->fd, buf, rd, offs)) <= 0) break;
+		}
+		free(buf);
+	}
+	if(fj->st.st_size > size) {
+		size = fj->st.st_size < IO_PREFETCH_MAX ? fj->st.st_size : IO_PREFETCH_MAX;
+		posix_fadvise(fj->fd, IO_FIRST_READ, size - IO_FIRST_READ, POSIX_FADV_WILLNEED);
+	}
+}
+
+/* back on the event loop, with the file ready to go */
+static void file_resolved(void *data)
+{
+	struct file_job *fj = data;
+	struct client *c;
+	int status;
+
+	if((c = fj->c)) {
+		mark_dirty(c);
+		c->fjob = 0;
+		status = serve_file(c, &c->req, fj, c->req.hdr->method != HTTP_HEAD);
+		end_request(c);
+		if(status == 0) {
+			end_response(c);
+		}
+	}
+	free_file_job(fj);
+}
+
+static int serve_file(struct client *c, struct tw_request *req, struct file_job *fj, int with_body)
+{
+	struct http_resp_header resp;
+	const char *type;
+	int res;
+
+	if(fj->status) {
+		respond_error(c, fj->status);
+		return -1;
+	}
+	if(fj->nodir_index) {
+		if(dirlist_enabled) {
+			return do_dirlist(c, req, fj->vhost, fj->uri, &fj->dirst, with_body);
+		}
+		respond_error(c, 404);
+		return -1;
+	}
+
+	if(cgi_enabled && (type = strrchr(fj->path, '.')) && strcmp(type, ".cgi") == 0) {
+		return do_cgi(c, req, fj->vhost, fj->path, with_body);
+	}
+	if(req->hdr->method != HTTP_GET && req->hdr->method != HTTP_HEAD) {
+		respond_error(c, 405);
+		return -1;
+	}
+	if(fj->fd == -1) {
+		respond_error(c, 403);
+		return -1;
+	}
+
+	/* construct response header */
+	http_init_resp(&resp);
+	http_add_resp_field(&resp, "Content-Length: %ld", (long)fj->st.st_size);
+	if((type = mime_type(fj->path))) {
+		http_add_resp_field(&resp, "Content-Type: %s", type);
+	}
+	res = queue_header(c, &resp);
+	http_destroy_resp(&resp);
+	if(res == -1) {
+		return -1;
+	}
+
+	/* the file contents are sent straight from the page cache with sendfile */
+	if(with_body) {
+		if(outq_add_file(&c->outq, fj->fd, 0, fj->st.st_size) == -1) {
+			close_conn(c);
+			return -1;
+		}
+		fj->fd = -1;	/* owned by the queue now */
+	}
+	return 0;
+}
+
+/* serve a file from the pack. Everything about it was worked out when the
+ * pack was built, and the data is sent straight from the mapping, so there
+ * are no system calls besides sending it.
+ */
+static int do_pack(struct client *c, struct tw_request *req, int with_body)
+{
+	const struct pack_entry *ent;
+	struct http_resp_header resp;
+	const char *type, *etag, *field;
+	uint64_t offs, size;
+	int res, gzip = 0;
+
+	if(req->hdr->method != HTTP_GET && req->hdr->method != HTTP_HEAD) {
+		respond_error(c, 405);
+		return -1;
+	}
+	if(!(ent = pack_find(pack, req->path))) {
+		respond_error(c, 404);
+		return -1;
+	}
+	if((ent->flags & PACK_DIR) && !(ent = pack_entry(pack, ent->index))) {
+		respond_error(c, 404);
+		return -1;
+	}
+
+	if(ent->gz_size > 0 && (field = http_field(req->hdr, HTTP_ACCEPT_ENCODING)) &&
+			has_token(field, "gzip")) {
+		gzip = 1;
+	}
+	offs = gzip ? ent->gz_offs : ent->offs;
+	size = gzip ? ent->gz_size : ent->size;
+	etag = pack_str(pack, gzip ? ent->gz_etag : ent->etag);
+
+	http_init_resp(&resp);
+	if((field = http_field(req->hdr, HTTP_IF_NONE_MATCH)) && (strstr(field, etag) ||
+				strcmp(field, "*") == 0)) {
+		resp.status = 304;
+		with_body = 0;
+	} else {
+		http_add_resp_field(&resp, "Content-Length: %lu", (unsigned long)size);
+		if(*(type = pack_str(pack, ent->type))) {
+			http_add_resp_field(&resp, "Content-Type: %s", type);
+		}
+		if(gzip) {
+			http_add_resp_field(&resp, "Content-Encoding: gzip");
+		}
+	}
+	http_add_resp_field(&resp, "ETag: %s", etag);
+	if(ent->gz_size > 0) {
+		http_add_resp_field(&resp, "Vary: Accept-Encoding");
+	}
+	res = queue_header(c, &resp);
+	http_destroy_resp(&resp);
+	if(res == -1) {
+		return -1;
+	}
+
+	if(with_body && outq_add_ref(&c->outq, pack_data(pack, offs), size) == -1) {
+		close_conn(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* auto-generated listing for directories without an index file. Listings are
+ * HTML, unless JSON is requested explicitly with a format=json query, or
+ * through the Accept header field.
+ */
+static int do_dirlist(struct client *c, struct tw_request *req, struct vhost *vh,
+		const char *path, struct stat *st, int with_body)
+{
+	struct http_resp_header resp;
+	char *dirpath, *ptr;
+	const char *uri, *accept, *text;
+	int res, len, fmt = DIRLIST_HTML, textsz;
+
+	/* relative links in the listing only work if the directory URI ends with
+	 * a slash, so redirect there first.
+	 */
+	uri = req->hdr->uri;
+	len = strcspn(uri, "?");
+	if(len == 0 || uri[len - 1] != '/') {
+		http_init_resp(&resp);
+		resp.status = 301;
+		http_add_resp_field(&resp, "Location: %.*s/%s", len, uri, uri + len);
+		http_add_resp_field(&resp, "Content-Length: 0");
+
+		res = queue_header(c, &resp);
+		http_destroy_resp(&resp);
+		return res;
+	}
+
+	if(req->query && strstr(req->query, "format=json")) {
+		fmt = DIRLIST_JSON;
+	} else if((accept = http_field(req->hdr, HTTP_ACCEPT)) && strstr(accept, "application/json")) {
+		fmt = DIRLIST_JSON;
+	}
+
+	/* use the path without trailing slashes as the cache key */
+	dirpath = alloca(strlen(path) + 1);
+	strcpy(dirpath, path);
+	ptr = dirpath + strlen(dirpath) - 1;
+	while(ptr > dirpath && *ptr == '/') {
+		*ptr-- = 0;
+	}
+
+	if(!(text = dirlist_get(vh->dlcache, dirpath, st, fmt, &textsz))) {
+		respond_error(c, 403);
+		return -1;
+	}
+
+	http_init_resp(&resp);
+	http_add_resp_field(&resp, "Content-Length: %d", textsz);
+	http_add_resp_field(&resp, "Content-Type: %s", fmt == DIRLIST_JSON ?
+			"application/json" : "text/html; charset=utf-8");
+
+	res = queue_header(c, &resp);
+	http_destroy_resp(&resp);
+	if(res == -1) {
+		return -1;
+	}
+
+	/* the cached listing may be gone by the time it's sent, so copy it */
+	if(with_body && outq_add_mem(&c->outq, text, textsz) == -1) {
+		close_conn(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* pass the request to the FastCGI application, and send the response as it
+ * arrives, from cgi_output.
+ */
+static int do_cgi(struct client *c, struct tw_request *req, struct vhost *vh, const char *path,
+		int with_body)
+{
+	char addr[INET6_ADDRSTRLEN], srvaddr[INET6_ADDRSTRLEN + 2], *script;
+	struct fcgi_vars vars;
+	int len;
+
+	/* whatever follows the script in the request path, see resolve_file */
+	len = strlen(path);
+	vars.path_info = 0;
+	if(strncmp(req->path + 1, path, len) == 0 && req->path[len + 1] == '/') {
+		vars.path_info = req->path + len + 1;
+	}
+	vars.docroot = vh->root;
+	vars.remote_addr = client_addr(c, addr);
+	vars.server_addr = server_addr(c, srvaddr, &vars.server_port);
+
+	/* the applications are found by their absolute path */
+	if(vh->root) {
+		script = alloca(strlen(vh->root) + strlen(path) + 2);
+		sprintf(script, "%s/%s", vh->root, path);
+		path = script;
+	}
+
+	c->with_body = with_body;
+	if(!(c->fcgi = fcgi_request(path, req, &vars, cgi_output, c))) {
+		respond_error(c, 502);
+		return -1;
+	}
+	return 1;
+}
+
+/* forward the request to the upstream, and send the response as it arrives,
+ * from cgi_output like a FastCGI response.
+ */
+static int do_proxy(struct client *c, struct tw_request *req, int with_body)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	c->with_body = with_body;
+	if(!(c->proxy = proxy_request(c->pgroup, req, client_addr(c, addr), cgi_output, c))) {
+		respond_error(c, 502);
+		return -1;
+	}
+	return 1;
+}
+
+/* the IP address of the client as text in buf, or null for unix sockets */
+static const char *client_addr(struct client *c, char *buf)
+{
+	if(c->addr.ss_family == AF_INET) {
+		return inet_ntop(AF_INET, &((struct sockaddr_in*)&c->addr)->sin_addr, buf,
+				INET6_ADDRSTRLEN);
+	}
+	if(c->addr.ss_family == AF_INET6) {
+		return inet_ntop(AF_INET6, &((struct sockaddr_in6*)&c->addr)->sin6_addr, buf,
+				INET6_ADDRSTRLEN);
+	}
+	return 0;
+}
+
+/* the local IP address the connection was accepted on, as text in buf, with
+ * IPv6 addresses in brackets like in a URI, and its port. Returns null with
+ * port 0 for unix sockets.
+ */
+static const char *server_addr(struct client *c, char *buf, int *port)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
+
+	*port = 0;
+	if(getsockname((c->parent ? c->parent : c)->s, (struct sockaddr*)&addr, &len) == -1) {
+		return 0;
+	}
+	if(addr.ss_family == AF_INET) {
+		*port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+		return inet_ntop(AF_INET, &((struct sockaddr_in*)&addr)->sin_addr, buf, INET6_ADDRSTRLEN);
+	}
+	if(addr.ss_family == AF_INET6) {
+		*port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+		if(!inet_ntop(AF_INET6, &((struct sockaddr_in6*)&addr)->sin6_addr, buf + 1, INET6_ADDRSTRLEN)) {
+			return 0;
+		}
+		buf[0] = '[';
+		strcat(buf, "]");
+		return buf;
+	}
+	return 0;
+}
+
+static void cgi_output(int status, const char *data, int size, void *cls)
+{
+	struct client *c = cls;
+	char *tmp;
+	int res;
+
+	mark_dirty(c);
+
+	switch(status) {
+	case FCGI_DATA:
+		if(!c->cgi_hdr_done) {
+			/* collect the CGI header until it's complete */
+			if(c->cgilen + size > MAX_HDR_LENGTH) {
+				logmsg("CGI response header too large\n");
+				cgi_fail(c, 502);
+				return;
+			}
+			if(!(tmp = realloc(c->cgibuf, c->cgilen + size))) {
+				logmsg("failed to allocate CGI header buffer\n");
+				free(c->cgibuf);
+				c->cgibuf = 0;
+				c->cgilen = 0;
+				cgi_fail(c, 503);
+				return;
+			}
+			c->cgibuf = tmp;
+			memcpy(c->cgibuf + c->cgilen, data, size);
+			c->cgilen += size;
+
+			if((res = cgi_header(c)) <= 0) {
+				if(res == -1 && c->s != -1) {
+					logmsg("invalid CGI response header\n");
+					cgi_fail(c, 502);
+				}
+				return;
+			}
+			/* whatever followed the header is the start of the body */
+			data = c->cgibuf + res;
+			size = c->cgilen - res;
+		}
+
+		if(size > 0 && c->with_body) {
+			if(queue_data(c, data, size) == -1) {
+				close_conn(c);
+				return;
+			}
+			/* the application is faster than the client, stop reading its
+			 * output until the client catches up. The same if its output
+			 * takes up more memory than we can spare.
+			 */
+			if((c->outq.size > OUTQ_HIWAT || (conn_mem_limit && c->outq.memsize > conn_mem_limit) ||
+						(mem_limit && mem_total() > mem_limit)) && !c->throttled) {
+				throttle_backend(c, 1);
+			}
+		}
+		if(c->cgibuf) {
+			free(c->cgibuf);
+			c->cgibuf = 0;
+			c->cgilen = 0;
+		}
+		flush_client(c);
+		break;
+
+	case FCGI_END:
+		c->fcgi = 0;
+		c->proxy = 0;
+		c->throttled = 0;
+		if(!c->cgi_hdr_done) {
+			logmsg("invalid CGI response header\n");
+			respond_error(c, 502);
+			break;
+		}
+		if(c->chunked && c->with_body && outq_add_mem(&c->outq, "0\r\n\r\n", 5) == -1) {
+			close_conn(c);
+			break;
+		}
+		end_response(c);
+		break;
+
+	case FCGI_ERROR:
+	case FCGI_TIMEOUT:
+		c->fcgi = 0;
+		c->proxy = 0;
+		c->throttled = 0;
+		if(c->cgi_hdr_done) {
+			/* too late to report it, cut the response short */
+			close_conn(c);
+		} else {
+			respond_error(c, status == FCGI_TIMEOUT ? 504 : 502);
+		}
+		break;
+	}
+}
+
+/* give up on the application, and reply with an error */
+static void cgi_fail(struct client *c, int errcode)
+{
+	abort_backend(c);
+	respond_error(c, errcode);
+}
+
+static void abort_backend(struct client *c)
+{
+	if(c->fcgi) {
+		fcgi_abort(c->fcgi);
+		c->fcgi = 0;
+	}
+	if(c->proxy) {
+		proxy_abort(c->proxy);
+		c->proxy = 0;
+	}
+	c->throttled = 0;
+}
+
+/* stop reading the output of the application or upstream while the client
+ * can't keep up, or resume it.
+ */
+static void throttle_backend(struct client *c, int stop)
+{
+	if(c->fcgi) {
+		fcgi_throttle(c->fcgi, stop);
+	}
+	if(c->proxy) {
+		proxy_throttle(c->proxy, stop);
+	}
+	c->throttled = stop;
+}
+
+/* CGI output starts with header lines, terminated by an empty line. Status
+ * sets the response status, Location without a status is a redirect, and
+ * everything else is passed through to the client. Unless the application
+ * provides a Content-Length, the body is sent chunked.
+ * Returns the size of the header once it's complete and queued, 0 if it's
+ * incomplete, or -1 if it's invalid.
+ */
+static int cgi_header(struct client *c)
+{
+	struct http_resp_header resp;
+	const char *ptr = c->cgibuf, *end = c->cgibuf + c->cgilen, *line;
+	int len, res, have_status = 0, have_location = 0, have_length = 0;
+
+	http_init_resp(&resp);
+	for(;;) {
+		line = ptr;
+		while(ptr < end && *ptr != '\n') ptr++;
+		if(ptr >= end) {
+			http_destroy_resp(&resp);
+			return 0;
+		}
+		len = ptr++ - line;
+		if(len > 0 && line[len - 1] == '\r') len--;
+		if(len == 0) break;
+
+		if(len > 7 && strncasecmp(line, "Status:", 7) == 0) {
+			resp.status = atoi(line + 7);
+			have_status = 1;
+			continue;
+		}
+		if(len > 9 && strncasecmp(line, "Location:", 9) == 0) {
+			have_location = 1;
+		}
+		if(len > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+			have_length = 1;
+		}
+		if(!memchr(line, ':', len)) continue;
+		http_add_resp_field(&resp, "%.*s", len, line);
+	}
+	if(have_location && !have_status) {
+		resp.status = 302;
+	}
+	if(resp.status < 100 || resp.status > 999) {
+		http_destroy_resp(&resp);
+		return -1;
+	}
+
+	/* 204 and 304 responses never have a body */
+	if(!have_length && resp.status != 204 && resp.status != 304 &&
+			c->hdr.ver_major == 1 && c->hdr.ver_minor >= 1) {
+		http_add_resp_field(&resp, "Transfer-Encoding: chunked");
+		c->chunked = 1;
+	}
+	c->cgi_hdr_done = 1;
+
+	res = queue_header(c, &resp);
+	http_destroy_resp(&resp);
+	if(res == -1) {
+		return -1;
+	}
+	return ptr - c->cgibuf;
+}
+
+/* queue an error response, and close the connection once it's sent */
+static void respond_error(struct client *c, int errcode)
+{
+	struct http_resp_header resp;
+	int res;
+
+	c->state = ST_DONE;
+
+	http_init_resp(&resp);
+	resp.status = errcode;
+	res = queue_header(c, &resp);
+	http_destroy_resp(&resp);
+
+	if(res != -1) {
+		end_response(c);
+	}
+}
+
+static void respond_limited(struct client *c, int status, int wait)
+{
+	struct http_resp_header resp;
+	int res;
+
+	c->state = ST_DONE;
+
+	http_init_resp(&resp);
+	resp.status = status;
+	http_add_resp_field(&resp, "Retry-After: %d", wait);
+	res = queue_header(c, &resp);
+	http_destroy_resp(&resp);
+
+	if(res != -1) {
+		end_response(c);
+	}
+}
+
+/* the client has output waiting to be sent, or a response to produce */
+static int want_write(struct client *c)
+{
+	struct client *st;
+
+	if(c->bw_waiting) {
+		return 0;
+	}
+	if(!outq_empty(&c->outq)) {
+		return 1;
+	}
+	for(st=c->streams; st; st=st->next) {
+		if(st->s == -1) continue;
+		if(!outq_empty(&st->outq)) {
+			if(h2_send_window(c->h2, st->h2s) > 0) {
+				return 1;
+			}
+		} else if((st->resp && !st->paused) || (st->close_when_done && !st->resp && !st->fcgi && !st->proxy)) {
+			return 1;
+		}
+	}
+	return c->resp && !c->paused;
+}
+
+/* switch the connection to HTTP/2, and process the data received so far,
+ * starting with the client preface.
+ */
+static int start_h2(struct client *c, char *data, int size)
+{
+	/* requests are traced on their streams from now on */
+	if(c->trace) {
+		trace_end(c);
+	}
+	if(!(c->h2 = malloc(sizeof *c->h2))) {
+		logmsg("failed to allocate HTTP/2 connection\n");
+		close_conn(c);
+		return -1;
+	}
+	if(h2_init(c->h2, &c->outq, &h2_cb, c) == -1) {
+		free(c->h2);
+		c->h2 = 0;
+		close_conn(c);
+		return -1;
+	}
+	if(input_h2(c, data, size) == -1) {
+		return -1;
+	}
+	if(draining) {
+		drain_conn(c);
+	}
+	return c->s == -1 ? -1 : 0;
+}
+
+/* HTTP/1.1 clients can ask to switch to HTTP/2 over cleartext (h2c). We only
+ * do that for requests without a body, which is allowed.
+ */
+static int want_upgrade(struct client *c)
+{
+	const char *field;
+
+	if(c->parent || c->tls || c->hdr.ver_major != 1 || c->hdr.ver_minor < 1) {
+		return 0;
+	}
+	if(!(field = http_field(&c->hdr, HTTP_UPGRADE)) || !has_token(field, "h2c")) {
+		return 0;
+	}
+	return http_field(&c->hdr, HTTP_HTTP2_SETTINGS) != 0;
+}
+
+/* the request which asked for the upgrade moves to stream 1, and its response
+ * is sent over HTTP/2.
+ */
+static int upgrade_h2(struct client *c)
+{
+	static const char resp[] = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	struct client *st;
+	struct h2_stream *h2s;
+	char *buf;
+	int size, offs;
+
+	if(outq_add_mem(&c->outq, resp, sizeof resp - 1) == -1) {
+		close_conn(c);
+		return -1;
+	}
+	if(!(c->h2 = malloc(sizeof *c->h2))) {
+		logmsg("failed to allocate HTTP/2 connection\n");
+		close_conn(c);
+		return -1;
+	}
+	if(h2_init(c->h2, &c->outq, &h2_cb, c) == -1) {
+		free(c->h2);
+		c->h2 = 0;
+		close_conn(c);
+		return -1;
+	}
+	if(h2_upgrade_settings(c->h2, http_field(&c->hdr, HTTP_HTTP2_SETTINGS)) == -1) {
+		h2_goaway(c->h2, H2_PROTOCOL_ERROR);
+		c->rd_eof = 1;
+		c->close_when_done = 1;
+		flush_client(c);
+		return -1;
+	}
+	if(!(h2s = h2_upgrade_stream(c->h2)) || !(st = new_stream(c, h2s))) {
+		close_conn(c);
+		return -1;
+	}
+
+	st->hdr = c->hdr;
+	st->req = c->req;
+	st->req.hdr = &st->hdr;
+	st->have_req = 1;
+	st->route = c->route;
+	st->pgroup = c->pgroup;
+	st->eos = 1;
+	c->have_req = 0;
+	c->route = 0;
+	c->pgroup = 0;
+	if(c->trace) {
+		free(st->trace);
+		st->trace = c->trace;
+		st->trace->stream = h2s->id;
+		c->trace = 0;
+	}
+
+	/* anything following the request is the start of the client preface */
+	buf = c->rcvbuf;
+	size = c->bufsz;
+	offs = st->hdr.body_offset;
+	c->rcvbuf = 0;
+	c->bufsz = 0;
+
+	finish_request(st);
+	mem_charge(MEM_HEADER, -size);
+	size = input_h2(c, buf + offs, size - offs);
+	free(buf);
+
+	if(size != -1 && draining) {
+		drain_conn(c);
+	}
+	return c->s == -1 ? -1 : 0;
+}
+
+static int recv_h2(struct client *c, char *buf, int bufsz)
+{
+	int rdsz;
+
+	while((rdsz = conn_recv(c, buf, bufsz)) > 0) {
+		if(input_h2(c, buf, rdsz) == -1 || c->rd_eof) {
+			return 0;
+		}
+		/* frames like PING and SETTINGS are answered whether the client reads
+		 * the answers or not, so stop while it doesn't, see want_read.
+		 */
+		if(c->outq.size > OUTQ_HIWAT) {
+			return 0;
+		}
+	}
+	if(rdsz == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		close_conn(c);
+	}
+	return 0;
+}
+
+/* pass received data to the HTTP/2 connection, and send whatever results */
+static int input_h2(struct client *c, const char *data, int size)
+{
+	if(size > 0 && h2_input(c->h2, data, size) == -1) {
+		if(c->s == -1) {
+			return -1;
+		}
+		/* protocol error, close the connection after sending the GOAWAY */
+		c->rd_eof = 1;
+		c->close_when_done = 1;
+	}
+	flush_client(c);
+	return c->s == -1 ? -1 : 0;
+}
+
+/* a request arrived on a new stream */
+static int h2_request(struct h2_stream *h2s, const char *hdr, int size, int eos, void *cls)
+{
+	struct client *c;
+	int status;
+
+	if(!(c = new_stream(cls, h2s))) {
+		return -1;
+	}
+	c->eos = eos;
+
+	if((status = http_parse_request(&c->hdr, hdr, size)) != HTTP_HDR_OK) {
+		http_destroy_request(&c->hdr);
+		respond_error(c, status == HTTP_HDR_NOMEM ? 503 : 400);
+		return 0;
+	}
+	http_log_request(&c->hdr);
+	c->have_req = 1;
+
+	begin_request(c);
+	return 0;
+}
+
+static void h2_data(struct h2_stream *h2s, char *data, int size, int eos)
+{
+	struct client *c = h2s->cls;
+
+	/* ignore anything after the request has been rejected */
+	if(c->state == ST_BODY) {
+		consume_body(c, data, size, eos);
+	}
+}
+
+static void h2_reset(struct h2_stream *h2s)
+{
+	struct client *c = h2s->cls;
+
+	c->h2s = 0;
+	close_conn(c);
+}
+
+static struct client *new_stream(struct client *conn, struct h2_stream *h2s)
+{
+	struct client *c, *tail;
+
+	if(!(c = calloc(1, sizeof *c))) {
+		logmsg("failed to allocate memory for HTTP/2 stream: %s\n", strerror(errno));
+		return 0;
+	}
+	c->s = conn->s;
+	c->state = ST_HEADER;
+	outq_init(&c->outq);
+	memcpy(&c->addr, &conn->addr, conn->addrlen);
+	c->addrlen = conn->addrlen;
+	c->parent = conn;
+	c->h2s = h2s;
+	h2s->cls = c;
+	if(trace_sample) {
+		trace_start(c, conn->conn_id, h2s->id);
+		TRACE(c, TR_FIRST_BYTE);
+	}
+
+	/* streams take turns sending, in the order they were opened */
+	if(conn->streams) {
+		tail = conn->streams;
+		while(tail->next) tail = tail->next;
+		tail->next = c;
+	} else {
+		conn->streams = c;
+	}
+	return c;
+}
+
+/* send the output of an HTTP/2 connection, refilling its queue with frames
+ * from the streams as it drains.
+ */
+static int flush_h2(struct client *c)
+{
+	int i, res = 0;
+	long size, max;
+
+	if(c->flushing || c->s == -1) {
+		return 0;
+	}
+	c->flushing = 1;
+
+	max = bw_allowance(c);
+	for(i=0; i<MAX_PRODUCE; i++) {
+		size = c->outq.size;
+		res = outq_flush(&c->outq, c->s, max);
+		if(c->outq.size < size) {
+			arm_timer(c);
+			max -= size - c->outq.size;
+			if(conn_bandwidth) c->bw_tokens -= size - c->outq.size;
+		}
+		if(res == 1 && conn_bandwidth && c->bw_tokens <= 0) {
+			bw_wait(c);
+		}
+		if(res != 0) {
+			break;
+		}
+		if((res = schedule_h2(c)) <= 0) {
+			break;
+		}
+	}
+	c->flushing = 0;
+
+	if(c->s == -1) {
+		return -1;
+	}
+	if(res == -1 || (outq_empty(&c->outq) && (c->close_when_done ||
+					(c->draining && !live_streams(c))))) {
+		close_conn(c);
+		return -1;
+	}
+	return 0;
+}
+
+static int live_streams(struct client *c)
+{
+	struct client *st;
+
+	for(st=c->streams; st; st=st->next) {
+		if(st->s != -1) return 1;
+	}
+	return 0;
+}
+
+/* queue DATA frames from the streams with something to send, one frame from
+ * each in turn, until the connection queue is full, or flow control stops
+ * them all. Returns the number of frames queued, or -1 on failure.
+ */
+static int schedule_h2(struct client *c)
+{
+	struct client *st, *tail;
+	int res, count = 0, progress;
+
+	/* start with a different stream each time */
+	if((st = c->streams) && st->next) {
+		tail = st;
+		while(tail->next) tail = tail->next;
+		c->streams = st->next;
+		st->next = 0;
+		tail->next = st;
+	}
+
+	do {
+		progress = 0;
+		for(st=c->streams; st; st=st->next) {
+			if(st->s == -1) continue;
+			if(c->outq.size >= H2_QUEUE_MAX) {
+				return count + progress;
+			}
+			if((res = stream_frame(c, st)) == -1) {
+				return -1;
+			}
+			progress += res;
+		}
+		count += progress;
+	} while(progress);
+
+	return count;
+}
+
+/* send the next DATA frame of a stream, if it has one and flow control allows
+ * it, calling the producer of streamed responses as needed. The last frame
+ * ends the stream. Returns 1 if a frame was queued.
+ */
+static int stream_frame(struct client *c, struct client *st)
+{
+	long len;
+	int eos, done;
+
+	if(outq_empty(&st->outq) && st->resp && !st->paused) {
+		if(produce(st) == -1 || st->s == -1) {
+			return c->s == -1 ? -1 : 0;
+		}
+	}
+	done = st->close_when_done && !st->resp && !st->fcgi && !st->proxy;
+
+	if(outq_empty(&st->outq)) {
+		if(!done) return 0;
+		len = 0;
+	} else {
+		if((len = h2_send_window(c->h2, st->h2s)) <= 0) {
+			return 0;
+		}
+		if(len > st->outq.size) {
+			len = st->outq.size;
+		}
+	}
+	eos = done && len == st->outq.size;
+
+	if(h2_send_data(c->h2, st->h2s, &st->outq, len, eos) == -1) {
+		close_conn(c);
+		return -1;
+	}
+	/* for streams, sent means moved to the connection queue */
+	TRACE(st, TR_FIRST_SENT);
+	if(eos) {
+		TRACE(st, TR_LAST_SENT);
+	}
+
+	if(st->throttled && st->outq.size < OUTQ_LOWAT) {
+		throttle_backend(st, 0);
+	}
+	if(eos) {
+		h2_close_stream(c->h2, st->h2s, 0);
+		st->h2s = 0;
+		close_conn(st);
+	}
+	return 1;
+}
+
+/* check for a token in a comma separated list, ignoring case and any
+ * parameters following it.
+ */
+static int has_token(const char *list, const char *tok)
+{
+	int len = strlen(tok);
+
+	while(*list) {
+		while(*list == ',' || isspace(*list)) list++;
+		if(strncasecmp(list, tok, len) == 0 && (!list[len] || list[len] == ',' ||
+					list[len] == ';' || isspace(list[len]))) {
+			return 1;
+		}
+		while(*list && *list != ',') list++;
+	}
+	return 0;
+}
+
+/* stop accepting new streams on an HTTP/2 connection, and close it when the
+ * ones in progress are done.
+ */
+static void drain_conn(struct client *c)
+{
+	if(c->draining) return;
+
+	h2_goaway(c->h2, H2_NO_ERROR);
+	c->draining = 1;
+	flush_client(c);
+}
+
+static int take_inherited(const char *name)
+{
+	int i, fd;
+
+	for(i=0; i<num_inherited; i++) {
+		if(inherited_fd[i] != -1 && strcmp(inherited_name[i], name) == 0) {
+			fd = inherited_fd[i];
+			inherited_fd[i] = -1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+/* close the inherited sockets which don't match any of our listeners */
+static void close_inherited(void)
+{
+	int i;
+
+	for(i=0; i<num_inherited; i++) {
+		if(inherited_fd[i] != -1) {
+			logmsg("handover: closing %s, not listening there anymore\n", inherited_name[i]);
+			close(inherited_fd[i]);
+		}
+		free(inherited_name[i]);
+	}
+	num_inherited = 0;
+}
+
+/* sampled requests get a trace record, which is added to the trace ring buffer
+ * when the connection or stream is closed, if the request got that far.
+ */
+static void trace_start(struct client *c, unsigned int conn, unsigned int stream)
+{
+	if(trace_count++ % trace_sample) {
+		return;
+	}
+	if(!(c->trace = calloc(1, sizeof *c->trace))) {
+		return;
+	}
+	c->trace->conn = conn;
+	c->trace->stream = stream;
+	TRACE(c, TR_ACCEPT);
+}
+
+static void trace_end(struct client *c)
+{
+	if(c->trace->t[TR_HEADER]) {
+		trace_commit(c->trace);
+	}
+	free(c->trace);
+	c->trace = 0;
+}
+
+static void fcgi_watch(int s, int events, void *cls)
+{
+	set_interest(s, events);
+}
+
+static void proxy_watch(int s, int events, void *cls)
+{
+	set_interest(s, events);
+}
+
+static struct fd_entry *get_fd_entry(int fd)
+{
+	int newsz;
+	struct fd_entry *tab;
+
+	if(fd >= fdtab_size) {
+		newsz = fdtab_size ? fdtab_size : 64;
+		while(newsz <= fd) {
+			newsz *= 2;
+		}
+		if(!(tab = realloc(fdtab, newsz * sizeof *tab))) {
+			return 0;
+		}
+		memset(tab + fdtab_size, 0, (newsz - fdtab_size) * sizeof *tab);
+		fdtab = tab;
+		fdtab_size = newsz;
+	}
+	return fdtab + fd;
+}
+
+/* report a socket to the interest function, if its events changed */
+static void set_interest(int fd, int events)
+{
+	struct fd_entry *fe;
+	int old;
+
+	if(!interest_func || fd < 0 || !(fe = get_fd_entry(fd))) {
+		return;
+	}
+	if((old = fe->events) != events) {
+		fe->events = events;
+		interest_func(fd, old, events, interest_cls);
+	}
+}
+
+/* the events of a connection (or the connection of a stream) might have
+ * changed, check it before returning to the event loop.
+ */
+static void mark_dirty(struct client *c)
+{
+	if(!interest_func) return;
+
+	if(c->parent) {
+		c = c->parent;
+	}
+	if(!c->dirty) {
+		c->dirty = 1;
+		c->next_dirty = dirty_list;
+		dirty_list = c;
+	}
+}
+
+/* report the events of the dirty connections, and free the closed ones */
+static void update_interest(void)
+{
+	struct client *c;
+
+	if(!interest_func || busy) return;
+
+	resume_reading();
+	while((c = dirty_list)) {
+		dirty_list = c->next_dirty;
+		c->dirty = 0;
+
+		if(c->s == -1) {
+			unlink_client(c);
+			free_client(c);
+			--num_clients;
+		} else {
+			set_interest(c->s, client_events(c));
+			reap_streams(c);
+		}
+	}
+
+	/* the I/O threads are started on demand */
+	if(iopool_fd() != iopool_watched) {
+		set_interest(iopool_watched, 0);
+		if((iopool_watched = iopool_fd()) != -1) {
+			set_interest(iopool_watched, TW_READ);
+		}
+	}
+}
+
+/* the same as tw_get_sockets/tw_get_wsockets */
+static int client_events(struct client *c)
+{
+	int wr, events = want_read(c) ? TW_READ : 0;
+
+	if(c->tls && !c->outq.tls) {
+		wr = tls_want_write(c->tls);	/* still in the TLS handshake */
+	} else {
+		wr = want_write(c);
+	}
+	return wr ? events | TW_WRITE : events;
+}
+
+static void unlink_client(struct client *c)
+{
+	if(c->prev) {
+		c->prev->next = c->next;
+	} else {
+		clist = c->next;
+	}
+	if(c->next) {
+		c->next->prev = c->prev;
+	}
+}
+
+/* free the finished streams of an HTTP/2 connection */
+static void reap_streams(struct client *c)
+{
+	struct client *st, dummy;
+
+	dummy.next = c->streams;
+	st = &dummy;
+	while(st->next) {
+		if(st->next->s == -1) {
+			struct client *dead = st->next;
+			st->next = dead->next;
+			free(dead);
+		} else {
+			st = st->next;
+		}
+	}
+	c->streams = dummy.next;
+}
+
+static long long now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* (re)start the idle timer of a connection, moving it to the end of the list */
+static void arm_timer(struct client *c)
+{
+	if(!idle_timeout || c->parent || c->s == -1) {
+		return;
+	}
+	disarm_timer(c);
+
+	c->deadline = now_msec() + idle_timeout * 1000LL;
+	c->tprev = timer_tail;
+	c->tnext = 0;
+	if(timer_tail) {
+		timer_tail->tnext = c;
+	} else {
+		timer_head = c;
+	}
+	timer_tail = c;
+	c->timer_armed = 1;
+}
+
+static void disarm_timer(struct client *c)
+{
+	if(!c->timer_armed) return;
+
+	if(c->tprev) {
+		c->tprev->tnext = c->tnext;
+	} else {
+		timer_head = c->tnext;
+	}
+	if(c->tnext) {
+		c->tnext->tprev = c->tprev;
+	} else {
+		timer_tail = c->tprev;
+	}
+	c->tprev = c->tnext = 0;
+	c->timer_armed = 0;
+}
+
+/* subscribers don't produce anything, their events are queued directly by
+ * tw_broadcast. They're only resumed to end the stream.
+ */
+static int sub_stream(struct tw_response *resp, void *cls)
+{
+	struct subscriber *sub = cls;
+	return sub->ch ? TW_STREAM_PAUSE : TW_STREAM_DONE;
+}
+
+static void sub_cleanup(void *cls)
+{
+	struct subscriber *sub = cls;
+	struct tw_channel *ch = sub->ch;
+
+	if(ch) {
+		if(sub->prev) {
+			sub->prev->next = sub->next;
+		} else {
+			ch->subs = sub->next;
+		}
+		if(sub->next) {
+			sub->next->prev = sub->prev;
+		}
+		ch->num_subs--;
+	}
+	free(sub);
+}
+
+/* write an event in the text/event-stream format, with a data line for each
+ * line of data, and return its size. With a null buf, just return the size.
+ */
+static long format_event(char *buf, const char *event, const char *data, int size)
+{
+	long len = 0;
+	int i, start = 0;
+
+	if(event) {
+		if(buf) sprintf(buf, "event: %s\n", event);
+		len = strlen(event) + 8;
+	}
+	for(i=0; i<=size; i++) {
+		if(i < size && data[i] != '\n') continue;
+
+		if(buf) {
+			memcpy(buf + len, "data: ", 6);
+			memcpy(buf + len + 6, data + start, i - start);
+			buf[len + 6 + i - start] = '\n';
+		}
+		len += i - start + 7;
+		start = i + 1;
+	}
+	if(buf) buf[len] = '\n';
+	return len + 1;
+}
+
+/* refill the bandwidth allowance of a connection for the time since it was
+ * last refilled, and return how many bytes it may send this turn.
+ */
+static long bw_allowance(struct client *c)
+{
+	long long now, burst;
+
+	if(!conn_bandwidth) {
+		return OUT_QUANTUM;
+	}
+	now = now_msec();
+	burst = (long long)conn_bandwidth * BW_TICK_MSEC * 2 / 1000 + 1;
+	if(now - c->bw_time >= 2 * BW_TICK_MSEC) {
+		c->bw_tokens = burst;
+	} else {
+		c->bw_tokens += (now - c->bw_time) * conn_bandwidth / 1000;
+		if(c->bw_tokens > burst) c->bw_tokens = burst;
+	}
+	c->bw_time = now;
+	return c->bw_tokens < OUT_QUANTUM ? c->bw_tokens : OUT_QUANTUM;
+}
+
+/* stop writing to a connection which used up its allowance until the next
+ * tick. Every wait is as long, so the list is kept in order by appending.
+ */
+static void bw_wait(struct client *c)
+{
+	if(c->bw_waiting || c->s == -1) return;
+
+	c->bw_deadline = now_msec() + BW_TICK_MSEC;
+	c->bwprev = bw_tail;
+	c->bwnext = 0;
+	if(bw_tail) {
+		bw_tail->bwnext = c;
+	} else {
+		bw_head = c;
+	}
+	bw_tail = c;
+	c->bw_waiting = 1;
+	mark_dirty(c);
+}
+
+static void bw_unwait(struct client *c)
+{
+	if(!c->bw_waiting) return;
+
+	if(c->bwprev) {
+		c->bwprev->bwnext = c->bwnext;
+	} else {
+		bw_head = c->bwnext;
+	}
+	if(c->bwnext) {
+		c->bwnext->bwprev = c->bwprev;
+	} else {
+		bw_tail = c->bwprev;
+	}
+	c->bwprev = c->bwnext = 0;
+	c->bw_waiting = 0;
+}
+
+/* the connection is idle if it's waiting for a request, or for the client to
+ * take more of the response. Waiting for a handler, a file or a CGI
+ * application doesn't count.
+ */
+static int waiting_for_client(struct client *c)
+{
+	if(c->h2) {
+		return !live_streams(c) || want_write(c);
+	}
+	return c->state != ST_DONE || want_write(c);
+}
+
+/* memory held for the responses of a connection (and all its streams) */
+static long output_memory(struct client *c)
+{
+	struct client *st;
+	long size = c->outq.memsize;
+
+	if(c->resp) {
+		size += c->resp->body_max;
+	}
+	for(st=c->streams; st; st=st->next) {
+		size += output_memory(st);
+	}
+	return size;
+}
+
+/* Stop reading from a connection while its output takes more memory than its
+ * budget, or takes any at all while the global budget is exceeded, so that
+ * clients which don't keep up can't make us queue more. Request headers and
+ * bodies don't count, since they're bounded anyway, and reading them is what
+ * lets them finish. Connections are read again once their output drains.
+ * HTTP/2 connections also stop over the high watermark, like the backends of
+ * slow clients.
+ */
+static int want_read(struct client *c)
+{
+	long size;
+	int paused = 0;
+
+	if(c->rd_eof) {
+		return 0;
+	}
+	if(conn_mem_limit || mem_limit) {
+		size = output_memory(c);
+		if(conn_mem_limit && size > conn_mem_limit) {
+			paused = MEM_PAUSED_CONN;
+		} else if(mem_limit && size > 0 && mem_total() > mem_limit) {
+			paused = MEM_PAUSED_GLOBAL;
+		}
+	}
+	set_mem_paused(c, paused);
+	if(c->h2 && c->outq.size > OUTQ_HIWAT) {
+		return 0;
+	}
+	return !paused;
+}
+
+static void set_mem_paused(struct client *c, int paused)
+{
+	if(c->mem_paused) {
+		num_mem_paused--;
+		if(c->mem_paused == MEM_PAUSED_GLOBAL) num_global_paused--;
+	}
+	if(paused) {
+		num_mem_paused++;
+		if(paused == MEM_PAUSED_GLOBAL) num_global_paused++;
+	}
+	c->mem_paused = paused;
+}
+
+/* Called before taking on more work. Over the high watermark (7/8 of the
+ * budget), the caches are trimmed to make room. Returns -1 if the budget is
+ * still exceeded after that, and the work should be turned away.
+ */
+static int reclaim_memory(void)
+{
+	long excess, cache;
+
+	if(!mem_limit) return 0;
+
+	if((excess = mem_total() - mem_limit / 8 * 7) > 0 && (cache = mem_used(MEM_CACHE)) > 0) {
+		mem_evicted += dirlist_trim(excess < cache ? cache - excess : 0);
+	}
+
+	if(mem_total() > mem_limit) {
+		if(!mem_exceeded) {
+			logmsg("memory budget exceeded (%ld of %ld bytes), turning requests away\n",
+					mem_total(), mem_limit);
+			mem_exceeded = 1;
+		}
+		return -1;
+	}
+	if(mem_exceeded) {
+		logmsg("memory use back within budget\n");
+		mem_exceeded = 0;
+	}
+	return 0;
+}
+
+/* connections paused while the global budget was exceeded are only checked
+ * again when they're marked dirty, so do that once there's room. The ones
+ * over their own budget are marked as their output drains.
+ */
+static void resume_reading(void)
+{
+	struct client *c;
+
+	if(!num_global_paused || (mem_limit && mem_total() > mem_limit)) {
+		return;
+	}
+	for(c=clist; c; c=c->next) {
+		if(c->mem_paused == MEM_PAUSED_GLOBAL) {
+			mark_dirty(c);
+		}
+	}
+}
+
+static void free_rcvbuf(struct client *c)
+{
+	mem_charge(MEM_HEADER, -c->bufsz);
+	free(c->rcvbuf);
+	c->rcvbuf = 0;
+	c->bufsz = 0;
+}
@@ -9,14 +9,352 @@
 #define TINYWEB_H_
 
 void tw_set_port(int port);
+
+/* listening sockets. If no listeners are added explicitly, tw_start listens
+ * on all IPv4 interfaces, on the port set with tw_set_port (8080 by default).
+ * Listeners must be added before calling tw_start, and are all serviced by the
+ * same loop, through tw_get_sockets/tw_handle_socket.
+ *
+ * addr is a numeric address to bind to, or null (or "*") for any interface.
+ * mode is the file permissions of the UNIX domain socket (0 for the default
+ * permissions according to the umask). A stale socket file with the same
+ * name is removed before binding, and the socket file is removed by tw_stop.
+ *
+ * All three return a listener id (>= 0), or -1 on failure.
+ */
+int tw_add_listen_inet(const char *addr, int port);
+int tw_add_listen_inet6(const char *addr, int port);
+int tw_add_listen_unix(const char *path, int mode);
+
+/* serve HTTPS on listener lis (an id returned by one of the above), with the
+ * certificate chain and private key in PEM files. keyfile can be null if the
+ * key is in the same file as the certificates. Where the kernel supports it,
+ * TLS records are encrypted by the kernel, so that files are still sent with
+ * sendfile. Returns -1 on failure, or if the library was built without TLS.
+ */
+int tw_set_listen_tls(int lis, const char *certfile, const char *keyfile);
+
+/* listening socket options, for listener lis, or if lis is -1, for all the
+ * listeners which don't set their own (including the default one added by
+ * tw_start). They must be set before tw_start, and apply to sockets inherited
+ * with a handover too. Options the system refuses are logged and skipped, and
+ * the TCP ones are ignored for UNIX domain sockets. TCP listeners always have
+ * SO_REUSEADDR set, so that restarting doesn't fail on connections of the
+ * previous run in TIME_WAIT.
+ *
+ * TW_SOCK_BACKLOG: length of the accept queue (default: 16).
+ * TW_SOCK_DEFER_ACCEPT: only accept a connection once its first data has
+ *   arrived, waiting for it up to this many seconds (TCP_DEFER_ACCEPT).
+ * TW_SOCK_FASTOPEN: accept data in the SYN from clients which connected
+ *   before, saving a round trip, with up to this many of them pending the
+ *   handshake (TCP_FASTOPEN). The system has to allow it too: on GNU/Linux the
+ *   net.ipv4.tcp_fastopen sysctl must have bit 1 (2) set.
+ * TW_SOCK_NODELAY: 1 to send without waiting to coalesce small writes on
+ *   accepted connections (TCP_NODELAY).
+ * TW_SOCK_BUSY_POLL: microseconds to busy poll the device queue when reading
+ *   from an empty socket (SO_BUSY_POLL), for lower latency at the expense of
+ *   CPU time. Values above the net.core.busy_read sysctl need CAP_NET_ADMIN.
+ * TW_SOCK_RCVBUF, TW_SOCK_SNDBUF: receive and send buffer sizes in bytes, for
+ *   accepted connections (0: the system default, adjusted automatically).
+ *
+ * Value 0 disables the option, or goes back to the default. Returns -1 on
+ * invalid arguments.
+ */
+#define TW_SOCK_BACKLOG			0
+#define TW_SOCK_DEFER_ACCEPT	1
+#define TW_SOCK_FASTOPEN		2
+#define TW_SOCK_NODELAY			3
+#define TW_SOCK_BUSY_POLL		4
+#define TW_SOCK_RCVBUF			5
+#define TW_SOCK_SNDBUF			6
+#define TW_NUM_SOCK_OPTS		7
+
+int tw_set_listen_opt(int lis, int opt, int value);
+
 int tw_set_root(const char *path);
+/* virtual hosts: requests with a Host matching name (without the port) are
+ * served from the files under root instead. Everything is looked up relative
+ * to a descriptor of each root, which is opened once, and each of them has its
+ * own directory listing cache. tw_add_vhost_dir adds every subdirectory of dir
+ * as a virtual host, named after it. Requests for any other host are served
+ * from the root set with tw_set_root, or the pack.
+ */
+int tw_add_vhost(const char *name, const char *root);
+int tw_add_vhost_dir(const char *dir);
+/* reverse proxy: requests for paths under prefix are forwarded to upstream
+ * HTTP servers, at host:port, [ipv6addr]:port, or unix:path. Adding more
+ * upstreams for the same prefix spreads the requests between them, skipping
+ * any which fail for a while. Upstream connections are kept alive and reused.
+ * Handlers take precedence over proxied prefixes, which take precedence over
+ * files.
+ */
+int tw_add_proxy(const char *prefix, const char *upstream);
+/* serve files from a static site pack built with twpack, instead of the
+ * document root. The pack is mapped to memory, and requests are served from it
+ * without touching the filesystem. Handlers still take precedence, but CGI and
+ * directory listings aren't available. Must be called before tw_start, and a
+ * null fname goes back to serving from the document root.
+ */
+int tw_set_pack(const char *fname);
 int tw_set_logfile(const char *fname);
 
+/* enable or disable automatically generated listings for directories which
+ * don't contain any index file (disabled by default). Listings are HTML, or
+ * JSON if the client asks for it with a format=json query string, or an
+ * Accept: application/json header field. Generated listings are cached, and
+ * only regenerated when the directory modification time changes.
+ */
+void tw_set_dirlist(int enable);
+
+/* warm up the caches at tw_start, before accepting connections (disabled by
+ * default). The document root is walked with nthreads threads, to get its
+ * metadata cached by the kernel, directory listings are generated, and files
+ * up to max_file_size bytes (or 1MB if 0) are read ahead into the page cache.
+ * With a pack, its files up to max_file_size are read ahead. The time spent
+ * and the amount prefetched are logged. nthreads 0 disables the warmup.
+ */
+void tw_set_warmup(int nthreads, long max_file_size);
+
+/* look up and open files with a pool of n threads, instead of on the thread
+ * running the loop (0, the default). The start of each file is read before
+ * it's sent, and the kernel is asked to read ahead the rest, so that a cold
+ * file on a slow disk only holds up the request for it. The threads are
+ * started when the first file is requested, and their notification descriptor
+ * is returned by tw_get_sockets along with the sockets.
+ */
+void tw_set_io_threads(int n);
+
+/* enable or disable HTTP/2 (enabled by default). Clients can start with the
+ * HTTP/2 preface on plain listeners, upgrade an HTTP/1.1 request with
+ * Upgrade: h2c, or choose it with ALPN on TLS listeners. Must be called before
+ * tw_start to affect ALPN.
+ */
+void tw_set_http2(int enable);
+
+/* run index.cgi and *.cgi files as FastCGI applications, with a pool of n
+ * persistent worker processes for each script, started on the first request
+ * and kept running until tw_stop. 0 disables CGI (the default), and .cgi files
+ * are served like any other file.
+ */
+void tw_set_cgi_workers(int n);
+
+/* maximum size of request bodies (64mb by default). Larger requests are
+ * rejected with 413 Request Entity Too Large. 0 means no limit.
+ */
+void tw_set_max_body(long size);
+
+/* per client limits (none by default), for each client address with scope
+ * TW_LIMIT_ADDR, and for each /24 IPv4 or /64 IPv6 network with scope
+ * TW_LIMIT_PREFIX. Clients can make rate requests per second on average, in
+ * bursts of up to burst requests (0 for one second's worth), and have up to
+ * max_conns connections open at once. Requests over the limit are answered
+ * with 429 Too Many Requests and a Retry-After field, before anything else is
+ * done for them, and connections over the limit are closed as soon as they're
+ * accepted. 0 disables either limit.
+ *
+ * Clients are tracked in fixed size tables, where the clients seen least
+ * recently make room for new ones. With worker processes, each worker keeps
+ * its own tables. Clients connecting over UNIX domain sockets aren't limited.
+ */
+#define TW_LIMIT_ADDR	0
+#define TW_LIMIT_PREFIX	1
+
+int tw_set_rate_limit(int scope, double rate, int burst, int max_conns);
+
+/* request tracing (disabled by default). The time each request reaches every
+ * phase is recorded: connection accepted (or stream opened), first byte of the
+ * request received, header complete, response ready, first and last byte of
+ * the response sent. 1 in sample requests is traced, and the last ring_size of
+ * them are kept in memory, where they can be written to a file with
+ * tw_trace_dump, as Chrome trace event JSON (for chrome://tracing or Perfetto).
+ * Traced requests taking longer than slow_msec are also logged, with the time
+ * spent in each phase (0 logs none). ring_size 0 disables tracing.
+ */
+int tw_set_trace(int ring_size, int sample, long slow_msec);
+int tw_trace_dump(const char *fname);
+
+/* capture everything received from clients to a file, as it arrives and with
+ * its timing, for replaying it later with twreplay. Data received over TLS is
+ * captured decrypted. The capture continues until tw_stop, or until
+ * tw_set_capture is called again, with another file name or null to stop it.
+ */
+int tw_set_capture(const char *fname);
+
+/* ---- in-process request handlers ----
+ * Handlers are called for requests matching a route, before falling back to
+ * serving files. Route patterns are absolute paths, where a segment starting
+ * with a colon (:id in /users/:id) is a parameter matching any single path
+ * segment, and a final segment starting with an asterisk (like *file) is a
+ * wildcard matching the rest of the path. Static segments take precedence over
+ * parameters, which take precedence over wildcards. Parameter values are
+ * retrieved by name with tw_req_param.
+ *
+ * method is the HTTP method name ("GET", "POST", ...), or null to match any
+ * method. HEAD requests are passed to GET handlers if there is no HEAD
+ * handler for that route, and the response body is dropped.
+ *
+ * The handler fills in the response with the tw_resp_* functions, and returns
+ * 0 on success, or -1 to reply with 500 Internal Server Error instead. The
+ * status defaults to 200, and Content-Length is added automatically.
+ *
+ * Request bodies (sent with Content-Length or chunked transfer-encoding) are
+ * received before the handler is called. They are kept in memory while
+ * they're small, and in an anonymous temporary file otherwise, and can be
+ * read with tw_req_read_body. Handlers added with tw_add_upload_handler get
+ * the body data passed to their body callback as it arrives instead, which
+ * returns 0 to continue, or -1 to abort the request with 500.
+ */
+struct tw_request;
+struct tw_response;
+
+typedef int (*tw_handler_func)(struct tw_request *req, struct tw_response *resp, void *cls);
+typedef int (*tw_body_func)(struct tw_request *req, const void *data, int size, void *cls);
+
+int tw_add_handler(const char *method, const char *pattern, tw_handler_func func, void *cls);
+int tw_add_upload_handler(const char *method, const char *pattern, tw_body_func body,
+		tw_handler_func func, void *cls);
+
+const char *tw_req_method(struct tw_request *req);
+const char *tw_req_path(struct tw_request *req);	/* decoded path */
+const char *tw_req_query(struct tw_request *req);	/* raw query string or null */
+const char *tw_req_param(struct tw_request *req, const char *name);
+const char *tw_req_header(struct tw_request *req, const char *name);
+/* size of the stored request body, and sequential reads from the start of it.
+ * tw_req_read_body returns the number of bytes read, 0 at the end, or -1.
+ */
+long tw_req_body_size(struct tw_request *req);
+int tw_req_read_body(struct tw_request *req, void *buf, int size);
+
+void tw_resp_status(struct tw_response *resp, int status);
+/* add a header field, formatted like printf: "Content-Type: %s" */
+int tw_resp_header(struct tw_response *resp, const char *fmt, ...);
+/* append to the response body. Both return the number of bytes written or -1 */
+int tw_resp_write(struct tw_response *resp, const void *data, int size);
+int tw_resp_printf(struct tw_response *resp, const char *fmt, ...);
+
+/* ---- streamed responses ----
+ * Handlers which don't know the size of the response up front, or want to
+ * start sending it before it's complete, call tw_resp_stream before returning.
+ * The header is sent when the handler returns, and then the stream function
+ * is called whenever the client is ready for more data, to write the next
+ * part of the body with tw_resp_write or tw_resp_printf. Each call is sent to
+ * HTTP/1.1 clients as a chunk with chunked transfer-encoding, and to older
+ * clients as is, with the end of the response marked by closing the
+ * connection. Slow clients aren't sent more data than they can take: the
+ * stream function isn't called again until they catch up.
+ *
+ * The stream function returns one of:
+ *  - TW_STREAM_MORE: call again when the client is ready for more.
+ *  - TW_STREAM_PAUSE: no data available right now, don't call again until
+ *    tw_resp_resume is called (for instance when new data arrives).
+ *  - TW_STREAM_DONE: the response is complete.
+ *  - -1 on errors, to abort the response and close the connection.
+ *
+ * The cleanup function (which can be null) is called once the stream ends,
+ * either because it's done, or because the connection was closed. The
+ * response must not be used after that.
+ */
+#define TW_STREAM_MORE	0
+#define TW_STREAM_DONE	1
+#define TW_STREAM_PAUSE	2
+
+typedef int (*tw_stream_func)(struct tw_response *resp, void *cls);
+typedef void (*tw_cleanup_func)(void *cls);
+
+int tw_resp_stream(struct tw_response *resp, tw_stream_func func, tw_cleanup_func cleanup,
+		void *cls);
+void tw_resp_resume(struct tw_response *resp);
+
+/* ---- event streams ----
+ * A channel broadcasts server-sent events to any number of subscribers. A
+ * handler subscribes its response to a channel with tw_subscribe, which turns
+ * it into a text/event-stream response kept open until the client goes away,
+ * or the channel is destroyed. tw_broadcast formats each event once, into a
+ * buffer shared by the output queues of all the subscribers instead of copied
+ * to each of them.
+ *
+ * Subscribers with more than max_queue bytes still waiting to be sent are
+ * handled according to the slow policy of the channel: TW_SLOW_SKIP doesn't
+ * send them any more events until they catch up, and TW_SLOW_CLOSE drops
+ * them.
+ */
+#define TW_SLOW_SKIP	0
+#define TW_SLOW_CLOSE	1
+
+struct tw_channel;
+
+struct tw_channel *tw_channel_create(int slow_policy, long max_queue);
+void tw_channel_destroy(struct tw_channel *ch);
+int tw_channel_subscribers(struct tw_channel *ch);
+
+int tw_subscribe(struct tw_response *resp, struct tw_channel *ch);
+/* event is the event type, or null for plain messages, and data may span
+ * multiple lines. Returns the number of subscribers the event was queued for,
+ * or -1 on errors.
+ */
+int tw_broadcast(struct tw_channel *ch, const char *event, const void *data, int size);
+
+
 int tw_start(void);
 int tw_stop(void);
 
+/* graceful shutdown: tw_drain closes the listening sockets, and lets the
+ * connections finish the requests in progress. HTTP/1 connections are closed
+ * after their response as usual, and HTTP/2 connections are sent a GOAWAY, and
+ * closed when their last stream is done. Keep running the loop until
+ * tw_get_num_clients returns 0 (or a deadline passes), then call tw_stop.
+ */
+int tw_drain(void);
+int tw_get_num_clients(void);
+
+/* hot restart: pass the listening sockets to a new process, over a connected
+ * UNIX domain socket which keeps message boundaries (SOCK_SEQPACKET), with
+ * SCM_RIGHTS. The new process calls tw_handover_recv before tw_start, which
+ * then keeps listening on the received sockets instead of creating its own,
+ * for all the listeners with the same address. The rest are closed. Once the
+ * new process has started, the old one drains with tw_drain, so that no
+ * connections are refused, and no responses are cut short. After a handover,
+ * UNIX domain socket files are left for the new process, and not removed.
+ */
+int tw_handover_send(int sock);
+int tw_handover_recv(int sock);
+/* the new process failed to start, and we keep serving */
+void tw_handover_cancel(void);
+
+/* ---- worker processes ----
+ * To use more than one CPU, the program forks n worker processes after
+ * tw_start, which each call tw_set_worker with their index (0 to n-1) and run
+ * the loop on their own, while the parent only holds on to the listeners.
+ * Each worker closes the sockets of the others.
+ *
+ * tw_set_workers must be called before tw_start, so that each TCP listener
+ * gets a socket for each worker in the same SO_REUSEPORT group, and with its
+ * own accept queue. UNIX domain listeners are shared by all workers. cpus is
+ * null, or an array of n CPUs to pin the workers to: tw_set_worker then pins
+ * the worker to its CPU, and makes it allocate memory from the NUMA node of
+ * that CPU, before it handles any connection.
+ *
+ * With steering enabled (tw_set_steering before tw_start, and pinned
+ * workers), each connection goes to the worker running on the CPU which
+ * received its packets, so that it's handled where the network stack has
+ * already touched it. Connections arriving on other CPUs are distributed as
+ * usual. Only the parent removes UNIX domain socket files, and should call
+ * tw_drain before stopping the workers.
+ */
+int tw_set_workers(int n, const int *cpus);
+void tw_set_steering(int enable);
+int tw_set_worker(int idx);
+/* called by the parent for a worker which won't be restarted, to close its
+ * sockets, so that their share of the connections goes to the others.
+ */
+void tw_drop_worker(int idx);
+/* fill cpus with the CPUs the process is allowed to run on, and return how
+ * many there are (-1 if it's not supported).
+ */
+int tw_get_cpus(int *cpus, int max);
+
 /* tw_get_sockets returns the number of active sockets managed by tinyweb
- * (clients plus the listening socket), and fills in the array sockets
+ * (clients plus the listening sockets), and fills in the array sockets
  * passed through the socks pointer, if it's not null.
  *
  * Call it with a null pointer initially to get the number of sockets, then
@@ -25,15 +363,106 @@ int tw_stop(void);
  */
 int tw_get_sockets(int *socks);
 
+/* tw_get_wsockets works the same way, and returns the client sockets with
+ * response data waiting to be sent, which need to be monitored for
+ * writability, and passed to tw_handle_socket when they're ready.
+ */
+int tw_get_wsockets(int *socks);
+
 /* returns the maximum file descriptor number in the set of sockets managed
  * by the library (useful for calling select).
  */
 int tw_get_maxfd(void);
 
 /* call tw_handle_socket to let tinyweb handle incoming traffic to any of the
- * tinyweb managed sockets.
+ * tinyweb managed sockets, or send more data to clients whose sockets are
+ * writable.
  */
 int tw_handle_socket(int s);
 
+/* Instead of collecting all the sockets every time around the loop, an event
+ * loop based on epoll/kqueue can be told which sockets to monitor only when
+ * that changes: the interest function is called with the events the socket
+ * was monitored for until now, and the ones it should be monitored for from
+ * now on (TW_READ and/or TW_WRITE). old_events is 0 for a new socket, and
+ * new_events is 0 for a socket which must no longer be monitored, which is
+ * also how it's reported right before a socket is closed.
+ *
+ * Set it before calling tw_start, and then pass every ready socket to
+ * tw_handle_socket. The sockets reported are the same as the ones returned by
+ * tw_get_sockets/tw_get_wsockets, which then don't need to be called at all.
+ */
+#define TW_READ		1
+#define TW_WRITE	2
+
+typedef void (*tw_interest_func)(int s, int old_events, int new_events, void *cls);
+
+int tw_set_interest_func(tw_interest_func func, void *cls);
+
+/* close connections after sec seconds without any progress while waiting on
+ * the client: for its request, or for it to take more of the response. HTTP/2
+ * connections without any open streams are idle too. 0 (the default) never
+ * closes them.
+ */
+void tw_set_idle_timeout(int sec);
+
+/* limit how fast the response of each connection is sent, in bytes per second.
+ * 0 (the default) sends as fast as the client takes it.
+ */
+void tw_set_conn_bandwidth(long bytes_per_sec);
+
+/* memory budgets in bytes (none by default), for everything held for the
+ * connections (request headers and bodies in memory, responses being built
+ * and waiting to be sent) and the caches, and for the responses of each
+ * connection. Connections with more output waiting than their budget aren't
+ * read from until it drains, and neither are the ones with any output waiting
+ * while the global budget is exceeded. Past 7/8 of the global budget, cached
+ * directory listings are dropped to make room, and past all of it, new
+ * requests are answered with 503 Service Unavailable and a Retry-After field.
+ * Request headers larger than the connection budget are rejected with 413.
+ * 0 disables either budget.
+ */
+void tw_set_mem_limit(long total, long per_conn);
+
+/* current memory accounting, and what the budgets have done so far */
+struct tw_mem_stats {
+	long header, body, output, cache;	/* bytes in use for each */
+	long total, peak, limit;
+	int paused;			/* connections not read from, to stay within budget */
+	long rejected;		/* requests answered with 503 */
+	long evicted;		/* bytes of cached listings dropped to make room */
+};
+
+void tw_get_mem_stats(struct tw_mem_stats *st);
+
+/* shed load when requests wait too long (disabled by default). The time the
+ * start of each request spends in its socket, from when the kernel received it
+ * until it's read, is measured with kernel receive timestamps. When even the
+ * shortest of these over a whole interval_msec (100 by default) is above
+ * target_msec, the server is falling behind rather than just going through a
+ * burst, and requests which waited longer than the target are answered right
+ * away with 503 Service Unavailable and a Retry-After field, instead of making
+ * everyone wait longer. Shedding stops after an interval where the shortest
+ * wait is back under the target. target_msec 0 disables it. Only connections
+ * accepted after it's enabled are measured.
+ */
+int tw_set_load_shedding(long target_msec, long interval_msec);
+
+struct tw_load_stats {
+	long min_sojourn_usec;	/* shortest wait in the last interval */
+	int overloaded;			/* shedding requests */
+	long shed;				/* requests shed so far */
+};
+
+void tw_get_load_stats(struct tw_load_stats *st);
+
+/* tw_next_timeout returns the number of milliseconds until the next timer
+ * expires (0 if one already has), or -1 if there are none, to be used as the
+ * timeout of poll/epoll_wait. tw_handle_timeouts must be called when it
+ * expires, and does nothing if called early.
+ */
+long tw_next_timeout(void);
+void tw_handle_timeouts(void);
+
 
 #endif	/* TINYWEB_H_ */
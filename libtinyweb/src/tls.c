@@ -0,0 +1,371 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "tls.h"
+#include "logger.h"
+
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* TLS 1.2 sessions kept in the server-side cache for resumption. TLS 1.3
+ * clients resume with session tickets instead, which are encrypted with a key
+ * generated for each context, and don't take up any memory on our side.
+ */
+#define SESS_CACHE_SIZE		4096
+#define SESS_TIMEOUT		3600
+
+/* encrypt files in pieces of this size, when kernel TLS isn't available */
+#define SENDFILE_BUFSZ		16384
+
+struct tls_ctx {
+	SSL_CTX *ctx;
+	int h2;			/* offer HTTP/2 with ALPN */
+};
+
+struct tls_conn {
+	SSL *ssl;
+	int want_write;
+	int ktls;		/* kernel TLS is handling encryption, SSL_sendfile works */
+	int pending;	/* size of a write to retry, see tls_write_pending */
+};
+
+static int io_error(struct tls_conn *conn, int res);
+static void log_errors(const char *msg);
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *cls);
+
+static int ktls_logged;
+
+
+struct tls_ctx *tls_create_ctx(const char *certfile, const char *keyfile)
+{
+	struct tls_ctx *ctx;
+	SSL_CTX *sslctx;
+
+	if(!(sslctx = SSL_CTX_new(TLS_server_method()))) {
+		log_errors("failed to create TLS context");
+		return 0;
+	}
+	SSL_CTX_set_min_proto_version(sslctx, TLS1_2_VERSION);
+
+	/* let the kernel do the record encryption after the handshake, where
+	 * it's supported, so that files can still be sent with sendfile.
+	 */
+	SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE |
+			SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(sslctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+	SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(sslctx, SESS_CACHE_SIZE);
+	SSL_CTX_set_timeout(sslctx, SESS_TIMEOUT);
+	SSL_CTX_set_session_id_context(sslctx, (unsigned char*)"tinyweb", 7);
+
+	if(SSL_CTX_use_certificate_chain_file(sslctx, certfile) != 1) {
+		logmsg("failed to load certificate: %s\n", certfile);
+		log_errors(0);
+		SSL_CTX_free(sslctx);
+		return 0;
+	}
+	if(!keyfile) keyfile = certfile;
+	if(SSL_CTX_use_PrivateKey_file(sslctx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(sslctx) != 1) {
+		logmsg("failed to load private key: %s\n", keyfile);
+		log_errors(0);
+		SSL_CTX_free(sslctx);
+		return 0;
+	}
+
+	if(!(ctx = malloc(sizeof *ctx))) {
+		logmsg("failed to allocate TLS context\n");
+		SSL_CTX_free(sslctx);
+		return 0;
+	}
+	ctx->ctx = sslctx;
+	ctx->h2 = 0;
+	SSL_CTX_set_alpn_select_cb(sslctx, select_alpn, ctx);
+	return ctx;
+}
+
+void tls_enable_h2(struct tls_ctx *ctx, int enable)
+{
+	ctx->h2 = enable;
+}
+
+void tls_destroy_ctx(struct tls_ctx *ctx)
+{
+	if(ctx) {
+		SSL_CTX_free(ctx->ctx);
+		free(ctx);
+	}
+}
+
+struct tls_conn *tls_accept(struct tls_ctx *ctx, int s)
+{
+	struct tls_conn *conn;
+
+	if(!(conn = calloc(1, sizeof *conn))) {
+		logmsg("failed to allocate TLS connection\n");
+		return 0;
+	}
+	if(!(conn->ssl = SSL_new(ctx->ctx)) || SSL_set_fd(conn->ssl, s) != 1) {
+		log_errors("failed to create TLS connection");
+		SSL_free(conn->ssl);
+		free(conn);
+		return 0;
+	}
+	SSL_set_accept_state(conn->ssl);
+	return conn;
+}
+
+void tls_close(struct tls_conn *conn)
+{
+	if(conn) {
+		/* send our close_notify if we can, but don't wait for the reply */
+		if(SSL_is_init_finished(conn->ssl)) {
+			SSL_shutdown(conn->ssl);
+		}
+		SSL_free(conn->ssl);
+		free(conn);
+		ERR_clear_error();
+	}
+}
+
+int tls_handshake(struct tls_conn *conn)
+{
+	int res;
+
+	if((res = SSL_do_handshake(conn->ssl)) == 1) {
+		conn->want_write = 0;
+		conn->ktls = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+		if(conn->ktls && !ktls_logged) {
+			logmsg("using kernel TLS offload\n");
+			ktls_logged = 1;
+		}
+		return 1;
+	}
+
+	switch(SSL_get_error(conn->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+		conn->want_write = 0;
+		return 0;
+
+	case SSL_ERROR_WANT_WRITE:
+		conn->want_write = 1;
+		return 0;
+
+	default:
+		break;
+	}
+	log_errors("TLS handshake failed");
+	return -1;
+}
+
+int tls_want_write(struct tls_conn *conn)
+{
+	return conn->want_write;
+}
+
+int tls_write_pending(struct tls_conn *conn)
+{
+	return conn->pending;
+}
+
+int tls_alpn_h2(struct tls_conn *conn)
+{
+	const unsigned char *proto;
+	unsigned int len;
+
+	SSL_get0_alpn_selected(conn->ssl, &proto, &len);
+	return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+int tls_recv(struct tls_conn *conn, void *buf, int size)
+{
+	int res;
+
+	if((res = SSL_read(conn->ssl, buf, size)) > 0) {
+		return res;
+	}
+	if(SSL_get_error(conn->ssl, res) == SSL_ERROR_ZERO_RETURN) {
+		return 0;
+	}
+	return io_error(conn, res);
+}
+
+int tls_send(struct tls_conn *conn, const void *buf, int size)
+{
+	int res;
+
+	if((res = SSL_write(conn->ssl, buf, size)) > 0) {
+		conn->want_write = 0;
+		conn->pending = 0;
+		return res;
+	}
+	/* OpenSSL fails a retry with less than this, as a bad write retry */
+	conn->pending = size;
+	return io_error(conn, res);
+}
+
+long tls_sendfile(struct tls_conn *conn, int fd, off_t *offs, long size)
+{
+	static char buf[SENDFILE_BUFSZ];
+	long res;
+
+	if(conn->ktls) {
+		if((res = SSL_sendfile(conn->ssl, fd, *offs, size, 0)) > 0) {
+			*offs += res;
+			return res;
+		}
+		return io_error(conn, res);
+	}
+
+	/* A retried write must pass the same data, which it does, since the
+	 * offset only advances when a write succeeds, and at least as much of it,
+	 * which is up to the caller.
+	 */
+	if(size > SENDFILE_BUFSZ) size = SENDFILE_BUFSZ;
+	if((res = pread(fd, buf, size, *offs)) <= 0) {
+		return res;
+	}
+	if((res = tls_send(conn, buf, res)) > 0) {
+		*offs += res;
+	}
+	return res;
+}
+
+/* translate OpenSSL errors to the errno values the callers expect */
+static int io_error(struct tls_conn *conn, int res)
+{
+	switch(SSL_get_error(conn->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+		conn->want_write = 0;
+		errno = EAGAIN;
+		break;
+
+	case SSL_ERROR_WANT_WRITE:
+		conn->want_write = 1;
+		errno = EAGAIN;
+		break;
+
+	case SSL_ERROR_SYSCALL:
+		if(!errno || errno == EAGAIN) errno = EPIPE;
+		break;
+
+	default:
+		log_errors("TLS error");
+		errno = EPROTO;
+		break;
+	}
+	ERR_clear_error();
+	return -1;
+}
+
+/* pick h2 if the client offers it and it's enabled, or http/1.1 */
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *cls)
+{
+	static const unsigned char protos[] = "\x02h2\x08http/1.1";
+	struct tls_ctx *ctx = cls;
+	const unsigned char *ours = protos;
+	unsigned int ourlen = sizeof protos - 1;
+
+	if(!ctx->h2) {
+		ours += 3;
+		ourlen -= 3;
+	}
+	if(SSL_select_next_proto((unsigned char**)out, outlen, ours, ourlen, in, inlen) !=
+			OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static void log_errors(const char *msg)
+{
+	unsigned long err;
+	char buf[256];
+
+	if(msg) {
+		logmsg("%s\n", msg);
+	}
+	while((err = ERR_get_error())) {
+		ERR_error_string_n(err, buf, sizeof buf);
+		logmsg("  %s\n", buf);
+	}
+}
+
+#else	/* !USE_TLS */
+
+struct tls_ctx *tls_create_ctx(const char *certfile, const char *keyfile)
+{
+	logmsg("tinyweb was built without TLS support\n");
+	return 0;
+}
+
+void tls_destroy_ctx(struct tls_ctx *ctx)
+{
+}
+
+struct tls_conn *tls_accept(struct tls_ctx *ctx, int s)
+{
+	return 0;
+}
+
+void tls_close(struct tls_conn *conn)
+{
+}
+
+int tls_handshake(struct tls_conn *conn)
+{
+	return -1;
+}
+
+int tls_want_write(struct tls_conn *conn)
+{
+	return 0;
+}
+
+int tls_write_pending(struct tls_conn *conn)
+{
+	return 0;
+}
+
+void tls_enable_h2(struct tls_ctx *ctx, int enable)
+{
+}
+
+int tls_alpn_h2(struct tls_conn *conn)
+{
+	return 0;
+}
+
+int tls_recv(struct tls_conn *conn, void *buf, int size)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+int tls_send(struct tls_conn *conn, const void *buf, int size)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+long tls_sendfile(struct tls_conn *conn, int fd, off_t *offs, long size)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+#endif	/* USE_TLS */
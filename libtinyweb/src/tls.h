@@ -0,0 +1,52 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <sys/types.h>
+
+/* TLS support is built with OpenSSL, when USE_TLS is defined. Without it,
+ * tls_create_ctx fails, and nothing else is ever called.
+ */
+struct tls_ctx;
+struct tls_conn;
+
+/* server context for a listener, with the certificate chain and private key
+ * in PEM files. keyfile can be null if it's in the same file as the chain.
+ */
+struct tls_ctx *tls_create_ctx(const char *certfile, const char *keyfile);
+void tls_destroy_ctx(struct tls_ctx *ctx);
+/* offer HTTP/2 to clients with ALPN, along with HTTP/1.1 */
+void tls_enable_h2(struct tls_ctx *ctx, int enable);
+
+struct tls_conn *tls_accept(struct tls_ctx *ctx, int s);
+void tls_close(struct tls_conn *conn);
+
+/* continue the handshake. Returns 1 when it's complete, 0 if it needs to wait
+ * for the socket, or -1 if it failed.
+ */
+int tls_handshake(struct tls_conn *conn);
+/* the connection is waiting for the socket to become writable */
+int tls_want_write(struct tls_conn *conn);
+/* HTTP/2 was chosen with ALPN during the handshake */
+int tls_alpn_h2(struct tls_conn *conn);
+
+/* tls_recv, tls_send and tls_sendfile work like recv, send and sendfile
+ * on non-blocking sockets, returning -1 with errno set to EAGAIN if they need
+ * to wait for the socket. tls_sendfile uses kernel TLS when it's available,
+ * and otherwise reads and encrypts the file in user space.
+ */
+int tls_recv(struct tls_conn *conn, void *buf, int size);
+int tls_send(struct tls_conn *conn, const void *buf, int size);
+long tls_sendfile(struct tls_conn *conn, int fd, off_t *offs, long size);
+/* after a write had to wait, it must be retried with the same data, and at
+ * least this much of it. 0 if there's no write to retry.
+ */
+int tls_write_pending(struct tls_conn *conn);
+
+#endif	/* TLS_H_ */
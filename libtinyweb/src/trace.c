@@ -0,0 +1,190 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+#include "logger.h"
+
+/* at most this many slow requests are logged each second, the rest are
+ * counted and mentioned with the next one logged.
+ */
+#define SLOW_LOG_RATE	10
+
+static void log_slow(const struct trace_req *tr, uint64_t total);
+static void write_str(FILE *fp, const char *s);
+
+/* names of the intervals between each phase and the next */
+static const char *interval_name[] = {
+	"wait request",
+	"receive header",
+	"resolve",
+	"wait send",
+	"send"
+};
+
+static struct trace_req *ring;
+static int ring_size, ring_head, ring_count;
+static uint64_t slow_ns;
+static time_t slow_sec;
+static int slow_logged, slow_skipped;
+
+
+int trace_init(int size, long slow_msec)
+{
+	trace_cleanup();
+	if(size <= 0) {
+		return 0;
+	}
+	if(!(ring = calloc(size, sizeof *ring))) {
+		logmsg("failed to allocate trace buffer\n");
+		return -1;
+	}
+	ring_size = size;
+	slow_ns = (uint64_t)slow_msec * 1000000;
+	return 0;
+}
+
+void trace_cleanup(void)
+{
+	free(ring);
+	ring = 0;
+	ring_size = ring_head = ring_count = 0;
+}
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_commit(const struct trace_req *tr)
+{
+	int i;
+	uint64_t end = 0;
+
+	if(!ring) return;
+
+	ring[ring_head] = *tr;
+	ring_head = (ring_head + 1) % ring_size;
+	if(ring_count < ring_size) {
+		ring_count++;
+	}
+
+	if(slow_ns) {
+		for(i=0; i<TR_NUM_PHASES; i++) {
+			if(tr->t[i]) end = tr->t[i];
+		}
+		if(end - tr->t[TR_ACCEPT] >= slow_ns) {
+			log_slow(tr, end - tr->t[TR_ACCEPT]);
+		}
+	}
+}
+
+/* every request is a complete event spanning the whole request, with its
+ * phases as complete events nested inside it, on a track of its own.
+ */
+int trace_dump(const char *fname)
+{
+	FILE *fp;
+	int i, j, idx, first = 1;
+	unsigned int pid = getpid();
+	struct trace_req *tr;
+	uint64_t end;
+
+	if(!ring) {
+		logmsg("trace_dump: tracing is disabled\n");
+		return -1;
+	}
+	if(!(fp = fopen(fname, "w"))) {
+		logmsg("failed to open trace file: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(i=0; i<ring_count; i++) {
+		idx = (ring_head - ring_count + i + ring_size) % ring_size;
+		tr = ring + idx;
+
+		end = tr->t[TR_ACCEPT];
+		for(j=0; j<TR_NUM_PHASES; j++) {
+			if(tr->t[j]) end = tr->t[j];
+		}
+
+		fprintf(fp, "%s{\"name\":\"", first ? "" : ",\n");
+		write_str(fp, tr->method);
+		fputc(' ', fp);
+		write_str(fp, tr->path);
+		fprintf(fp, "\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%u,\"tid\":%d,\"ts\":%.3f,"
+				"\"dur\":%.3f,\"args\":{\"status\":%d,\"conn\":%u,\"stream\":%u}}", pid, i,
+				tr->t[TR_ACCEPT] / 1000.0, (end - tr->t[TR_ACCEPT]) / 1000.0, tr->status,
+				tr->conn, tr->stream);
+		first = 0;
+
+		for(j=0; j<TR_NUM_PHASES - 1; j++) {
+			if(!tr->t[j] || !tr->t[j + 1]) continue;
+			fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":%u,"
+					"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", interval_name[j], pid, i,
+					tr->t[j] / 1000.0, (tr->t[j + 1] - tr->t[j]) / 1000.0);
+		}
+	}
+	fprintf(fp, "\n]}\n");
+
+	if(fclose(fp) == EOF) {
+		logmsg("failed to write trace file: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	logmsg("wrote %d traced requests to %s\n", ring_count, fname);
+	return 0;
+}
+
+static void log_slow(const struct trace_req *tr, uint64_t total)
+{
+	int i;
+	time_t now = time(0);
+	char buf[256], *ptr = buf;
+
+	if(now != slow_sec) {
+		slow_sec = now;
+		slow_logged = 0;
+	}
+	if(++slow_logged > SLOW_LOG_RATE) {
+		slow_skipped++;
+		return;
+	}
+
+	for(i=0; i<TR_NUM_PHASES - 1; i++) {
+		if(tr->t[i] && tr->t[i + 1]) {
+			ptr += sprintf(ptr, "%s%s %.1f", ptr == buf ? "" : ", ", interval_name[i],
+					(tr->t[i + 1] - tr->t[i]) / 1000000.0);
+		}
+	}
+	logmsg("slow request: %s %s (%d): %.1f ms (%s)%s\n", tr->method, tr->path, tr->status,
+			total / 1000000.0, buf, slow_skipped ? ", more not logged" : "");
+	slow_skipped = 0;
+}
+
+static void write_str(FILE *fp, const char *s)
+{
+	while(*s) {
+		if(*s == '"' || *s == '\\') {
+			fputc('\\', fp);
+			fputc(*s, fp);
+		} else if((unsigned char)*s < 32) {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			fputc(*s, fp);
+		}
+		s++;
+	}
+}
@@ -0,0 +1,47 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/* request phases, in the order they happen */
+enum {
+	TR_ACCEPT,		/* connection accepted, or HTTP/2 stream opened */
+	TR_FIRST_BYTE,	/* first byte of the request received */
+	TR_HEADER,		/* request header complete */
+	TR_RESOLVED,	/* response header ready: handler done, file found, etc */
+	TR_FIRST_SENT,	/* first byte of the response sent */
+	TR_LAST_SENT,	/* last byte of the response sent */
+
+	TR_NUM_PHASES
+};
+
+struct trace_req {
+	uint64_t t[TR_NUM_PHASES];	/* nanoseconds, 0 for phases never reached */
+	unsigned int conn, stream;
+	int status;
+	char method[8];
+	char path[64];
+};
+
+/* keep the last size traced requests (0 disables tracing), and log the ones
+ * slower than slow_msec (0 to log none).
+ */
+int trace_init(int size, long slow_msec);
+void trace_cleanup(void);
+
+uint64_t trace_now(void);
+
+/* add a finished request to the ring buffer */
+void trace_commit(const struct trace_req *tr);
+
+/* write the requests in the ring buffer as Chrome trace event JSON */
+int trace_dump(const char *fname);
+
+#endif	/* TRACE_H_ */
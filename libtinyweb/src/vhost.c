@@ -0,0 +1,172 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <alloca.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "vhost.h"
+#include "dirlist.h"
+#include "rbtree.h"
+#include "logger.h"
+
+#define MAX_HOST_LEN	255
+
+static int host_key(const char *host, char *buf);
+static void free_vhost(struct vhost *vh);
+
+static struct rbtree *hosts;
+static struct vhost *vhlist;
+static struct vhost defhost = {"", 0, AT_FDCWD, 0, 0};
+
+
+int vhost_add(const char *name, const char *root)
+{
+	struct vhost *vh;
+	char key[MAX_HOST_LEN + 1];
+
+	if(host_key(name, key) == -1 || !*key) {
+		logmsg("invalid virtual host name: %s\n", name);
+		return -1;
+	}
+	if(!hosts) {
+		if(!(hosts = rb_create(RB_KEY_STRING))) {
+			logmsg("failed to allocate virtual host table\n");
+			return -1;
+		}
+	}
+	if(rb_find(hosts, key)) {
+		logmsg("virtual host %s added twice\n", key);
+		return -1;
+	}
+
+	if(!(vh = calloc(1, sizeof *vh))) {
+		logmsg("failed to allocate virtual host: %s\n", strerror(errno));
+		return -1;
+	}
+	vh->rootfd = -1;
+	if(!(vh->name = strdup(key))) {
+		logmsg("failed to allocate virtual host: %s\n", strerror(errno));
+		free_vhost(vh);
+		return -1;
+	}
+	if((vh->rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+			!(vh->root = realpath(root, 0))) {
+		logmsg("virtual host %s: failed to open %s: %s\n", key, root, strerror(errno));
+		free_vhost(vh);
+		return -1;
+	}
+	if(!(vh->dlcache = dirlist_create(vh->rootfd)) || rb_insert(hosts, vh->name, vh) == -1) {
+		logmsg("failed to allocate virtual host %s\n", key);
+		free_vhost(vh);
+		return -1;
+	}
+
+	vh->next = vhlist;
+	vhlist = vh;
+	return 0;
+}
+
+int vhost_add_dir(const char *dir)
+{
+	DIR *dp;
+	struct dirent *dent;
+	struct stat st;
+	char *path;
+	int count = 0;
+
+	if(!(dp = opendir(dir))) {
+		logmsg("failed to open virtual hosts directory %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	path = alloca(strlen(dir) + 258);
+
+	while((dent = readdir(dp))) {
+		if(dent->d_name[0] == '.' || strlen(dent->d_name) > MAX_HOST_LEN) {
+			continue;
+		}
+		if(fstatat(dirfd(dp), dent->d_name, &st, 0) == -1 || !S_ISDIR(st.st_mode)) {
+			continue;
+		}
+		sprintf(path, "%s/%s", dir, dent->d_name);
+		if(vhost_add(dent->d_name, path) == 0) {
+			count++;
+		}
+	}
+	closedir(dp);
+
+	logmsg("added %d virtual hosts from %s\n", count, dir);
+	return 0;
+}
+
+struct vhost *vhost_find(const char *host)
+{
+	struct rbnode *node;
+	char key[MAX_HOST_LEN + 1];
+
+	if(host && hosts && host_key(host, key) != -1 && (node = rb_find(hosts, key))) {
+		return node->data;
+	}
+	return vhost_default();
+}
+
+struct vhost *vhost_default(void)
+{
+	if(!defhost.dlcache) {
+		defhost.dlcache = dirlist_create(AT_FDCWD);
+	}
+	return &defhost;
+}
+
+struct vhost *vhost_list(void)
+{
+	return vhlist;
+}
+
+/* host names are matched in lowercase, without the port, and without the dot
+ * of fully qualified names.
+ */
+static int host_key(const char *host, char *buf)
+{
+	int len;
+	const char *end;
+
+	if(*host == '[' && (end = strchr(host, ']'))) {
+		len = end - host + 1;	/* IPv6 address */
+	} else {
+		len = strcspn(host, ":/");
+	}
+	if(len > 1 && host[len - 1] == '.') {
+		len--;
+	}
+	if(len > MAX_HOST_LEN) {
+		return -1;
+	}
+
+	buf[len] = 0;
+	while(--len >= 0) {
+		buf[len] = tolower((unsigned char)host[len]);
+	}
+	return 0;
+}
+
+static void free_vhost(struct vhost *vh)
+{
+	if(vh->rootfd != -1) {
+		close(vh->rootfd);
+	}
+	dirlist_destroy(vh->dlcache);
+	free(vh->root);
+	free(vh->name);
+	free(vh);
+}
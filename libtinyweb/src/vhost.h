@@ -0,0 +1,41 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef VHOST_H_
+#define VHOST_H_
+
+struct dirlist_cache;
+
+/* A site served by name. Files are looked up relative to its root directory
+ * descriptor, never through the current directory, so any number of them can
+ * be served by the same process. The default site, for requests which don't
+ * match any of them, is the current directory.
+ */
+struct vhost {
+	char *name;		/* lowercase host name, without a port */
+	char *root;		/* absolute path of the root, null for the default site */
+	int rootfd;		/* AT_FDCWD for the default site */
+	struct dirlist_cache *dlcache;	/* listings of its directories */
+
+	struct vhost *next;
+};
+
+/* add a site with the files under root. name can't be added twice */
+int vhost_add(const char *name, const char *root);
+/* add every subdirectory of dir as a site, named after the subdirectory */
+int vhost_add_dir(const char *dir);
+
+/* the site for the Host of a request, or the default site for anything else,
+ * including a null host.
+ */
+struct vhost *vhost_find(const char *host);
+struct vhost *vhost_default(void);
+
+/* all the sites added, not including the default */
+struct vhost *vhost_list(void);
+
+#endif	/* VHOST_H_ */
@@ -0,0 +1,220 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <alloca.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "warmup.h"
+#include "logger.h"
+
+struct dirnode {
+	char *path;
+	struct stat st;
+	struct dirnode *next;
+};
+
+/* state shared by the walker threads. Directories are taken from the queue
+ * by whichever thread is free, and the walk is over when the queue is empty
+ * and no thread is reading a directory, which could add more.
+ */
+struct walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct dirnode *queue;
+	struct dirnode *done;	/* directories already read, for the callback */
+	int busy;
+	int rootfd;
+	long max_size;
+	struct warmup_stats stats;
+};
+
+static void *walk_thread(void *cls);
+static void read_dir(struct walk *w, struct dirnode *node);
+static int add_dir(struct walk *w, const char *path, struct stat *st);
+
+
+int warmup(int rootfd, int nthreads, long max_size, warmup_dir_func func, void *cls,
+		struct warmup_stats *stats)
+{
+	struct walk w;
+	struct stat st;
+	struct dirnode *node;
+	pthread_t *threads;
+	sigset_t sigset, oldset;
+	int i, num_started = 0;
+
+	memset(&w, 0, sizeof w);
+	pthread_mutex_init(&w.lock, 0);
+	pthread_cond_init(&w.cond, 0);
+	w.rootfd = rootfd;
+	w.max_size = max_size;
+
+	if(fstatat(rootfd, ".", &st, 0) == -1 || add_dir(&w, ".", &st) == -1) {
+		return -1;
+	}
+
+	/* the calling thread walks too, so start one less. Signals are left to
+	 * the main thread.
+	 */
+	threads = alloca((nthreads > 1 ? nthreads - 1 : 1) * sizeof *threads);
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+	for(i=0; i<nthreads - 1; i++) {
+		if(pthread_create(threads + num_started, 0, walk_thread, &w) != 0) {
+			logmsg("warmup: failed to start thread, continuing with %d\n", num_started + 1);
+			break;
+		}
+		num_started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, 0);
+
+	walk_thread(&w);
+	for(i=0; i<num_started; i++) {
+		pthread_join(threads[i], 0);
+	}
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+
+	while(w.done) {
+		node = w.done;
+		w.done = node->next;
+		if(func) {
+			func(node->path, &node->st, cls);
+		}
+		free(node->path);
+		free(node);
+	}
+
+	if(stats) {
+		stats->num_dirs += w.stats.num_dirs;
+		stats->num_files += w.stats.num_files;
+		stats->prefetched += w.stats.prefetched;
+	}
+	return 0;
+}
+
+static void *walk_thread(void *cls)
+{
+	struct walk *w = cls;
+	struct dirnode *node;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;) {
+		while(!w->queue && w->busy) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if(!(node = w->queue)) {
+			break;
+		}
+		w->queue = node->next;
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		read_dir(w, node);
+
+		pthread_mutex_lock(&w->lock);
+		node->next = w->done;
+		w->done = node;
+		w->stats.num_dirs++;
+		if(--w->busy == 0) {
+			pthread_cond_broadcast(&w->cond);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static void read_dir(struct walk *w, struct dirnode *node)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	char *path;
+	int fd, dfd, num_files = 0;
+	long prefetched = 0;
+
+	if((fd = openat(w->rootfd, node->path, O_RDONLY | O_DIRECTORY)) == -1) {
+		return;
+	}
+	if(!(dir = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+	dfd = dirfd(dir);
+
+	while((dent = readdir(dir))) {
+		if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+		/* don't follow symlinks to directories, they could lead to loops */
+		if(fstatat(dfd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if(S_ISLNK(st.st_mode) && (fstatat(dfd, dent->d_name, &st, 0) == -1 ||
+					S_ISDIR(st.st_mode))) {
+			continue;
+		}
+
+		if(S_ISDIR(st.st_mode)) {
+			if(!(path = malloc(strlen(node->path) + strlen(dent->d_name) + 2))) {
+				continue;
+			}
+			if(strcmp(node->path, ".") == 0) {
+				strcpy(path, dent->d_name);
+			} else {
+				sprintf(path, "%s/%s", node->path, dent->d_name);
+			}
+			add_dir(w, path, &st);
+			free(path);
+			continue;
+		}
+		if(!S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		num_files++;
+		if(st.st_size > 0 && st.st_size <= w->max_size &&
+				(fd = openat(dfd, dent->d_name, O_RDONLY)) != -1) {
+			if(posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED) == 0) {
+				prefetched += st.st_size;
+			}
+			close(fd);
+		}
+	}
+	closedir(dir);
+
+	pthread_mutex_lock(&w->lock);
+	w->stats.num_files += num_files;
+	w->stats.prefetched += prefetched;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int add_dir(struct walk *w, const char *path, struct stat *st)
+{
+	struct dirnode *node;
+
+	if(!(node = malloc(sizeof *node)) || !(node->path = strdup(path))) {
+		logmsg("warmup: failed to allocate directory node\n");
+		free(node);
+		return -1;
+	}
+	node->st = *st;
+
+	pthread_mutex_lock(&w->lock);
+	node->next = w->queue;
+	w->queue = node;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
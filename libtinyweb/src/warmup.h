@@ -0,0 +1,31 @@
+/* tinyweb - tiny web server library and daemon
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#ifndef WARMUP_H_
+#define WARMUP_H_
+
+#include <sys/stat.h>
+
+struct warmup_stats {
+	int num_dirs, num_files;
+	long prefetched;		/* bytes of files we asked the kernel to read ahead */
+};
+
+/* called for each directory, with a path relative to the root ("." for the
+ * root itself). Called from the thread which called warmup, after the walk.
+ */
+typedef void (*warmup_dir_func)(const char *path, struct stat *st, void *cls);
+
+/* walk the tree under rootfd (AT_FDCWD for the current directory) with
+ * nthreads threads, to get the metadata of everything in the kernel caches,
+ * and start reading files up to max_size bytes into the page cache. The stats
+ * are added to the ones passed in.
+ */
+int warmup(int rootfd, int nthreads, long max_size, warmup_dir_func func, void *cls,
+		struct warmup_stats *stats);
+
+#endif	/* WARMUP_H_ */
@@ -8,80 +8,1030 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <alloca.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include "tinyweb.h"
 
+/* default time to let requests in progress finish, when shutting down */
+#define DEF_GRACE_PERIOD	30
+
+/* the new process gets the socket to receive the listeners from on this fd */
+#define HANDOVER_FD		3
+#define HANDOVER_ENV	"TINYWEB_HANDOVER_FD"
+
+/* maximum CPUs in the -a list */
+#define MAX_CPUS		1024
+
+/* traced requests kept for dumping */
+#define TRACE_RING_SIZE	4096
+
 int parse_args(int argc, char **argv);
 void sighandler(int s);
+static int init_signals(void);
+static int serve(void);
+static int run_master(void);
+static int start_worker(int idx);
+static int run_worker(int idx, sigset_t *sigmask);
+static void stop_workers(void);
+static void signal_workers(int sig);
+static int live_workers(void);
+static void reap_workers(void);
+static int setup_workers(void);
+static int handle_signals(void);
+static int hot_restart(void);
+static int finish_handover(void);
+static void start_drain(void);
+static void dump_trace(void);
+static void print_stats(void);
+static int set_mem_limit(const char *str);
+static int set_load_shedding(const char *str);
+static int start_capture(void);
+static int add_vhost(const char *spec);
+static int add_proxy(const char *spec);
+static int set_sock_opts(const char *spec);
+
+static int last_lis = -1;	/* last listener added, for -t and -O */
+static int grace_period = DEF_GRACE_PERIOD;
+
+/* signals are passed to the main loop through a pipe */
+static int sigpipe[2] = {-1, -1};
+static int draining;
+static time_t deadline;
+
+/* hot restart: the arguments and directory to start the new process with,
+ * and our end of the socket it gets the listeners from, until it's ready.
+ */
+static char **args;
+static char *startdir, *binpath;
+static int handover_fd = -1;
+static pid_t newpid;
+
+/* worker processes (-j), the CPUs to pin them to (-a), and whether to steer
+ * connections to the worker on the CPU which received them (-s). Only the
+ * master has the table of worker pids.
+ */
+static int num_workers;
+static int *worker_cpus, num_cpus;
+static int steer;
+static pid_t *worker_pids;
+static time_t *worker_start;
+static int worker_num = -1;		/* index of this worker */
+
+/* request tracing: dumped to trace_file on SIGUSR1 and at exit (-T), and
+ * requests slower than slow_msec logged (-S).
+ */
+static char *trace_file;
+static int trace_sample = 1;
+static long slow_msec;
+
+/* traffic capture file (-C) */
+static char *capture_file;
 
 
 int main(int argc, char **argv)
 {
-	int *sockets, num_sockets, sockets_arr_size = 0;
+	int res, handover_in = -1;
+	char *env;
 
-	if(parse_args(argc, argv) == -1) {
+	args = argv;
+	startdir = getcwd(0, 0);
+	binpath = realpath("/proc/self/exe", 0);
+
+	if(parse_args(argc, argv) == -1 || setup_workers() == -1) {
+		return 1;
+	}
+	if((trace_file || slow_msec) && tw_set_trace(TRACE_RING_SIZE, trace_sample, slow_msec) == -1) {
 		return 1;
 	}
 
-	signal(SIGINT, sighandler);
-	signal(SIGTERM, sighandler);
-	signal(SIGQUIT, sighandler);
+	/* started by a hot restart, take over the listening sockets */
+	if((env = getenv(HANDOVER_ENV))) {
+		handover_in = atoi(env);
+		unsetenv(HANDOVER_ENV);
+		if(tw_handover_recv(handover_in) == -1) {
+			return 1;
+		}
+	}
+
+	if(init_signals() == -1) {
+		return 1;
+	}
 
 	if(tw_start() == -1) {
 		return 1;
 	}
 
+	/* let the previous process know we're serving, so that it can drain */
+	if(handover_in != -1) {
+		if(write(handover_in, "k", 1) != 1) {
+			perror("failed to notify the previous process");
+		}
+		close(handover_in);
+	}
+
+	if(worker_pids) {
+		res = run_master();
+	} else {
+		res = start_capture() == -1 ? 1 : serve();
+		dump_trace();
+	}
+
+	tw_stop();
+	printf("bye!\n");
+	return res;
+}
+
+static int init_signals(void)
+{
+	struct sigaction sa;
+
+	if(pipe(sigpipe) == -1) {
+		perror("failed to create signal pipe");
+		return -1;
+	}
+	fcntl(sigpipe[0], F_SETFL, fcntl(sigpipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(sigpipe[1], F_SETFL, fcntl(sigpipe[1], F_GETFL) | O_NONBLOCK);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGQUIT, &sa, 0);
+	sigaction(SIGUSR1, &sa, 0);
+	sigaction(SIGUSR2, &sa, 0);
+	if(worker_pids) {
+		sigaction(SIGCHLD, &sa, 0);
+	}
+	return 0;
+}
+
+/* the main loop of a single process server, or of each worker */
+static int serve(void)
+{
+	int *sockets = 0, num_sockets, num_wsockets, sockets_arr_size = 0;
+
 	for(;;) {
-		int i;
-		fd_set rdset;
+		int i, maxfd, res;
+		long msec;
+		fd_set rdset, wrset;
+		struct timeval tv, *timeout = 0;
+
+		if(draining) {
+			time_t now = time(0);
+			if(tw_get_num_clients() == 0) {
+				break;
+			}
+			if(now >= deadline) {
+				fprintf(stderr, "grace period over, closing %d connections\n",
+						tw_get_num_clients());
+				break;
+			}
+			tv.tv_sec = deadline - now;
+			tv.tv_usec = 0;
+			timeout = &tv;
+		}
+		/* wake up for the next connection timeout too, if it's sooner */
+		if((msec = tw_next_timeout()) >= 0 && (!timeout || msec < tv.tv_sec * 1000)) {
+			tv.tv_sec = msec / 1000;
+			tv.tv_usec = (msec % 1000) * 1000;
+			timeout = &tv;
+		}
 
+		/* read sockets first, followed by the sockets waiting to send */
 		num_sockets = tw_get_sockets(0);
-		if(num_sockets > sockets_arr_size) {
+		num_wsockets = tw_get_wsockets(0);
+		if(num_sockets + num_wsockets > sockets_arr_size) {
 			int newsz = sockets_arr_size ? sockets_arr_size * 2 : 16;
-			int *newarr = realloc(sockets, newsz * sizeof *sockets);
-			if(!newarr) {
+			int *newarr;
+
+			while(newsz < num_sockets + num_wsockets) newsz *= 2;
+			if(!(newarr = realloc(sockets, newsz * sizeof *sockets))) {
 				fprintf(stderr, "failed to allocate sockets array\n");
-				tw_stop();
+				free(sockets);
 				return 1;
 			}
 			sockets = newarr;
 			sockets_arr_size = newsz;
 		}
 		tw_get_sockets(sockets);
+		tw_get_wsockets(sockets + num_sockets);
 
 		FD_ZERO(&rdset);
+		FD_ZERO(&wrset);
 		for(i=0; i<num_sockets; i++) {
 			FD_SET(sockets[i], &rdset);
 		}
+		for(i=0; i<num_wsockets; i++) {
+			FD_SET(sockets[num_sockets + i], &wrset);
+		}
+
+		FD_SET(sigpipe[0], &rdset);
+		maxfd = tw_get_maxfd();
+		if(sigpipe[0] > maxfd) maxfd = sigpipe[0];
+		if(handover_fd != -1) {
+			FD_SET(handover_fd, &rdset);
+			if(handover_fd > maxfd) maxfd = handover_fd;
+		}
 
-		while(select(tw_get_maxfd() + 1, &rdset, 0, 0, 0) == -1 && errno == EINTR);
+		if((res = select(maxfd + 1, &rdset, &wrset, 0, timeout)) == -1) {
+			if(errno == EINTR) continue;
+			perror("select failed");
+			break;
+		}
 
 		for(i=0; i<num_sockets; i++) {
 			if(FD_ISSET(sockets[i], &rdset)) {
+				FD_CLR(sockets[i], &wrset);
 				tw_handle_socket(sockets[i]);
 			}
 		}
+		for(i=0; i<num_wsockets; i++) {
+			int s = sockets[num_sockets + i];
+			if(FD_ISSET(s, &wrset)) {
+				tw_handle_socket(s);
+			}
+		}
+		tw_handle_timeouts();
+
+		/* after the sockets, since draining closes the listening sockets */
+		if(handover_fd != -1 && FD_ISSET(handover_fd, &rdset)) {
+			finish_handover();
+		}
+		if(FD_ISSET(sigpipe[0], &rdset) && handle_signals() == -1) {
+			break;
+		}
+	}
+
+	free(sockets);
+	return 0;
+}
+
+/* with workers, the master process only starts them, restarts them if they
+ * die, and passes signals on to them. The listeners stay open here, so that
+ * restarted workers and hot restarts get them.
+ */
+static int run_master(void)
+{
+	int i, maxfd;
+	fd_set rdset;
+
+	for(i=0; i<num_workers; i++) {
+		if(start_worker(i) == -1) {
+			stop_workers();
+			return 1;
+		}
+	}
+
+	for(;;) {
+		if(!live_workers()) {
+			if(draining) {
+				return 0;
+			}
+			fprintf(stderr, "no workers left, giving up\n");
+			return 1;
+		}
+
+		FD_ZERO(&rdset);
+		FD_SET(sigpipe[0], &rdset);
+		maxfd = sigpipe[0];
+		if(handover_fd != -1) {
+			FD_SET(handover_fd, &rdset);
+			if(handover_fd > maxfd) maxfd = handover_fd;
+		}
+
+		if(select(maxfd + 1, &rdset, 0, 0, 0) == -1) {
+			if(errno == EINTR) continue;
+			perror("select failed");
+			break;
+		}
+
+		if(handover_fd != -1 && FD_ISSET(handover_fd, &rdset)) {
+			finish_handover();
+		}
+		if(FD_ISSET(sigpipe[0], &rdset) && handle_signals() == -1) {
+			break;
+		}
+	}
+
+	stop_workers();
+	return 0;
+}
+
+static int start_worker(int idx)
+{
+	pid_t pid;
+	sigset_t set, oldset;
+
+	/* no signal must reach the worker before it has its own signal pipe */
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, &oldset);
+	fflush(stdout);
+	fflush(stderr);
+
+	if((pid = fork()) == -1) {
+		perror("failed to start worker");
+		sigprocmask(SIG_SETMASK, &oldset, 0);
+		return -1;
+	}
+	if(!pid) {
+		exit(run_worker(idx, &oldset));
+	}
+
+	sigprocmask(SIG_SETMASK, &oldset, 0);
+	worker_pids[idx] = pid;
+	worker_start[idx] = time(0);
+	return 0;
+}
+
+static int run_worker(int idx, sigset_t *sigmask)
+{
+	int res;
+
+	close(sigpipe[0]);
+	close(sigpipe[1]);
+	if(handover_fd != -1) {
+		close(handover_fd);
+		handover_fd = -1;
+	}
+	free(worker_pids);
+	worker_pids = 0;
+	worker_num = idx;
+
+	if(init_signals() == -1) {
+		return 1;
+	}
+	/* interrupts from the terminal, and hot restarts, are up to the master,
+	 * which passes on what concerns the workers.
+	 */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+	sigprocmask(SIG_SETMASK, sigmask, 0);
+
+	if(tw_set_worker(idx) == -1 || start_capture() == -1) {
+		return 1;
+	}
+	res = serve();
+	dump_trace();
+	tw_stop();
+	return res;
+}
+
+/* stop the workers right away, and wait for them */
+static void stop_workers(void)
+{
+	int i;
+
+	signal_workers(SIGQUIT);
+	for(i=0; i<num_workers; i++) {
+		if(worker_pids[i] > 0) {
+			waitpid(worker_pids[i], 0, 0);
+			worker_pids[i] = 0;
+		}
+	}
+}
+
+static void signal_workers(int sig)
+{
+	int i;
+
+	for(i=0; i<num_workers; i++) {
+		if(worker_pids[i] > 0) {
+			kill(worker_pids[i], sig);
+		}
+	}
+}
+
+static int live_workers(void)
+{
+	int i, count = 0;
+
+	for(i=0; i<num_workers; i++) {
+		if(worker_pids[i] > 0) count++;
+	}
+	return count;
+}
+
+/* restart workers which died, unless they die as soon as they start */
+static void reap_workers(void)
+{
+	int i, status;
+	pid_t pid;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for(i=0; i<num_workers; i++) {
+			if(worker_pids[i] == pid) break;
+		}
+		if(i >= num_workers) {
+			continue;	/* the new process of a failed hot restart */
+		}
+		worker_pids[i] = 0;
+		if(draining) continue;
+
+		if(WIFSIGNALED(status)) {
+			fprintf(stderr, "worker %d (pid %d) killed by signal %d\n", i, (int)pid,
+					WTERMSIG(status));
+		} else {
+			fprintf(stderr, "worker %d (pid %d) exited with status %d\n", i, (int)pid,
+					WEXITSTATUS(status));
+		}
+		if(time(0) - worker_start[i] < 1) {
+			fprintf(stderr, "worker %d died right after starting, not restarting it\n", i);
+			tw_drop_worker(i);
+			continue;
+		}
+		start_worker(i);
+	}
+}
+
+/* pin the workers to the CPUs of -a in turn, as many as there are CPUs unless
+ * -j says otherwise.
+ */
+static int setup_workers(void)
+{
+	int i, *cpus = 0;
+
+	if(steer && !worker_cpus) {
+		fprintf(stderr, "-s needs the workers pinned to CPUs with -a\n");
+		return -1;
+	}
+	if(!num_workers && !worker_cpus) {
+		return 0;
+	}
+	if(!num_workers) {
+		num_workers = num_cpus;
+	}
+
+	if(worker_cpus) {
+		cpus = alloca(num_workers * sizeof *cpus);
+		for(i=0; i<num_workers; i++) {
+			cpus[i] = worker_cpus[i % num_cpus];
+		}
 	}
+	if(tw_set_workers(num_workers, cpus) == -1) {
+		return -1;
+	}
+	tw_set_steering(steer);
 
-	return 0;	/* unreachable */
+	if(!(worker_pids = calloc(num_workers, sizeof *worker_pids)) ||
+			!(worker_start = calloc(num_workers, sizeof *worker_start))) {
+		perror("failed to allocate worker table");
+		return -1;
+	}
+	return 0;
 }
 
+/* everything is done in the main loop, the handler only wakes it up */
 void sighandler(int s)
 {
-	if(s == SIGINT || s == SIGTERM || s == SIGQUIT) {
-		tw_stop();
-		printf("bye!\n");
-		exit(0);
+	int err = errno;
+	unsigned char c = s;
+
+	if(write(sigpipe[1], &c, 1) == -1) {
+		/* the pipe is full, there are plenty of wakeups pending */
+	}
+	errno = err;
+}
+
+/* SIGINT and SIGTERM start a graceful shutdown, and stop the server right
+ * away if it's already shutting down. SIGQUIT stops it right away, SIGUSR1
+ * dumps the request trace and prints the memory use and load, and SIGUSR2
+ * starts a hot restart. The master also
+ * gets SIGCHLD when workers die. Returns -1 to stop.
+ */
+static int handle_signals(void)
+{
+	unsigned char sig;
+
+	while(read(sigpipe[0], &sig, 1) == 1) {
+		switch(sig) {
+		case SIGINT:
+		case SIGTERM:
+			if(draining) {
+				return -1;
+			}
+			printf("shutting down, waiting up to %d seconds for requests in progress\n",
+					grace_period);
+			start_drain();
+			break;
+
+		case SIGQUIT:
+			return -1;
+
+		case SIGUSR1:
+			if(worker_pids) {
+				signal_workers(SIGUSR1);
+			} else {
+				dump_trace();
+				print_stats();
+			}
+			break;
+
+		case SIGUSR2:
+			if(draining || handover_fd != -1) {
+				fprintf(stderr, "ignoring hot restart request while %s\n",
+						draining ? "shutting down" : "restarting");
+				break;
+			}
+			hot_restart();
+			break;
+
+		case SIGCHLD:
+			reap_workers();
+			break;
+		}
+	}
+	return 0;
+}
+
+/* start a new process with the same arguments, and pass it the listening
+ * sockets. We keep serving until it says it's ready, then drain.
+ */
+static int hot_restart(void)
+{
+	int sv[2];
+	pid_t pid;
+	char buf[16];
+
+	printf("hot restart: starting new process\n");
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("hot restart: failed to create socket pair");
+		return -1;
+	}
+	if((pid = fork()) == -1) {
+		perror("hot restart: fork failed");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if(!pid) {
+		/* nothing of ours must stay open in the new process, especially the
+		 * client connections, which would never be closed otherwise.
+		 */
+		if(sv[1] != HANDOVER_FD) {
+			dup2(sv[1], HANDOVER_FD);
+		}
+		closefrom(HANDOVER_FD + 1);
+		sprintf(buf, "%d", HANDOVER_FD);
+		setenv(HANDOVER_ENV, buf, 1);
+
+		/* relative paths in the arguments are relative to where we started */
+		if(startdir && chdir(startdir) == -1) {
+			_exit(1);
+		}
+		if(binpath) {
+			execv(binpath, args);
+		}
+		execvp(args[0], args);
+		perror("hot restart: failed to execute");
+		_exit(1);
+	}
+
+	close(sv[1]);
+	newpid = pid;
+	if(tw_handover_send(sv[0]) == -1) {
+		close(sv[0]);
+		return -1;
+	}
+	handover_fd = sv[0];
+	return 0;
+}
+
+/* the new process is ready if it sent anything, or failed if it closed the
+ * socket. Either way it's done with it.
+ */
+static int finish_handover(void)
+{
+	char c;
+	int res;
+
+	while((res = read(handover_fd, &c, 1)) == -1 && errno == EINTR);
+	close(handover_fd);
+	handover_fd = -1;
+
+	if(res != 1) {
+		fprintf(stderr, "hot restart failed, the new process didn't start\n");
+		tw_handover_cancel();
+		waitpid(newpid, 0, 0);
+		return -1;
+	}
+
+	printf("hot restart: new process ready, draining\n");
+	start_drain();
+	return 0;
+}
+
+/* the master closes its listeners first, so that they're gone as soon as the
+ * workers close theirs.
+ */
+static void start_drain(void)
+{
+	tw_drain();
+	draining = 1;
+	deadline = time(0) + grace_period;
+	if(worker_pids) {
+		signal_workers(SIGTERM);
+	}
+}
+
+
+/* TCP listener address formats: <port>, <ipv4 addr>:<port>, [<ipv6 addr>]:<port>
+ * where the address can be * to listen on all interfaces.
+ */
+static int add_tcp_listener(const char *spec)
+{
+	char *addr, *ptr;
+	int port;
+
+	addr = alloca(strlen(spec) + 1);
+	strcpy(addr, spec);
+
+	if(*addr == '[') {
+		if(!(ptr = strchr(addr, ']')) || ptr[1] != ':' || !(port = atoi(ptr + 2))) {
+			fprintf(stderr, "invalid IPv6 listen address: %s\n", spec);
+			return -1;
+		}
+		*ptr = 0;
+		return tw_add_listen_inet6(addr + 1, port);
+	}
+
+	if((ptr = strrchr(addr, ':'))) {
+		*ptr++ = 0;
+	} else {
+		ptr = addr;
+		addr = 0;
+	}
+	if(!(port = atoi(ptr))) {
+		fprintf(stderr, "invalid listen address: %s\n", spec);
+		return -1;
+	}
+	return tw_add_listen_inet(addr, port);
+}
+
+/* TLS certificate for the last listener: <cert file>[:<key file>] */
+static int set_listener_tls(const char *spec)
+{
+	char *cert, *key;
+
+	if(last_lis == -1) {
+		fprintf(stderr, "-t must follow the -b or -u option of the listener\n");
+		return -1;
+	}
+
+	cert = alloca(strlen(spec) + 1);
+	strcpy(cert, spec);
+	if((key = strchr(cert, ':'))) {
+		*key++ = 0;
+	}
+	return tw_set_listen_tls(last_lis, cert, key);
+}
+
+/* socket options for the last listener, or all of them if there isn't one yet:
+ * a list of <name>[=<value>], with an optional k or m suffix on the value.
+ */
+static int set_sock_opts(const char *spec)
+{
+	static const struct {
+		const char *name;
+		int opt;
+	} optnames[] = {
+		{"backlog", TW_SOCK_BACKLOG},
+		{"defer", TW_SOCK_DEFER_ACCEPT},
+		{"fastopen", TW_SOCK_FASTOPEN},
+		{"nodelay", TW_SOCK_NODELAY},
+		{"busypoll", TW_SOCK_BUSY_POLL},
+		{"rcvbuf", TW_SOCK_RCVBUF},
+		{"sndbuf", TW_SOCK_SNDBUF},
+		{0, 0}
+	};
+	char *str, *name, *val, *next, *endp;
+	long value;
+	int i;
+
+	str = alloca(strlen(spec) + 1);
+	strcpy(str, spec);
+
+	for(name = str; name; name = next) {
+		if((next = strchr(name, ','))) {
+			*next++ = 0;
+		}
+		value = 1;
+		if((val = strchr(name, '='))) {
+			*val++ = 0;
+			value = strtol(val, &endp, 10);
+			if(*endp == 'k' || *endp == 'K') {
+				value <<= 10;
+				endp++;
+			} else if(*endp == 'm' || *endp == 'M') {
+				value <<= 20;
+				endp++;
+			}
+			if(!*val || *endp || value < 0 || value > INT_MAX) {
+				fprintf(stderr, "invalid value for socket option %s: %s\n", name, val);
+				return -1;
+			}
+		}
+
+		for(i=0; optnames[i].name; i++) {
+			if(strcmp(optnames[i].name, name) == 0) break;
+		}
+		if(!optnames[i].name) {
+			fprintf(stderr, "unknown socket option: %s\n", name);
+			return -1;
+		}
+		if(tw_set_listen_opt(last_lis, optnames[i].opt, value) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* virtual host: <host>=<dir>, or a directory with one for each host */
+static int add_vhost(const char *spec)
+{
+	char *name, *dir;
+
+	if(!(dir = strchr(spec, '='))) {
+		return tw_add_vhost_dir(spec);
+	}
+	name = alloca(dir - spec + 1);
+	memcpy(name, spec, dir - spec);
+	name[dir - spec] = 0;
+	return tw_add_vhost(name, dir + 1);
+}
+
+/* reverse proxy: <prefix>=<upstream>[,<upstream>...] */
+static int add_proxy(const char *spec)
+{
+	char *prefix, *up, *next;
+
+	prefix = alloca(strlen(spec) + 1);
+	strcpy(prefix, spec);
+	if(!(up = strchr(prefix, '='))) {
+		fprintf(stderr, "-P must be followed by <prefix>=<upstream>\n");
+		return -1;
+	}
+	*up++ = 0;
+
+	while(up) {
+		if((next = strchr(up, ','))) {
+			*next++ = 0;
+		}
+		if(tw_add_proxy(prefix, up) == -1) {
+			return -1;
+		}
+		up = next;
+	}
+	return 0;
+}
+
+/* UNIX domain socket listener: <path>[:<octal mode>] */
+static int add_unix_listener(const char *spec)
+{
+	char *path, *ptr, *endp;
+	int mode = 0;
+
+	path = alloca(strlen(spec) + 1);
+	strcpy(path, spec);
+
+	if((ptr = strrchr(path, ':'))) {
+		mode = strtol(ptr + 1, &endp, 8);
+		if(ptr[1] && !*endp) {
+			*ptr = 0;
+		} else {
+			mode = 0;	/* not a mode suffix, just part of the path */
+		}
+	}
+	return tw_add_listen_unix(path, mode);
+}
+
+/* CPUs to pin workers to: auto for all the CPUs we're allowed to run on, or a
+ * list of CPU numbers and ranges, like 0-3,8,10-11
+ */
+static int parse_cpus(const char *spec)
+{
+	char *endp;
+	int i, first, last;
+
+	if(!(worker_cpus = malloc(MAX_CPUS * sizeof *worker_cpus))) {
+		perror("failed to allocate CPU list");
+		return -1;
+	}
+	if(strcmp(spec, "auto") == 0) {
+		if((num_cpus = tw_get_cpus(worker_cpus, MAX_CPUS)) <= 0) {
+			fprintf(stderr, "can't get the list of CPUs on this system\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	num_cpus = 0;
+	do {
+		first = last = strtol(spec, &endp, 10);
+		if(endp == spec || first < 0) goto invalid;
+		if(*endp == '-') {
+			spec = endp + 1;
+			last = strtol(spec, &endp, 10);
+			if(endp == spec || last < first) goto invalid;
+		}
+		for(i=first; i<=last; i++) {
+			if(num_cpus >= MAX_CPUS) goto invalid;
+			worker_cpus[num_cpus++] = i;
+		}
+		spec = endp + 1;
+	} while(*endp == ',');
+
+	if(*endp) goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid CPU list, expected auto, or something like 0-3,8\n");
+	return -1;
+}
+
+/* rate limit: <requests per second>[:<burst>[:<max connections>]] */
+static int set_rate_limit(int scope, const char *spec)
+{
+	char *endp;
+	const char *str = spec;
+	double rate;
+	int burst = 0, conns = 0;
+
+	rate = strtod(spec, &endp);
+	if(*endp == ':') {
+		spec = endp + 1;
+		burst = strtol(spec, &endp, 10);
+		if(*endp == ':') {
+			spec = endp + 1;
+			conns = strtol(spec, &endp, 10);
+		}
+	}
+	if(*endp || rate < 0 || burst < 0 || conns < 0) {
+		fprintf(stderr, "invalid rate limit: %s, expected <rate>[:<burst>[:<connections>]]\n",
+				str);
+		return -1;
+	}
+	return tw_set_rate_limit(scope, rate, burst, conns);
+}
+
+/* each worker writes its own trace file, named after its index */
+static void dump_trace(void)
+{
+	char *fname;
+
+	if(!trace_file) return;
+
+	if(worker_num >= 0) {
+		fname = alloca(strlen(trace_file) + 16);
+		sprintf(fname, "%s.%d", trace_file, worker_num);
+	} else {
+		fname = trace_file;
+	}
+	tw_trace_dump(fname);
+}
+
+static void print_stats(void)
+{
+	struct tw_mem_stats st;
+	struct tw_load_stats ld;
+
+	tw_get_mem_stats(&st);
+	tw_get_load_stats(&ld);
+	if(worker_num >= 0) {
+		printf("worker %d: ", worker_num);
+	}
+	printf("memory: %ld bytes (headers %ld, bodies %ld, output %ld, cache %ld), peak %ld",
+			st.total, st.header, st.body, st.output, st.cache, st.peak);
+	if(st.limit) {
+		printf(", budget %ld, %d connections paused, %ld requests rejected, %ld cache bytes evicted",
+				st.limit, st.paused, st.rejected, st.evicted);
+	}
+	printf("\nload: shortest wait %ld us, %s, %ld requests shed\n", ld.min_sojourn_usec,
+			ld.overloaded ? "overloaded" : "not overloaded", ld.shed);
+	fflush(stdout);
+}
+
+/* memory budget: <total MB>[:<per connection KB>] */
+static int set_mem_limit(const char *str)
+{
+	long total, conn = 0;
+	char *endp;
+
+	total = strtol(str, &endp, 10);
+	if(*endp == ':') {
+		conn = strtol(endp + 1, &endp, 10);
+	}
+	if(*endp || total < 0 || conn < 0) {
+		fprintf(stderr, "invalid memory budget: %s, expected <MB>[:<KB per connection>]\n", str);
+		return -1;
+	}
+	tw_set_mem_limit(total << 20, conn << 10);
+	return 0;
+}
+
+/* load shedding: <target msec>[:<interval msec>] */
+static int set_load_shedding(const char *str)
+{
+	long target, interval = 0;
+	char *endp;
+
+	target = strtol(str, &endp, 10);
+	if(*endp == ':') {
+		interval = strtol(endp + 1, &endp, 10);
 	}
+	if(*endp || target <= 0 || interval < 0) {
+		fprintf(stderr, "invalid load shedding target: %s, expected <msec>[:<interval msec>]\n",
+				str);
+		return -1;
+	}
+	return tw_set_load_shedding(target, interval);
 }
 
+/* like the trace, each worker captures to its own file */
+static int start_capture(void)
+{
+	char *fname;
+
+	if(!capture_file) return 0;
+
+	if(worker_num >= 0) {
+		fname = alloca(strlen(capture_file) + 16);
+		sprintf(fname, "%s.%d", capture_file, worker_num);
+	} else {
+		fname = capture_file;
+	}
+	return tw_set_capture(fname);
+}
+
+/* request trace: <file>[:<sample>] */
+static int set_trace(const char *spec)
+{
+	char *ptr, *endp;
+
+	free(trace_file);
+	if(!(trace_file = strdup(spec))) {
+		perror("failed to allocate trace file name");
+		return -1;
+	}
+	if((ptr = strrchr(trace_file, ':'))) {
+		trace_sample = strtol(ptr + 1, &endp, 10);
+		if(ptr[1] && !*endp && trace_sample > 0) {
+			*ptr = 0;
+		} else {
+			trace_sample = 1;	/* not a sampling suffix, just part of the name */
+		}
+	}
+	return 0;
+}
 
 static void print_help(const char *argv0)
 {
 	printf("Usage: %s [options]\n", argv0);
 	printf("Options:\n");
 	printf(" -p <port>  set the TCP/IP port number to use\n");
+	printf(" -b <addr>  listen on a TCP address: <port>, <ipv4>:<port>, or [<ipv6>]:<port>\n");
+	printf(" -u <path>  listen on a UNIX domain socket, optionally followed by :<mode>\n");
+	printf(" -t <cert>  serve HTTPS on the preceding listener, optionally followed by :<key file>\n");
+	printf(" -O <opts>  socket options for the preceding listener, or all of them if given\n");
+	printf("            first: a list of backlog=<n>, defer=<sec>, fastopen=<n>, nodelay,\n");
+	printf("            busypoll=<usec>, rcvbuf=<size>, sndbuf=<size>\n");
+	printf(" -c <dir>   serve files from the specified directory\n");
+	printf(" -V <vhost> serve requests for a host from its own directory: <host>=<dir>, or\n");
+	printf("            just <dir>, with a subdirectory for each host, named after it\n");
+	printf(" -P <proxy> forward requests under a path prefix to upstream HTTP servers:\n");
+	printf("            <prefix>=<upstream>[,<upstream>...], each host:port or unix:<path>\n");
+	printf(" -k <pack>  serve files from a static site pack made with twpack\n");
+	printf(" -d         generate listings for directories without an index file\n");
+	printf(" -f <n>     run .cgi files as FastCGI applications with n workers each\n");
+	printf(" -w <n>     warm up the caches with n threads before accepting connections\n");
+	printf(" -i <n>     open files with n I/O threads, so that slow disks don't stall the server\n");
+	printf(" -r <lim>   limit each client address to <rate>[:<burst>[:<connections>]]\n");
+	printf(" -R <lim>   same for each /24 IPv4 or /64 IPv6 network\n");
+	printf(" -o <sec>   close connections idle for this long, waiting for the client\n");
+	printf(" -B <KB/s>  limit the bandwidth of each connection\n");
+	printf(" -m <mem>   memory budget: <MB>[:<KB per connection>], shedding load past it\n");
+	printf(" -L <msec>  shed requests waiting longer than this while overloaded,\n");
+	printf("            optionally followed by :<msec> for the interval (default: 100)\n");
+	printf(" -g <sec>   time to let requests in progress finish when shutting down (default: %d)\n",
+			DEF_GRACE_PERIOD);
+	printf(" -j <n>     serve with n worker processes\n");
+	printf(" -a <cpus>  pin workers to these CPUs in turn: auto, or a list like 0-3,8\n");
+	printf(" -s         steer connections to the worker on the CPU which received them\n");
+	printf(" -T <file>  trace requests, and write the trace to <file> on SIGUSR1 and at exit,\n");
+	printf("            optionally followed by :<n> to trace 1 in n requests\n");
+	printf(" -S <msec>  log traced requests slower than this, with the time of each phase\n");
+	printf(" -C <file>  capture the traffic from clients to <file>, to replay it with twreplay\n");
 	printf(" -h         print usage help and exit\n");
 }
 
@@ -103,12 +1053,178 @@ int parse_args(int argc, char **argv)
 				}
 				break;
 
+			case 'b':
+				if(!argv[++i] || (last_lis = add_tcp_listener(argv[i])) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'u':
+				if(!argv[++i] || (last_lis = add_unix_listener(argv[i])) == -1) {
+					return -1;
+				}
+				break;
+
+			case 't':
+				if(!argv[++i] || set_listener_tls(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'O':
+				if(!argv[++i] || set_sock_opts(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
 			case 'c':
 				if(tw_set_root(argv[++i]) == -1) {
 					return -1;
 				}
 				break;
 
+			case 'V':
+				if(!argv[++i] || add_vhost(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'P':
+				if(!argv[++i] || add_proxy(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'k':
+				if(!argv[++i] || tw_set_pack(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'd':
+				tw_set_dirlist(1);
+				break;
+
+			case 'f':
+				{
+					int n = argv[++i] ? atoi(argv[i]) : 0;
+					if(n <= 0) {
+						fprintf(stderr, "-f must be followed by the number of FastCGI workers\n");
+						return -1;
+					}
+					tw_set_cgi_workers(n);
+				}
+				break;
+
+			case 'w':
+				{
+					int n = argv[++i] ? atoi(argv[i]) : 0;
+					if(n <= 0) {
+						fprintf(stderr, "-w must be followed by the number of warmup threads\n");
+						return -1;
+					}
+					tw_set_warmup(n, 0);
+				}
+				break;
+
+			case 'i':
+				{
+					int n = argv[++i] ? atoi(argv[i]) : 0;
+					if(n <= 0) {
+						fprintf(stderr, "-i must be followed by the number of I/O threads\n");
+						return -1;
+					}
+					tw_set_io_threads(n);
+				}
+				break;
+
+			case 'o':
+				{
+					int sec = argv[++i] ? atoi(argv[i]) : 0;
+					if(sec <= 0) {
+						fprintf(stderr, "-o must be followed by the idle timeout in seconds\n");
+						return -1;
+					}
+					tw_set_idle_timeout(sec);
+				}
+				break;
+
+			case 'B':
+				{
+					long kb = argv[++i] ? atol(argv[i]) : 0;
+					if(kb <= 0) {
+						fprintf(stderr, "-B must be followed by the bandwidth limit in KB/s\n");
+						return -1;
+					}
+					tw_set_conn_bandwidth(kb * 1024);
+				}
+				break;
+
+			case 'm':
+				if(!argv[++i] || set_mem_limit(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'L':
+				if(!argv[++i] || set_load_shedding(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'g':
+				if(!argv[++i] || (grace_period = atoi(argv[i])) < 0) {
+					fprintf(stderr, "-g must be followed by the grace period in seconds\n");
+					return -1;
+				}
+				break;
+
+			case 'r':
+			case 'R':
+				if(!argv[i + 1] || set_rate_limit(argv[i][1] == 'R' ? TW_LIMIT_PREFIX :
+							TW_LIMIT_ADDR, argv[i + 1]) == -1) {
+					return -1;
+				}
+				i++;
+				break;
+
+			case 'j':
+				if(!argv[++i] || (num_workers = atoi(argv[i])) <= 0) {
+					fprintf(stderr, "-j must be followed by the number of worker processes\n");
+					return -1;
+				}
+				break;
+
+			case 'a':
+				if(!argv[++i] || parse_cpus(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 's':
+				steer = 1;
+				break;
+
+			case 'T':
+				if(!argv[++i] || set_trace(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'C':
+				if(!(capture_file = argv[++i])) {
+					fprintf(stderr, "-C must be followed by the capture file name\n");
+					return -1;
+				}
+				break;
+
+			case 'S':
+				if(!argv[++i] || (slow_msec = atol(argv[i])) <= 0) {
+					fprintf(stderr, "-S must be followed by a time in milliseconds\n");
+					return -1;
+				}
+				break;
+
 			case 'h':
 				print_help(argv[0]);
 				exit(0);
@@ -0,0 +1,613 @@
+/* twfcgi - stand-in FastCGI application, for testing the tinyweb FastCGI support
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define FCGI_VERSION_1			1
+
+/* record types */
+#define FCGI_BEGIN_REQUEST		1
+#define FCGI_ABORT_REQUEST		2
+#define FCGI_END_REQUEST		3
+#define FCGI_PARAMS				4
+#define FCGI_STDIN				5
+#define FCGI_STDOUT				6
+#define FCGI_STDERR				7
+#define FCGI_GET_VALUES			9
+#define FCGI_GET_VALUES_RESULT	10
+#define FCGI_UNKNOWN_TYPE		11
+
+#define FCGI_RESPONDER			1
+#define FCGI_KEEP_CONN			1
+
+/* protocol status of FCGI_END_REQUEST */
+#define FCGI_REQUEST_COMPLETE	0
+#define FCGI_CANT_MPX_CONN		1
+#define FCGI_UNKNOWN_ROLE		3
+
+#define FCGI_HDR_SIZE			8
+#define FCGI_MAX_CONTENT		65535
+
+#define MAX_CONNS		256
+/* requests multiplexed over a connection, with -m */
+#define MAX_CONN_REQS	64
+
+struct request {
+	int id;
+	unsigned char *params;
+	int params_len, params_size;
+	long body_size;
+	uint32_t hash;
+};
+
+struct conn {
+	int s, id;
+	int num_reqs;		/* requests completed */
+	int keep;			/* the server asked to keep the connection open */
+	int close;			/* close once the output is sent */
+
+	unsigned char *inbuf;
+	int inlen, insize;
+	unsigned char *out;
+	int outlen, outsize;
+
+	struct request *reqs[MAX_CONN_REQS];
+	int num_active;
+};
+
+static int accept_conn(void);
+static void close_conn(struct conn *c);
+static int recv_conn(struct conn *c);
+static int send_conn(struct conn *c);
+static int proc_record(struct conn *c, unsigned char *rec);
+static int get_values(struct conn *c, unsigned char *content, int len);
+static int begin_request(struct conn *c, int id, unsigned char *content);
+static int respond(struct conn *c, struct request *req);
+static void end_request(struct conn *c, struct request *req, int status);
+static void free_request(struct request *req);
+static const char *param(struct request *req, const char *name, char *buf, int size);
+static long get_length(unsigned char **ptr, unsigned char *end);
+static int put_record(struct conn *c, int type, int id, const void *data, int len);
+static int append(unsigned char **buf, int *len, int *size, const void *data, int datalen);
+static void print_help(const char *argv0);
+static int parse_args(int argc, char **argv);
+
+static struct conn *conns[MAX_CONNS];
+static int num_conns, next_id;
+static long total_reqs;
+
+static int mpxs;			/* multiplex requests over a connection */
+static int max_reqs;		/* close connections after this many requests, 0 for no limit */
+static int exit_every;		/* exit on every nth request, 0 for never */
+static int delay;			/* seconds to wait before each response */
+static int quiet;
+
+
+int main(int argc, char **argv)
+{
+	int i, n;
+	struct pollfd pfd[MAX_CONNS + 1];
+	struct conn *c;
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the server passes the listening socket on fd 0 */
+	if(getsockname(0, (struct sockaddr*)&addr, &len) == -1) {
+		fprintf(stderr, "twfcgi: standard input isn't a socket, run it as a .cgi file from tinywebd -f\n");
+		return 1;
+	}
+	fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+
+	for(;;) {
+		pfd[0].fd = 0;
+		pfd[0].events = num_conns < MAX_CONNS ? POLLIN : 0;
+		for(i=0; i<num_conns; i++) {
+			pfd[i + 1].fd = conns[i]->s;
+			pfd[i + 1].events = conns[i]->outlen ? POLLOUT : POLLIN;
+		}
+		if(poll(pfd, num_conns + 1, -1) == -1) {
+			if(errno == EINTR) continue;
+			perror("twfcgi: poll failed");
+			return 1;
+		}
+
+		/* go backwards, closed connections are replaced by the last one */
+		n = num_conns;
+		for(i=n-1; i>=0; i--) {
+			c = conns[i];
+			if(pfd[i + 1].revents) {
+				if((c->outlen ? send_conn(c) : recv_conn(c)) == -1) {
+					close_conn(c);
+				}
+			}
+		}
+		if(pfd[0].revents & POLLIN) {
+			while(num_conns < MAX_CONNS && accept_conn() != -1);
+		}
+	}
+	return 0;
+}
+
+static int accept_conn(void)
+{
+	int s;
+	struct conn *c;
+
+	if((s = accept(0, 0, 0)) == -1) {
+		return -1;
+	}
+	if(!(c = calloc(1, sizeof *c))) {
+		fprintf(stderr, "twfcgi: failed to allocate connection\n");
+		close(s);
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	c->s = s;
+	c->id = ++next_id;
+	conns[num_conns++] = c;
+	return 0;
+}
+
+static void close_conn(struct conn *c)
+{
+	int i;
+
+	for(i=0; i<num_conns; i++) {
+		if(conns[i] == c) {
+			conns[i] = conns[--num_conns];
+			break;
+		}
+	}
+	for(i=0; i<MAX_CONN_REQS; i++) {
+		if(c->reqs[i]) free_request(c->reqs[i]);
+	}
+	close(c->s);
+	free(c->inbuf);
+	free(c->out);
+	free(c);
+}
+
+/* receive and process complete records, and start sending whatever they
+ * produced.
+ */
+static int recv_conn(struct conn *c)
+{
+	unsigned char buf[65536];
+	long sz;
+	int pos, reclen;
+
+	while((sz = recv(c->s, buf, sizeof buf, 0)) > 0) {
+		if(append(&c->inbuf, &c->inlen, &c->insize, buf, sz) == -1) {
+			fprintf(stderr, "twfcgi: failed to allocate input buffer\n");
+			return -1;
+		}
+	}
+	if(sz == 0) {
+		return -1;
+	}
+	if(errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -1;
+	}
+
+	pos = 0;
+	while(c->inlen - pos >= FCGI_HDR_SIZE) {
+		unsigned char *rec = c->inbuf + pos;
+
+		reclen = FCGI_HDR_SIZE + ((rec[4] << 8) | rec[5]) + rec[6];
+		if(c->inlen - pos < reclen) {
+			break;
+		}
+		if(proc_record(c, rec) == -1) {
+			return -1;
+		}
+		pos += reclen;
+	}
+	memmove(c->inbuf, c->inbuf + pos, c->inlen - pos);
+	c->inlen -= pos;
+
+	if(c->outlen) {
+		return send_conn(c);
+	}
+	return 0;
+}
+
+static int send_conn(struct conn *c)
+{
+	long sz;
+	int pos = 0;
+
+	while(pos < c->outlen) {
+		if((sz = send(c->s, c->out + pos, c->outlen - pos, MSG_NOSIGNAL)) == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+			break;
+		}
+		pos += sz;
+	}
+	memmove(c->out, c->out + pos, c->outlen - pos);
+	c->outlen -= pos;
+	return c->close && !c->outlen ? -1 : 0;
+}
+
+static int proc_record(struct conn *c, unsigned char *rec)
+{
+	int id, len;
+	unsigned char *content = rec + FCGI_HDR_SIZE, type[8] = {0};
+	struct request *req = 0;
+
+	if(rec[0] != FCGI_VERSION_1) {
+		fprintf(stderr, "twfcgi: conn %d: invalid record version %d\n", c->id, rec[0]);
+		return -1;
+	}
+	id = (rec[2] << 8) | rec[3];
+	len = (rec[4] << 8) | rec[5];
+
+	if(id > 0 && id <= MAX_CONN_REQS) {
+		req = c->reqs[id - 1];
+	}
+
+	switch(rec[1]) {
+	case FCGI_GET_VALUES:
+		return get_values(c, content, len);
+
+	case FCGI_BEGIN_REQUEST:
+		if(len < 8) {
+			fprintf(stderr, "twfcgi: conn %d: short FCGI_BEGIN_REQUEST\n", c->id);
+			return -1;
+		}
+		return begin_request(c, id, content);
+
+	case FCGI_ABORT_REQUEST:
+		if(req) {
+			if(!quiet) fprintf(stderr, "twfcgi: conn %d: request %d aborted\n", c->id, id);
+			end_request(c, req, FCGI_REQUEST_COMPLETE);
+		}
+		break;
+
+	case FCGI_PARAMS:
+		if(req && len > 0 && append(&req->params, &req->params_len, &req->params_size,
+					content, len) == -1) {
+			fprintf(stderr, "twfcgi: failed to allocate request parameters\n");
+			return -1;
+		}
+		break;
+
+	case FCGI_STDIN:
+		if(!req) break;
+		if(len == 0) {
+			return respond(c, req);
+		}
+		req->body_size += len;
+		while(len-- > 0) {
+			req->hash = (req->hash ^ *content++) * 16777619u;
+		}
+		break;
+
+	default:
+		type[0] = rec[1];
+		return put_record(c, FCGI_UNKNOWN_TYPE, 0, type, sizeof type);
+	}
+	return 0;
+}
+
+/* answer the variables we know about, out of the ones the server asks for */
+static int get_values(struct conn *c, unsigned char *content, int len)
+{
+	unsigned char *end = content + len, res[256];
+	long nlen, vlen;
+	int reslen = 0;
+	const char *val;
+
+	while(content < end) {
+		if((nlen = get_length(&content, end)) == -1 || (vlen = get_length(&content, end)) == -1 ||
+				nlen + vlen > end - content) {
+			fprintf(stderr, "twfcgi: conn %d: truncated FCGI_GET_VALUES\n", c->id);
+			return -1;
+		}
+		val = 0;
+		if(nlen == 15 && memcmp(content, "FCGI_MPXS_CONNS", 15) == 0) {
+			val = mpxs ? "1" : "0";
+		} else if(nlen == 13 && memcmp(content, "FCGI_MAX_REQS", 13) == 0) {
+			val = mpxs ? "64" : "1";
+		}
+		if(val && reslen + 2 + nlen + strlen(val) <= sizeof res) {
+			res[reslen++] = nlen;
+			res[reslen++] = strlen(val);
+			memcpy(res + reslen, content, nlen);
+			reslen += nlen;
+			memcpy(res + reslen, val, strlen(val));
+			reslen += strlen(val);
+		}
+		content += nlen + vlen;
+	}
+	return put_record(c, FCGI_GET_VALUES_RESULT, 0, res, reslen);
+}
+
+static int begin_request(struct conn *c, int id, unsigned char *content)
+{
+	unsigned char body[8] = {0};
+	struct request *req;
+
+	if(id <= 0 || id > MAX_CONN_REQS || (!mpxs && c->num_active > 0)) {
+		body[4] = FCGI_CANT_MPX_CONN;
+		return put_record(c, FCGI_END_REQUEST, id, body, sizeof body);
+	}
+	if(((content[0] << 8) | content[1]) != FCGI_RESPONDER) {
+		body[4] = FCGI_UNKNOWN_ROLE;
+		return put_record(c, FCGI_END_REQUEST, id, body, sizeof body);
+	}
+	if(c->reqs[id - 1]) {
+		fprintf(stderr, "twfcgi: conn %d: request id %d is already in use\n", c->id, id);
+		return -1;
+	}
+
+	if(!(req = calloc(1, sizeof *req))) {
+		fprintf(stderr, "twfcgi: failed to allocate request\n");
+		return -1;
+	}
+	req->id = id;
+	req->hash = 2166136261u;
+	c->reqs[id - 1] = req;
+	c->num_active++;
+	c->keep = content[2] & FCGI_KEEP_CONN;
+	return 0;
+}
+
+/* the response says which worker, connection and request it came from, what
+ * the body was, and lists the CGI variables, so that the server side of all
+ * of them can be checked.
+ */
+static int respond(struct conn *c, struct request *req)
+{
+	unsigned char *out = 0, *ptr, *end;
+	int outlen = 0, outsize = 0, len, pos;
+	long nlen, vlen;
+	char buf[512], mbuf[16], sbuf[256], pbuf[256];
+	const char *method, *script, *pinfo;
+
+	c->num_reqs++;
+	total_reqs++;
+
+	method = param(req, "REQUEST_METHOD", mbuf, sizeof mbuf);
+	script = param(req, "SCRIPT_NAME", sbuf, sizeof sbuf);
+	pinfo = param(req, "PATH_INFO", pbuf, sizeof pbuf);
+	if(!quiet) {
+		fprintf(stderr, "twfcgi: worker %d conn %d request %d: %s %s%s, %ld byte body\n",
+				(int)getpid(), c->id, c->num_reqs, method ? method : "?", script ? script : "?",
+				pinfo ? pinfo : "", req->body_size);
+	}
+
+	if(exit_every && total_reqs % exit_every == 0) {
+		if(!quiet) fprintf(stderr, "twfcgi: worker %d exiting\n", (int)getpid());
+		exit(1);
+	}
+	if(delay) {
+		sleep(delay);
+	}
+
+	len = sprintf(buf, "Content-Type: text/plain\r\n\r\n"
+			"worker %d conn %d request %d\nbody %ld bytes, fnv1a %08x\n\n", (int)getpid(),
+			c->id, c->num_reqs, req->body_size, (unsigned int)req->hash);
+	if(append(&out, &outlen, &outsize, buf, len) == -1) {
+		goto nomem;
+	}
+
+	ptr = req->params;
+	end = ptr + req->params_len;
+	while(ptr < end) {
+		if((nlen = get_length(&ptr, end)) == -1 || (vlen = get_length(&ptr, end)) == -1 ||
+				nlen + vlen > end - ptr) {
+			break;
+		}
+		if(append(&out, &outlen, &outsize, ptr, nlen) == -1 ||
+				append(&out, &outlen, &outsize, "=", 1) == -1 ||
+				append(&out, &outlen, &outsize, ptr + nlen, vlen) == -1 ||
+				append(&out, &outlen, &outsize, "\n", 1) == -1) {
+			goto nomem;
+		}
+		ptr += nlen + vlen;
+	}
+
+	for(pos=0; pos<outlen; pos+=len) {
+		len = outlen - pos < FCGI_MAX_CONTENT ? outlen - pos : FCGI_MAX_CONTENT;
+		if(put_record(c, FCGI_STDOUT, req->id, out + pos, len) == -1) {
+			goto nomem;
+		}
+	}
+	free(out);
+
+	if(put_record(c, FCGI_STDOUT, req->id, 0, 0) == -1) {
+		return -1;
+	}
+	end_request(c, req, FCGI_REQUEST_COMPLETE);
+	if(!c->keep || (max_reqs && c->num_reqs >= max_reqs)) {
+		c->close = 1;
+	}
+	return 0;
+
+nomem:
+	fprintf(stderr, "twfcgi: failed to allocate response\n");
+	free(out);
+	return -1;
+}
+
+static void end_request(struct conn *c, struct request *req, int status)
+{
+	unsigned char body[8] = {0};
+
+	body[4] = status;
+	put_record(c, FCGI_END_REQUEST, req->id, body, sizeof body);
+	c->reqs[req->id - 1] = 0;
+	c->num_active--;
+	free_request(req);
+}
+
+static void free_request(struct request *req)
+{
+	free(req->params);
+	free(req);
+}
+
+/* the value of a CGI variable in buf, cut short if it doesn't fit, or null */
+static const char *param(struct request *req, const char *name, char *buf, int size)
+{
+	unsigned char *ptr = req->params, *end = ptr + req->params_len;
+	long nlen, vlen, len = strlen(name);
+
+	while(ptr < end) {
+		if((nlen = get_length(&ptr, end)) == -1 || (vlen = get_length(&ptr, end)) == -1 ||
+				nlen + vlen > end - ptr) {
+			break;
+		}
+		if(nlen == len && memcmp(ptr, name, len) == 0) {
+			if(vlen >= size) vlen = size - 1;
+			memcpy(buf, ptr + nlen, vlen);
+			buf[vlen] = 0;
+			return buf;
+		}
+		ptr += nlen + vlen;
+	}
+	return 0;
+}
+
+/* name-value pair lengths are one byte if they're shorter than 128 bytes, or
+ * four bytes with the top bit set. Returns -1 if it doesn't fit before end.
+ */
+static long get_length(unsigned char **ptr, unsigned char *end)
+{
+	unsigned char *p = *ptr;
+
+	if(p >= end) {
+		return -1;
+	}
+	if(!(*p & 0x80)) {
+		*ptr = p + 1;
+		return *p;
+	}
+	if(end - p < 4) {
+		return -1;
+	}
+	*ptr = p + 4;
+	return ((long)(p[0] & 0x7f) << 24) | ((long)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int put_record(struct conn *c, int type, int id, const void *data, int len)
+{
+	unsigned char hdr[FCGI_HDR_SIZE];
+
+	hdr[0] = FCGI_VERSION_1;
+	hdr[1] = type;
+	hdr[2] = id >> 8;
+	hdr[3] = id;
+	hdr[4] = len >> 8;
+	hdr[5] = len;
+	hdr[6] = 0;
+	hdr[7] = 0;
+	if(append(&c->out, &c->outlen, &c->outsize, hdr, sizeof hdr) == -1 ||
+			append(&c->out, &c->outlen, &c->outsize, data, len) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int append(unsigned char **buf, int *len, int *size, const void *data, int datalen)
+{
+	if(*len + datalen > *size) {
+		unsigned char *tmp;
+		int newsz = *size ? *size * 2 : 1024;
+
+		while(newsz < *len + datalen) newsz *= 2;
+		if(!(tmp = realloc(*buf, newsz))) {
+			return -1;
+		}
+		*buf = tmp;
+		*size = newsz;
+	}
+	if(datalen > 0) {
+		memcpy(*buf + *len, data, datalen);
+		*len += datalen;
+	}
+	return 0;
+}
+
+static void print_help(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("Options:\n");
+	printf(" -m         multiplex requests over each connection\n");
+	printf(" -n <n>     close each connection after n requests (default: as the server asks)\n");
+	printf(" -x <n>     exit on every nth request, without a response\n");
+	printf(" -s <sec>   wait this long before each response, stalling the whole worker\n");
+	printf(" -q         don't log each request to stderr\n");
+	printf(" -h         print usage help and exit\n");
+	printf("Run by tinywebd -f as a .cgi file, or from a .cgi shell script with exec to\n");
+	printf("pass it options. Every request gets a text response with the worker process,\n");
+	printf("connection and request number, the size and FNV-1a hash of its body, and the\n");
+	printf("CGI variables it was passed.\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int i;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'm':
+				mpxs = 1;
+				break;
+
+			case 'n':
+				if(!argv[++i] || (max_reqs = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'x':
+				if(!argv[++i] || (exit_every = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 's':
+				if(!argv[++i] || (delay = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'q':
+				quiet = 1;
+				break;
+
+			case 'h':
+				print_help(argv[0]);
+				exit(0);
+
+			default:
+				fprintf(stderr, "unrecognized option: %s\n", argv[i]);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+
+missing:
+	fprintf(stderr, "%s must be followed by a positive number\n", argv[i - 1]);
+	return -1;
+}
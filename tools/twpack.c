@@ -0,0 +1,564 @@
+/* twpack - builds static site packs for tinyweb
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <alloca.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "pack.h"
+#include "mime.h"
+
+/* files smaller than this aren't worth compressing */
+#define MIN_GZIP_SIZE	256
+
+struct file {
+	char *path;			/* relative to the root, the pack key */
+	char *fname;		/* path in the filesystem */
+	int isdir;
+	long size;
+
+	char *gzname;		/* precompressed variant next to the file */
+	void *gzdata;		/* or compressed by us */
+	long gzsize;
+
+	struct pack_entry ent;
+};
+
+static int add_tree(const char *root, const char *path);
+static int add_entry(const char *root, const char *relpath, char *fname);
+static struct file *add_file(const char *path, const char *fname, struct stat *st);
+static int prepare(struct file *f);
+static int hash_file(const char *fname, uint64_t *hash);
+static uint64_t hash_mem(const void *data, long size, uint64_t hash);
+static int gzip_file(struct file *f);
+static uint32_t add_str(const char *s);
+static int copy_file(FILE *out, const char *fname, long size);
+static int pad_to(FILE *out, long offs);
+static int cmp_files(const void *a, const void *b);
+static void print_help(const char *argv0);
+static int parse_args(int argc, char **argv);
+
+static const char *indexfiles[] = {
+	"index.html",
+	"index.htm",
+	0
+};
+
+static struct file *files;
+static int num_files, max_files;
+static char *strtab;
+static long strtab_size, strtab_max;
+
+static const char *rootdir, *outfname;
+static int compress, verbose;
+
+
+int main(int argc, char **argv)
+{
+	int i, j;
+	char *tmpname, *idxpath;
+	FILE *out;
+	struct pack_header hdr;
+	struct file *f;
+	long offs, total = 0;
+	struct stat st;
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+
+	if(stat(rootdir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s is not a directory\n", rootdir);
+		return 1;
+	}
+	add_str("");
+	if(!add_file("", rootdir, &st) || add_tree(rootdir, "") == -1) {
+		return 1;
+	}
+	qsort(files, num_files, sizeof *files, cmp_files);
+
+	for(i=0; i<num_files; i++) {
+		if(prepare(files + i) == -1) {
+			return 1;
+		}
+	}
+
+	/* find the index file of each directory, now that they're sorted */
+	for(i=0; i<num_files; i++) {
+		f = files + i;
+		if(!f->isdir) continue;
+
+		if(!(idxpath = malloc(strlen(f->path) + 32))) {
+			fprintf(stderr, "failed to allocate file name\n");
+			return 1;
+		}
+		for(j=0; indexfiles[j]; j++) {
+			struct file key, *idx;
+			sprintf(idxpath, "%s%s%s", f->path, *f->path ? "/" : "", indexfiles[j]);
+			key.path = idxpath;
+			if((idx = bsearch(&key, files, num_files, sizeof *files, cmp_files)) && !idx->isdir) {
+				f->ent.index = idx - files;
+				break;
+			}
+		}
+		free(idxpath);
+	}
+
+	/* lay out the file data after the index, each file starting on a page */
+	memcpy(hdr.magic, PACK_MAGIC, sizeof hdr.magic);
+	hdr.version = PACK_VERSION;
+	hdr.num_ent = num_files;
+	hdr.ent_offs = sizeof hdr;
+	hdr.str_offs = hdr.ent_offs + num_files * sizeof(struct pack_entry);
+	hdr.str_size = strtab_size;
+
+	offs = hdr.str_offs + strtab_size;
+	for(i=0; i<num_files; i++) {
+		f = files + i;
+		if(f->isdir) continue;
+
+		offs = (offs + PACK_ALIGN - 1) & ~(long)(PACK_ALIGN - 1);
+		f->ent.offs = offs;
+		offs += f->size;
+		if(f->gzsize > 0) {
+			offs = (offs + PACK_ALIGN - 1) & ~(long)(PACK_ALIGN - 1);
+			f->ent.gz_offs = offs;
+			offs += f->gzsize;
+		}
+		total += f->size;
+	}
+
+	/* write to a temporary file and rename it, so that a pack in use is
+	 * never modified, and a failed run doesn't leave a broken pack behind.
+	 */
+	tmpname = alloca(strlen(outfname) + 8);
+	sprintf(tmpname, "%s.tmp", outfname);
+	if(!(out = fopen(tmpname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", tmpname, strerror(errno));
+		return 1;
+	}
+	fwrite(&hdr, sizeof hdr, 1, out);
+	for(i=0; i<num_files; i++) {
+		fwrite(&files[i].ent, sizeof files[i].ent, 1, out);
+	}
+	fwrite(strtab, 1, strtab_size, out);
+
+	for(i=0; i<num_files; i++) {
+		f = files + i;
+		if(f->isdir) continue;
+
+		if(pad_to(out, f->ent.offs) == -1 || copy_file(out, f->fname, f->size) == -1) {
+			goto fail;
+		}
+		if(f->gzsize > 0) {
+			if(pad_to(out, f->ent.gz_offs) == -1) {
+				goto fail;
+			}
+			if(f->gzdata) {
+				fwrite(f->gzdata, 1, f->gzsize, out);
+			} else if(copy_file(out, f->gzname, f->gzsize) == -1) {
+				goto fail;
+			}
+		}
+	}
+
+	if(fflush(out) == EOF || ferror(out)) {
+		fprintf(stderr, "failed to write %s: %s\n", tmpname, strerror(errno));
+		goto fail;
+	}
+	fclose(out);
+	if(rename(tmpname, outfname) == -1) {
+		fprintf(stderr, "failed to rename %s to %s: %s\n", tmpname, outfname, strerror(errno));
+		unlink(tmpname);
+		return 1;
+	}
+
+	printf("%s: %d entries, %ld bytes of files, %ld bytes total\n", outfname, num_files,
+			total, offs);
+	return 0;
+
+fail:
+	fclose(out);
+	unlink(tmpname);
+	return 1;
+}
+
+static int add_tree(const char *root, const char *path)
+{
+	DIR *dir;
+	struct dirent *dent;
+	char *fname, *relpath;
+	int len;
+
+	fname = alloca(strlen(root) + strlen(path) + 2);
+	sprintf(fname, "%s%s%s", root, *path ? "/" : "", path);
+	if(!(dir = opendir(fname))) {
+		fprintf(stderr, "failed to open directory %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	while((dent = readdir(dir))) {
+		if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+		len = strlen(path) + strlen(dent->d_name) + 2;
+		if(!(relpath = malloc(len)) || !(fname = malloc(strlen(root) + len + 1))) {
+			fprintf(stderr, "failed to allocate file name\n");
+			free(relpath);
+			break;
+		}
+		sprintf(relpath, "%s%s%s", path, *path ? "/" : "", dent->d_name);
+		sprintf(fname, "%s/%s", root, relpath);
+
+		if(add_entry(root, relpath, fname) == -1) {
+			free(relpath);
+			free(fname);
+			break;
+		}
+		free(relpath);
+		free(fname);
+	}
+	closedir(dir);
+	return dent ? -1 : 0;
+}
+
+static int add_entry(const char *root, const char *relpath, char *fname)
+{
+	struct stat st, orig;
+	struct file *f;
+	const char *type;
+	int len;
+
+	if(stat(fname, &st) == -1) {
+		fprintf(stderr, "skipping %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+
+	if(S_ISDIR(st.st_mode)) {
+		if(!add_file(relpath, fname, &st)) {
+			return -1;
+		}
+		return add_tree(root, relpath);
+	}
+	if(!S_ISREG(st.st_mode)) {
+		return 0;
+	}
+
+	/* foo.gz next to foo is its precompressed variant, not a file of its
+	 * own. It's picked up when the original is prepared.
+	 */
+	len = strlen(fname);
+	if(len > 3 && strcmp(fname + len - 3, ".gz") == 0) {
+		fname[len - 3] = 0;
+		if(stat(fname, &orig) == 0 && S_ISREG(orig.st_mode)) {
+			return 0;
+		}
+		fname[len - 3] = '.';
+	}
+
+	if(!(type = mime_type(relpath))) {
+		fprintf(stderr, "skipping %s: CGI programs can't be served from a pack\n", fname);
+		return 0;
+	}
+	if(!(f = add_file(relpath, fname, &st))) {
+		return -1;
+	}
+	f->ent.type = add_str(type);
+	return 0;
+}
+
+static struct file *add_file(const char *path, const char *fname, struct stat *st)
+{
+	struct file *f;
+
+	if(num_files >= max_files) {
+		int newmax = max_files ? max_files * 2 : 64;
+		void *tmp = realloc(files, newmax * sizeof *files);
+		if(!tmp) {
+			fprintf(stderr, "failed to allocate file list\n");
+			return 0;
+		}
+		files = tmp;
+		max_files = newmax;
+	}
+	f = files + num_files;
+	memset(f, 0, sizeof *f);
+
+	if(!(f->path = strdup(path)) || !(f->fname = strdup(fname))) {
+		fprintf(stderr, "failed to allocate file name\n");
+		return 0;
+	}
+	f->isdir = S_ISDIR(st->st_mode);
+	f->size = f->isdir ? 0 : st->st_size;
+	f->ent.index = -1;
+	if(f->isdir) {
+		f->ent.flags = PACK_DIR;
+	}
+	num_files++;
+	return f;
+}
+
+/* compute the entity tags, and find or make the gzip variant */
+static int prepare(struct file *f)
+{
+	uint64_t hash;
+	char buf[32];
+	struct stat st;
+
+	f->ent.path = add_str(f->path);
+	if(f->isdir) return 0;
+
+	if(hash_file(f->fname, &hash) == -1) {
+		return -1;
+	}
+	sprintf(buf, "\"%016llx\"", (unsigned long long)hash);
+	f->ent.etag = add_str(buf);
+
+	if(!(f->gzname = malloc(strlen(f->fname) + 4))) {
+		fprintf(stderr, "failed to allocate file name\n");
+		return -1;
+	}
+	sprintf(f->gzname, "%s.gz", f->fname);
+
+	if(stat(f->gzname, &st) == 0 && S_ISREG(st.st_mode)) {
+		f->gzsize = st.st_size;
+		if(hash_file(f->gzname, &hash) == -1) {
+			return -1;
+		}
+	} else if(compress && f->size >= MIN_GZIP_SIZE &&
+			strncmp(strtab + f->ent.type, "text/", 5) == 0) {
+		if(gzip_file(f) == -1) {
+			return -1;
+		}
+		/* keep it only if it saves enough to be worth it */
+		if(f->gzsize > f->size - f->size / 10) {
+			free(f->gzdata);
+			f->gzdata = 0;
+			f->gzsize = 0;
+		}
+		hash = hash_mem(f->gzdata, f->gzsize, 0);
+	}
+
+	if(f->gzsize > 0) {
+		sprintf(buf, "\"%016llx-gz\"", (unsigned long long)hash);
+		f->ent.gz_etag = add_str(buf);
+		f->ent.gz_size = f->gzsize;
+	}
+	f->ent.size = f->size;
+
+	if(verbose) {
+		printf("%s (%s)%s\n", f->path, strtab + f->ent.type, f->gzsize > 0 ? " +gzip" : "");
+	}
+	return 0;
+}
+
+static int hash_file(const char *fname, uint64_t *hash)
+{
+	int fd;
+	long rdsz;
+	char buf[65536];
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	*hash = 0;
+	while((rdsz = read(fd, buf, sizeof buf)) > 0) {
+		*hash = hash_mem(buf, rdsz, *hash);
+	}
+	close(fd);
+	if(rdsz == -1) {
+		fprintf(stderr, "failed to read %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* 64bit FNV-1a, continuing from a previous hash, or starting if it's 0 */
+static uint64_t hash_mem(const void *data, long size, uint64_t hash)
+{
+	const unsigned char *ptr = data;
+
+	if(!hash) hash = 0xcbf29ce484222325ull;
+	while(size-- > 0) {
+		hash ^= *ptr++;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/* compress the file with the gzip program, reading its output into memory */
+static int gzip_file(struct file *f)
+{
+	int pfd[2], status;
+	pid_t pid;
+	long rdsz, bufsz = 0;
+	char *buf = 0, *tmp;
+
+	if(pipe(pfd) == -1 || (pid = fork()) == -1) {
+		fprintf(stderr, "failed to run gzip: %s\n", strerror(errno));
+		return -1;
+	}
+	if(!pid) {
+		close(pfd[0]);
+		dup2(pfd[1], 1);
+		execlp("gzip", "gzip", "-9", "-n", "-c", f->fname, (char*)0);
+		_exit(127);
+	}
+	close(pfd[1]);
+
+	for(;;) {
+		if(f->gzsize >= bufsz) {
+			bufsz = bufsz ? bufsz * 2 : 65536;
+			if(!(tmp = realloc(buf, bufsz))) {
+				fprintf(stderr, "failed to allocate compression buffer\n");
+				break;
+			}
+			buf = tmp;
+		}
+		if((rdsz = read(pfd[0], buf + f->gzsize, bufsz - f->gzsize)) <= 0) {
+			if(rdsz == -1 && errno == EINTR) continue;
+			break;
+		}
+		f->gzsize += rdsz;
+	}
+	close(pfd[0]);
+
+	if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+			rdsz != 0) {
+		fprintf(stderr, "failed to compress %s with gzip\n", f->fname);
+		free(buf);
+		f->gzsize = 0;
+		return -1;
+	}
+	f->gzdata = buf;
+	return 0;
+}
+
+/* strings are deduplicated, which mostly helps with the MIME types */
+static uint32_t add_str(const char *s)
+{
+	long offs, len = strlen(s) + 1;
+	char *tmp;
+
+	for(offs=0; offs<strtab_size; offs += strlen(strtab + offs) + 1) {
+		if(strcmp(strtab + offs, s) == 0) {
+			return offs;
+		}
+	}
+
+	if(strtab_size + len > strtab_max) {
+		long newmax = strtab_max ? strtab_max * 2 : 4096;
+		while(newmax < strtab_size + len) newmax *= 2;
+		if(!(tmp = realloc(strtab, newmax))) {
+			fprintf(stderr, "failed to allocate string table\n");
+			exit(1);
+		}
+		strtab = tmp;
+		strtab_max = newmax;
+	}
+	memcpy(strtab + strtab_size, s, len);
+	offs = strtab_size;
+	strtab_size += len;
+	return offs;
+}
+
+static int copy_file(FILE *out, const char *fname, long size)
+{
+	FILE *fp;
+	char buf[65536];
+	long rdsz;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	while(size > 0 && (rdsz = fread(buf, 1, size < sizeof buf ? size : sizeof buf, fp)) > 0) {
+		fwrite(buf, 1, rdsz, out);
+		size -= rdsz;
+	}
+	fclose(fp);
+
+	if(size > 0) {
+		fprintf(stderr, "%s changed while building the pack\n", fname);
+		return -1;
+	}
+	return 0;
+}
+
+static int pad_to(FILE *out, long offs)
+{
+	long pos = ftell(out);
+
+	while(pos++ < offs) {
+		fputc(0, out);
+	}
+	return ferror(out) ? -1 : 0;
+}
+
+static int cmp_files(const void *a, const void *b)
+{
+	return strcmp(((struct file*)a)->path, ((struct file*)b)->path);
+}
+
+static void print_help(const char *argv0)
+{
+	printf("Usage: %s [options] <root directory> <pack file>\n", argv0);
+	printf("Options:\n");
+	printf(" -z  compress text files larger than %d bytes with gzip, when it helps\n",
+			MIN_GZIP_SIZE);
+	printf(" -v  list the files as they're packed\n");
+	printf(" -h  print usage help and exit\n");
+	printf("Files named like other files with a .gz suffix are included as their\n");
+	printf("precompressed variants.\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int i;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'z':
+				compress = 1;
+				break;
+
+			case 'v':
+				verbose = 1;
+				break;
+
+			case 'h':
+				print_help(argv[0]);
+				exit(0);
+
+			default:
+				fprintf(stderr, "unrecognized option: %s\n", argv[i]);
+				return -1;
+			}
+		} else if(!rootdir) {
+			rootdir = argv[i];
+		} else if(!outfname) {
+			outfname = argv[i];
+		} else {
+			fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	if(!outfname) {
+		print_help(argv[0]);
+		return -1;
+	}
+	return 0;
+}
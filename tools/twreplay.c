@@ -0,0 +1,980 @@
+/* twreplay - replays traffic captured by tinyweb
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <alloca.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "capture.h"
+
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#define DEF_ADDR		"127.0.0.1:8080"
+#define DEF_TIMEOUT		30
+
+/* reads from a connection each time it's readable */
+#define MAX_READS		16
+
+/* connection states */
+enum {
+	CONN_WAIT,			/* not started yet */
+	CONN_CONNECT,		/* connecting */
+	CONN_HANDSHAKE,		/* in the TLS handshake */
+	CONN_ACTIVE,		/* sending the captured data, and receiving */
+	CONN_DONE
+};
+
+/* a record of the capture: data received from the client, or the end of it */
+struct chunk {
+	uint64_t time;
+	uint32_t conn, seq;
+	uint32_t size;
+	const char *data;
+};
+
+struct conn {
+	struct chunk *chunks;
+	int num_chunks, cur;
+	long offs;			/* sent from the current chunk */
+
+	int s, state;
+#ifdef USE_TLS
+	SSL *ssl;
+#endif
+	int want;			/* poll events the TLS handshake waits for */
+	int class;
+	uint64_t start;		/* when we started replaying it */
+	uint64_t first, last;	/* first byte sent, last byte received (or activity) */
+	long rcvd;
+	char stbuf[16];		/* start of the response, for the status code */
+	int stlen;
+};
+
+/* URI class: requests for paths with the same first few segments */
+struct uclass {
+	char *name;
+	int count, failed, bad;		/* bad: responses with status >= 400 */
+	double *lat;
+	int num_lat, max_lat;
+};
+
+static int load_capture(const char *fname);
+static int classify(const char *data, long size);
+static int start_conn(struct conn *c, uint64_t now);
+static void connected(struct conn *c, uint64_t now);
+static void handshake(struct conn *c, uint64_t now);
+static long conn_send(struct conn *c, const void *buf, long size);
+static long conn_recv(struct conn *c, void *buf, long size);
+static void conn_shutdown(struct conn *c);
+static int tls_pending(struct conn *c);
+static int init_tls(void);
+static void send_conn(struct conn *c, uint64_t now);
+static void recv_conn(struct conn *c, uint64_t now);
+static void end_conn(struct conn *c, uint64_t now, int failed);
+static uint64_t due_time(struct conn *c);
+static void report(uint64_t elapsed);
+static double percentile(double *arr, int n, double p);
+static uint64_t nsec_now(void);
+static int parse_addr(const char *spec);
+static int cmp_chunks(const void *a, const void *b);
+static int cmp_conns(const void *a, const void *b);
+static int cmp_double(const void *a, const void *b);
+static void print_help(const char *argv0);
+static int parse_args(int argc, char **argv);
+
+static char *capdata;
+static struct chunk *chunks;
+static int num_chunks;
+static struct conn *conns;
+static int num_conns;
+static struct uclass *classes;
+static int num_classes, max_classes;
+
+static const char *capfname;
+static double speed = 1.0;		/* 0 to replay as fast as possible */
+static int max_active;			/* 0 for no limit */
+static int depth = 1;
+static int timeout = DEF_TIMEOUT;
+static int fastopen;			/* send the first data in the SYN, with TCP fast open */
+static int from_connect;		/* measure latency from the start of the connect */
+static int use_tls;				/* connect with TLS, to an HTTPS listener */
+
+#ifdef USE_TLS
+static SSL_CTX *sslctx;
+#endif
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+
+static uint64_t t0;
+static long total_rcvd;
+
+
+int main(int argc, char **argv)
+{
+	int i, j, n, res, next = 0, active = 0, done = 0;
+	struct pollfd *pfd;
+	struct conn **pconn, *c;
+	uint64_t now, due, wake;
+	int wait_ms;
+
+	if(parse_args(argc, argv) == -1 || load_capture(capfname) == -1) {
+		return 1;
+	}
+	if(use_tls && init_tls() == -1) {
+		return 1;
+	}
+	if(!num_conns) {
+		fprintf(stderr, "%s: nothing to replay\n", capfname);
+		return 1;
+	}
+
+	if(!(pfd = malloc(num_conns * sizeof *pfd)) || !(pconn = malloc(num_conns * sizeof *pconn))) {
+		fprintf(stderr, "failed to allocate poll set\n");
+		return 1;
+	}
+
+	printf("replaying %d connections from %s at %s speed\n", num_conns, capfname,
+			speed > 0 ? (speed == 1.0 ? "original" : "scaled") : "maximum");
+
+	t0 = nsec_now();
+	while(done < num_conns) {
+		now = nsec_now() - t0;
+
+		/* connections start when they started in the capture, if there's room */
+		while(next < num_conns && (!max_active || active < max_active)) {
+			c = conns + next;
+			if(speed > 0 && (uint64_t)(c->chunks[0].time / speed) > now) {
+				break;
+			}
+			next++;
+			if(start_conn(c, now) == -1) {
+				end_conn(c, now, 1);
+				done++;
+			} else if(c->state == CONN_DONE) {
+				done++;		/* the TLS handshake failed right away */
+			} else {
+				active++;
+			}
+		}
+
+		/* wake up for the next connection to start, and the next chunks due */
+		wake = UINT64_MAX;
+		if(next < num_conns && (!max_active || active < max_active)) {
+			wake = speed > 0 ? (uint64_t)(conns[next].chunks[0].time / speed) : now;
+		}
+
+		n = 0;
+		for(i=0; i<num_conns; i++) {
+			c = conns + i;
+			if(c->state == CONN_WAIT || c->state == CONN_DONE) continue;
+
+			pfd[n].fd = c->s;
+			pfd[n].events = POLLIN;
+			if(c->state == CONN_CONNECT) {
+				pfd[n].events = POLLOUT;
+			} else if(c->state == CONN_HANDSHAKE) {
+				pfd[n].events = c->want;
+			} else if(c->cur < c->num_chunks) {
+				if((due = due_time(c)) <= now) {
+					if(c->chunks[c->cur].size) {
+						pfd[n].events |= POLLOUT;
+					} else {
+						send_conn(c, now);	/* end of the client's data */
+					}
+				} else if(due < wake) {
+					wake = due;
+				}
+			}
+			if(tls_pending(c)) {
+				wake = now;		/* decrypted data left over from the last read */
+			}
+			if(c->last + timeout * 1000000000ull < wake) {
+				wake = c->last + timeout * 1000000000ull;
+			}
+			pconn[n++] = c;
+		}
+
+		if(wake == UINT64_MAX) {
+			wait_ms = -1;
+		} else {
+			wait_ms = wake > now ? (wake - now + 999999) / 1000000 : 0;
+		}
+		if((res = poll(pfd, n, wait_ms)) == -1) {
+			if(errno == EINTR) continue;
+			perror("poll failed");
+			return 1;
+		}
+		now = nsec_now() - t0;
+
+		for(i=0; i<n; i++) {
+			c = pconn[i];
+			if(c->state == CONN_HANDSHAKE) {
+				if(pfd[i].revents) {
+					handshake(c, now);
+				}
+			} else if(pfd[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+				if(c->state == CONN_CONNECT) {
+					int err = 0;
+					socklen_t len = sizeof err;
+					getsockopt(c->s, SOL_SOCKET, SO_ERROR, &err, &len);
+					if(err) {
+						end_conn(c, now, 1);
+					} else {
+						connected(c, now);
+					}
+				} else if(pfd[i].revents & POLLOUT) {
+					send_conn(c, now);
+				}
+			}
+			if(c->state == CONN_ACTIVE && ((pfd[i].revents & (POLLIN | POLLERR | POLLHUP)) ||
+						tls_pending(c))) {
+				recv_conn(c, now);
+			}
+			if(c->state != CONN_DONE && now - c->last > timeout * 1000000000ull) {
+				end_conn(c, now, 1);
+			}
+			if(c->state == CONN_DONE) {
+				active--;
+				done++;
+			}
+		}
+	}
+	now = nsec_now() - t0;
+
+	report(now);
+
+	for(i=0; i<num_classes; i++) {
+		free(classes[i].name);
+		free(classes[i].lat);
+	}
+	free(classes);
+	free(pfd);
+	free(pconn);
+	for(j=0; j<num_conns; j++) {
+		if(conns[j].s != -1) close(conns[j].s);
+	}
+	free(conns);
+	free(chunks);
+	free(capdata);
+#ifdef USE_TLS
+	SSL_CTX_free(sslctx);
+#endif
+	return 0;
+}
+
+/* read the whole capture, and group its records by connection, in the order
+ * the connections started.
+ */
+static int load_capture(const char *fname)
+{
+	FILE *fp;
+	struct stat st;
+	struct capture_header *hdr;
+	struct capture_record rec;
+	struct conn *c = 0;
+	long offs;
+	int i;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fstat(fileno(fp), &st);
+	if(!(capdata = malloc(st.st_size + 1))) {
+		fprintf(stderr, "failed to allocate %ld bytes for the capture\n", (long)st.st_size);
+		fclose(fp);
+		return -1;
+	}
+	if(fread(capdata, 1, st.st_size, fp) != st.st_size) {
+		fprintf(stderr, "failed to read %s: %s\n", fname, strerror(errno));
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	hdr = (struct capture_header*)capdata;
+	if(st.st_size < sizeof *hdr || memcmp(hdr->magic, CAPTURE_MAGIC, sizeof hdr->magic) != 0) {
+		fprintf(stderr, "%s is not a tinyweb capture\n", fname);
+		return -1;
+	}
+	if(hdr->version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: unsupported capture version %u\n", fname, (unsigned int)hdr->version);
+		return -1;
+	}
+
+	/* count the records first, a capture cut short ends at the last whole one */
+	for(i=0, offs=sizeof *hdr; offs + (long)sizeof rec <= st.st_size; i++) {
+		memcpy(&rec, capdata + offs, sizeof rec);
+		if(offs + (long)sizeof rec + rec.size > st.st_size) {
+			fprintf(stderr, "%s: truncated after %d records\n", fname, i);
+			break;
+		}
+		offs += sizeof rec + rec.size;
+	}
+	num_chunks = i;
+	if(!(chunks = malloc((num_chunks + 1) * sizeof *chunks))) {
+		fprintf(stderr, "failed to allocate %d records\n", num_chunks);
+		return -1;
+	}
+	for(i=0, offs=sizeof *hdr; i<num_chunks; i++) {
+		memcpy(&rec, capdata + offs, sizeof rec);
+		chunks[i].time = rec.time;
+		chunks[i].conn = rec.conn;
+		chunks[i].seq = i;
+		chunks[i].size = rec.size;
+		chunks[i].data = capdata + offs + sizeof rec;
+		offs += sizeof rec + rec.size;
+	}
+	qsort(chunks, num_chunks, sizeof *chunks, cmp_chunks);
+
+	/* connections which only closed don't need replaying */
+	if(!(conns = calloc(num_chunks + 1, sizeof *conns))) {
+		fprintf(stderr, "failed to allocate connections\n");
+		return -1;
+	}
+	for(i=0; i<num_chunks; i++) {
+		if(i == 0 || chunks[i].conn != chunks[i - 1].conn) {
+			if(num_conns && conns[num_conns - 1].chunks[0].size == 0) {
+				num_conns--;
+			}
+			c = conns + num_conns++;
+			c->chunks = chunks + i;
+			c->s = -1;
+		}
+		c->num_chunks++;
+	}
+	if(num_conns && conns[num_conns - 1].chunks[0].size == 0) {
+		num_conns--;
+	}
+	qsort(conns, num_conns, sizeof *conns, cmp_conns);
+
+	for(i=0; i<num_conns; i++) {
+		c = conns + i;
+		if((c->class = classify(c->chunks[0].data, c->chunks[0].size)) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* the class of a request: its method, and up to depth segments of its path.
+ * Connections starting with the HTTP/2 preface, or anything which doesn't
+ * look like an HTTP/1 request line, get a class of their own.
+ */
+static int classify(const char *data, long size)
+{
+	static const char h2pre[] = "PRI * HTTP/2.0\r\n";
+	const char *end = data + size, *method, *path, *ptr;
+	char *name;
+	int i, n = 0, more = 0;
+	void *tmp;
+
+	if(size >= sizeof h2pre - 1 && memcmp(data, h2pre, sizeof h2pre - 1) == 0) {
+		name = strdup("(HTTP/2)");
+	} else {
+		method = data;
+		for(ptr=data; ptr < end && *ptr > ' '; ptr++);
+		path = ptr + 1;
+		if(ptr == method || path >= end || *path != '/') {
+			name = strdup("(other)");
+		} else {
+			for(ptr=path; ptr < end && *ptr > ' ' && *ptr != '?'; ptr++) {
+				if(*ptr == '/' && ++n > depth) {
+					more = 1;
+					ptr++;
+					break;
+				}
+			}
+			if((name = malloc(ptr - data + 2))) {
+				sprintf(name, "%.*s %.*s%s", (int)(path - 1 - method), method,
+						(int)(ptr - path), path, more ? "*" : "");
+			}
+		}
+	}
+	if(!name) {
+		fprintf(stderr, "failed to allocate URI class\n");
+		return -1;
+	}
+
+	for(i=0; i<num_classes; i++) {
+		if(strcmp(classes[i].name, name) == 0) {
+			free(name);
+			return i;
+		}
+	}
+
+	if(num_classes >= max_classes) {
+		int newsz = max_classes ? max_classes * 2 : 16;
+		if(!(tmp = realloc(classes, newsz * sizeof *classes))) {
+			fprintf(stderr, "failed to allocate URI classes\n");
+			free(name);
+			return -1;
+		}
+		classes = tmp;
+		max_classes = newsz;
+	}
+	memset(classes + num_classes, 0, sizeof *classes);
+	classes[num_classes].name = name;
+	return num_classes++;
+}
+
+static int start_conn(struct conn *c, uint64_t now)
+{
+	c->start = c->last = now;
+	if((c->s = socket(addr.ss_family, SOCK_STREAM, 0)) == -1) {
+		perror("failed to create socket");
+		return -1;
+	}
+	fcntl(c->s, F_SETFL, fcntl(c->s, F_GETFL) | O_NONBLOCK);
+
+#ifdef TCP_FASTOPEN_CONNECT
+	/* connect returns right away, and the SYN goes out with the first send if
+	 * we have a cookie from the server, or it's a normal connect if not.
+	 */
+	if(fastopen && addr.ss_family != AF_UNIX) {
+		int one = 1;
+		if(setsockopt(c->s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof one) == -1) {
+			perror("failed to enable TCP fast open, connecting normally");
+			fastopen = 0;
+		}
+	}
+#endif
+
+	if(connect(c->s, (struct sockaddr*)&addr, addrlen) == -1) {
+		if(errno != EINPROGRESS && errno != EAGAIN) {
+			return -1;
+		}
+		c->state = CONN_CONNECT;
+		return 0;
+	}
+	connected(c, now);
+	return 0;
+}
+
+/* the TCP connection is up, start the TLS handshake if we're using TLS */
+static void connected(struct conn *c, uint64_t now)
+{
+#ifdef USE_TLS
+	static const unsigned char alpn_h1[] = "\x08http/1.1";
+	static const unsigned char alpn_h2[] = "\x02h2";
+	static const char h2pre[] = "PRI * HTTP/2.0\r\n";
+	int h2;
+#endif
+
+	c->last = now;
+	if(!use_tls) {
+		c->state = CONN_ACTIVE;
+		return;
+	}
+
+#ifdef USE_TLS
+	if(!(c->ssl = SSL_new(sslctx)) || SSL_set_fd(c->ssl, c->s) != 1) {
+		fprintf(stderr, "failed to create TLS connection\n");
+		ERR_clear_error();
+		end_conn(c, now, 1);
+		return;
+	}
+	/* HTTP/2 connections need it negotiated with ALPN */
+	h2 = c->chunks[0].size >= sizeof h2pre - 1 &&
+		memcmp(c->chunks[0].data, h2pre, sizeof h2pre - 1) == 0;
+	if(h2) {
+		SSL_set_alpn_protos(c->ssl, alpn_h2, sizeof alpn_h2 - 1);
+	} else {
+		SSL_set_alpn_protos(c->ssl, alpn_h1, sizeof alpn_h1 - 1);
+	}
+	SSL_set_connect_state(c->ssl);
+	c->state = CONN_HANDSHAKE;
+	handshake(c, now);
+#endif
+}
+
+static void handshake(struct conn *c, uint64_t now)
+{
+#ifdef USE_TLS
+	int res;
+
+	c->last = now;
+	if((res = SSL_do_handshake(c->ssl)) == 1) {
+		c->state = CONN_ACTIVE;
+		return;
+	}
+	switch(SSL_get_error(c->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+		c->want = POLLIN;
+		break;
+
+	case SSL_ERROR_WANT_WRITE:
+		c->want = POLLOUT;
+		break;
+
+	default:
+		ERR_clear_error();
+		end_conn(c, now, 1);
+		break;
+	}
+#endif
+}
+
+/* conn_send and conn_recv work like send and recv on a non-blocking socket,
+ * through TLS if we're using it. A TLS write which has to wait is retried
+ * with the same data, which send_conn does anyway.
+ */
+static long conn_send(struct conn *c, const void *buf, long size)
+{
+#ifdef USE_TLS
+	int res;
+
+	if(c->ssl) {
+		if((res = SSL_write(c->ssl, buf, size)) > 0) {
+			return res;
+		}
+		switch(SSL_get_error(c->ssl, res)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			break;
+		default:
+			errno = EPIPE;
+			break;
+		}
+		ERR_clear_error();
+		return -1;
+	}
+#endif
+	return send(c->s, buf, size, MSG_NOSIGNAL);
+}
+
+static long conn_recv(struct conn *c, void *buf, long size)
+{
+#ifdef USE_TLS
+	int res;
+
+	if(c->ssl) {
+		errno = 0;
+		if((res = SSL_read(c->ssl, buf, size)) > 0) {
+			return res;
+		}
+		switch(SSL_get_error(c->ssl, res)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			res = -1;
+			break;
+		case SSL_ERROR_ZERO_RETURN:
+			res = 0;
+			break;
+		case SSL_ERROR_SYSCALL:
+			/* closed without a close_notify, still the end of the response */
+			res = errno ? -1 : 0;
+			break;
+		default:
+			errno = EPROTO;
+			res = -1;
+			break;
+		}
+		ERR_clear_error();
+		return res;
+	}
+#endif
+	return recv(c->s, buf, size, 0);
+}
+
+/* the end of the client's data */
+static void conn_shutdown(struct conn *c)
+{
+#ifdef USE_TLS
+	if(c->ssl) {
+		SSL_shutdown(c->ssl);
+		ERR_clear_error();
+	}
+#endif
+	shutdown(c->s, SHUT_WR);
+}
+
+/* SSL_read may decrypt more than it returns, and poll won't tell us about it */
+static int tls_pending(struct conn *c)
+{
+#ifdef USE_TLS
+	return c->ssl && c->state == CONN_ACTIVE && SSL_pending(c->ssl) > 0;
+#else
+	return 0;
+#endif
+}
+
+/* the certificate isn't verified: this is for testing our own servers */
+static int init_tls(void)
+{
+#ifdef USE_TLS
+	if(!(sslctx = SSL_CTX_new(TLS_client_method()))) {
+		fprintf(stderr, "failed to create TLS context\n");
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(sslctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(sslctx, SSL_VERIFY_NONE, 0);
+	SSL_CTX_set_mode(sslctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+	return 0;
+#else
+	fprintf(stderr, "twreplay was built without TLS support\n");
+	return -1;
+#endif
+}
+
+/* send the chunks which are due, each one after the one before it */
+static void send_conn(struct conn *c, uint64_t now)
+{
+	struct chunk *ch;
+	long sz;
+
+	while(c->cur < c->num_chunks && due_time(c) <= now) {
+		ch = c->chunks + c->cur;
+		if(!ch->size) {
+			conn_shutdown(c);
+			c->cur++;
+			continue;
+		}
+
+		if((sz = conn_send(c, ch->data + c->offs, ch->size - c->offs)) == -1) {
+			/* EINPROGRESS: a fast open SYN without room for the data */
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+				end_conn(c, now, 1);
+			}
+			return;
+		}
+		if(!c->first) {
+			c->first = now ? now : 1;
+		}
+		c->last = now;
+		if((c->offs += sz) >= ch->size) {
+			c->cur++;
+			c->offs = 0;
+		}
+	}
+}
+
+/* the server closing the connection marks the end of the response */
+static void recv_conn(struct conn *c, uint64_t now)
+{
+	static char buf[65536];
+	long sz;
+	int n, count = 0;
+
+	/* don't hold up the other connections with a large response */
+	while((sz = conn_recv(c, buf, sizeof buf)) > 0) {
+		if(c->stlen < sizeof c->stbuf - 1) {
+			n = sizeof c->stbuf - 1 - c->stlen;
+			if(n > sz) n = sz;
+			memcpy(c->stbuf + c->stlen, buf, n);
+			c->stlen += n;
+		}
+		c->rcvd += sz;
+		c->last = now;
+		if(++count >= MAX_READS) return;
+	}
+
+	if(sz == 0) {
+		/* reading a large response can take a while */
+		end_conn(c, nsec_now() - t0, c->rcvd == 0);
+	} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+		end_conn(c, now, 1);
+	}
+}
+
+static void end_conn(struct conn *c, uint64_t now, int failed)
+{
+	struct uclass *uc = classes + c->class;
+	void *tmp;
+
+#ifdef USE_TLS
+	if(c->ssl) {
+		SSL_free(c->ssl);
+		c->ssl = 0;
+	}
+#endif
+	if(c->s != -1) {
+		close(c->s);
+		c->s = -1;
+	}
+	c->state = CONN_DONE;
+	total_rcvd += c->rcvd;
+
+	uc->count++;
+	if(failed) {
+		uc->failed++;
+		return;
+	}
+	c->stbuf[c->stlen] = 0;
+	if(memcmp(c->stbuf, "HTTP/", 5) == 0 && c->stlen > 9 && atoi(c->stbuf + 9) >= 400) {
+		uc->bad++;
+	}
+
+	if(uc->num_lat >= uc->max_lat) {
+		int newsz = uc->max_lat ? uc->max_lat * 2 : 64;
+		if(!(tmp = realloc(uc->lat, newsz * sizeof *uc->lat))) {
+			return;
+		}
+		uc->lat = tmp;
+		uc->max_lat = newsz;
+	}
+	uc->lat[uc->num_lat++] = (now - (c->first && !from_connect ? c->first : c->start)) / 1000000.0;
+}
+
+/* when the next chunk of a connection is due: its time in the capture,
+ * relative to the start of the connection, scaled by the replay speed.
+ */
+static uint64_t due_time(struct conn *c)
+{
+	if(speed <= 0) return 0;
+	return c->start + (uint64_t)((c->chunks[c->cur].time - c->chunks[0].time) / speed);
+}
+
+static void report(uint64_t elapsed)
+{
+	int i, total = 0, failed = 0, w = 10;
+	double sec = elapsed / 1000000000.0;
+	struct uclass *uc;
+
+	for(i=0; i<num_classes; i++) {
+		int len = strlen(classes[i].name);
+		if(len > w) w = len;
+	}
+
+	printf("\n%-*s %8s %6s %6s %9s %9s %9s %9s\n", w, "class", "requests", "failed", ">=400",
+			"p50 ms", "p90 ms", "p99 ms", "max ms");
+	for(i=0; i<num_classes; i++) {
+		uc = classes + i;
+		total += uc->count;
+		failed += uc->failed;
+		qsort(uc->lat, uc->num_lat, sizeof *uc->lat, cmp_double);
+		printf("%-*s %8d %6d %6d %9.2f %9.2f %9.2f %9.2f\n", w, uc->name, uc->count,
+				uc->failed, uc->bad, percentile(uc->lat, uc->num_lat, 0.5),
+				percentile(uc->lat, uc->num_lat, 0.9), percentile(uc->lat, uc->num_lat, 0.99),
+				percentile(uc->lat, uc->num_lat, 1.0));
+	}
+
+	printf("\n%d connections (%d failed) in %.3f sec: %.1f per sec, %.2f MB/s received\n",
+			total, failed, sec, sec > 0 ? total / sec : 0.0,
+			sec > 0 ? total_rcvd / sec / 1048576.0 : 0.0);
+}
+
+/* nearest rank, from a sorted array */
+static double percentile(double *arr, int n, double p)
+{
+	int idx;
+
+	if(n <= 0) return 0.0;
+	if((idx = (int)(p * n - 1e-9)) < 0) idx = 0;
+	return arr[idx];
+}
+
+static uint64_t nsec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* server address: <port>, <ipv4>:<port>, [<ipv6>]:<port>, or a UNIX domain
+ * socket path (anything with a slash in it).
+ */
+static int parse_addr(const char *spec)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in*)&addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&addr;
+	struct sockaddr_un *sun = (struct sockaddr_un*)&addr;
+	char *host, *ptr;
+	int port;
+
+	memset(&addr, 0, sizeof addr);
+
+	if(strchr(spec, '/')) {
+		if(strlen(spec) >= sizeof sun->sun_path) {
+			fprintf(stderr, "socket path too long: %s\n", spec);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, spec);
+		addrlen = sizeof *sun;
+		return 0;
+	}
+
+	host = alloca(strlen(spec) + 1);
+	strcpy(host, spec);
+
+	if(*host == '[') {
+		if(!(ptr = strchr(host, ']')) || ptr[1] != ':') goto invalid;
+		*ptr = 0;
+		port = atoi(ptr + 2);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		if(port <= 0 || inet_pton(AF_INET6, host + 1, &sin6->sin6_addr) != 1) goto invalid;
+		addrlen = sizeof *sin6;
+		return 0;
+	}
+
+	if((ptr = strchr(host, ':'))) {
+		*ptr++ = 0;
+	} else {
+		ptr = host;
+		host = "127.0.0.1";
+	}
+	port = atoi(ptr);
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	if(port <= 0 || inet_pton(AF_INET, host, &sin->sin_addr) != 1) goto invalid;
+	addrlen = sizeof *sin;
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid address: %s\n", spec);
+	return -1;
+}
+
+/* by connection, keeping the order they arrived in */
+static int cmp_chunks(const void *a, const void *b)
+{
+	const struct chunk *ca = a, *cb = b;
+
+	if(ca->conn != cb->conn) {
+		return ca->conn < cb->conn ? -1 : 1;
+	}
+	return ca->seq < cb->seq ? -1 : (ca->seq > cb->seq ? 1 : 0);
+}
+
+static int cmp_conns(const void *a, const void *b)
+{
+	const struct conn *ca = a, *cb = b;
+
+	if(ca->chunks[0].time != cb->chunks[0].time) {
+		return ca->chunks[0].time < cb->chunks[0].time ? -1 : 1;
+	}
+	return ca->chunks[0].seq < cb->chunks[0].seq ? -1 : 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(double*)a, db = *(double*)b;
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static void print_help(const char *argv0)
+{
+	printf("Usage: %s [options] <capture file>\n", argv0);
+	printf("Options:\n");
+	printf(" -a <addr>   server address: <port>, <ipv4>:<port>, [<ipv6>]:<port>, or a UNIX\n");
+	printf("             domain socket path (default: %s)\n", DEF_ADDR);
+	printf(" -s <speed>  replay speed: 1 is the original speed, 2 twice as fast, and so on,\n");
+	printf("             or max to send everything as fast as possible (default: 1)\n");
+	printf(" -c <n>      at most n connections at once (default: as in the capture)\n");
+	printf(" -d <n>      group requests by the first n segments of their path (default: 1)\n");
+	printf(" -t <sec>    give up on connections idle for this long (default: %d)\n", DEF_TIMEOUT);
+	printf(" -H          count the TCP (and TLS) handshake in the latency, from the start of\n");
+	printf("             the connect\n");
+	printf(" -F          connect with TCP fast open, sending the request in the SYN\n");
+	printf(" -S          connect with TLS, to an HTTPS listener (the certificate isn't checked)\n");
+	printf(" -h          print usage help and exit\n");
+	printf("Each connection is replayed with the timing it had in the capture, and the time\n");
+	printf("from its first byte sent (or its connect, with -H) until the server closes it is\n");
+	printf("its latency.\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int i;
+	char *endp;
+
+	if(parse_addr(DEF_ADDR) == -1) {
+		return -1;
+	}
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'a':
+				if(!argv[++i] || parse_addr(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 's':
+				if(!argv[++i]) goto missing;
+				if(strcmp(argv[i], "max") == 0) {
+					speed = 0;
+				} else {
+					speed = strtod(argv[i], &endp);
+					if(*endp || speed <= 0) {
+						fprintf(stderr, "-s must be followed by a speed factor, or max\n");
+						return -1;
+					}
+				}
+				break;
+
+			case 'c':
+				if(!argv[++i] || (max_active = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'd':
+				if(!argv[++i] || (depth = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 't':
+				if(!argv[++i] || (timeout = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'H':
+				from_connect = 1;
+				break;
+
+			case 'F':
+				fastopen = 1;
+				break;
+
+			case 'S':
+				use_tls = 1;
+				break;
+
+			case 'h':
+				print_help(argv[0]);
+				exit(0);
+
+			default:
+				fprintf(stderr, "unrecognized option: %s\n", argv[i]);
+				return -1;
+			}
+		} else if(!capfname) {
+			capfname = argv[i];
+		} else {
+			fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	if(!capfname) {
+		print_help(argv[0]);
+		return -1;
+	}
+	return 0;
+
+missing:
+	fprintf(stderr, "%s must be followed by a positive number\n", argv[i - 1]);
+	return -1;
+}
@@ -0,0 +1,467 @@
+/* twupstream - stand-in upstream server, for testing the tinyweb proxy
+ * Author: John Tsiombikas <nuclear@member.fsf.org>
+ *
+ * This program is placed in the public domain. Feel free to use it any
+ * way you like. Mentions and retaining this attribution header will be
+ * appreciated, but not required.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <alloca.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEF_ADDR		"127.0.0.1:9000"
+#define MAX_CONNS		1024
+#define MAX_HDR			16384
+
+/* connection states */
+enum {
+	ST_HEADER,			/* receiving a request header */
+	ST_BODY,			/* receiving its body */
+	ST_RESPOND			/* sending the response */
+};
+
+struct conn {
+	int s, state;
+	int id, num_reqs;
+	time_t last;
+
+	char hdr[MAX_HDR];
+	int hdrlen;
+
+	/* the request being received */
+	char method[16], path[256];
+	int head, close;
+	long body_size, body_left;
+	uint32_t hash;
+
+	char *out;
+	int outlen, outpos;
+};
+
+static int accept_conn(void);
+static void close_conn(struct conn *c);
+static int recv_conn(struct conn *c);
+static int send_conn(struct conn *c);
+static int parse_header(struct conn *c, int len);
+static int respond(struct conn *c);
+static void hash_body(struct conn *c, const char *data, long size);
+static int parse_addr(const char *spec);
+static void print_help(const char *argv0);
+static int parse_args(int argc, char **argv);
+
+static int lis = -1;
+static struct conn *conns[MAX_CONNS];
+static int num_conns, next_id;
+static long total_reqs;
+
+static int max_reqs;		/* close connections after this many requests, 0 for no limit */
+static int idle_timeout;	/* close idle connections after this many seconds, 0 for never */
+static int drop_every;		/* drop every nth request without a response, 0 for none */
+static int quiet;
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+
+
+int main(int argc, char **argv)
+{
+	int i, n, one = 1;
+	struct pollfd pfd[MAX_CONNS + 1];
+	struct conn *c;
+	time_t now;
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if((lis = socket(addr.ss_family, SOCK_STREAM, 0)) == -1) {
+		perror("failed to create socket");
+		return 1;
+	}
+	if(addr.ss_family == AF_UNIX) {
+		unlink(((struct sockaddr_un*)&addr)->sun_path);
+	} else {
+		setsockopt(lis, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	}
+	if(bind(lis, (struct sockaddr*)&addr, addrlen) == -1 || listen(lis, 128) == -1) {
+		perror("failed to listen");
+		return 1;
+	}
+	fcntl(lis, F_SETFL, fcntl(lis, F_GETFL) | O_NONBLOCK);
+
+	for(;;) {
+		pfd[0].fd = lis;
+		pfd[0].events = num_conns < MAX_CONNS ? POLLIN : 0;
+		for(i=0; i<num_conns; i++) {
+			pfd[i + 1].fd = conns[i]->s;
+			pfd[i + 1].events = conns[i]->state == ST_RESPOND ? POLLOUT : POLLIN;
+		}
+		if(poll(pfd, num_conns + 1, idle_timeout ? 1000 : -1) == -1) {
+			if(errno == EINTR) continue;
+			perror("poll failed");
+			return 1;
+		}
+		now = time(0);
+
+		/* go backwards, closed connections are replaced by the last one */
+		n = num_conns;
+		for(i=n-1; i>=0; i--) {
+			c = conns[i];
+			if(pfd[i + 1].revents) {
+				c->last = now;
+				if((c->state == ST_RESPOND ? send_conn(c) : recv_conn(c)) == -1) {
+					close_conn(c);
+				}
+			} else if(idle_timeout && c->state == ST_HEADER && !c->hdrlen &&
+					now - c->last >= idle_timeout) {
+				if(!quiet) printf("conn %d: idle, closing\n", c->id);
+				close_conn(c);
+			}
+		}
+		if(pfd[0].revents & POLLIN) {
+			while(num_conns < MAX_CONNS && accept_conn() != -1);
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
+
+static int accept_conn(void)
+{
+	int s;
+	struct conn *c;
+
+	if((s = accept(lis, 0, 0)) == -1) {
+		return -1;
+	}
+	if(!(c = calloc(1, sizeof *c))) {
+		fprintf(stderr, "failed to allocate connection\n");
+		close(s);
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	c->s = s;
+	c->id = ++next_id;
+	c->last = time(0);
+	conns[num_conns++] = c;
+	return 0;
+}
+
+static void close_conn(struct conn *c)
+{
+	int i;
+
+	for(i=0; i<num_conns; i++) {
+		if(conns[i] == c) {
+			conns[i] = conns[--num_conns];
+			break;
+		}
+	}
+	close(c->s);
+	free(c->out);
+	free(c);
+}
+
+/* receive requests, passing over their bodies, and start the response when a
+ * request is complete. Pipelined requests wait until the response before them
+ * is sent.
+ */
+static int recv_conn(struct conn *c)
+{
+	char buf[65536], *end;
+	long sz, len;
+
+	while((sz = recv(c->s, buf, sizeof buf, 0)) > 0) {
+		char *ptr = buf;
+
+		while(sz > 0 && c->state != ST_RESPOND) {
+			if(c->state == ST_BODY) {
+				len = sz < c->body_left ? sz : c->body_left;
+				hash_body(c, ptr, len);
+				c->body_left -= len;
+				ptr += len;
+				sz -= len;
+				if(!c->body_left && respond(c) == -1) {
+					return -1;
+				}
+				continue;
+			}
+
+			len = sz < MAX_HDR - 1 - c->hdrlen ? sz : MAX_HDR - 1 - c->hdrlen;
+			memcpy(c->hdr + c->hdrlen, ptr, len);
+			c->hdrlen += len;
+			c->hdr[c->hdrlen] = 0;
+
+			if(!(end = strstr(c->hdr, "\r\n\r\n"))) {
+				if(c->hdrlen >= MAX_HDR - 1) {
+					fprintf(stderr, "conn %d: request header too large\n", c->id);
+					return -1;
+				}
+				ptr += len;
+				sz -= len;
+				continue;
+			}
+			/* whatever followed the header in this read is the start of the body */
+			len -= c->hdrlen - (end + 4 - c->hdr);
+			ptr += len;
+			sz -= len;
+			if(parse_header(c, end + 4 - c->hdr) == -1) {
+				return -1;
+			}
+			c->hdrlen = 0;
+			if(!c->body_left && respond(c) == -1) {
+				return -1;
+			}
+		}
+		if(sz > 0) {
+			fprintf(stderr, "conn %d: pipelined requests aren't supported\n", c->id);
+			return -1;
+		}
+		if(c->state == ST_RESPOND) {
+			return send_conn(c);
+		}
+	}
+	if(sz == 0) {
+		return -1;
+	}
+	return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+}
+
+static int send_conn(struct conn *c)
+{
+	long sz;
+
+	while(c->outpos < c->outlen) {
+		if((sz = send(c->s, c->out + c->outpos, c->outlen - c->outpos, MSG_NOSIGNAL)) == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		c->outpos += sz;
+	}
+	free(c->out);
+	c->out = 0;
+	c->state = ST_HEADER;
+	return c->close ? -1 : 0;
+}
+
+static int parse_header(struct conn *c, int len)
+{
+	char *line, *next, *val;
+	int minor = 1;
+
+	c->hdr[len - 2] = 0;
+	line = c->hdr;
+	if(!(next = strstr(line, "\r\n")) || sscanf(line, "%15s %255s HTTP/1.%d", c->method,
+				c->path, &minor) != 3) {
+		fprintf(stderr, "conn %d: invalid request line\n", c->id);
+		return -1;
+	}
+	c->head = strcmp(c->method, "HEAD") == 0;
+	c->close = minor < 1;
+	c->body_size = c->body_left = 0;
+	c->hash = 2166136261u;
+
+	for(line=next+2; *line; line=next+2) {
+		if(!(next = strstr(line, "\r\n"))) break;
+		*next = 0;
+		if(!(val = strchr(line, ':'))) continue;
+		*val++ = 0;
+		while(*val == ' ' || *val == '\t') val++;
+
+		if(strcasecmp(line, "Content-Length") == 0) {
+			c->body_size = c->body_left = atol(val);
+		} else if(strcasecmp(line, "Transfer-Encoding") == 0) {
+			fprintf(stderr, "conn %d: only bodies with a Content-Length are supported\n", c->id);
+			return -1;
+		} else if(strcasecmp(line, "Connection") == 0) {
+			if(strcasecmp(val, "close") == 0) c->close = 1;
+			if(strcasecmp(val, "keep-alive") == 0) c->close = 0;
+		}
+	}
+	c->state = c->body_left ? ST_BODY : ST_RESPOND;
+	return 0;
+}
+
+/* the response says which connection the request came on, and what its body
+ * was, so that the client can check both.
+ */
+static int respond(struct conn *c)
+{
+	char body[512];
+	int len, size;
+
+	c->num_reqs++;
+	total_reqs++;
+	if(!quiet) {
+		printf("conn %d request %d: %s %s, %ld byte body\n", c->id, c->num_reqs, c->method,
+				c->path, c->body_size);
+	}
+
+	if(drop_every && total_reqs % drop_every == 0) {
+		if(!quiet) printf("conn %d: dropping request\n", c->id);
+		return -1;
+	}
+	if(max_reqs && c->num_reqs >= max_reqs) {
+		c->close = 1;
+	}
+
+	len = sprintf(body, "conn %d request %d: %s %s\nbody %ld bytes, fnv1a %08x\n", c->id,
+			c->num_reqs, c->method, c->path, c->body_size, (unsigned int)c->hash);
+	size = len + 256;
+	if(!(c->out = malloc(size))) {
+		fprintf(stderr, "failed to allocate response\n");
+		return -1;
+	}
+	c->outlen = snprintf(c->out, size, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+			"Content-Length: %d\r\nX-Upstream-Conn: %d\r\n%s\r\n%s", len, c->id,
+			c->close ? "Connection: close\r\n" : "", c->head ? "" : body);
+	c->outpos = 0;
+	c->state = ST_RESPOND;
+	return 0;
+}
+
+/* 32-bit FNV-1a of the body, which doesn't need to keep it */
+static void hash_body(struct conn *c, const char *data, long size)
+{
+	while(size-- > 0) {
+		c->hash = (c->hash ^ (unsigned char)*data++) * 16777619u;
+	}
+}
+
+/* listening address: <port>, <ipv4>:<port>, [<ipv6>]:<port>, or a UNIX domain
+ * socket path (anything with a slash in it).
+ */
+static int parse_addr(const char *spec)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in*)&addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&addr;
+	struct sockaddr_un *sun = (struct sockaddr_un*)&addr;
+	char *host, *ptr;
+	int port;
+
+	memset(&addr, 0, sizeof addr);
+
+	if(strchr(spec, '/')) {
+		if(strlen(spec) >= sizeof sun->sun_path) {
+			fprintf(stderr, "socket path too long: %s\n", spec);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, spec);
+		addrlen = sizeof *sun;
+		return 0;
+	}
+
+	host = alloca(strlen(spec) + 1);
+	strcpy(host, spec);
+
+	if(*host == '[') {
+		if(!(ptr = strchr(host, ']')) || ptr[1] != ':') goto invalid;
+		*ptr = 0;
+		port = atoi(ptr + 2);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		if(port <= 0 || inet_pton(AF_INET6, host + 1, &sin6->sin6_addr) != 1) goto invalid;
+		addrlen = sizeof *sin6;
+		return 0;
+	}
+
+	if((ptr = strchr(host, ':'))) {
+		*ptr++ = 0;
+	} else {
+		ptr = host;
+		host = "127.0.0.1";
+	}
+	port = atoi(ptr);
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	if(port <= 0 || inet_pton(AF_INET, host, &sin->sin_addr) != 1) goto invalid;
+	addrlen = sizeof *sin;
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid address: %s\n", spec);
+	return -1;
+}
+
+static void print_help(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("Options:\n");
+	printf(" -a <addr>  listen on <port>, <ipv4>:<port>, [<ipv6>]:<port>, or a UNIX domain\n");
+	printf("            socket path (default: %s)\n", DEF_ADDR);
+	printf(" -n <n>     close each connection after n requests (default: keep it open)\n");
+	printf(" -i <sec>   close connections idle for this long (default: never)\n");
+	printf(" -x <n>     drop every nth request, closing its connection without a response\n");
+	printf(" -q         don't print each request\n");
+	printf(" -h         print usage help and exit\n");
+	printf("Every request gets a short text response with the number of its connection,\n");
+	printf("and the size and FNV-1a hash of its body, so that keep-alive reuse and the\n");
+	printf("bodies passed on by a proxy can be checked.\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int i;
+
+	if(parse_addr(DEF_ADDR) == -1) {
+		return -1;
+	}
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'a':
+				if(!argv[++i] || parse_addr(argv[i]) == -1) {
+					return -1;
+				}
+				break;
+
+			case 'n':
+				if(!argv[++i] || (max_reqs = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'i':
+				if(!argv[++i] || (idle_timeout = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'x':
+				if(!argv[++i] || (drop_every = atoi(argv[i])) <= 0) goto missing;
+				break;
+
+			case 'q':
+				quiet = 1;
+				break;
+
+			case 'h':
+				print_help(argv[0]);
+				exit(0);
+
+			default:
+				fprintf(stderr, "unrecognized option: %s\n", argv[i]);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+
+missing:
+	fprintf(stderr, "%s must be followed by a positive number\n", argv[i - 1]);
+	return -1;
+}